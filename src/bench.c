@@ -0,0 +1,950 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Load generator for Redis Cluster Proxy.
+ *
+ * Every client connection sends batches of '--pipeline' queries whose
+ * commands are randomly picked according to the '--mix' weights, with keys
+ * drawn from a uniform, zipfian or sequential distribution.
+ *
+ * By default the benchmark is closed-loop: a client sends its next batch as
+ * soon as it receives all the replies of the previous one. When '--rate'
+ * is given, the benchmark is open-loop instead: batches are scheduled at
+ * fixed intervals, whether or not the previous replies arrived, and the
+ * latency of every query is measured from its scheduled time rather than
+ * from the time it was actually written. This way a stalled proxy is
+ * charged for all the queries that it delayed (no coordinated omission).
+ *
+ * Latencies are recorded into histograms with three significant digits of
+ * precision (in the style of HdrHistogram), and results are printed as
+ * text, CSV or JSON. */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <hiredis.h>
+#include "ae.h"
+#include "anet.h"
+#include "sds.h"
+#include "zmalloc.h"
+#include "util.h"
+
+#define BENCH_DEFAULT_HOST          "127.0.0.1"
+#define BENCH_DEFAULT_PORT          7777
+#define BENCH_DEFAULT_CLIENTS       50
+#define BENCH_DEFAULT_REQUESTS      100000
+#define BENCH_DEFAULT_KEYSPACE      100000
+#define BENCH_DEFAULT_VALUE_SIZE    3
+#define BENCH_DEFAULT_MULTI_KEYS    10
+#define BENCH_DEFAULT_ZIPF_THETA    0.99
+#define BENCH_DEFAULT_MIX           "get:1"
+#define BENCH_IOBUF_LEN             (1024*16)
+#define BENCH_MAX_VALUE_SIZE        (1024*1024*512)
+#define BENCH_CRON_PERIOD           1 /* Milliseconds */
+
+#define BENCH_OUTPUT_TEXT           0
+#define BENCH_OUTPUT_CSV            1
+#define BENCH_OUTPUT_JSON           2
+
+#define KEY_DIST_UNIFORM            0
+#define KEY_DIST_ZIPF               1
+#define KEY_DIST_SEQUENTIAL         2
+
+/* Histograms keep 2^HIST_SUB_BITS sub-buckets for every power of two, that
+ * is a relative error lower than 0.1%. Values are microseconds. */
+#define HIST_SUB_BITS               11
+#define HIST_SUB_COUNT              (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT             (HIST_SUB_COUNT / 2)
+#define HIST_MAX_SHIFT              (40 - HIST_SUB_BITS)
+#define HIST_BUCKETS                ((HIST_MAX_SHIFT + 2) * HIST_HALF_COUNT)
+
+enum {
+    BENCH_CMD_GET = 0,
+    BENCH_CMD_SET,
+    BENCH_CMD_MGET,
+    BENCH_CMD_MSET,
+    BENCH_CMD_INCR,
+    BENCH_CMD_DEL,
+    BENCH_CMD_PING,
+    BENCH_CMD_COUNT
+};
+
+/* The histogram with index BENCH_CMD_COUNT collects all the commands. */
+#define BENCH_CMD_ALL   BENCH_CMD_COUNT
+
+static const char *benchCommandNames[BENCH_CMD_COUNT + 1] = {
+    "get", "set", "mget", "mset", "incr", "del", "ping", "all"
+};
+
+typedef struct latencyHistogram {
+    uint64_t *counts;
+    uint64_t total;
+    uint64_t errors;
+    long long min;
+    long long max;
+    double sum;
+} latencyHistogram;
+
+typedef struct benchRequest {
+    int command;
+    long long start; /* Intended start time (usec) */
+} benchRequest;
+
+typedef struct benchClient {
+    int id;
+    int fd;
+    redisReader *reader;
+    sds obuf;
+    benchRequest *pending;  /* Circular buffer of requests waiting for a
+                             * reply. */
+    int pending_size;
+    int pending_head;
+    int pending_count;
+    long long next_batch;   /* Open-loop: scheduled time of the next batch */
+} benchClient;
+
+static struct {
+    /* Workload */
+    char *host;
+    int port;
+    int numclients;
+    long long requests;
+    int duration;
+    int pipeline;
+    long long keyspace;
+    int key_dist;
+    double zipf_theta;
+    int value_min;
+    int value_max;
+    int mix[BENCH_CMD_COUNT];
+    int mix_total;
+    sds mix_descr;
+    int multi_keys;
+    int same_slot;
+    double rate;
+    int seed;
+    int output;
+    int quiet;
+    /* State */
+    aeEventLoop *el;
+    benchClient **clients;
+    uint64_t rand_state;
+    char *value;
+    long long sequence;
+    long long issued;
+    long long completed;
+    long long disconnections;
+    long long start;
+    long long end;
+    long long last_progress;
+    long long batch_interval;
+    int stop_issuing;
+    latencyHistogram hist[BENCH_CMD_COUNT + 1];
+    sds first_error;
+    /* Zipfian generator, see nextZipf */
+    double zipf_zetan;
+    double zipf_alpha;
+    double zipf_eta;
+    double zipf_half_pow_theta;
+} bench;
+
+static void connectClient(benchClient *c);
+static void sendBatch(benchClient *c, long long start);
+
+/* Small deterministic PRNG (xorshift64*). */
+static uint64_t benchRandom(void) {
+    uint64_t x = bench.rand_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    bench.rand_state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Uniform double in [0, 1) */
+static double benchRandomDouble(void) {
+    return (double) (benchRandom() >> 11) / (double) (1ULL << 53);
+}
+
+/* -----------------------------------------------------------------------------
+ * Latency histograms
+ * -------------------------------------------------------------------------- */
+
+static void histInit(latencyHistogram *h) {
+    h->counts = zcalloc(sizeof(uint64_t) * HIST_BUCKETS);
+    h->total = 0;
+    h->errors = 0;
+    h->min = LLONG_MAX;
+    h->max = 0;
+    h->sum = 0;
+}
+
+static int histIndex(long long value) {
+    if (value < HIST_SUB_COUNT) return (int) value;
+    int msb = 63 - __builtin_clzll((unsigned long long) value);
+    int shift = msb - (HIST_SUB_BITS - 1);
+    if (shift > HIST_MAX_SHIFT) return HIST_BUCKETS - 1;
+    return shift * HIST_HALF_COUNT + (int) (value >> shift);
+}
+
+/* Highest value that falls in the same bucket of 'index'. */
+static long long histValue(int index) {
+    if (index < HIST_SUB_COUNT) return index;
+    int shift = index / HIST_HALF_COUNT - 1;
+    long long sub = index - shift * HIST_HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void histRecord(latencyHistogram *h, long long value) {
+    if (value < 0) value = 0;
+    h->counts[histIndex(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+static long long histPercentile(latencyHistogram *h, double percentile) {
+    uint64_t target, count = 0;
+    int i;
+    if (h->total == 0) return 0;
+    target = (uint64_t) ceil((percentile / 100.0) * h->total);
+    if (target == 0) target = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        count += h->counts[i];
+        if (count >= target) {
+            long long value = histValue(i);
+            return (value > h->max ? h->max : value);
+        }
+    }
+    return h->max;
+}
+
+/* -----------------------------------------------------------------------------
+ * Workload
+ * -------------------------------------------------------------------------- */
+
+/* Zipfian generator from "Quickly Generating Billion-Record Synthetic
+ * Databases" (Gray et al.), also used by YCSB. zeta(n) is computed once at
+ * startup, then every key is generated in constant time. */
+static void initZipf(void) {
+    double theta = bench.zipf_theta, zeta2 = 0;
+    long long i;
+    bench.zipf_zetan = 0;
+    for (i = 1; i <= bench.keyspace; i++)
+        bench.zipf_zetan += 1.0 / pow((double) i, theta);
+    for (i = 1; i <= 2; i++) zeta2 += 1.0 / pow((double) i, theta);
+    bench.zipf_alpha = 1.0 / (1.0 - theta);
+    bench.zipf_eta = (1.0 - pow(2.0 / bench.keyspace, 1.0 - theta)) /
+                     (1.0 - zeta2 / bench.zipf_zetan);
+    bench.zipf_half_pow_theta = 1.0 + pow(0.5, theta);
+}
+
+static long long nextZipf(void) {
+    double u = benchRandomDouble(), uz = u * bench.zipf_zetan;
+    if (uz < 1.0) return 0;
+    if (uz < bench.zipf_half_pow_theta) return 1;
+    long long key = (long long) (bench.keyspace *
+        pow(bench.zipf_eta * u - bench.zipf_eta + 1.0, bench.zipf_alpha));
+    return (key >= bench.keyspace ? bench.keyspace - 1 : key);
+}
+
+static long long nextKey(void) {
+    switch (bench.key_dist) {
+    case KEY_DIST_ZIPF: return nextZipf();
+    case KEY_DIST_SEQUENTIAL: return bench.sequence++ % bench.keyspace;
+    default: return (long long) (benchRandom() % bench.keyspace);
+    }
+}
+
+static int pickCommand(void) {
+    int r = (int) (benchRandom() % bench.mix_total), i;
+    for (i = 0; i < BENCH_CMD_COUNT; i++) {
+        if (r < bench.mix[i]) return i;
+        r -= bench.mix[i];
+    }
+    return BENCH_CMD_GET;
+}
+
+static sds catBulk(sds buf, const char *s, size_t len) {
+    buf = sdscatfmt(buf, "$%U\r\n", (unsigned long long) len);
+    buf = sdscatlen(buf, s, len);
+    return sdscatlen(buf, "\r\n", 2);
+}
+
+/* Keys of multi-key commands share the hash tag of their first key when
+ * --same-slot is used, otherwise they are spread across the slots. */
+static sds catKey(sds buf, long long key, long long tag) {
+    char k[64];
+    int len;
+    if (tag >= 0) len = snprintf(k, sizeof(k), "key:{%lld}:%lld", tag, key);
+    else len = snprintf(k, sizeof(k), "key:%lld", key);
+    return catBulk(buf, k, len);
+}
+
+static sds catValue(sds buf) {
+    int len = bench.value_min;
+    if (bench.value_max > bench.value_min)
+        len += (int) (benchRandom() %
+                      (uint64_t) (bench.value_max - bench.value_min + 1));
+    return catBulk(buf, bench.value, len);
+}
+
+static sds catCommand(sds buf, int command) {
+    const char *name = benchCommandNames[command];
+    int i, keys = 1, with_values = 0;
+    long long tag = -1;
+    switch (command) {
+    case BENCH_CMD_PING:
+        return sdscat(buf, "*1\r\n$4\r\nPING\r\n");
+    case BENCH_CMD_SET:
+        buf = sdscat(buf, "*3\r\n");
+        with_values = 1;
+        break;
+    case BENCH_CMD_MSET:
+        with_values = 1;
+        /* Fall through */
+    case BENCH_CMD_MGET:
+        keys = bench.multi_keys;
+        buf = sdscatfmt(buf, "*%i\r\n", 1 + keys * (1 + with_values));
+        if (bench.same_slot) tag = nextKey();
+        break;
+    default:
+        buf = sdscat(buf, "*2\r\n");
+    }
+    buf = catBulk(buf, name, strlen(name));
+    for (i = 0; i < keys; i++) {
+        buf = catKey(buf, nextKey(), tag);
+        if (with_values) buf = catValue(buf);
+    }
+    return buf;
+}
+
+/* -----------------------------------------------------------------------------
+ * Clients
+ * -------------------------------------------------------------------------- */
+
+static void addPendingRequest(benchClient *c, int command, long long start) {
+    if (c->pending_count == c->pending_size) {
+        int size = c->pending_size * 2, i;
+        benchRequest *pending = zmalloc(sizeof(benchRequest) * size);
+        for (i = 0; i < c->pending_count; i++)
+            pending[i] = c->pending[(c->pending_head + i) % c->pending_size];
+        zfree(c->pending);
+        c->pending = pending;
+        c->pending_size = size;
+        c->pending_head = 0;
+    }
+    int tail = (c->pending_head + c->pending_count) % c->pending_size;
+    c->pending[tail].command = command;
+    c->pending[tail].start = start;
+    c->pending_count++;
+}
+
+static benchRequest *popPendingRequest(benchClient *c) {
+    if (c->pending_count == 0) return NULL;
+    benchRequest *req = &c->pending[c->pending_head];
+    c->pending_head = (c->pending_head + 1) % c->pending_size;
+    c->pending_count--;
+    return req;
+}
+
+static void checkCompletion(void) {
+    int i;
+    if (!bench.stop_issuing) return;
+    for (i = 0; i < bench.numclients; i++)
+        if (bench.clients[i]->pending_count > 0) return;
+    bench.end = ustime();
+    aeStop(bench.el);
+}
+
+static void stopIssuing(void) {
+    if (bench.stop_issuing) return;
+    bench.stop_issuing = 1;
+    checkCompletion();
+}
+
+static int canIssue(void) {
+    if (bench.stop_issuing) return 0;
+    if (bench.requests > 0 && bench.issued >= bench.requests) {
+        stopIssuing();
+        return 0;
+    }
+    if (bench.duration > 0 &&
+        (ustime() - bench.start) >= (long long) bench.duration * 1000000)
+    {
+        stopIssuing();
+        return 0;
+    }
+    return 1;
+}
+
+/* Requests waiting for a reply on a dropped connection are counted as
+ * errors, then the client connects again. */
+static void resetClient(benchClient *c, const char *reason) {
+    benchRequest *req;
+    if (bench.first_error == NULL)
+        bench.first_error = sdsnew(reason);
+    while ((req = popPendingRequest(c)) != NULL) {
+        bench.hist[req->command].errors++;
+        bench.hist[BENCH_CMD_ALL].errors++;
+        bench.completed++;
+    }
+    bench.disconnections++;
+    aeDeleteFileEvent(bench.el, c->fd, AE_READABLE | AE_WRITABLE);
+    close(c->fd);
+    redisReaderFree(c->reader);
+    sdsclear(c->obuf);
+    connectClient(c);
+    if (bench.rate <= 0 && canIssue()) sendBatch(c, ustime());
+    checkCompletion();
+}
+
+static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+static void writeToClient(benchClient *c) {
+    while (sdslen(c->obuf) > 0) {
+        ssize_t nwritten = write(c->fd, c->obuf, sdslen(c->obuf));
+        if (nwritten <= 0) {
+            if (nwritten == -1 && errno == EAGAIN) break;
+            resetClient(c, "Connection lost while writing");
+            return;
+        }
+        sdsrange(c->obuf, nwritten, -1);
+    }
+    int installed = aeGetFileEvents(bench.el, c->fd) & AE_WRITABLE;
+    if (sdslen(c->obuf) == 0 && installed)
+        aeDeleteFileEvent(bench.el, c->fd, AE_WRITABLE);
+    else if (sdslen(c->obuf) > 0 && !installed)
+        aeCreateFileEvent(bench.el, c->fd, AE_WRITABLE, writeHandler, c);
+}
+
+static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    (void) el;
+    (void) fd;
+    (void) mask;
+    writeToClient(privdata);
+}
+
+/* Send a batch of --pipeline queries, whose latency will be measured from
+ * 'start'. */
+static void sendBatch(benchClient *c, long long start) {
+    int i;
+    for (i = 0; i < bench.pipeline && canIssue(); i++) {
+        int command = pickCommand();
+        c->obuf = catCommand(c->obuf, command);
+        addPendingRequest(c, command, start);
+        bench.issued++;
+    }
+    writeToClient(c);
+}
+
+static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    benchClient *c = privdata;
+    char buf[BENCH_IOBUF_LEN];
+    void *reply = NULL;
+    (void) el;
+    (void) mask;
+    ssize_t nread = read(fd, buf, sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        resetClient(c, "Connection closed by the server");
+        return;
+    }
+    if (redisReaderFeed(c->reader, buf, nread) != REDIS_OK) {
+        resetClient(c, "Failed to feed the reply reader");
+        return;
+    }
+    long long now = ustime();
+    while (1) {
+        if (redisReaderGetReply(c->reader, &reply) != REDIS_OK) {
+            resetClient(c, "Protocol error");
+            return;
+        }
+        if (reply == NULL) break;
+        benchRequest *req = popPendingRequest(c);
+        redisReply *r = reply;
+        if (req == NULL) {
+            freeReplyObject(reply);
+            resetClient(c, "Unexpected reply");
+            return;
+        }
+        if (r->type == REDIS_REPLY_ERROR) {
+            if (bench.first_error == NULL)
+                bench.first_error = sdsnewlen(r->str, r->len);
+            bench.hist[req->command].errors++;
+            bench.hist[BENCH_CMD_ALL].errors++;
+        } else {
+            histRecord(&bench.hist[req->command], now - req->start);
+            histRecord(&bench.hist[BENCH_CMD_ALL], now - req->start);
+        }
+        freeReplyObject(reply);
+        bench.completed++;
+    }
+    /* Closed-loop clients send the next batch as soon as they received all
+     * the replies of the previous one. */
+    if (bench.rate <= 0 && c->pending_count == 0 && canIssue())
+        sendBatch(c, now);
+    checkCompletion();
+}
+
+static void connectClient(benchClient *c) {
+    char err[ANET_ERR_LEN];
+    c->fd = anetTcpConnect(err, bench.host, bench.port);
+    if (c->fd == ANET_ERR) {
+        fprintf(stderr, "Could not connect to %s:%d: %s\n", bench.host,
+                bench.port, err);
+        exit(1);
+    }
+    anetNonBlock(NULL, c->fd);
+    anetEnableTcpNoDelay(NULL, c->fd);
+    c->reader = redisReaderCreate();
+    if (aeCreateFileEvent(bench.el, c->fd, AE_READABLE, readHandler, c)
+        == AE_ERR)
+    {
+        fprintf(stderr, "Could not create read handler\n");
+        exit(1);
+    }
+}
+
+static benchClient *createClient(int id) {
+    benchClient *c = zmalloc(sizeof(*c));
+    c->id = id;
+    c->obuf = sdsempty();
+    c->pending_size = (bench.pipeline > 16 ? bench.pipeline : 16);
+    c->pending = zmalloc(sizeof(benchRequest) * c->pending_size);
+    c->pending_head = 0;
+    c->pending_count = 0;
+    c->next_batch = 0;
+    connectClient(c);
+    return c;
+}
+
+/* -----------------------------------------------------------------------------
+ * Cron and reports
+ * -------------------------------------------------------------------------- */
+
+static void showProgress(long long now) {
+    if (bench.quiet || !isatty(fileno(stderr))) return;
+    double elapsed = (double) (now - bench.start) / 1000000;
+    fprintf(stderr, "\r%.1fs: %lld requests, %.2f requests/s, "
+            "p50 %lld usec, p99 %lld usec          ", elapsed,
+            bench.completed,
+            (elapsed > 0 ? bench.completed / elapsed : 0),
+            histPercentile(&bench.hist[BENCH_CMD_ALL], 50),
+            histPercentile(&bench.hist[BENCH_CMD_ALL], 99));
+}
+
+static int benchCron(aeEventLoop *el, long long id, void *privdata) {
+    long long now = ustime();
+    int i;
+    (void) el;
+    (void) id;
+    (void) privdata;
+    /* Open-loop: send all the batches whose scheduled time has come. */
+    if (bench.rate > 0) {
+        for (i = 0; i < bench.numclients; i++) {
+            benchClient *c = bench.clients[i];
+            while (c->next_batch <= now && canIssue()) {
+                sendBatch(c, c->next_batch);
+                c->next_batch += bench.batch_interval;
+            }
+        }
+    } else canIssue(); /* Check --duration */
+    if ((now - bench.last_progress) >= 1000000) {
+        showProgress(now);
+        bench.last_progress = now;
+    }
+    return BENCH_CRON_PERIOD;
+}
+
+static double getDurationSecs(void) {
+    double secs = (double) (bench.end - bench.start) / 1000000;
+    return (secs > 0 ? secs : 1e-6);
+}
+
+static const char *getKeyDistName(void) {
+    switch (bench.key_dist) {
+    case KEY_DIST_ZIPF: return "zipf";
+    case KEY_DIST_SEQUENTIAL: return "sequential";
+    default: return "uniform";
+    }
+}
+
+static void printTextReport(void) {
+    double secs = getDurationSecs();
+    int i;
+    printf("Workload: %s, %d clients, pipeline %d, keyspace %lld (%s",
+           bench.mix_descr, bench.numclients, bench.pipeline,
+           bench.keyspace, getKeyDistName());
+    if (bench.key_dist == KEY_DIST_ZIPF) printf(" %g", bench.zipf_theta);
+    printf("), value size %d", bench.value_min);
+    if (bench.value_max > bench.value_min) printf("-%d", bench.value_max);
+    if (bench.rate > 0) printf(", rate %.0f requests/s\n", bench.rate);
+    else printf(", closed-loop\n");
+    printf("Duration: %.3f seconds, %lld requests, %.2f requests/s, "
+           "%lld disconnections\n\n", secs, bench.completed,
+           bench.completed / secs, bench.disconnections);
+    printf("%-8s %10s %8s %12s %8s %10s %8s %8s %8s %8s %8s %8s\n",
+           "command", "requests", "errors", "rps", "min", "mean", "p50",
+           "p90", "p99", "p99.9", "p99.99", "max");
+    for (i = BENCH_CMD_COUNT; i >= 0; i--) {
+        latencyHistogram *h = &bench.hist[i];
+        uint64_t requests = h->total + h->errors;
+        if (requests == 0 && i != BENCH_CMD_ALL) continue;
+        printf("%-8s %10llu %8llu %12.2f %8lld %10.2f %8lld %8lld %8lld "
+               "%8lld %8lld %8lld\n", benchCommandNames[i],
+               (unsigned long long) requests,
+               (unsigned long long) h->errors, requests / secs,
+               (h->total ? h->min : 0),
+               (h->total ? h->sum / h->total : 0),
+               histPercentile(h, 50), histPercentile(h, 90),
+               histPercentile(h, 99), histPercentile(h, 99.9),
+               histPercentile(h, 99.99), h->max);
+    }
+    printf("(latencies in microseconds)\n");
+    if (bench.first_error != NULL)
+        printf("\nFirst error: %s\n", bench.first_error);
+}
+
+static void printCSVReport(void) {
+    double secs = getDurationSecs();
+    int i;
+    printf("command,requests,errors,rps,min_usec,mean_usec,p50_usec,"
+           "p90_usec,p99_usec,p999_usec,p9999_usec,max_usec\n");
+    for (i = BENCH_CMD_COUNT; i >= 0; i--) {
+        latencyHistogram *h = &bench.hist[i];
+        uint64_t requests = h->total + h->errors;
+        if (requests == 0 && i != BENCH_CMD_ALL) continue;
+        printf("%s,%llu,%llu,%.2f,%lld,%.2f,%lld,%lld,%lld,%lld,%lld,%lld\n",
+               benchCommandNames[i], (unsigned long long) requests,
+               (unsigned long long) h->errors, requests / secs,
+               (h->total ? h->min : 0),
+               (h->total ? h->sum / h->total : 0),
+               histPercentile(h, 50), histPercentile(h, 90),
+               histPercentile(h, 99), histPercentile(h, 99.9),
+               histPercentile(h, 99.99), h->max);
+    }
+}
+
+static void printJSONReport(void) {
+    double secs = getDurationSecs();
+    int i, first = 1;
+    printf("{\n  \"workload\": {\"mix\": \"%s\", \"clients\": %d, "
+           "\"pipeline\": %d, \"keyspace\": %lld, \"key_distribution\": "
+           "\"%s\", \"zipf_theta\": %g, \"value_min\": %d, \"value_max\": "
+           "%d, \"multi_keys\": %d, \"same_slot\": %s, \"rate\": %.0f},\n",
+           bench.mix_descr, bench.numclients, bench.pipeline, bench.keyspace,
+           getKeyDistName(), bench.zipf_theta, bench.value_min,
+           bench.value_max, bench.multi_keys,
+           (bench.same_slot ? "true" : "false"), bench.rate);
+    printf("  \"duration_sec\": %.6f,\n  \"requests\": %lld,\n"
+           "  \"rps\": %.2f,\n  \"disconnections\": %lld,\n"
+           "  \"commands\": {", secs, bench.completed,
+           bench.completed / secs, bench.disconnections);
+    for (i = BENCH_CMD_COUNT; i >= 0; i--) {
+        latencyHistogram *h = &bench.hist[i];
+        uint64_t requests = h->total + h->errors;
+        if (requests == 0 && i != BENCH_CMD_ALL) continue;
+        printf("%s\n    \"%s\": {\"requests\": %llu, \"errors\": %llu, "
+               "\"rps\": %.2f, \"latency_usec\": {\"min\": %lld, "
+               "\"mean\": %.2f, \"p50\": %lld, \"p90\": %lld, \"p99\": %lld, "
+               "\"p99.9\": %lld, \"p99.99\": %lld, \"max\": %lld}}",
+               (first ? "" : ","), benchCommandNames[i],
+               (unsigned long long) requests,
+               (unsigned long long) h->errors, requests / secs,
+               (h->total ? h->min : 0),
+               (h->total ? h->sum / h->total : 0),
+               histPercentile(h, 50), histPercentile(h, 90),
+               histPercentile(h, 99), histPercentile(h, 99.9),
+               histPercentile(h, 99.99), h->max);
+        first = 0;
+    }
+    printf("\n  }\n}\n");
+}
+
+/* -----------------------------------------------------------------------------
+ * Main
+ * -------------------------------------------------------------------------- */
+
+static void usage(void) {
+    fprintf(stderr,
+"Usage: redis-cluster-proxy-bench [OPTIONS]\n\n"
+"  -h <hostname>          Proxy hostname (default: %s)\n"
+"  -p <port>              Proxy port (default: %d)\n"
+"  -c <clients>           Number of connections (default: %d)\n"
+"  -n <requests>          Total number of requests (default: %d)\n"
+"  --duration <secs>      Run for <secs> seconds instead of -n requests\n"
+"  -P <numreq>            Pipeline <numreq> requests (default: 1)\n"
+"  --mix <cmd:weight,...> Command mix, ie. get:80,set:20 (default: %s)\n"
+"                         Commands: get, set, mget, mset, incr, del, ping\n"
+"  -r <keyspace>          Number of distinct keys (default: %d)\n"
+"  --key-dist <dist>      Key distribution: uniform, zipf or sequential\n"
+"                         (default: uniform)\n"
+"  --zipf-theta <theta>   Skew of the zipf distribution, 0 < theta < 1\n"
+"                         (default: %g)\n"
+"  -d <size>|<min>-<max>  Size of SET/MSET values (default: %d)\n"
+"  --multi-keys <n>       Keys of every MGET/MSET (default: %d)\n"
+"  --same-slot            Use a shared hash tag for MGET/MSET keys\n"
+"  --rate <rps>           Open-loop mode: schedule <rps> requests per\n"
+"                         second, measuring latencies from the scheduled\n"
+"                         times\n"
+"  --seed <n>             Seed for the random generator (default: 1)\n"
+"  --csv                  Output results as CSV\n"
+"  --json                 Output results as JSON\n"
+"  -q                     Don't show progress\n"
+"  --help                 Print this help\n",
+    BENCH_DEFAULT_HOST, BENCH_DEFAULT_PORT, BENCH_DEFAULT_CLIENTS,
+    BENCH_DEFAULT_REQUESTS, BENCH_DEFAULT_MIX, BENCH_DEFAULT_KEYSPACE,
+    BENCH_DEFAULT_ZIPF_THETA, BENCH_DEFAULT_VALUE_SIZE,
+    BENCH_DEFAULT_MULTI_KEYS);
+}
+
+static int parseLongLong(const char *arg, const char *value, long long min,
+                         long long max, long long *result)
+{
+    char *eptr = NULL;
+    errno = 0;
+    long long ll = strtoll(value, &eptr, 10);
+    if (errno || *value == '\0' || *eptr != '\0' || ll < min || ll > max) {
+        fprintf(stderr, "Invalid value for %s: %s\n", arg, value);
+        return 0;
+    }
+    *result = ll;
+    return 1;
+}
+
+static int parseInt(const char *arg, const char *value, int min, int max,
+                    int *result)
+{
+    long long ll;
+    if (!parseLongLong(arg, value, min, max, &ll)) return 0;
+    *result = (int) ll;
+    return 1;
+}
+
+static int parseDouble(const char *arg, const char *value, double min,
+                       double max, double *result)
+{
+    char *eptr = NULL;
+    double d = strtod(value, &eptr);
+    if (*value == '\0' || *eptr != '\0' || d < min || d > max) {
+        fprintf(stderr, "Invalid value for %s: %s\n", arg, value);
+        return 0;
+    }
+    *result = d;
+    return 1;
+}
+
+static int parseMix(const char *value) {
+    int count, i, j, ok = 1;
+    sds *items = sdssplitlen(value, strlen(value), ",", 1, &count);
+    memset(bench.mix, 0, sizeof(bench.mix));
+    bench.mix_total = 0;
+    for (i = 0; i < count && ok; i++) {
+        int weight = 1;
+        char *sep = strchr(items[i], ':');
+        if (sep != NULL) {
+            *sep = '\0';
+            ok = parseInt("--mix", sep + 1, 0, 1000000, &weight);
+            if (!ok) break;
+        }
+        for (j = 0; j < BENCH_CMD_COUNT; j++)
+            if (!strcasecmp(items[i], benchCommandNames[j])) break;
+        if (j == BENCH_CMD_COUNT) {
+            fprintf(stderr, "Unsupported command in --mix: %s\n", items[i]);
+            ok = 0;
+            break;
+        }
+        bench.mix[j] += weight;
+        bench.mix_total += weight;
+    }
+    sdsfreesplitres(items, count);
+    if (ok && bench.mix_total == 0) {
+        fprintf(stderr, "Invalid --mix: all the weights are zero\n");
+        ok = 0;
+    }
+    if (ok) {
+        sdsfree(bench.mix_descr);
+        bench.mix_descr = sdsnew(value);
+    }
+    return ok;
+}
+
+static int parseValueSize(const char *value) {
+    const char *sep = strchr(value, '-');
+    if (sep == NULL) {
+        if (!parseInt("-d", value, 1, BENCH_MAX_VALUE_SIZE, &bench.value_min))
+            return 0;
+        bench.value_max = bench.value_min;
+        return 1;
+    }
+    sds min = sdsnewlen(value, sep - value);
+    int ok = parseInt("-d", min, 1, BENCH_MAX_VALUE_SIZE, &bench.value_min) &&
+             parseInt("-d", sep + 1, 1, BENCH_MAX_VALUE_SIZE,
+                      &bench.value_max);
+    sdsfree(min);
+    if (ok && bench.value_max < bench.value_min) {
+        fprintf(stderr, "Invalid value for -d: %s\n", value);
+        ok = 0;
+    }
+    return ok;
+}
+
+static int parseOptions(int argc, char **argv) {
+    int i, requests_set = 0;
+    for (i = 1; i < argc; i++) {
+        int lastarg = (i == (argc - 1)), ok = 1;
+        const char *arg = argv[i];
+        if (!strcmp("--help", arg)) {
+            usage();
+            exit(0);
+        } else if (!strcmp("-h", arg) && !lastarg)
+            bench.host = argv[++i];
+        else if (!strcmp("-p", arg) && !lastarg)
+            ok = parseInt(arg, argv[++i], 1, 65535, &bench.port);
+        else if (!strcmp("-c", arg) && !lastarg)
+            ok = parseInt(arg, argv[++i], 1, 1000000, &bench.numclients);
+        else if (!strcmp("-n", arg) && !lastarg) {
+            ok = parseLongLong(arg, argv[++i], 1, LLONG_MAX,
+                               &bench.requests);
+            requests_set = 1;
+        } else if (!strcmp("--duration", arg) && !lastarg)
+            ok = parseInt(arg, argv[++i], 1, INT_MAX, &bench.duration);
+        else if (!strcmp("-P", arg) && !lastarg)
+            ok = parseInt(arg, argv[++i], 1, 1000000, &bench.pipeline);
+        else if (!strcmp("--mix", arg) && !lastarg)
+            ok = parseMix(argv[++i]);
+        else if (!strcmp("-r", arg) && !lastarg)
+            ok = parseLongLong(arg, argv[++i], 1, LLONG_MAX,
+                               &bench.keyspace);
+        else if (!strcmp("--key-dist", arg) && !lastarg) {
+            const char *dist = argv[++i];
+            if (!strcasecmp(dist, "uniform")) bench.key_dist = KEY_DIST_UNIFORM;
+            else if (!strcasecmp(dist, "zipf")) bench.key_dist = KEY_DIST_ZIPF;
+            else if (!strcasecmp(dist, "sequential"))
+                bench.key_dist = KEY_DIST_SEQUENTIAL;
+            else {
+                fprintf(stderr, "Invalid key distribution: %s\n", dist);
+                ok = 0;
+            }
+        } else if (!strcmp("--zipf-theta", arg) && !lastarg) {
+            ok = parseDouble(arg, argv[++i], 0, 1, &bench.zipf_theta);
+            if (ok && (bench.zipf_theta <= 0 || bench.zipf_theta >= 1)) {
+                fprintf(stderr, "--zipf-theta must be between 0 and 1\n");
+                ok = 0;
+            }
+        } else if (!strcmp("-d", arg) && !lastarg)
+            ok = parseValueSize(argv[++i]);
+        else if (!strcmp("--multi-keys", arg) && !lastarg)
+            ok = parseInt(arg, argv[++i], 1, 1000000, &bench.multi_keys);
+        else if (!strcmp("--same-slot", arg))
+            bench.same_slot = 1;
+        else if (!strcmp("--rate", arg) && !lastarg)
+            ok = parseDouble(arg, argv[++i], 0, 1e9, &bench.rate);
+        else if (!strcmp("--seed", arg) && !lastarg)
+            ok = parseInt(arg, argv[++i], 0, INT_MAX, &bench.seed);
+        else if (!strcmp("--csv", arg))
+            bench.output = BENCH_OUTPUT_CSV;
+        else if (!strcmp("--json", arg))
+            bench.output = BENCH_OUTPUT_JSON;
+        else if (!strcmp("-q", arg))
+            bench.quiet = 1;
+        else {
+            fprintf(stderr, "Invalid option: %s\n\n", arg);
+            usage();
+            return 0;
+        }
+        if (!ok) return 0;
+    }
+    /* --duration without -n runs until time is up. */
+    if (bench.duration > 0 && !requests_set) bench.requests = 0;
+    return 1;
+}
+
+static void initBench(void) {
+    int i;
+    memset(&bench, 0, sizeof(bench));
+    bench.host = BENCH_DEFAULT_HOST;
+    bench.port = BENCH_DEFAULT_PORT;
+    bench.numclients = BENCH_DEFAULT_CLIENTS;
+    bench.requests = BENCH_DEFAULT_REQUESTS;
+    bench.pipeline = 1;
+    bench.keyspace = BENCH_DEFAULT_KEYSPACE;
+    bench.key_dist = KEY_DIST_UNIFORM;
+    bench.zipf_theta = BENCH_DEFAULT_ZIPF_THETA;
+    bench.value_min = BENCH_DEFAULT_VALUE_SIZE;
+    bench.value_max = BENCH_DEFAULT_VALUE_SIZE;
+    bench.multi_keys = BENCH_DEFAULT_MULTI_KEYS;
+    bench.seed = 1;
+    bench.output = BENCH_OUTPUT_TEXT;
+    parseMix(BENCH_DEFAULT_MIX);
+    for (i = 0; i <= BENCH_CMD_COUNT; i++) histInit(&bench.hist[i]);
+}
+
+int main(int argc, char **argv) {
+    int i;
+    initBench();
+    if (!parseOptions(argc, argv)) return 1;
+    signal(SIGPIPE, SIG_IGN);
+    bench.rand_state = (uint64_t) bench.seed * 0x9E3779B97F4A7C15ULL + 1;
+    if (bench.key_dist == KEY_DIST_ZIPF) initZipf();
+    bench.value = zmalloc(bench.value_max);
+    memset(bench.value, 'x', bench.value_max);
+    bench.el = aeCreateEventLoop(bench.numclients + 128);
+    if (bench.el == NULL) {
+        fprintf(stderr, "Could not create event loop\n");
+        return 1;
+    }
+    bench.clients = zmalloc(sizeof(benchClient *) * bench.numclients);
+    for (i = 0; i < bench.numclients; i++)
+        bench.clients[i] = createClient(i);
+    bench.start = bench.last_progress = ustime();
+    if (bench.rate > 0) {
+        /* Every client sends a batch every 'batch_interval' microseconds,
+         * with start times spread across the interval. */
+        bench.batch_interval = (long long) ((1000000.0 * bench.numclients *
+                                             bench.pipeline) / bench.rate);
+        if (bench.batch_interval < 1) bench.batch_interval = 1;
+        for (i = 0; i < bench.numclients; i++) {
+            bench.clients[i]->next_batch = bench.start +
+                (bench.batch_interval * i) / bench.numclients;
+        }
+    } else {
+        for (i = 0; i < bench.numclients && canIssue(); i++)
+            sendBatch(bench.clients[i], bench.start);
+    }
+    aeCreateTimeEvent(bench.el, BENCH_CRON_PERIOD, benchCron, NULL, NULL);
+    aeMain(bench.el);
+    if (bench.end == 0) bench.end = ustime();
+    if (!bench.quiet && isatty(fileno(stderr))) fprintf(stderr, "\n");
+    switch (bench.output) {
+    case BENCH_OUTPUT_CSV: printCSVReport(); break;
+    case BENCH_OUTPUT_JSON: printJSONReport(); break;
+    default: printTextReport();
+    }
+    return (bench.hist[BENCH_CMD_ALL].total > 0 ? 0 : 1);
+}
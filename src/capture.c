@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Capture of the traffic sent by clients (see PROXY CAPTURE).
+ *
+ * Every thread appends the records of its clients to its own buffer, so that
+ * threads never contend with each other, while a background thread swaps
+ * the buffers with empty ones every CAPTURE_FLUSH_INTERVAL milliseconds and
+ * writes them to the capture file: no thread ever blocks on disk I/O.
+ * If the writer can't keep up and a buffer grows beyond CAPTURE_MAX_BUFFER,
+ * records are dropped and counted. */
+
+#include "fmacros.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "capture.h"
+#include "config.h"
+#include "logger.h"
+#include "zmalloc.h"
+#include "util.h"
+
+#define CAPTURE_FLUSH_INTERVAL  100 /* Milliseconds */
+#define CAPTURE_MAX_BUFFER      (32*1024*1024)
+
+typedef struct captureBuffer {
+    pthread_mutex_t lock;
+    sds buf;
+    uint64_t records;
+    uint64_t dropped_records;
+} captureBuffer;
+
+_Atomic int capture_active = 0;
+
+static struct {
+    pthread_mutex_t lock; /* Serializes start and stop. */
+    pthread_mutex_t writer_lock;
+    pthread_cond_t writer_cond;
+    pthread_t writer;
+    int initialized;
+    int stopping;
+    FILE *fp;
+    sds filename;
+    double sample_rate;
+    uint32_t sample_threshold;
+    long long start_us;
+    _Atomic uint64_t bytes;
+    /* Buffers are never released, since a thread could still be appending
+     * to its buffer while the capture gets stopped. There's a buffer for
+     * every possible thread, since threads can be added at runtime. */
+    captureBuffer buffers[MAX_THREADS];
+} capture = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .writer_lock = PTHREAD_MUTEX_INITIALIZER,
+    .writer_cond = PTHREAD_COND_INITIALIZER
+};
+
+static sds catVarint(sds s, uint64_t value) {
+    unsigned char buf[CAPTURE_MAX_VARINT_LEN];
+    int len = 0;
+    while (value >= 0x80) {
+        buf[len++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = (unsigned char) value;
+    return sdscatlen(s, buf, len);
+}
+
+static sds catRecordHeader(sds s, int type, int thread_id,
+                           uint64_t client_id)
+{
+    unsigned char t = (unsigned char) type;
+    s = sdscatlen(s, &t, 1);
+    s = catVarint(s, ustime() - capture.start_us);
+    s = catVarint(s, thread_id);
+    return catVarint(s, client_id);
+}
+
+/* Clients are sampled by hashing their IDs, so that either all the traffic
+ * of a client is captured or none of it. */
+static int isClientSampled(int thread_id, uint64_t client_id) {
+    if (capture.sample_rate >= 1) return 1;
+    uint64_t h = (client_id ^ ((uint64_t) thread_id << 48)) *
+                 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (h >> 32) < capture.sample_threshold;
+}
+
+static captureBuffer *getClientBuffer(int thread_id, uint64_t client_id) {
+    if (thread_id < 0 || thread_id >= MAX_THREADS) return NULL;
+    if (!isClientSampled(thread_id, client_id)) return NULL;
+    return capture.buffers + thread_id;
+}
+
+void captureQuery(int thread_id, uint64_t client_id, const char *buf,
+                  size_t len)
+{
+    captureBuffer *b = getClientBuffer(thread_id, client_id);
+    if (b == NULL) return;
+    pthread_mutex_lock(&b->lock);
+    if (sdslen(b->buf) + len > CAPTURE_MAX_BUFFER) b->dropped_records++;
+    else {
+        b->buf = catRecordHeader(b->buf, CAPTURE_RECORD_QUERY, thread_id,
+                                 client_id);
+        b->buf = catVarint(b->buf, len);
+        b->buf = sdscatlen(b->buf, buf, len);
+        b->records++;
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+void captureClose(int thread_id, uint64_t client_id) {
+    captureBuffer *b = getClientBuffer(thread_id, client_id);
+    if (b == NULL) return;
+    pthread_mutex_lock(&b->lock);
+    b->buf = catRecordHeader(b->buf, CAPTURE_RECORD_CLOSE, thread_id,
+                             client_id);
+    b->records++;
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* Write the content of all the buffers to the capture file. The buffers are
+ * swapped with the 'spare' one, so that threads can keep appending records
+ * while the file is being written. Return 0 on write errors. */
+static int flushBuffers(sds *spare) {
+    int i, ok = 1;
+    for (i = 0; i < MAX_THREADS; i++) {
+        captureBuffer *b = capture.buffers + i;
+        sds buf;
+        pthread_mutex_lock(&b->lock);
+        buf = b->buf;
+        b->buf = *spare;
+        pthread_mutex_unlock(&b->lock);
+        size_t len = sdslen(buf);
+        if (len > 0 && ok) {
+            ok = (fwrite(buf, 1, len, capture.fp) == len);
+            if (ok) capture.bytes += len;
+        }
+        sdsclear(buf);
+        *spare = buf;
+    }
+    if (ok) ok = (fflush(capture.fp) == 0);
+    return ok;
+}
+
+static void *captureWriterThread(void *arg) {
+    (void) arg;
+    sds spare = sdsempty();
+    int ok = 1;
+    pthread_mutex_lock(&capture.writer_lock);
+    while (!capture.stopping && ok) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CAPTURE_FLUSH_INTERVAL * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&capture.writer_cond, &capture.writer_lock,
+                               &deadline);
+        pthread_mutex_unlock(&capture.writer_lock);
+        ok = flushBuffers(&spare);
+        pthread_mutex_lock(&capture.writer_lock);
+    }
+    pthread_mutex_unlock(&capture.writer_lock);
+    if (!ok) {
+        proxyLogErr("Failed to write capture file '%s': %s. Capture "
+                    "stopped.", capture.filename, strerror(errno));
+        capture_active = 0;
+    } else flushBuffers(&spare);
+    sdsfree(spare);
+    return NULL;
+}
+
+int captureStart(const char *filename, double sample_rate, char **err) {
+    int i, ok = 0;
+    pthread_mutex_lock(&capture.lock);
+    if (capture_active || capture.fp != NULL) {
+        /* A capture that failed because of a write error still has to be
+         * stopped in order to join its writer. */
+        if (!capture_active) {
+            pthread_mutex_unlock(&capture.lock);
+            captureStop();
+            pthread_mutex_lock(&capture.lock);
+        } else {
+            *err = "a capture is already in progress";
+            goto cleanup;
+        }
+    }
+    if (!capture.initialized) {
+        for (i = 0; i < MAX_THREADS; i++) {
+            pthread_mutex_init(&capture.buffers[i].lock, NULL);
+            capture.buffers[i].buf = sdsempty();
+        }
+        capture.initialized = 1;
+    }
+    capture.fp = fopen(filename, "w");
+    if (capture.fp == NULL) {
+        *err = strerror(errno);
+        goto cleanup;
+    }
+    capture.start_us = ustime();
+    unsigned char header[CAPTURE_HEADER_LEN] = {0};
+    memcpy(header, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    header[CAPTURE_MAGIC_LEN] = CAPTURE_VERSION;
+    for (i = 0; i < 8; i++)
+        header[8 + i] = (unsigned char) (capture.start_us >> (i * 8));
+    if (fwrite(header, 1, sizeof(header), capture.fp) != sizeof(header)) {
+        *err = strerror(errno);
+        fclose(capture.fp);
+        capture.fp = NULL;
+        goto cleanup;
+    }
+    for (i = 0; i < MAX_THREADS; i++) {
+        captureBuffer *b = capture.buffers + i;
+        pthread_mutex_lock(&b->lock);
+        sdsclear(b->buf);
+        b->records = 0;
+        b->dropped_records = 0;
+        pthread_mutex_unlock(&b->lock);
+    }
+    capture.bytes = sizeof(header);
+    capture.stopping = 0;
+    if (capture.filename) sdsfree(capture.filename);
+    capture.filename = sdsnew(filename);
+    capture.sample_rate = sample_rate;
+    capture.sample_threshold = (uint32_t) (sample_rate * UINT32_MAX);
+    if (pthread_create(&capture.writer, NULL, captureWriterThread, NULL)) {
+        *err = "failed to start the capture thread";
+        fclose(capture.fp);
+        capture.fp = NULL;
+        goto cleanup;
+    }
+    capture_active = 1;
+    ok = 1;
+    proxyLogInfo("Started capturing clients' queries to '%s' "
+                 "(sample rate: %.2f)", filename, sample_rate);
+cleanup:
+    pthread_mutex_unlock(&capture.lock);
+    return ok;
+}
+
+/* Stop the capture and wait for the writer to flush all the buffers.
+ * Return 0 if there was no capture to stop. */
+int captureStop(void) {
+    pthread_mutex_lock(&capture.lock);
+    if (capture.fp == NULL) {
+        pthread_mutex_unlock(&capture.lock);
+        return 0;
+    }
+    capture_active = 0;
+    pthread_mutex_lock(&capture.writer_lock);
+    capture.stopping = 1;
+    pthread_cond_signal(&capture.writer_cond);
+    pthread_mutex_unlock(&capture.writer_lock);
+    pthread_join(capture.writer, NULL);
+    fclose(capture.fp);
+    capture.fp = NULL;
+    proxyLogInfo("Stopped capturing clients' queries to '%s' (%llu bytes)",
+                 capture.filename, (unsigned long long) capture.bytes);
+    pthread_mutex_unlock(&capture.lock);
+    return 1;
+}
+
+void captureGetInfo(captureInfo *info) {
+    int i;
+    pthread_mutex_lock(&capture.lock);
+    info->active = capture_active;
+    info->filename = (capture.filename ? sdsdup(capture.filename) : NULL);
+    info->sample_rate = capture.sample_rate;
+    info->start_time = capture.start_us / 1000;
+    info->bytes = capture.bytes;
+    info->records = 0;
+    info->dropped_records = 0;
+    for (i = 0; i < MAX_THREADS; i++) {
+        captureBuffer *b = capture.buffers + i;
+        pthread_mutex_lock(&b->lock);
+        info->records += b->records;
+        info->dropped_records += b->dropped_records;
+        pthread_mutex_unlock(&b->lock);
+    }
+    pthread_mutex_unlock(&capture.lock);
+}
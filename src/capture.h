@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REDIS_CLUSTER_PROXY_CAPTURE_H__
+#define __REDIS_CLUSTER_PROXY_CAPTURE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sds.h"
+
+/* Capture file format.
+ *
+ * The file starts with a 16 bytes header: the CAPTURE_MAGIC string, the
+ * format version (one byte), a reserved byte and the time when the capture
+ * started (microseconds since the epoch, 64 bit little endian).
+ *
+ * The header is followed by the records, every record starting with its
+ * type (one byte) followed by these unsigned varints (7 bits per byte, least
+ * significant group first, the high bit set on all the bytes but the last):
+ *
+ * - the time of the record, in microseconds since the start of the capture;
+ * - the ID of the client's thread;
+ * - the ID of the client inside its thread.
+ *
+ * CAPTURE_RECORD_QUERY records are then followed by the length of the data
+ * (varint) and by the raw bytes read from the client, while
+ * CAPTURE_RECORD_CLOSE records, written when the client gets disconnected,
+ * have no data. Records of the same client are always in order, while
+ * records of clients belonging to different threads can be slightly out of
+ * order. */
+
+#define CAPTURE_MAGIC               "RCPCAP"
+#define CAPTURE_MAGIC_LEN           6
+#define CAPTURE_VERSION             1
+#define CAPTURE_HEADER_LEN          16
+#define CAPTURE_RECORD_QUERY        1
+#define CAPTURE_RECORD_CLOSE        2
+#define CAPTURE_MAX_VARINT_LEN      10
+
+typedef struct captureInfo {
+    int active;
+    sds filename;
+    double sample_rate;
+    long long start_time;           /* Milliseconds */
+    uint64_t records;
+    uint64_t bytes;                 /* Bytes written to the file */
+    uint64_t dropped_records;
+} captureInfo;
+
+extern _Atomic int capture_active;
+
+int captureStart(const char *filename, double sample_rate, char **err);
+int captureStop(void);
+void captureGetInfo(captureInfo *info);
+void captureQuery(int thread_id, uint64_t client_id, const char *buf,
+                  size_t len);
+void captureClose(int thread_id, uint64_t client_id);
+
+#define isCaptureActive() (capture_active)
+
+#endif /* __REDIS_CLUSTER_PROXY_CAPTURE_H__ */
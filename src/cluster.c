@@ -17,8 +17,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <hiredis.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -29,6 +33,7 @@
 #include "config.h"
 #include "proxy.h"
 #include "util.h"
+#include "crc16.h"
 #include "assert.h" /* Use proxy's assert */
 
 #define CLUSTER_NODE_KEEPALIVE_INTERVAL 15
@@ -40,41 +45,7 @@
 
 clusterNode *duplicateClusterNode(clusterNode *source, redisCluster *c);
 static void freeClusterNode(clusterNode *node);
-
-/* Utils */
-
-uint16_t crc16(const char *buf, int len);
-
-/* -----------------------------------------------------------------------------
- * Key space handling
- * -------------------------------------------------------------------------- */
-
-/* We have 16384 hash slots. The hash slot of a given key is obtained
- * as the least significant 14 bits of the crc16 of the key.
- *
- * However if the key contains the {...} pattern, only the part between
- * { and } is hashed. This may be useful in the future to force certain
- * keys to be in the same node (assuming no resharding is in progress). */
-static unsigned int clusterKeyHashSlot(char *key, int keylen) {
-    int s, e; /* start-end indexes of { and } */
-
-    for (s = 0; s < keylen; s++)
-        if (key[s] == '{') break;
-
-    /* No '{' ? Hash the whole key. This is the base case. */
-    if (s == keylen) return crc16(key,keylen) & 0x3FFF;
-
-    /* '{' found? Check if we have the corresponding '}'. */
-    for (e = s+1; e < keylen; e++)
-        if (key[e] == '}') break;
-
-    /* No '}' or nothing between {} ? Hash the whole key. */
-    if (e == keylen || e == s+1) return crc16(key,keylen) & 0x3FFF;
-
-    /* If we are here there is both a { and a } on its right. Hash
-     * what is in the middle between { and }. */
-    return crc16(key+s+1,e-s-1) & 0x3FFF;
-}
+static void releaseFailoverProbe(clusterFailoverProbe *probe);
 
 /* Cluster functions. */
 
@@ -82,10 +53,14 @@ redisClusterConnection *createClusterConnection(void) {
     redisClusterConnection *conn = zmalloc(sizeof(*conn));
     if (conn == NULL) return NULL;
     conn->context = NULL;
+    conn->tls = NULL;
     conn->has_read_handler = 0;
     conn->connected = 0;
     conn->authenticating = 0;
     conn->authenticated = 0;
+    conn->reads_paused = 0;
+    conn->readlen = 0;
+    conn->inflight_bytes = 0;
     conn->requests_pending = listCreate();
     if (conn->requests_pending == NULL) {
         zfree(conn);
@@ -97,6 +72,24 @@ redisClusterConnection *createClusterConnection(void) {
         zfree(conn);
         return NULL;
     }
+    conn->send_queues = raxNew();
+    int i, ok = (conn->send_queues != NULL);
+    for (i = 0; i < PRIORITY_COUNT; i++) {
+        conn->active_send_queues[i] = listCreate();
+        conn->priority_sent_bytes[i] = 0;
+        if (conn->active_send_queues[i] == NULL) ok = 0;
+    }
+    if (!ok) {
+        if (conn->send_queues) raxFree(conn->send_queues);
+        for (i = 0; i < PRIORITY_COUNT; i++) {
+            if (conn->active_send_queues[i])
+                listRelease(conn->active_send_queues[i]);
+        }
+        listRelease(conn->requests_pending);
+        listRelease(conn->requests_to_send);
+        zfree(conn);
+        return NULL;
+    }
     conn->node = NULL;
     return conn;
 }
@@ -104,11 +97,125 @@ redisClusterConnection *createClusterConnection(void) {
 void freeClusterConnection(redisClusterConnection *conn) {
     freeRequestList(conn->requests_pending);
     freeRequestList(conn->requests_to_send);
-    redisContext *ctx = conn->context;
-    if (ctx != NULL) redisFree(ctx);
+    /* Freeing the requests also released all the send queues. */
+    raxFree(conn->send_queues);
+    int i;
+    for (i = 0; i < PRIORITY_COUNT; i++)
+        listRelease(conn->active_send_queues[i]);
+    clusterConnectionClose(conn);
     zfree(conn);
 }
 
+/* Free the context of the connection (closing its socket), together with
+ * its TLS connection, if any. */
+void clusterConnectionClose(redisClusterConnection *conn) {
+    if (conn->tls != NULL) tlsFree(conn->tls);
+    if (conn->context != NULL) redisFree(conn->context);
+    conn->tls = NULL;
+    conn->context = NULL;
+}
+
+void setClusterConnectionError(redisContext *ctx, int type, const char *str) {
+    ctx->err = type;
+    snprintf(ctx->errstr, sizeof(ctx->errstr), "%s", str);
+}
+
+/* Perform the TLS handshake on the connection's socket if --tls-cluster is
+ * enabled (connections to unix sockets are left in plain text). Since
+ * hiredis has no TLS support, the handshake blocks for at most
+ * TLS_CONNECT_TIMEOUT milliseconds, so that the rest of the connection's
+ * I/O never has to deal with it. Errors of the underlying connection are
+ * left to the caller.
+ * Return 0 if the handshake failed (the error is set into the context). */
+int clusterConnectionStartTLS(redisClusterConnection *conn) {
+    redisContext *ctx = conn->context;
+    if (!config.tls_cluster || ctx == NULL || ctx->err ||
+        ctx->connection_type != REDIS_CONN_TCP || conn->tls != NULL)
+        return 1;
+    sds err = NULL;
+    conn->tls = tlsConnect(ctx->fd, TLS_CONNECT_TIMEOUT, &err);
+    if (conn->tls == NULL) {
+        setClusterConnectionError(ctx, REDIS_ERR_IO, err);
+        sdsfree(err);
+        return 0;
+    }
+    return 1;
+}
+
+/* Write the context's output buffer just like redisBufferWrite, also
+ * supporting TLS connections (`tls` not NULL). */
+static int clusterFlushContext(redisContext *ctx, tlsConnection *tls,
+                               int *done)
+{
+    if (tls == NULL) return redisBufferWrite(ctx, done);
+    if (ctx->err) return REDIS_ERR;
+    size_t buflen = sdslen(ctx->obuf);
+    if (buflen > 0) {
+        ssize_t nwritten = tlsWrite(tls, ctx->obuf, buflen);
+        if (nwritten == -1) {
+            if ((errno != EAGAIN || (ctx->flags & REDIS_BLOCK)) &&
+                errno != EINTR)
+            {
+                setClusterConnectionError(ctx, REDIS_ERR_IO, strerror(errno));
+                return REDIS_ERR;
+            }
+        } else if (nwritten > 0) sdsrange(ctx->obuf, nwritten, -1);
+    }
+    if (done != NULL) *done = (sdslen(ctx->obuf) == 0);
+    return REDIS_OK;
+}
+
+int clusterConnectionFlush(redisClusterConnection *conn, int *done) {
+    return clusterFlushContext(conn->context, conn->tls, done);
+}
+
+/* Send the commands in the context's output buffer and read a reply from a
+ * blocking TLS connection, like hiredis does for plain connections. */
+static void *clusterBlockForReply(redisContext *ctx, tlsConnection *tls) {
+    void *reply = NULL;
+    char buf[1024*16];
+    int done = 0;
+    do {
+        if (clusterFlushContext(ctx, tls, &done) == REDIS_ERR) return NULL;
+    } while (!done);
+    if (redisGetReplyFromReader(ctx, &reply) == REDIS_ERR) return NULL;
+    while (reply == NULL) {
+        ssize_t nread = tlsRead(tls, buf, sizeof(buf));
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread <= 0) {
+            if (nread == 0) {
+                setClusterConnectionError(ctx, REDIS_ERR_EOF,
+                                          "Server closed the connection");
+            } else setClusterConnectionError(ctx, REDIS_ERR_IO,
+                                             strerror(errno));
+            return NULL;
+        }
+        redisReaderFeed(ctx->reader, buf, nread);
+        if (redisGetReplyFromReader(ctx, &reply) == REDIS_ERR) return NULL;
+    }
+    return reply;
+}
+
+/* Just like redisCommand, but also supporting TLS connections (`tls` not
+ * NULL): on blocking contexts, the reply is returned, while on non-blocking
+ * contexts the command is only appended to the output buffer (see
+ * clusterConnectionFlush) and NULL is returned. */
+static redisReply *clusterCommand(redisContext *ctx, tlsConnection *tls,
+                                  const char *fmt, ...)
+{
+    void *reply = NULL;
+    va_list ap;
+    va_start(ap, fmt);
+    if (tls == NULL) reply = redisvCommand(ctx, fmt, ap);
+    else if (redisvAppendCommand(ctx, fmt, ap) == REDIS_OK &&
+             (ctx->flags & REDIS_BLOCK))
+    {
+        reply = clusterBlockForReply(ctx, tls);
+    }
+    va_end(ap);
+    return reply;
+}
+
 
 /* Check whether reply is NULL or its type is REDIS_REPLY_ERROR. In the
  * latest case, if the 'err' arg is not NULL, it gets allocated with a copy
@@ -159,6 +266,12 @@ redisCluster *createCluster(int thread_id) {
         freeCluster(cluster);
         return NULL;
     }
+    cluster->held_requests = listCreate();
+    if (cluster->held_requests == NULL) {
+        freeCluster(cluster);
+        return NULL;
+    }
+    cluster->failover_probe = NULL;
     /* The 'master_names' list is used by such commands as SCAN. It will
      * remain NULL until requested by the function clusterGetMasterNames,
      * so it doesn't use any memory if not needed. */
@@ -169,7 +282,7 @@ redisCluster *createCluster(int thread_id) {
     return cluster;
 }
 
-static void clusterAddNode(redisCluster* cluster, clusterNode *node) {
+void clusterAddNode(redisCluster* cluster, clusterNode *node) {
     listAddNodeTail(cluster->nodes, node);
     if (node->name) {
         raxInsert(cluster->nodes_by_name, (unsigned char*) node->name,
@@ -299,6 +412,20 @@ void freeCluster(redisCluster *cluster) {
     if (cluster->slots_map) raxFree(cluster->slots_map);
     if (cluster->nodes_by_name) raxFree(cluster->nodes_by_name);
     if (cluster->master_names) listRelease(cluster->master_names);
+    if (cluster->failover_probe) releaseFailoverProbe(cluster->failover_probe);
+    if (cluster->held_requests) {
+        /* Held requests are owned by their clients, so just unlink them
+         * from the list. */
+        listIter li;
+        listNode *ln;
+        listRewind(cluster->held_requests, &li);
+        while ((ln = listNext(&li))) {
+            clientRequest *req = ln->value;
+            req->held_requests_lnode = NULL;
+        }
+        listRelease(cluster->held_requests);
+        cluster->held_requests = NULL;
+    }
     freeClusterNodes(cluster);
     if (cluster->requests_to_reprocess)
         raxFree(cluster->requests_to_reprocess);
@@ -336,7 +463,7 @@ void freeCluster(redisCluster *cluster) {
     zfree(cluster);
 }
 
-static clusterNode *createClusterNode(char *ip, int port, redisCluster *c) {
+clusterNode *createClusterNode(char *ip, int port, redisCluster *c) {
     clusterNode *node = zcalloc(sizeof(*node));
     if (!node) return NULL;
     node->cluster = c;
@@ -353,6 +480,7 @@ static clusterNode *createClusterNode(char *ip, int port, redisCluster *c) {
     node->migrating_count = 0;
     node->importing_count = 0;
     node->duplicated_from = NULL;
+    node->failed = 0;
     node->connection = createClusterConnection();
     if (node->connection == NULL) {
         freeClusterNode(node);
@@ -402,7 +530,7 @@ redisContext *clusterNodeConnect(clusterNode *node) {
     redisContext *ctx = getClusterNodeContext(node);
     if (ctx) {
         onClusterNodeDisconnection(node);
-        redisFree(ctx);
+        clusterConnectionClose(node->connection);
         ctx = NULL;
     }
     proxyLogDebug("Connecting to node %s:%d", node->ip, node->port);
@@ -420,6 +548,12 @@ redisContext *clusterNodeConnect(clusterNode *node) {
      * errors. */
     anetKeepAlive(NULL, ctx->fd, CLUSTER_NODE_KEEPALIVE_INTERVAL);
     node->connection->context = ctx;
+    if (!clusterConnectionStartTLS(node->connection)) {
+        proxyLogErr("Could not connect to Redis at %s:%d: %s",
+                    node->ip, node->port, ctx->errstr);
+        clusterConnectionClose(node->connection);
+        return NULL;
+    }
     return ctx;
 }
 
@@ -428,8 +562,7 @@ void clusterNodeDisconnect(clusterNode *node) {
     if (ctx == NULL) return;
     proxyLogDebug("Disconnecting from node %s:%d", node->ip, node->port);
     onClusterNodeDisconnection(node);
-    redisFree(ctx);
-    node->connection->context = NULL;
+    clusterConnectionClose(node->connection);
 }
 
 /* Map to slot into the cluster's radix tree map after converting the slot
@@ -456,6 +589,11 @@ int clusterNodeLoadInfo(redisCluster *cluster, clusterNode *node, list *friends,
     }
     node->connection->context = ctx;
     node->connection->connected = 1;
+    if (!clusterConnectionStartTLS(node->connection)) {
+        fprintf(stderr, "Could not connect to Redis at %s:%d: %s\n",
+                node->ip, node->port, ctx->errstr);
+        return 0;
+    }
     int auth_failed = 0;
     char *auth = config.auth, *user = config.auth_user;
     if (cluster->owner != NULL) {
@@ -478,7 +616,7 @@ int clusterNodeLoadInfo(redisCluster *cluster, clusterNode *node, list *friends,
             auth_failed = 1;
         }
     }
-    reply = redisCommand(ctx, "CLUSTER NODES");
+    reply = clusterCommand(ctx, node->connection->tls, "CLUSTER NODES");
     success = (reply != NULL);
     if (!success) goto cleanup;
     success = (reply->type != REDIS_REPLY_ERROR);
@@ -540,6 +678,11 @@ int clusterNodeLoadInfo(redisCluster *cluster, clusterNode *node, list *friends,
             }
         } else {
             if (friends == NULL) continue;
+            /* Skip nodes that the cluster already flagged as failed, since
+             * they're unreachable: their slots (if any) will be left
+             * unmapped. */
+            if (strstr(flags, "fail") != NULL && strstr(flags, "fail?") == NULL)
+                continue;
             clusterNode *friend = createClusterNode(ip, port, cluster);
             if (friend == NULL) {
                 success = 0;
@@ -707,6 +850,10 @@ int fetchClusterConfiguration(redisCluster *cluster,
     }
 cleanup:
     if (friends) listRelease(friends);
+    /* Keep the topology of the first thread's shared cluster, so that it can
+     * be passed to the new process in case of binary upgrade. */
+    if (success && cluster->owner == NULL && cluster->thread_id == 0)
+        saveClusterTopology(cluster);
     return success;
 }
 
@@ -850,6 +997,7 @@ int updateCluster(redisCluster *cluster) {
                 clusterAddRequestToReprocess(cluster, req);
                 listDelNode(conn->requests_to_send, rln);
                 req->requests_to_send_lnode = NULL;
+                removeRequestFromSendQueue(req);
             }
         }
     }
@@ -895,8 +1043,10 @@ int updateCluster(redisCluster *cluster) {
         req->need_reprocessing = 0;
         if (raxRemove(cluster->requests_to_reprocess, iter.key, iter.key_len,
              NULL)) raxSeek(&iter,">",iter.key,iter.key_len);
-        listNode *ln = listSearchKey(req->client->requests_to_reprocess, req);
-        if (ln) listDelNode(req->client->requests_to_reprocess, ln);
+        list *to_reprocess = req->client->requests_to_reprocess;
+        listNode *ln = NULL;
+        if (to_reprocess) ln = listSearchKey(to_reprocess, req);
+        if (ln) listDelNode(to_reprocess, ln);
         /* Other relatives of the requests (children or siblings) could still
          * have their node pointing to the old (freed) node.
          * Ensure that all relatives have their node set to NULL. */
@@ -919,6 +1069,9 @@ int updateCluster(redisCluster *cluster) {
         processRequest(req, NULL, NULL);
     }
     raxStop(&iter);
+    /* Also send requests that were held while waiting for a failover, since
+     * the new configuration could now contain the promoted master. */
+    processHeldRequests(cluster);
     proxyLogDebug("Cluster reconfiguration ended (thread: %d)",
                   cluster->thread_id);
     status = CLUSTER_RECONFIG_ENDED;
@@ -931,6 +1084,219 @@ final:
     return status;
 }
 
+/* Nodes of the cluster as seen by a failover probe. The probe runs on its
+ * own thread, so it works on a copy of the nodes' addresses and flags. */
+typedef struct failoverProbeNode {
+    sds ip;
+    int port;
+    sds name;
+    int failed;
+    int recovered;
+} failoverProbeNode;
+
+/* Fetch CLUSTER NODES from the first reachable node that has not been
+ * flagged as failed and check whether the failed masters have been replaced
+ * by one of their replicas (or whether they're back again). It runs on a
+ * detached thread, since connecting to the nodes and waiting for their
+ * reply would block the event loop of the thread owning the cluster. */
+static void *runFailoverProbe(void *arg) {
+    clusterFailoverProbe *probe = arg;
+    int status = CLUSTER_FAILOVER_WAIT, i, recovered = 0;
+    redisContext *ctx = NULL;
+    tlsConnection *tls = NULL;
+    redisReply *reply = NULL;
+    struct timeval timeout = {0, CLUSTER_FAILOVER_CHECK_TIMEOUT * 1000};
+    for (i = 0; i < probe->nodes_count && ctx == NULL; i++) {
+        failoverProbeNode *node = &(probe->nodes[i]);
+        if (node->failed) continue;
+        ctx = redisConnectWithTimeout(node->ip, node->port, timeout);
+        if (ctx == NULL) continue;
+        if (ctx->err) {
+            redisFree(ctx);
+            ctx = NULL;
+            continue;
+        }
+        redisSetTimeout(ctx, timeout);
+        if (config.tls_cluster) {
+            sds err = NULL;
+            tls = tlsConnect(ctx->fd, CLUSTER_FAILOVER_CHECK_TIMEOUT, &err);
+            if (tls == NULL) {
+                proxyLogDebug("Node %s:%d: %s", node->ip, node->port, err);
+                sdsfree(err);
+                redisFree(ctx);
+                ctx = NULL;
+                continue;
+            }
+        }
+        if (config.auth) {
+            redisReply *authreply = NULL;
+            if (config.auth_user == NULL)
+                authreply = clusterCommand(ctx, tls, "AUTH %s", config.auth);
+            else {
+                authreply = clusterCommand(ctx, tls, "AUTH %s %s",
+                                           config.auth_user, config.auth);
+            }
+            if (authreply != NULL) freeReplyObject(authreply);
+        }
+    }
+    if (ctx == NULL) goto cleanup;
+    reply = clusterCommand(ctx, tls, "CLUSTER NODES");
+    if (reply == NULL || reply->type != REDIS_REPLY_STRING) goto cleanup;
+    for (i = 0; i < probe->nodes_count; i++) {
+        failoverProbeNode *node = &(probe->nodes[i]);
+        if (!node->failed || node->name == NULL) continue;
+        /* Search the line starting with the node's name. */
+        char *line = reply->str, *p;
+        size_t namelen = sdslen(node->name);
+        while (line != NULL && *line != '\0') {
+            if (strncmp(line, node->name, namelen) == 0 &&
+                line[namelen] == ' ') break;
+            line = strchr(line, '\n');
+            if (line != NULL) line++;
+        }
+        if (line == NULL || *line == '\0') {
+            /* The node has been removed from the cluster. */
+            status = CLUSTER_FAILOVER_COMPLETED;
+            break;
+        }
+        char *eol = strchr(line, '\n');
+        int len = (eol ? (eol - line) : (int) strlen(line)), j = 0;
+        sds nodeinfo = sdsnewlen(line, len);
+        char *flags = NULL, *link_state = NULL, *tok = nodeinfo;
+        while ((p = strchr(tok, ' ')) != NULL) {
+            *p = '\0';
+            if (j == 2) flags = tok;
+            else if (j == 7) link_state = tok;
+            tok = p + 1;
+            if (++j == 8) break;
+        }
+        /* Fields after link-state are the slots owned by the node. */
+        int has_slots = (j == 8 && *tok != '\0');
+        if (j == 7) link_state = tok;
+        if (flags == NULL) {
+            sdsfree(nodeinfo);
+            continue;
+        }
+        int is_failed = (strstr(flags, "fail") != NULL &&
+                         strstr(flags, "fail?") == NULL);
+        if (is_failed || strstr(flags, "slave") != NULL || !has_slots) {
+            status = CLUSTER_FAILOVER_COMPLETED;
+        } else if (strstr(flags, "fail?") == NULL && link_state != NULL &&
+                   strcmp(link_state, "connected") == 0)
+        {
+            node->recovered = 1;
+            recovered++;
+        }
+        sdsfree(nodeinfo);
+        if (status == CLUSTER_FAILOVER_COMPLETED) break;
+    }
+    if (status == CLUSTER_FAILOVER_WAIT && recovered == probe->failed_count)
+        status = CLUSTER_FAILOVER_RECOVERED;
+cleanup:
+    if (reply != NULL) freeReplyObject(reply);
+    if (tls != NULL) tlsFree(tls);
+    if (ctx != NULL) redisFree(ctx);
+    probe->status = status;
+    atomic_store(&probe->done, 1);
+    releaseFailoverProbe(probe);
+    return NULL;
+}
+
+/* The probe is shared by the thread running it and the cluster that
+ * started it: whoever releases it last frees it, so that a cluster can be
+ * freed while its probe is still waiting for a node. */
+static void releaseFailoverProbe(clusterFailoverProbe *probe) {
+    int i;
+    if (atomic_fetch_sub(&probe->refcount, 1) > 1) return;
+    for (i = 0; i < probe->nodes_count; i++) {
+        sdsfree(probe->nodes[i].ip);
+        sdsfree(probe->nodes[i].name);
+    }
+    zfree(probe->nodes);
+    zfree(probe);
+}
+
+static clusterFailoverProbe *startFailoverProbe(redisCluster *cluster) {
+    clusterFailoverProbe *probe = zcalloc(sizeof(*probe));
+    pthread_attr_t attr;
+    pthread_t tid;
+    listIter li;
+    listNode *ln;
+    int i = 0, err;
+    probe->nodes = zcalloc(sizeof(failoverProbeNode) *
+                           listLength(cluster->nodes));
+    listRewind(cluster->nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *node = ln->value;
+        failoverProbeNode *pnode = &(probe->nodes[i++]);
+        pnode->ip = sdsnew(node->ip);
+        pnode->port = node->port;
+        pnode->name = (node->name ? sdsdup(node->name) : NULL);
+        pnode->failed = node->failed;
+        if (node->failed) probe->failed_count++;
+    }
+    probe->nodes_count = i;
+    atomic_init(&probe->done, 0);
+    atomic_init(&probe->refcount, 2);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&tid, &attr, runFailoverProbe, probe);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        proxyLogErr("Failed to start failover probe (thread: %d): %s",
+                    cluster->thread_id, strerror(err));
+        atomic_fetch_sub(&probe->refcount, 1);
+        releaseFailoverProbe(probe);
+        return NULL;
+    }
+    return probe;
+}
+
+/* Check whether the masters flagged as failed have been replaced by one of
+ * their replicas (or whether they're back again). The check is performed by
+ * a probe running on its own thread (see runFailoverProbe): the first call
+ * starts it, and the following calls return its result once it's done.
+ * Return values:
+ *      CLUSTER_FAILOVER_WAIT: no failover happened yet, no node could
+ *                             be reached or the probe is still running.
+ *      CLUSTER_FAILOVER_RECOVERED: all the failed masters are reachable
+ *                                  again by the cluster, so their `failed`
+ *                                  flag has been reset.
+ *      CLUSTER_FAILOVER_COMPLETED: at least one failed master has been
+ *                                  replaced (it's now a replica, it has no
+ *                                  slots or it has been flagged as failed
+ *                                  by the cluster), so the cluster must be
+ *                                  updated. */
+int clusterCheckFailedNodes(redisCluster *cluster) {
+    clusterFailoverProbe *probe = cluster->failover_probe;
+    int status, i, failed_count = 0;
+    listIter li;
+    listNode *ln;
+    listRewind(cluster->nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *node = ln->value;
+        if (node->failed) failed_count++;
+    }
+    if (failed_count == 0) return CLUSTER_FAILOVER_RECOVERED;
+    if (probe == NULL) {
+        cluster->failover_probe = startFailoverProbe(cluster);
+        return CLUSTER_FAILOVER_WAIT;
+    }
+    if (!atomic_load(&probe->done)) return CLUSTER_FAILOVER_WAIT;
+    status = probe->status;
+    /* Nodes could have been changed while the probe was running, so look
+     * them up again by name. */
+    for (i = 0; i < probe->nodes_count; i++) {
+        failoverProbeNode *pnode = &(probe->nodes[i]);
+        if (!pnode->recovered) continue;
+        clusterNode *node = getNodeByName(cluster, pnode->name);
+        if (node != NULL) node->failed = 0;
+    }
+    cluster->failover_probe = NULL;
+    releaseFailoverProbe(probe);
+    return status;
+}
+
 /* Add the request to `cluster->requests_to_reprocess` rax. Also add it
  * to the client's `requests_to_reprocess` list.
  * The request's node will also be set to NULL (since the current configuration
@@ -948,6 +1314,9 @@ void clusterAddRequestToReprocess(redisCluster *cluster, void *r) {
     sds id = sdscatprintf(sdsempty(), fmt, req->client->id, req->id);
     raxInsert(cluster->requests_to_reprocess, (unsigned char *) id,
               sdslen(id), req, NULL);
+    /* The client's list is created lazily, see createClient. */
+    if (req->client->requests_to_reprocess == NULL)
+        req->client->requests_to_reprocess = listCreate();
     listAddNodeTail(req->client->requests_to_reprocess, req);
     sdsfree(id);
 }
@@ -977,10 +1346,11 @@ int clusterNodeAuth(clusterNode *node, char *auth, char *user, char **err) {
     /* If `user` is NULL, user simple redis authentication (password-only),
      * otherwise use the ACL authentication implemented in Redis >= 6.0 that
      * allows combination of both username and password. */
+    tlsConnection *tls = node->connection->tls;
     if (user == NULL)
-        reply = redisCommand(ctx, "AUTH %s", auth);
+        reply = clusterCommand(ctx, tls, "AUTH %s", auth);
     else
-        reply = redisCommand(ctx, "AUTH %s %s", user, auth);
+        reply = clusterCommand(ctx, tls, "AUTH %s %s", user, auth);
     int ok = clusterCheckRedisReply(node, reply, err);
     if (reply != NULL) freeReplyObject(reply);
     if (!ok) goto fail;
@@ -22,6 +22,7 @@
 #include "adlist.h"
 #include "rax.h"
 #include "config.h"
+#include "tls.h"
 #include <hiredis.h>
 #include <time.h>
 
@@ -30,20 +31,57 @@
 #define CLUSTER_RECONFIG_ENDED      0
 #define CLUSTER_RECONFIG_WAIT       1
 #define CLUSTER_RECONFIG_STARTED    2
+#define CLUSTER_FAILOVER_WAIT       0
+#define CLUSTER_FAILOVER_RECOVERED  1
+#define CLUSTER_FAILOVER_COMPLETED  2
+#define CLUSTER_FAILOVER_CHECK_TIMEOUT  100 /* Milliseconds */
 #define getClusterNodeContext(node) (node->connection->context)
 #define isClusterNodeConnected(node) (node->connection->connected)
 
 struct redisCluster;
 struct clusterNode;
 
+/* Priority classes of the requests (see getRequestPriority). */
+#define PRIORITY_INTERACTIVE    0
+#define PRIORITY_BULK           1
+#define PRIORITY_COUNT          2
+
+/* Requests sent by a single client that are still waiting to be written to
+ * a connection. Since connections are shared by all the clients of a thread,
+ * the send queues of the clients are drained in deficit round robin, so that
+ * a client with a deep pipeline cannot delay the queries of other clients
+ * (see getNextRequestToSend). */
+typedef struct clientSendQueue {
+    uint64_t client_id;
+    list *requests;
+    long long deficit; /* Bytes the client can still send in its turn. */
+    int priority; /* Priority class of the first request in the queue. */
+    listNode *active_lnode; /* Pointer to node in redisClusterConnection->
+                             * active_send_queues[priority] list */
+    struct redisClusterConnection *connection;
+} clientSendQueue;
+
 typedef struct redisClusterConnection {
     redisContext *context;
+    tlsConnection *tls; /* TLS connection (--tls-cluster), or NULL */
     list *requests_to_send;
     list *requests_pending;
+    rax *send_queues; /* Client ID -> clientSendQueue */
+    /* Round robin lists of clientSendQueue, one for every priority class */
+    list *active_send_queues[PRIORITY_COUNT];
+    /* Bytes sent by every priority class since they've been competing for
+     * the connection, used to give each class its share (see
+     * config.bulk_weight). */
+    long long priority_sent_bytes[PRIORITY_COUNT];
+    size_t inflight_bytes; /* Query bytes of the requests pending */
     int connected;
     int has_read_handler;
     int authenticating;
     int authenticated;
+    int reads_paused; /* Reads paused because the next reply is for the
+                       * client flooding the thread's output buffers. */
+    int readlen; /* Size of the next read from the socket (0 if the
+                  * connection has not been read from yet) */
     struct clusterNode *node;
 } redisClusterConnection;
 
@@ -69,8 +107,22 @@ typedef struct clusterNode {
     int migrating_count; /* Length of the migrating array (migrating slots*2) */
     int importing_count; /* Length of the importing array (importing slots*2) */
     struct clusterNode *duplicated_from;
+    int failed; /* Set to 1 when the connection to a master is lost, it's
+                 * used to hold requests until the failover happens (see
+                 * 'failover-hold-time'). */
 } clusterNode;
 
+/* Check of the failed masters running on its own thread (see
+ * clusterCheckFailedNodes). */
+typedef struct clusterFailoverProbe {
+    struct failoverProbeNode *nodes;
+    int nodes_count;
+    int failed_count;
+    int status;
+    _Atomic int done;
+    _Atomic int refcount;
+} clusterFailoverProbe;
+
 typedef struct redisCluster {
     int thread_id;
     list *nodes;
@@ -81,6 +133,8 @@ typedef struct redisCluster {
     int replicas_count;
     redisClusterEntryPoint *entry_point;
     rax  *requests_to_reprocess;
+    list *held_requests; /* Requests held while waiting for a failover */
+    clusterFailoverProbe *failover_probe; /* Running check of failed nodes */
     int is_updating;
     int update_required;
     int broken;
@@ -98,6 +152,13 @@ int fetchClusterConfiguration(redisCluster *cluster,
                               int entry_points_count);
 redisContext *clusterNodeConnect(clusterNode *node);
 void clusterNodeDisconnect(clusterNode *node);
+int clusterConnectionStartTLS(redisClusterConnection *conn);
+int clusterConnectionFlush(redisClusterConnection *conn, int *done);
+void clusterConnectionClose(redisClusterConnection *conn);
+void setClusterConnectionError(redisContext *ctx, int type, const char *str);
+clusterNode *createClusterNode(char *ip, int port, redisCluster *c);
+void clusterAddNode(redisCluster* cluster, clusterNode *node);
+void mapSlot(redisCluster *cluster, int slot, clusterNode *node);
 clusterNode *searchNodeBySlot(redisCluster *cluster, int slot);
 clusterNode *getNodeByKey(redisCluster *cluster, char *key, int keylen,
                           int *getslot);
@@ -105,6 +166,7 @@ clusterNode *getNodeByName(redisCluster *cluster, const char *name);
 clusterNode *getFirstMappedNode(redisCluster *cluster);
 list *clusterGetMasterNames(redisCluster *cluster);
 int updateCluster(redisCluster *cluster);
+int clusterCheckFailedNodes(redisCluster *cluster);
 void clusterAddRequestToReprocess(redisCluster *cluster, void *r);
 void clusterRemoveRequestToReprocess(redisCluster *cluster, void *r);
 int clusterNodeAuth(clusterNode *node, char *auth, char *user, char **err);
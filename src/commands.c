@@ -51,7 +51,9 @@ struct redisCommandDef redisCommandTable[203] = {
     {"cluster", -2, 0, 0, 0, 0, 1, NULL, NULL, NULL},
     {"randomkey", 1, 0, 0, 0, 0, 0, NULL, NULL, getRandomReply},
     {"georadius", -6, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"sdiff", -2, 1, -1, 1, 0, 0, NULL, NULL, NULL},
+    {"sdiff", -2, 1, -1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"flushdb", -1, 0, 0, 0, 0, 0, NULL, NULL, getFirstMultipleReply},
     {"pfmerge", -2, 1, -1, 1, 0, 0, NULL, NULL, NULL},
     {"strlen", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
@@ -94,7 +96,9 @@ struct redisCommandDef redisCommandTable[203] = {
     {"bitcount", -2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"getset", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"llen", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"zrange", -4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"zrange", -4, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"xinfo", -2, 2, 2, 1, 0, 0, NULL, NULL, NULL},
     {"zremrangebyscore", 4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"config", -2, 0, 0, 0, 0, 1, NULL, NULL, NULL},
@@ -106,15 +110,21 @@ struct redisCommandDef redisCommandTable[203] = {
     {"brpoplpush", 4, 1, 2, 1, 0, 0, NULL, NULL, NULL},
     {"sismember", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"bzpopmax", -3, 1, -2, 1, 0, 0, NULL, commandWithPrivateConnection, NULL},
-    {"sscan", -3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"sscan", -3, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"unlink", -2, 1, -1, 1, 0, 0, NULL, NULL, sumReplies},
     {"hsetnx", 4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"substr", 4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"hscan", -3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"hscan", -3, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"watch", -2, 1, -1, 1, 0, 0, NULL, commandWithPrivateConnection, getFirstMultipleReply},
     {"append", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"xadd", -5, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"sinter", -2, 1, -1, 1, 0, 0, NULL, NULL, NULL},
+    {"sinter", -2, 1, -1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"slaveof", 3, 0, 0, 0, 0, 1, NULL, NULL, NULL},
     {"zpopmin", -2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"lolwut", -1, 0, 0, 0, 0, 0, NULL, NULL, getFirstMultipleReply},
@@ -137,7 +147,9 @@ struct redisCommandDef redisCommandTable[203] = {
     {"lpush", -3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"select", 2, 0, 0, 0, 0, 0, NULL, NULL, NULL},
     {"pfadd", -2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"hkeys", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"hkeys", 2, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"sinterstore", -3, 1, -1, 1,
      CMDFLAG_MULTISLOT_UNSUPPORTED,
      0, NULL, NULL, NULL},
@@ -166,19 +178,23 @@ struct redisCommandDef redisCommandTable[203] = {
     {"pexpireat", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"zrem", -3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"ping", -1, 0, 0, 0, 0, 0, NULL, pingCommand, NULL},
-    {"zrevrangebylex", -4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"zrevrangebylex", -4, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"flushall", -1, 0, 0, 0, 0, 0, NULL, NULL, getFirstMultipleReply},
     {"subscribe", -2, 0, 0, 0, 0, 1, NULL, NULL, NULL},
     {"evalsha", -3, 0, 0, 0, 0, 0, evalGetKeys, NULL, NULL},
     {"zremrangebyrank", 4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"publish", 3, 0, 0, 0, 0, 1, NULL, NULL, NULL},
-    {"zrevrangebyscore", -4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"zrevrangebyscore", -4, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"swapdb", 3, 0, 0, 0, 0, 0, NULL, NULL, NULL},
     {"latency", -2, 0, 0, 0, 0, 1, NULL, NULL, NULL},
     {"zscore", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"lset", 4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"scan", -2, 0, 0, 0,
-     CMDFLAG_HANDLE_REPLY,
+     CMDFLAG_HANDLE_REPLY | CMDFLAG_BULK,
      0, NULL, scanCommand, handleScanReply},
     {"debug", -2, 0, 0, 0, 0, 1, NULL, NULL, NULL},
     {"zrevrank", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
@@ -188,21 +204,27 @@ struct redisCommandDef redisCommandTable[203] = {
     {"hlen", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"renamenx", 3, 1, 2, 1, 0, 0, NULL, NULL, NULL},
     {"acl", -2, 0, 0, 0, 0, 1, NULL, NULL, NULL},
-    {"hgetall", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"hgetall", 2, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"incr", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"punsubscribe", -1, 0, 0, 0, 0, 1, NULL, NULL, NULL},
     {"setnx", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"del", -2, 1, -1, 1, 0, 0, NULL, NULL, sumReplies},
-    {"xrange", -4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"xrange", -4, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"sunionstore", -3, 1, -1, 1,
      CMDFLAG_MULTISLOT_UNSUPPORTED,
      0, NULL, NULL, NULL},
     {"pfselftest", 1, 0, 0, 0, 0, 1, NULL, NULL, NULL},
-    {"smembers", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"smembers", 2, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"bitop", -4, 2, -1, 1, 0, 0, NULL, NULL, NULL},
     {"zrank", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"keys", 2, 0, 0, 0,
-     CMDFLAG_DUPLICATE,
+     CMDFLAG_DUPLICATE | CMDFLAG_BULK,
      0, NULL, NULL, mergeReplies},
     {"pttl", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"xlen", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
@@ -210,10 +232,16 @@ struct redisCommandDef redisCommandTable[203] = {
     {"xread", -4, 1, 1, 1,
      CMDFLAG_MULTISLOT_UNSUPPORTED,
      0, xreadGetKeys, xreadCommand, NULL},
-    {"sunion", -2, 1, -1, 1, 0, 0, NULL, NULL, NULL},
+    {"sunion", -2, 1, -1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"psync", 3, 0, 0, 0, 0, 1, NULL, NULL, NULL},
-    {"xrevrange", -4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"lrange", 4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"xrevrange", -4, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
+    {"lrange", 4, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"xreadgroup", -7, 1, 1, 1,
      CMDFLAG_MULTISLOT_UNSUPPORTED,
      0, xreadGetKeys, xreadCommand, NULL},
@@ -236,8 +264,12 @@ struct redisCommandDef redisCommandTable[203] = {
      0, NULL, NULL, NULL},
     {"post", -1, 0, 0, 0, 0, 0, NULL, securityWarningCommand, NULL},
     {"hincrbyfloat", 4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"hvals", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"zscan", -3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"hvals", 2, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
+    {"zscan", -3, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"geopos", -2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"bitfield", -2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"decrby", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
@@ -250,8 +282,12 @@ struct redisCommandDef redisCommandTable[203] = {
     {"save", 1, 0, 0, 0, 0, 0, NULL, NULL, getFirstMultipleReply},
     {"type", 2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"restore-asking", -4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"zrevrange", -4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"zrangebyscore", -4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"zrevrange", -4, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
+    {"zrangebyscore", -4, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"incrby", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"mset", -3, 1, -1, 2, 0, 0, NULL, NULL, getFirstMultipleReply},
     {"discard", 1, 0, 0, 0, 0, 0, NULL, execOrDiscardCommand, NULL},
@@ -262,9 +298,13 @@ struct redisCommandDef redisCommandTable[203] = {
     {"lindex", 3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"readonly", 1, 0, 0, 0, 0, 1, NULL, NULL, NULL},
     {"bgsave", -1, 0, 0, 0, 0, 0, NULL, NULL, getFirstMultipleReply},
-    {"sort", -2, 1, 1, 1, 0, 0, sortGetKeys, NULL, NULL},
+    {"sort", -2, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, sortGetKeys, NULL, NULL},
     {"srandmember", -2, 1, 1, 1, 0, 0, NULL, NULL, NULL},
-    {"zrangebylex", -4, 1, 1, 1, 0, 0, NULL, NULL, NULL},
+    {"zrangebylex", -4, 1, 1, 1,
+     CMDFLAG_BULK,
+     0, NULL, NULL, NULL},
     {"linsert", 5, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"lpushx", -3, 1, 1, 1, 0, 0, NULL, NULL, NULL},
     {"client", -2, 0, 0, 0, 0, 1, NULL, NULL, NULL},
@@ -29,6 +29,7 @@
 #define CMDFLAG_MULTISLOT_UNSUPPORTED 1 << 0
 #define CMDFLAG_DUPLICATE 1 << 1
 #define CMDFLAG_HANDLE_REPLY 1 << 2
+#define CMDFLAG_BULK 1 << 3
 
 typedef int redisClusterProxyCommandHandler(void *request);
 typedef int redisClusterProxyReplyHandler(void *reply, void *request,
@@ -19,38 +19,151 @@
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <limits.h>
 #include "config.h"
 #include "sds.h"
 #include "zmalloc.h"
 #include "logger.h"
+#include "util.h"
 
 #define CONFIG_MAX_LINE 1024
 
-void initConfig(void) {
-    config.entry_points_count = 0;
-    config.port = DEFAULT_PORT;
-    config.unixsocket = NULL;
-    config.unixsocketperm = DEFAULT_UNIXSOCKETPERM;
-    config.tcpkeepalive = DEFAULT_TCP_KEEPALIVE;
-    config.maxclients = DEFAULT_MAX_CLIENTS;
-    config.num_threads = DEFAULT_THREADS;
-    config.tcp_backlog = DEFAULT_TCP_BACKLOG;
-    config.daemonize = 0;
-    config.loglevel = LOGLEVEL_INFO;
-    config.use_colors = 0;
-    config.dump_queries = 0;
-    config.dump_buffer = 0;
-    config.dump_queues = 0;
-    config.auth = NULL;
-    config.auth_user = NULL;
-    config.cross_slot_enabled = 0;
-    config.bindaddr_count = 0;
-    config.pidfile = NULL;
-    config.logfile = NULL;
-    config.connections_pool.size = DEFAULT_CONNECTIONS_POOL_SIZE;
-    config.connections_pool.min_size = DEFAULT_CONNECTIONS_POOL_MINSIZE;
-    config.connections_pool.spawn_every = DEFAULT_CONNECTIONS_POOL_INTERVAL;
-    config.connections_pool.spawn_rate = DEFAULT_CONNECTIONS_POOL_SPAWNRATE;
+clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_COUNT] = {
+    {0, 0, 0}, /* normal */
+    {0, 0, 0}  /* private */
+};
+
+const char *clientTypeNames[CLIENT_TYPE_COUNT] = {"normal", "private"};
+
+void initConfig(redisClusterProxyConfig *cfg) {
+    cfg->entry_points_count = 0;
+    cfg->port = DEFAULT_PORT;
+    cfg->unixsocket = NULL;
+    cfg->unixsocketperm = DEFAULT_UNIXSOCKETPERM;
+    cfg->tcpkeepalive = DEFAULT_TCP_KEEPALIVE;
+    cfg->maxclients = DEFAULT_MAX_CLIENTS;
+    cfg->num_threads = DEFAULT_THREADS;
+    cfg->tcp_backlog = DEFAULT_TCP_BACKLOG;
+    cfg->daemonize = 0;
+    cfg->loglevel = LOGLEVEL_INFO;
+    cfg->use_colors = 0;
+    cfg->dump_queries = 0;
+    cfg->dump_buffer = 0;
+    cfg->dump_queues = 0;
+    cfg->auth = NULL;
+    cfg->auth_user = NULL;
+    cfg->cross_slot_enabled = 0;
+    cfg->bindaddr_count = 0;
+    cfg->pidfile = NULL;
+    cfg->logfile = NULL;
+    cfg->connections_pool.size = DEFAULT_CONNECTIONS_POOL_SIZE;
+    cfg->connections_pool.min_size = DEFAULT_CONNECTIONS_POOL_MINSIZE;
+    cfg->connections_pool.spawn_every = DEFAULT_CONNECTIONS_POOL_INTERVAL;
+    cfg->connections_pool.spawn_rate = DEFAULT_CONNECTIONS_POOL_SPAWNRATE;
+    cfg->failover_hold_time = DEFAULT_FAILOVER_HOLD_TIME;
+    cfg->failover_hold_max_requests = DEFAULT_FAILOVER_HOLD_MAX_REQUESTS;
+    cfg->client_query_buffer_limit = DEFAULT_CLIENT_QUERY_BUFFER_LIMIT;
+    cfg->proto_max_bulk_len = DEFAULT_PROTO_MAX_BULK_LEN;
+    cfg->maxmemory = DEFAULT_MAXMEMORY;
+    cfg->io_read_max_len = DEFAULT_IO_READ_MAX_LEN;
+    cfg->io_read_budget = DEFAULT_IO_READ_BUDGET;
+    cfg->bulk_weight = DEFAULT_BULK_WEIGHT;
+    cfg->bulk_min_keys = DEFAULT_BULK_MIN_KEYS;
+    cfg->bulk_users = NULL;
+    cfg->client_max_ops = DEFAULT_CLIENT_MAX_OPS;
+    cfg->client_max_bytes = DEFAULT_CLIENT_MAX_BYTES;
+    cfg->user_max_ops = DEFAULT_USER_MAX_OPS;
+    cfg->user_max_bytes = DEFAULT_USER_MAX_BYTES;
+    cfg->node_max_inflight_requests = DEFAULT_NODE_MAX_INFLIGHT_REQUESTS;
+    cfg->node_max_inflight_bytes = DEFAULT_NODE_MAX_INFLIGHT_BYTES;
+    cfg->node_max_queued_requests = DEFAULT_NODE_MAX_QUEUED_REQUESTS;
+    cfg->upgrade_drain_timeout = DEFAULT_UPGRADE_DRAIN_TIMEOUT;
+    cfg->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+    cfg->threads_retire_timeout = DEFAULT_THREADS_RETIRE_TIMEOUT;
+    cfg->tls = 0;
+    cfg->tls_cluster = 0;
+    cfg->tls_auth_clients = 0;
+    cfg->tls_ktls = 0;
+    cfg->tls_session_cache_size = DEFAULT_TLS_SESSION_CACHE_SIZE;
+    cfg->tls_session_cache_timeout = DEFAULT_TLS_SESSION_CACHE_TIMEOUT;
+    cfg->tls_cert_file = NULL;
+    cfg->tls_key_file = NULL;
+    cfg->tls_ca_cert_file = NULL;
+    cfg->tls_ca_cert_dir = NULL;
+    int j;
+    for (j = 0; j < CLIENT_TYPE_COUNT; j++)
+        cfg->client_obuf_limits[j] = clientBufferLimitsDefaults[j];
+}
+
+/* Parse a memory amount such as "512mb" into `dest`. Since request buffers
+ * are indexed by int offsets, values must fit into an int. Return 1 on
+ * success, 0 if the value is invalid (in this case `dest` is not modified). */
+int parseMemoryValue(const char *value, int *dest) {
+    int err = 0;
+    long long val = memtoll(value, &err);
+    if (err || val < 0 || val > INT_MAX) return 0;
+    *dest = (int) val;
+    return 1;
+}
+
+/* Set the output buffer limits for one or more client types. Arguments must
+ * be a multiple of 4, in the form: <class> <hard> <soft> <soft seconds>,
+ * ie: "normal 256mb 64mb 60". Limits are only applied if all the arguments
+ * are valid. Return 1 on success, 0 on failure (in this case, if `err` is not
+ * NULL, it will point to a static error string). */
+int setClientOutputBufferLimit(redisClusterProxyConfig *cfg, char **args,
+                               int count, char **err)
+{
+    clientBufferLimitsConfig limits[CLIENT_TYPE_COUNT];
+    int j, class_idx;
+    if (count <= 0 || (count % 4) != 0) {
+        if (err) *err = "Wrong number of arguments in buffer limit "
+                        "configuration.";
+        return 0;
+    }
+    for (j = 0; j < CLIENT_TYPE_COUNT; j++)
+        limits[j] = cfg->client_obuf_limits[j];
+    for (j = 0; j < count; j += 4) {
+        for (class_idx = 0; class_idx < CLIENT_TYPE_COUNT; class_idx++) {
+            if (!strcasecmp(args[j], clientTypeNames[class_idx])) break;
+        }
+        if (class_idx == CLIENT_TYPE_COUNT) {
+            if (err) *err = "Invalid client class specified in buffer limit "
+                            "configuration.";
+            return 0;
+        }
+        int hard_err = 0, soft_err = 0;
+        long long hard = memtoll(args[j + 1], &hard_err);
+        long long soft = memtoll(args[j + 2], &soft_err);
+        long long soft_seconds = strtoll(args[j + 3], NULL, 10);
+        if (hard_err || soft_err || hard < 0 || soft < 0 || soft_seconds < 0){
+            if (err) *err = "Error in hard, soft or soft_seconds setting in "
+                            "buffer limit configuration.";
+            return 0;
+        }
+        limits[class_idx].hard_limit_bytes = hard;
+        limits[class_idx].soft_limit_bytes = soft;
+        limits[class_idx].soft_limit_seconds = soft_seconds;
+    }
+    for (j = 0; j < CLIENT_TYPE_COUNT; j++)
+        cfg->client_obuf_limits[j] = limits[j];
+    return 1;
+}
+
+/* Return the output buffer limits in the same format used by the
+ * 'client-output-buffer-limit' option (the string must be freed by the
+ * caller). */
+sds getClientOutputBufferLimitString(void) {
+    sds str = sdsempty();
+    int j;
+    for (j = 0; j < CLIENT_TYPE_COUNT; j++) {
+        clientBufferLimitsConfig *limits = &(config.client_obuf_limits[j]);
+        str = sdscatprintf(str, "%s%s %llu %llu %ld", (j > 0 ? " " : ""),
+                           clientTypeNames[j], limits->hard_limit_bytes,
+                           limits->soft_limit_bytes,
+                           (long) limits->soft_limit_seconds);
+    }
+    return str;
 }
 
 int parseAddress(char *address, redisClusterEntryPoint *entry_point) {
@@ -73,7 +186,7 @@ int parseAddress(char *address, redisClusterEntryPoint *entry_point) {
     return 1;
 }
 
-int parseOptionsFromFile(const char *filename) {
+int parseOptionsFromFile(redisClusterProxyConfig *cfg, const char *filename) {
     FILE *f;
     if (filename[0] == '-' || filename[0] == '\0') f = stdin;
     else {
@@ -120,7 +233,7 @@ int parseOptionsFromFile(const char *filename) {
                 goto cleanup;
             }
             char *configfile = tokens[1];
-            success = parseOptionsFromFile(configfile);
+            success = parseOptionsFromFile(cfg, configfile);
             if (!success) goto cleanup;
             handled = 1;
         } else if (strcmp("cluster", tokens[0]) == 0 ||
@@ -133,18 +246,18 @@ int parseOptionsFromFile(const char *filename) {
                         "'%s' option\n", filename, linenum, tokens[0]);
                 goto cleanup;
             }
-            if (config.entry_points_count >= MAX_ENTRY_POINTS) {
+            if (cfg->entry_points_count >= MAX_ENTRY_POINTS) {
                 proxyLogWarn(MAX_ENTRY_POINTS_WARN_MSG,
                     MAX_ENTRY_POINTS, tokens[1]);
                 goto next_line;
             }
             redisClusterEntryPoint *entry_point =
-                &(config.entry_points[config.entry_points_count++]);
+                &(cfg->entry_points[cfg->entry_points_count++]);
             if (!parseAddress(tokens[1], entry_point)) {
                 fprintf(stderr, "Error in config file '%s', at line %d:\n"
                         "Invalid address for '%s' option\n",
                         filename, linenum, tokens[0]);
-                config.entry_points_count--;
+                cfg->entry_points_count--;
                 goto next_line;
             }
             handled = 1;
@@ -179,7 +292,7 @@ next_line:
             zfree(tokens);
         }
     }
-    if (argc > 1) parseOptions(argc, argv);
+    if (argc > 1 && parseOptions(cfg, argc, argv) < 0) success = 0;
 cleanup:
     if (f != stdin) fclose(f);
     if (argv) {
@@ -189,21 +302,27 @@ cleanup:
     return success;
 }
 
-void checkConfig(void) {
-    if (config.logfile != NULL) {
+void checkConfig(redisClusterProxyConfig *cfg) {
+    if (cfg->logfile != NULL) {
         /* If the logfile is an empty string, set it NULL and use STDOUT */
-        if (config.logfile[0] == '\0') {
-            zfree(config.logfile);
-            config.logfile = NULL;
-        } else config.use_colors = 0;
+        if (cfg->logfile[0] == '\0') {
+            zfree(cfg->logfile);
+            cfg->logfile = NULL;
+        } else cfg->use_colors = 0;
     }
-    if (config.connections_pool.size > MAX_POOL_SIZE) {
-        config.connections_pool.size = MAX_POOL_SIZE;
+    if (cfg->connections_pool.size > MAX_POOL_SIZE) {
+        cfg->connections_pool.size = MAX_POOL_SIZE;
         proxyLogWarn("Limiting connections-pool-size to max. %d\n",
             MAX_POOL_SIZE);
     }
-    if (config.connections_pool.min_size > config.connections_pool.size)
-        config.connections_pool.min_size = config.connections_pool.size;
-    if (config.connections_pool.spawn_every < 0)
-        config.connections_pool.spawn_every = 0;
+    if (cfg->connections_pool.min_size > cfg->connections_pool.size)
+        cfg->connections_pool.min_size = cfg->connections_pool.size;
+    if (cfg->connections_pool.spawn_every < 0)
+        cfg->connections_pool.spawn_every = 0;
+    if (cfg->failover_hold_time < 0) cfg->failover_hold_time = 0;
+    if (cfg->failover_hold_max_requests < 0)
+        cfg->failover_hold_max_requests = 0;
+    if (cfg->tls_session_cache_size < 0) cfg->tls_session_cache_size = 0;
+    if (cfg->tls_session_cache_timeout < 1)
+        cfg->tls_session_cache_timeout = DEFAULT_TLS_SESSION_CACHE_TIMEOUT;
 }
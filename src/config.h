@@ -18,13 +18,16 @@
 #ifndef __REDIS_CLUSTER_PROXY_CONFIG_H__
 #define __REDIS_CLUSTER_PROXY_CONFIG_H__
 
+#include <time.h>
 #include "redis_config.h"
+#include "sds.h"
 
 #define CFG_DISABLE_MULTIPLEXING_AUTO       1
 #define CFG_DISABLE_MULTIPLEXING_ALWAYS     2
 #define BINDADDR_MAX                        16
 #define MAX_ENTRY_POINTS                    255
 #define MAX_POOL_SIZE                       50
+#define MAX_THREADS                         500
 #define DEFAULT_PID_FILE                    "/var/run/redis-cluster-proxy.pid"
 #define DEFAULT_PORT                        7777
 #define DEFAULT_UNIXSOCKETPERM              0
@@ -36,6 +39,31 @@
 #define DEFAULT_CONNECTIONS_POOL_MINSIZE    10
 #define DEFAULT_CONNECTIONS_POOL_INTERVAL   50
 #define DEFAULT_CONNECTIONS_POOL_SPAWNRATE  2
+#define DEFAULT_FAILOVER_HOLD_TIME          0
+#define DEFAULT_FAILOVER_HOLD_MAX_REQUESTS  10000
+#define DEFAULT_CLIENT_QUERY_BUFFER_LIMIT   (1024*1024*1024) /* 1GB */
+#define DEFAULT_PROTO_MAX_BULK_LEN          (512*1024*1024) /* 512MB */
+#define DEFAULT_MAXMEMORY                   0
+#define DEFAULT_IO_READ_MAX_LEN             (1024*1024) /* 1MB */
+#define DEFAULT_IO_READ_BUDGET              (4*1024*1024) /* 4MB */
+#define DEFAULT_BULK_WEIGHT                 10 /* Percent */
+#define DEFAULT_BULK_MIN_KEYS               100
+#define DEFAULT_CLIENT_MAX_OPS              0 /* Per second, 0 = no limit */
+#define DEFAULT_CLIENT_MAX_BYTES            0 /* Per second, 0 = no limit */
+#define DEFAULT_USER_MAX_OPS                0 /* Per second, 0 = no limit */
+#define DEFAULT_USER_MAX_BYTES              0 /* Per second, 0 = no limit */
+#define DEFAULT_NODE_MAX_INFLIGHT_REQUESTS  0 /* 0 = no limit */
+#define DEFAULT_NODE_MAX_INFLIGHT_BYTES     0 /* 0 = no limit */
+#define DEFAULT_NODE_MAX_QUEUED_REQUESTS    -1 /* -1 = no limit */
+#define DEFAULT_UPGRADE_DRAIN_TIMEOUT       60 /* Seconds, 0 = no limit */
+#define DEFAULT_DRAIN_TIMEOUT               30 /* Seconds, 0 = no limit */
+#define DEFAULT_THREADS_RETIRE_TIMEOUT      30 /* Seconds, 0 = no limit */
+#define DEFAULT_TLS_SESSION_CACHE_SIZE      (1024*20) /* 0 = disabled */
+#define DEFAULT_TLS_SESSION_CACHE_TIMEOUT   300 /* Seconds */
+
+#define CLIENT_TYPE_NORMAL                  0 /* Multiplexed clients */
+#define CLIENT_TYPE_PRIVATE                 1 /* Clients with private conn. */
+#define CLIENT_TYPE_COUNT                   2
 
 #define MAX_ENTRY_POINTS_WARN_MSG "You cannot use more than %d entry points, "\
                                   "skipping entry point '%s'"
@@ -47,6 +75,15 @@ typedef struct redisClusterEntryPoint {
     char *address;
 } redisClusterEntryPoint;
 
+typedef struct clientBufferLimitsConfig {
+    unsigned long long hard_limit_bytes;
+    unsigned long long soft_limit_bytes;
+    time_t soft_limit_seconds;
+} clientBufferLimitsConfig;
+
+extern clientBufferLimitsConfig clientBufferLimitsDefaults[CLIENT_TYPE_COUNT];
+extern const char *clientTypeNames[CLIENT_TYPE_COUNT];
+
 typedef struct {
     int port;
     char *unixsocket;
@@ -77,13 +114,48 @@ typedef struct {
         int spawn_every;
         int spawn_rate;
     } connections_pool;
+    int failover_hold_time;
+    int failover_hold_max_requests;
+    int client_query_buffer_limit;
+    int proto_max_bulk_len;
+    unsigned long long maxmemory;
+    int io_read_max_len;
+    int io_read_budget;
+    int bulk_weight;
+    int bulk_min_keys;
+    char *bulk_users;
+    int client_max_ops;
+    int client_max_bytes;
+    int user_max_ops;
+    int user_max_bytes;
+    int node_max_inflight_requests;
+    int node_max_inflight_bytes;
+    int node_max_queued_requests;
+    int upgrade_drain_timeout;
+    int drain_timeout;
+    int threads_retire_timeout;
+    int tls;
+    int tls_cluster;
+    int tls_auth_clients;
+    int tls_ktls;
+    int tls_session_cache_size;
+    int tls_session_cache_timeout;
+    char *tls_cert_file;
+    char *tls_key_file;
+    char *tls_ca_cert_file;
+    char *tls_ca_cert_dir;
+    clientBufferLimitsConfig client_obuf_limits[CLIENT_TYPE_COUNT];
 } redisClusterProxyConfig;
 
 extern redisClusterProxyConfig config;
-void initConfig(void);
-int parseOptions(int argc, char **argv);
-int parseOptionsFromFile(const char *filename);
-void checkConfig(void);
+void initConfig(redisClusterProxyConfig *cfg);
+int parseOptions(redisClusterProxyConfig *cfg, int argc, char **argv);
+int parseOptionsFromFile(redisClusterProxyConfig *cfg, const char *filename);
+void checkConfig(redisClusterProxyConfig *cfg);
 int parseAddress(char *address, redisClusterEntryPoint *entry_point);
+int setClientOutputBufferLimit(redisClusterProxyConfig *cfg, char **args,
+                               int count, char **err);
+int parseMemoryValue(const char *value, int *dest);
+sds getClientOutputBufferLimitString(void);
 
 #endif /* __REDIS_CLUSTER_PROXY_CONFIG_H__ */
@@ -23,6 +23,9 @@ const char *proxyCommandHelp[] = {
     "CONFIG GET <param>         -- Get Proxy's confinguration value for <param>",
     "CONFIG SET <param> <value> -- Set Proxy's confinguration value for "
                                    "<param> to <value>",
+    "CONFIG RELOAD              -- Reload the configuration file and apply "
+                                   "the options that can be changed at "
+                                   "runtime (same as SIGHUP)",
     "MULTIPLEXING STATUS|OFF    -- Get current client's multiplexing status "
                                    "or turn it off (private cluster connection)",
     "COMMAND [type]             -- List commands currently known by the Proxy."
@@ -32,8 +35,17 @@ const char *proxyCommandHelp[] = {
                                    "`PROXY CLIENT HELP` for more info)",
     "CLUSTER [subcmd]           -- Execute cluster specific actions (type "
                                    "`PROXY CLUSTER HELP` for more info)",
+    "CAPTURE <subcmd>           -- Capture the queries sent by clients to a "
+                                   "file, in order to replay them (type "
+                                   "`PROXY CAPTURE HELP` for more info)",
     "DEBUG <subcmd>             -- Utilities for debugging the proxy (type "
                                    "`PROXY DEBUG HELP` for more info)",
+    "DRAIN [timeout]            -- Stop accepting connections and reading "
+                                   "queries, close clients once their "
+                                   "pending requests are replied and exit "
+                                   "when all clients are gone or after "
+                                   "`timeout` seconds (default: "
+                                   "drain-timeout, 0 means no timeout)",
     "SHUTDOWN [ASAP]            -- Shutdown the proxy. If `ASAP` is used, "
                                    "perform an immeditae dirty exit, "
                                    "otherwise send a SIGINT.",
@@ -46,6 +58,9 @@ const char *proxyCommandSubcommandClientHelp[] = {
     "PROXY CLIENT <subcommand> [arg arg ... arg]",
     "ID     -- Get current client's internal id",
     "THREAD -- Get current client's thread id",
+    "MEMORY -- Get memory used by current client's query and output buffers",
+    "PRIORITY [interactive|bulk] -- Get or set the priority class of current "
+        "client's requests",
     NULL
 };
 
@@ -63,6 +78,17 @@ const char *proxyCommandSubcommandClusterHelp[] = {
     NULL
 };
 
+const char *proxyCommandSubcommandCaptureHelp[] = {
+    "PROXY CAPTURE <subcommand> [arg arg ... arg]",
+    "START <file> [sample-rate] -- Start capturing the queries sent by "
+                                   "clients to <file>. If sample-rate (0-1) "
+                                   "is given, only that fraction of the "
+                                   "clients is captured",
+    "STOP                       -- Stop the capture and flush the file",
+    "STATUS                     -- Get info about the current capture",
+    NULL
+};
+
 const char *proxyCommandSubcommandDebugtHelp[] = {
     "PROXY DEBUG <subcommand> [ARGS...]",
     "SEGFAULT            -- Cause a SEGFAULT on the proxy",
@@ -110,7 +136,118 @@ const char *mainHelpString =
 "                       in the pool. Default: %d\n"
 "  --connections-pool-spawn-rate <num>\n"
 "                       Number of connections to re-spawn in the pool at\n"
-"                       every cycle. Default: %d\n"
+"                       every cycle. Default: %d\n";
+
+/* The main help is split in multiple strings, since string literals longer
+ * than 4095 chars are not required to be supported by C99 compilers. */
+const char *mainHelpStringLimits =
+"  --failover-hold-time <ms>\n"
+"                       Time in milliseconds during which requests directed\n"
+"                       to a failed master are held, waiting for one of its\n"
+"                       replicas to be promoted. Use 0 to disable.\n"
+"                       Default: %d\n"
+"  --failover-hold-max-requests <num>\n"
+"                       Max. number of requests held by every thread while\n"
+"                       waiting for a failover. Default: %d\n"
+"  --client-output-buffer-limit <class> <hard> <soft> <soft-seconds>\n"
+"                       Output buffer limits for a class of clients\n"
+"                       (normal|private). Over the soft limit, the proxy\n"
+"                       stops reading queries from the client. Over the hard\n"
+"                       limit (or over the soft limit for more than\n"
+"                       soft-seconds) the client is disconnected.\n"
+"                       Use 0 to disable a limit. Default: no limits\n"
+"  --client-query-buffer-limit <bytes>\n"
+"                       Max. size of a client's query buffer: clients\n"
+"                       sending bigger queries are disconnected.\n"
+"                       Use 0 to disable. Default: %d\n"
+"  --maxmemory <bytes>  Max. memory used by the clients: when it's reached,\n"
+"                       clients using the most memory are disconnected.\n"
+"                       Use 0 to disable. Default: 0\n"
+"  --proto-max-bulk-len <bytes>\n"
+"                       Max. length of a single bulk argument of a query.\n"
+"                       Default: %d\n"
+"  --io-read-max-len <bytes>\n"
+"                       Max. size of a single read from a socket: read\n"
+"                       sizes grow up to it when reads fill the buffer.\n"
+"                       Default: %d\n"
+"  --io-read-budget <bytes>\n"
+"                       Max. bytes read from a single connection on every\n"
+"                       event before serving the others. Default: %d\n"
+"  --bulk-weight <percent>\n"
+"                       Share of the bytes sent to a node given to bulk\n"
+"                       requests while interactive requests are waiting.\n"
+"                       Use 0 for strict priority. Default: %d\n"
+"  --bulk-min-keys <num>\n"
+"                       Multi-key queries with at least <num> keys are\n"
+"                       bulk requests. Use 0 to disable. Default: %d\n"
+"  --bulk-users <user,...>\n"
+"                       Comma separated list of users whose clients only\n"
+"                       send bulk requests.\n"
+"  --client-max-ops-per-sec <num>\n"
+"                       Max. queries per second a client can send: reads\n"
+"                       from faster clients are paused. Use 0 for no\n"
+"                       limit. Default: 0\n"
+"  --client-max-bytes-per-sec <bytes>\n"
+"                       Max. bytes per second a client can send. Use 0\n"
+"                       for no limit. Default: 0\n"
+"  --user-max-ops-per-sec <num>\n"
+"                       Max. queries per second sent by all the clients\n"
+"                       authenticated with the same user. Default: 0\n"
+"  --user-max-bytes-per-sec <bytes>\n"
+"                       Max. bytes per second sent by all the clients\n"
+"                       authenticated with the same user. Default: 0\n";
+
+const char *mainHelpStringNodes =
+"  --node-max-inflight-requests <num>\n"
+"                       Max. requests waiting for a reply from a node on\n"
+"                       every thread: further requests wait in the proxy.\n"
+"                       Use 0 for no limit. Default: 0\n"
+"  --node-max-inflight-bytes <bytes>\n"
+"                       Max. query bytes waiting for a reply from a node on\n"
+"                       every thread. Use 0 for no limit. Default: 0\n"
+"  --node-max-queued-requests <num>\n"
+"                       Max. requests waiting in the proxy for the in-flight\n"
+"                       limits of a node: further requests are rejected with\n"
+"                       a BUSY error. Use 0 to fail fast, -1 for no limit.\n"
+"                       Default: -1\n"
+"  --upgrade-drain-timeout <sec>\n"
+"                       Max. seconds the old process keeps serving its\n"
+"                       clients after a binary upgrade (see SIGUSR2).\n"
+"                       Use 0 for no limit. Default: 60\n"
+"  --drain-timeout <sec>\n"
+"                       Max. seconds spent draining clients before exiting\n"
+"                       when drain mode is entered via SIGUSR1 (see\n"
+"                       PROXY DRAIN). Use 0 for no limit. Default: 30\n"
+"  --threads-retire-timeout <sec>\n"
+"                       Max. seconds a retiring thread waits for its\n"
+"                       clients to be migrated (see PROXY CONFIG SET\n"
+"                       threads): clients that can't be migrated yet are\n"
+"                       closed. Use 0 for no limit. Default: 30\n";
+
+const char *mainHelpStringTLS =
+"  --tls                Use TLS for client connections on TCP (requires\n"
+"                       a build with BUILD_TLS=yes)\n"
+"  --tls-cluster        Use TLS for connections to cluster nodes\n"
+"  --tls-cert-file <path>\n"
+"                       Certificate (chain) in PEM format, presented to\n"
+"                       clients and to nodes\n"
+"  --tls-key-file <path>\n"
+"                       Private key of the certificate (default: the\n"
+"                       certificate file itself)\n"
+"  --tls-ca-cert-file <path>\n"
+"                       CA certificates used to verify clients and nodes\n"
+"  --tls-ca-cert-dir <path>\n"
+"                       Directory of CA certificates (see c_rehash)\n"
+"  --tls-auth-clients   Require clients to present a valid certificate\n"
+"  --tls-session-cache-size <num>\n"
+"                       Max. TLS sessions cached for resumption. Use 0 to\n"
+"                       disable resumption. Default: %d\n"
+"  --tls-session-cache-timeout <sec>\n"
+"                       Lifetime of cached TLS sessions. Default: %d\n"
+"  --tls-ktls           Offload record encryption to the kernel (kTLS) if\n"
+"                       supported by OpenSSL and the kernel\n";
+
+const char *mainHelpStringTail =
 "  --disable-multiplexing <opt>\n"
 "                       When should multiplexing be disabled\n"
 "                       Values: (auto|always) (default: auto)\n"
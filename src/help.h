@@ -21,8 +21,13 @@
 extern const char *proxyCommandHelp[];
 extern const char *proxyCommandSubcommandClientHelp[];
 extern const char *proxyCommandSubcommandClusterHelp[];
+extern const char *proxyCommandSubcommandCaptureHelp[];
 extern const char *proxyCommandSubcommandDebugtHelp[];
 extern const char *mainHelpString;
+extern const char *mainHelpStringLimits;
+extern const char *mainHelpStringNodes;
+extern const char *mainHelpStringTLS;
+extern const char *mainHelpStringTail;
 
 void printHelp(void);
 
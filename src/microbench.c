@@ -0,0 +1,1051 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks of the proxy's hot paths, measured in nanoseconds and
+ * allocations per operation.
+ *
+ * Usage: redis-cluster-proxy-microbench [OPTIONS] [BENCHMARK ...]
+ *
+ * The benchmarks are linked against the proxy's objects, so they call the
+ * same functions of the request processing pipeline. The requests are
+ * processed by a fake client of a fake thread whose cluster is an in-memory
+ * map of three masters: no connection is ever made, so the results only
+ * depend on the proxy's code. Allocations are counted by zmalloc, that is
+ * compiled with ZMALLOC_COUNT_ALLOCATIONS for this binary (see the
+ * Makefile). Benchmarks whose name ends with '-legacy' or '-bytewise'
+ * measure the implementations replaced by the current ones, as a reference
+ * for their speedup. */
+
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <hiredis.h>
+#include "proxy.h"
+#include "zmalloc.h"
+#include "protocol.h"
+#include "endianconv.h"
+#include "logger.h"
+#include "sds.h"
+#include "util.h"
+#include "resp.h"
+#include "crc16.h"
+
+#define MICROBENCH_DEFAULT_MIN_TIME     200     /* Milliseconds */
+#define MICROBENCH_DEFAULT_THRESHOLD    10      /* Percent */
+#define MICROBENCH_MAX_RESULTS          64
+#define MICROBENCH_KEYS                 1024
+#define MICROBENCH_MASTERS              3
+#define PARSER_BENCH_MAX_ARGS           (1024*1024)
+/* Number of keys hashed by every round of the CRC16 benchmarks. */
+#define CRC16_BENCH_KEYS                1024
+/* Fixtures mapping every hash slot to a key, shared with the test suite. */
+#define CRC16_SLOT_TABLE_PATH           "../test/lib/crc16_slottable.rb"
+
+extern redisClusterProxy proxy;
+
+typedef struct microBenchmark {
+    const char *name;
+    const char *description;
+    /* Execute a round of the benchmark and return the number of operations
+     * performed by the round. */
+    long long (*proc)(void);
+} microBenchmark;
+
+typedef struct microBenchResult {
+    char name[64];
+    double ns_per_op;
+    double allocs_per_op;
+} microBenchResult;
+
+/* The timer is stopped by the benchmarks that need to prepare the input of
+ * the measured function (ie. replies to be merged), so that neither the
+ * time nor the allocations of the preparation get measured. */
+static struct {
+    int running;
+    long long started;
+    long long elapsed;
+    size_t allocations_start;
+    size_t allocations;
+} timer;
+
+static client *bench_client = NULL;
+static sds bench_keys[MICROBENCH_KEYS];
+static sds inline_get_query = NULL;
+static sds get_query = NULL;
+static sds set_query = NULL;
+static sds pipeline16_query = NULL;
+static sds pipeline128_query = NULL;
+static sds mset_query = NULL;
+static sds mget_query = NULL;
+static sds mget_reply = NULL;
+
+static long long nstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long) ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
+static void startTimer(void) {
+    if (timer.running) return;
+    timer.running = 1;
+    timer.allocations_start = zmalloc_allocations();
+    timer.started = nstime();
+}
+
+static void stopTimer(void) {
+    if (!timer.running) return;
+    timer.elapsed += nstime() - timer.started;
+    timer.allocations += zmalloc_allocations() - timer.allocations_start;
+    timer.running = 0;
+}
+
+static void resetTimer(void) {
+    timer.running = 0;
+    timer.elapsed = 0;
+    timer.allocations = 0;
+}
+
+static void benchmarkFail(const char *benchmark, const char *msg) {
+    fprintf(stderr, "Benchmark '%s' failed: %s\n", benchmark, msg);
+    exit(1);
+}
+
+/* Build a multibulk query from the 'argc' arguments in 'argv'. */
+static sds catMultibulkQuery(sds query, int argc, sds *argv) {
+    int i;
+    query = sdscatfmt(query, "*%i\r\n", argc);
+    for (i = 0; i < argc; i++) {
+        query = sdscatfmt(query, "$%u\r\n", (unsigned int) sdslen(argv[i]));
+        query = sdscatsds(query, argv[i]);
+        query = sdscatlen(query, "\r\n", 2);
+    }
+    return query;
+}
+
+/* Build a query of the command 'name' having 'count' keys as arguments,
+ * every key being followed by 'values' values. */
+static sds createKeysQuery(const char *name, int count, int values) {
+    int argc = 1 + count * (1 + values), i, j, n = 1;
+    sds *argv = zmalloc(argc * sizeof(sds));
+    argv[0] = sdsnew(name);
+    for (i = 0; i < count; i++) {
+        argv[n++] = sdsdup(bench_keys[i]);
+        for (j = 0; j < values; j++) argv[n++] = sdsnew("value");
+    }
+    sds query = catMultibulkQuery(sdsempty(), argc, argv);
+    for (i = 0; i < argc; i++) sdsfree(argv[i]);
+    zfree(argv);
+    return query;
+}
+
+static void initQueries(void) {
+    int i;
+    for (i = 0; i < MICROBENCH_KEYS; i++)
+        bench_keys[i] = sdscatprintf(sdsempty(), "key:%06d", i);
+    inline_get_query = sdscatfmt(sdsempty(), "GET %S\r\n", bench_keys[0]);
+    get_query = createKeysQuery("GET", 1, 0);
+    sds argv[3];
+    argv[0] = sdsnew("SET");
+    argv[1] = sdsdup(bench_keys[0]);
+    argv[2] = sdsgrowzero(sdsempty(), 1024);
+    memset(argv[2], 'x', 1024);
+    set_query = catMultibulkQuery(sdsempty(), 3, argv);
+    for (i = 0; i < 3; i++) sdsfree(argv[i]);
+    pipeline16_query = sdsempty();
+    pipeline128_query = sdsempty();
+    for (i = 0; i < 128; i++) {
+        argv[0] = sdsnew("GET");
+        argv[1] = bench_keys[i];
+        if (i < 16)
+            pipeline16_query = catMultibulkQuery(pipeline16_query, 2, argv);
+        pipeline128_query = catMultibulkQuery(pipeline128_query, 2, argv);
+        sdsfree(argv[0]);
+    }
+    mset_query = createKeysQuery("MSET", 128, 1);
+    mget_query = createKeysQuery("MGET", 16, 0);
+    mget_reply = sdsnew("*1\r\n$5\r\nvalue\r\n");
+}
+
+/* Map the slots to MICROBENCH_MASTERS fake masters, just like
+ * clusterNodeLoadInfo does, and assign the resulting cluster to a fake
+ * thread. */
+static void initCluster(void) {
+    int i, slots_per_node = CLUSTER_SLOTS / MICROBENCH_MASTERS;
+    config.num_threads = 1;
+    proxy.threads = zmalloc(sizeof(proxyThread *));
+    proxy.threads[0] = zcalloc(sizeof(proxyThread));
+    redisCluster *cluster = createCluster(0);
+    for (i = 0; i < MICROBENCH_MASTERS; i++) {
+        clusterNode *node = createClusterNode("127.0.0.1", 7000 + i, cluster);
+        int start = i * slots_per_node, stop = start + slots_per_node - 1;
+        if (i == MICROBENCH_MASTERS - 1) stop = CLUSTER_SLOTS - 1;
+        node->name = sdscatprintf(sdsempty(), "%040d", i);
+        clusterAddNode(cluster, node);
+        mapSlot(cluster, start, node);
+        mapSlot(cluster, stop, node);
+        cluster->masters_count++;
+    }
+    proxy.threads[0]->cluster = cluster;
+}
+
+static void initClient(void) {
+    bench_client = zcalloc(sizeof(*bench_client));
+    bench_client->fd = -1;
+    bench_client->status = CLIENT_STATUS_NONE;
+    bench_client->thread_id = 0;
+    bench_client->obuf = sdsempty();
+}
+
+/* Free all the requests of the benchmark client, including the placeholders
+ * left by child requests freed together with their parent. */
+static void freeClientRequests(client *c) {
+    if (c->requests == NULL) return;
+    while (listLength(c->requests) > 0) {
+        listNode *ln = listFirst(c->requests);
+        if (ln->value == NULL) listDelNode(c->requests, ln);
+        else freeRequest(ln->value);
+    }
+}
+
+/* Create a request containing 'query' (that can also contain pipelined
+ * queries), parse it and return the number of parsed queries. */
+static int parseQueries(const char *benchmark, sds query) {
+    clientRequest *req = createRequest(bench_client);
+    req->buffer = sdscatsds(req->buffer, query);
+    int count = 0;
+    while (req != NULL) {
+        sds err = NULL;
+        if (parseRequest(req, &err) != PARSE_STATUS_OK)
+            benchmarkFail(benchmark, err ? err : "incomplete query");
+        req->parsed = 1;
+        count++;
+        listNode *next = listNextNode(req->requests_lnode);
+        req = (next != NULL ? next->value : NULL);
+    }
+    return count;
+}
+
+/* Request processing pipeline benchmarks. */
+
+static long long benchParse(const char *benchmark, sds query, int expected) {
+    if (parseQueries(benchmark, query) != expected)
+        benchmarkFail(benchmark, "unexpected number of queries");
+    freeClientRequests(bench_client);
+    return expected;
+}
+
+static long long benchParseInline(void) {
+    return benchParse("parse-inline", inline_get_query, 1);
+}
+
+static long long benchParseGet(void) {
+    return benchParse("parse-get", get_query, 1);
+}
+
+static long long benchParseSet(void) {
+    return benchParse("parse-set-1k", set_query, 1);
+}
+
+static long long benchParsePipeline16(void) {
+    return benchParse("parse-pipeline-16", pipeline16_query, 16);
+}
+
+static long long benchParsePipeline128(void) {
+    return benchParse("parse-pipeline-128", pipeline128_query, 128);
+}
+
+static long long benchParseMset(void) {
+    return benchParse("parse-mset-128", mset_query, 1);
+}
+
+static long long benchCreateRequest(void) {
+    int i;
+    for (i = 0; i < 16; i++) freeRequest(createRequest(bench_client));
+    return 16;
+}
+
+static long long benchCommandLookup(void) {
+    static sds names[8];
+    int i;
+    if (names[0] == NULL) {
+        const char *cmds[] = {"get", "set", "mget", "hgetall", "zadd",
+                              "ping", "incrby", "xadd"};
+        for (i = 0; i < 8; i++) names[i] = sdsnew(cmds[i]);
+    }
+    for (i = 0; i < 8; i++) {
+        if (getRedisCommand(names[i]) == NULL)
+            benchmarkFail("command-lookup", "command not found");
+    }
+    return 8;
+}
+
+static long long benchKeySlot(void) {
+    redisCluster *cluster = proxy.threads[0]->cluster;
+    int i;
+    for (i = 0; i < MICROBENCH_KEYS; i++) {
+        sds key = bench_keys[i];
+        int slot = clusterKeyHashSlot(key, sdslen(key));
+        if (searchNodeBySlot(cluster, slot) == NULL)
+            benchmarkFail("key-slot", "slot not mapped");
+    }
+    return MICROBENCH_KEYS;
+}
+
+/* Parse the MGET query and split it into a child request for every slot,
+ * just like processRequest does. */
+static clientRequest *splitMget(const char *benchmark) {
+    static redisCommandDef *mget = NULL;
+    clientRequest *req = NULL;
+    sds err = NULL;
+    if (mget == NULL) {
+        sds name = sdsnew("mget");
+        mget = getRedisCommand(name);
+        sdsfree(name);
+    }
+    parseQueries(benchmark, mget_query);
+    req = listNodeValue(listFirst(bench_client->requests));
+    req->command = mget;
+    if (getRequestNode(req, &err) == NULL)
+        benchmarkFail(benchmark, err ? err : "no node");
+    if (req->child_requests == NULL)
+        benchmarkFail(benchmark, "query was not split");
+    return req;
+}
+
+static long long benchSplitMultiSlot(void) {
+    splitMget("split-mget-16");
+    freeClientRequests(bench_client);
+    return 1;
+}
+
+static long long benchMergeReplies(void) {
+    stopTimer();
+    clientRequest *req = splitMget("merge-mget-16");
+    listIter li;
+    listNode *ln;
+    listRewind(req->child_requests, &li);
+    while ((ln = listNext(&li))) {
+        clientRequest *child = ln->value;
+        uint64_t be_id = htonu64(child->id);
+        raxInsert(req->child_replies, (unsigned char *) &be_id,
+                  sizeof(be_id), sdsdup(mget_reply), NULL);
+    }
+    uint64_t be_id = htonu64(req->id);
+    raxInsert(req->child_replies, (unsigned char *) &be_id, sizeof(be_id),
+              sdsdup(mget_reply), NULL);
+    bench_client->min_reply_id = req->id;
+    startTimer();
+    if (!mergeReplies(NULL, req, NULL, 0))
+        benchmarkFail("merge-mget-16", "failed to merge replies");
+    stopTimer();
+    sdsclear(bench_client->obuf);
+    freeClientRequests(bench_client);
+    startTimer();
+    return 1;
+}
+
+/* Add the replies of 16 requests in reverse order, so that all of them but
+ * the last one have to be kept into the unordered replies, and they all get
+ * appended to the output buffer by the last one. */
+static long long benchUnorderedReplies(void) {
+    const char *reply = "$5\r\nvalue\r\n";
+    size_t len = strlen(reply);
+    uint64_t min_id = bench_client->min_reply_id;
+    int i;
+    for (i = 15; i >= 0; i--) addReplyRaw(bench_client, reply, len, min_id + i);
+    if (bench_client->min_reply_id != min_id + 16)
+        benchmarkFail("unordered-replies-16", "replies not written");
+    sdsclear(bench_client->obuf);
+    return 16;
+}
+
+/* Node reply buffer benchmarks.
+ *
+ * Pipelined replies are consumed just like the proxy does in
+ * processClusterReplyBuffer, by moving a cursor and trimming the reader's
+ * buffer only once at the end. The '-legacy' benchmarks trim the buffer
+ * after every reply, like the proxy used to do. */
+
+static redisContext reply_ctx;
+static sds replies16 = NULL;
+static sds replies1024 = NULL;
+
+static void initReplies(void) {
+    int i;
+    memset(&reply_ctx, 0, sizeof(reply_ctx));
+    reply_ctx.reader = redisReaderCreate();
+    replies16 = sdsempty();
+    replies1024 = sdsempty();
+    for (i = 0; i < 1024; i++) {
+        const char *reply = "$16\r\nxxxxxxxxxxxxxxxx\r\n";
+        if (i < 16) replies16 = sdscat(replies16, reply);
+        replies1024 = sdscat(replies1024, reply);
+    }
+}
+
+static long long processReplies(const char *benchmark, sds replies,
+                                int expected, int trim_every_reply)
+{
+    redisReader *r = reply_ctx.reader;
+    long long count = 0;
+    size_t start = 0;
+    redisReaderFeed(r, replies, sdslen(replies));
+    while (start < r->len) {
+        void *reply = NULL;
+        if (__hiredisReadReplyFromBuffer(r, &reply) != REDIS_OK)
+            benchmarkFail(benchmark, r->errstr);
+        if (reply == NULL) break;
+        freeReplyObject(reply);
+        count++;
+        if (trim_every_reply) consumeRedisReaderBuffer(&reply_ctx);
+        else start = r->pos;
+    }
+    if (!trim_every_reply) trimRedisReaderBuffer(&reply_ctx, start);
+    if (count != expected || r->len != 0)
+        benchmarkFail(benchmark, "unexpected number of replies");
+    return count;
+}
+
+static long long benchReplies16(void) {
+    return processReplies("replies-16", replies16, 16, 0);
+}
+
+static long long benchReplies16Legacy(void) {
+    return processReplies("replies-16-legacy", replies16, 16, 1);
+}
+
+static long long benchReplies1024(void) {
+    return processReplies("replies-1024", replies1024, 1024, 0);
+}
+
+static long long benchReplies1024Legacy(void) {
+    return processReplies("replies-1024-legacy", replies1024, 1024, 1);
+}
+
+/* Request scanner benchmarks.
+ *
+ * The '-legacy' benchmarks reproduce the way queries were parsed before the
+ * introduction of resp.c: every '*<count>' and '$<len>' line was searched
+ * with strchr, copied into a new string and converted by strtoll, and every
+ * query of a pipeline was split from the following ones by copying the
+ * whole remaining buffer into a new request. */
+
+static sds inline1000_queries = NULL;
+static sds multibulk1000_queries = NULL;
+static sds argv100k_query = NULL;
+static sds args64k_query = NULL;
+
+static int parser_offsets[PARSER_BENCH_MAX_ARGS];
+static int parser_lengths[PARSER_BENCH_MAX_ARGS];
+
+static long long legacyParseLength(const char *p, const char **next) {
+    const char *nl = strchr(p, '\r');
+    if (nl == NULL) return -1;
+    sds line = sdsnewlen(p, nl - p);
+    char *errptr = NULL;
+    long long value = strtoll(line, &errptr, 10);
+    if (errptr && errptr < (line + sdslen(line))) value = -1;
+    sdsfree(line);
+    *next = nl + 2;
+    return value;
+}
+
+static long long legacyScanMultibulk(const char *buf) {
+    const char *p;
+    long long count = legacyParseLength(buf + 1, &p), i;
+    if (count <= 0) return -1;
+    for (i = 0; i < count; i++) {
+        if (*p != '$') return -1;
+        long long arglen = legacyParseLength(p + 1, &p);
+        if (arglen <= 0 || p[arglen] != '\r') return -1;
+        parser_offsets[i] = p - buf;
+        parser_lengths[i] = arglen;
+        p += arglen + 2;
+    }
+    return p - buf;
+}
+
+static long long legacyScanInline(const char *buf) {
+    const char *nl = strchr(buf, '\n'), *p = buf;
+    int argc = 0;
+    if (nl == NULL) return -1;
+    while (p < nl) {
+        const char *sep = strchr(p, ' ');
+        if (sep == NULL || sep > nl) sep = nl;
+        parser_offsets[argc] = p - buf;
+        parser_lengths[argc++] = sep - p;
+        p = sep + 1;
+    }
+    return (nl - buf) + 1;
+}
+
+static long long respScanInline(const char *buf, size_t len) {
+    const char *nl = memchr(buf, '\n', len), *p = buf;
+    int argc = 0;
+    if (nl == NULL) return -1;
+    while (p < nl) {
+        const char *sep = memchr(p, ' ', nl - p);
+        if (sep == NULL) sep = nl;
+        parser_offsets[argc] = p - buf;
+        parser_lengths[argc++] = sep - p;
+        p = sep + 1;
+    }
+    return (nl - buf) + 1;
+}
+
+/* Scan all the queries contained in 'queries', giving every query its own
+ * buffer, just like the proxy does with pipelined queries. Returns the
+ * number of scanned queries. */
+static int scanPipeline(sds queries, int is_inline, int legacy) {
+    int count = 0;
+    if (legacy) {
+        sds buf = sdsdup(queries);
+        while (sdslen(buf) > 0) {
+            long long qlen = (is_inline ? legacyScanInline(buf) :
+                                          legacyScanMultibulk(buf));
+            if (qlen <= 0) break;
+            sds query = sdsnewlen(buf, qlen);
+            sds rest = sdsnewlen(buf + qlen, sdslen(buf) - qlen);
+            sdsfree(query);
+            sdsfree(buf);
+            buf = rest;
+            count++;
+        }
+        sdsfree(buf);
+    } else {
+        const char *p = queries, *end = queries + sdslen(queries);
+        while (p < end) {
+            long long qlen;
+            int argc = 0;
+            if (is_inline) qlen = respScanInline(p, end - p);
+            else {
+                qlen = respScanMultibulk(p, end - p, LLONG_MAX, &argc, NULL,
+                                         NULL);
+                if (qlen > 0)
+                    respScanMultibulk(p, qlen, LLONG_MAX, &argc,
+                                      parser_offsets, parser_lengths);
+            }
+            if (qlen <= 0) break;
+            sds query = sdsnewlen(p, qlen);
+            sdsfree(query);
+            p += qlen;
+            count++;
+        }
+    }
+    return count;
+}
+
+static sds createMultibulkQuery(sds buf, int argc, const char *prefix,
+                                int arglen)
+{
+    int i;
+    sds arg = sdsempty();
+    buf = sdscatfmt(buf, "*%i\r\n", argc);
+    for (i = 0; i < argc; i++) {
+        sdsclear(arg);
+        arg = sdscatfmt(arg, "%s%i", (i == 0 ? "MSET" : prefix), i);
+        while ((int) sdslen(arg) < arglen) arg = sdscatlen(arg, "x", 1);
+        buf = sdscatfmt(buf, "$%u\r\n%S\r\n", sdslen(arg), arg);
+    }
+    sdsfree(arg);
+    return buf;
+}
+
+static void initScanQueries(void) {
+    int i;
+    inline1000_queries = sdsempty();
+    multibulk1000_queries = sdsempty();
+    for (i = 0; i < 1000; i++) {
+        inline1000_queries = sdscatfmt(inline1000_queries,
+                                       "SET key:%i value:%i\r\n", i, i);
+        multibulk1000_queries = createMultibulkQuery(multibulk1000_queries,
+                                                     3, "key:", 8);
+    }
+    argv100k_query = createMultibulkQuery(sdsempty(), 100000, "key:", 8);
+    args64k_query = createMultibulkQuery(sdsempty(), 3, "key:", 65536);
+}
+
+static long long benchScan(const char *benchmark, sds queries, int expected,
+                           int is_inline, int legacy)
+{
+    if (scanPipeline(queries, is_inline, legacy) != expected)
+        benchmarkFail(benchmark, "unexpected number of queries");
+    return expected;
+}
+
+static long long benchScanInline(void) {
+    return benchScan("scan-inline-1000", inline1000_queries, 1000, 1, 0);
+}
+
+static long long benchScanInlineLegacy(void) {
+    return benchScan("scan-inline-1000-legacy", inline1000_queries, 1000,
+                     1, 1);
+}
+
+static long long benchScanMultibulk(void) {
+    return benchScan("scan-multibulk-1000", multibulk1000_queries, 1000,
+                     0, 0);
+}
+
+static long long benchScanMultibulkLegacy(void) {
+    return benchScan("scan-multibulk-1000-legacy", multibulk1000_queries,
+                     1000, 0, 1);
+}
+
+static long long benchScanHugeArgv(void) {
+    return benchScan("scan-argv-100k", argv100k_query, 1, 0, 0);
+}
+
+static long long benchScanHugeArgvLegacy(void) {
+    return benchScan("scan-argv-100k-legacy", argv100k_query, 1, 0, 1);
+}
+
+static long long benchScanBigArgs(void) {
+    return benchScan("scan-args-64k", args64k_query, 1, 0, 0);
+}
+
+static long long benchScanBigArgsLegacy(void) {
+    return benchScan("scan-args-64k-legacy", args64k_query, 1, 0, 1);
+}
+
+/* CRC16 benchmarks.
+ *
+ * crc16Bytewise is the byte-at-a-time implementation that crc16.c used
+ * before switching to slicing-by-8: it's used both as a reference for the
+ * correctness checks and by the '-bytewise' benchmarks. It's never inlined,
+ * just like crc16 that lives in another object, so that short keys are
+ * compared fairly. */
+
+static char crc16_buf[4096];
+
+static const uint16_t crc16BytewiseTab[256] = {
+    0x0000,0x1021,0x2042,0x3063,0x4084,0x50a5,0x60c6,0x70e7,
+    0x8108,0x9129,0xa14a,0xb16b,0xc18c,0xd1ad,0xe1ce,0xf1ef,
+    0x1231,0x0210,0x3273,0x2252,0x52b5,0x4294,0x72f7,0x62d6,
+    0x9339,0x8318,0xb37b,0xa35a,0xd3bd,0xc39c,0xf3ff,0xe3de,
+    0x2462,0x3443,0x0420,0x1401,0x64e6,0x74c7,0x44a4,0x5485,
+    0xa56a,0xb54b,0x8528,0x9509,0xe5ee,0xf5cf,0xc5ac,0xd58d,
+    0x3653,0x2672,0x1611,0x0630,0x76d7,0x66f6,0x5695,0x46b4,
+    0xb75b,0xa77a,0x9719,0x8738,0xf7df,0xe7fe,0xd79d,0xc7bc,
+    0x48c4,0x58e5,0x6886,0x78a7,0x0840,0x1861,0x2802,0x3823,
+    0xc9cc,0xd9ed,0xe98e,0xf9af,0x8948,0x9969,0xa90a,0xb92b,
+    0x5af5,0x4ad4,0x7ab7,0x6a96,0x1a71,0x0a50,0x3a33,0x2a12,
+    0xdbfd,0xcbdc,0xfbbf,0xeb9e,0x9b79,0x8b58,0xbb3b,0xab1a,
+    0x6ca6,0x7c87,0x4ce4,0x5cc5,0x2c22,0x3c03,0x0c60,0x1c41,
+    0xedae,0xfd8f,0xcdec,0xddcd,0xad2a,0xbd0b,0x8d68,0x9d49,
+    0x7e97,0x6eb6,0x5ed5,0x4ef4,0x3e13,0x2e32,0x1e51,0x0e70,
+    0xff9f,0xefbe,0xdfdd,0xcffc,0xbf1b,0xaf3a,0x9f59,0x8f78,
+    0x9188,0x81a9,0xb1ca,0xa1eb,0xd10c,0xc12d,0xf14e,0xe16f,
+    0x1080,0x00a1,0x30c2,0x20e3,0x5004,0x4025,0x7046,0x6067,
+    0x83b9,0x9398,0xa3fb,0xb3da,0xc33d,0xd31c,0xe37f,0xf35e,
+    0x02b1,0x1290,0x22f3,0x32d2,0x4235,0x5214,0x6277,0x7256,
+    0xb5ea,0xa5cb,0x95a8,0x8589,0xf56e,0xe54f,0xd52c,0xc50d,
+    0x34e2,0x24c3,0x14a0,0x0481,0x7466,0x6447,0x5424,0x4405,
+    0xa7db,0xb7fa,0x8799,0x97b8,0xe75f,0xf77e,0xc71d,0xd73c,
+    0x26d3,0x36f2,0x0691,0x16b0,0x6657,0x7676,0x4615,0x5634,
+    0xd94c,0xc96d,0xf90e,0xe92f,0x99c8,0x89e9,0xb98a,0xa9ab,
+    0x5844,0x4865,0x7806,0x6827,0x18c0,0x08e1,0x3882,0x28a3,
+    0xcb7d,0xdb5c,0xeb3f,0xfb1e,0x8bf9,0x9bd8,0xabbb,0xbb9a,
+    0x4a75,0x5a54,0x6a37,0x7a16,0x0af1,0x1ad0,0x2ab3,0x3a92,
+    0xfd2e,0xed0f,0xdd6c,0xcd4d,0xbdaa,0xad8b,0x9de8,0x8dc9,
+    0x7c26,0x6c07,0x5c64,0x4c45,0x3ca2,0x2c83,0x1ce0,0x0cc1,
+    0xef1f,0xff3e,0xcf5d,0xdf7c,0xaf9b,0xbfba,0x8fd9,0x9ff8,
+    0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0
+};
+
+__attribute__((noinline))
+static uint16_t crc16Bytewise(const char *buf, int len) {
+    int counter;
+    uint16_t crc = 0;
+    for (counter = 0; counter < len; counter++)
+            crc = (crc<<8) ^ crc16BytewiseTab[((crc>>8) ^ *buf++)&0x00FF];
+    return crc;
+}
+
+/* Check every key of the CRC16_SLOT_TABLE fixture (the array of strings
+ * used by the test suite, whose index is the slot of the string) against
+ * clusterKeyHashSlot. Returns the number of checked keys, or -1 if the fixture
+ * could not be read. */
+static int checkCRC16SlotTable(void) {
+    FILE *f = fopen(CRC16_SLOT_TABLE_PATH, "r");
+    if (f == NULL) return -1;
+    int slot = 0, c, in_string = 0, in_table = 0;
+    sds key = sdsempty();
+    while ((c = fgetc(f)) != EOF) {
+        if (!in_table) {
+            if (c == '[') in_table = 1;
+            continue;
+        }
+        if (!in_string) {
+            if (c == '"') in_string = 1;
+            else if (c == ']') break;
+            continue;
+        }
+        if (c != '"') {
+            char ch = (char) c;
+            key = sdscatlen(key, &ch, 1);
+            continue;
+        }
+        unsigned int keyslot = clusterKeyHashSlot(key, sdslen(key));
+        if (keyslot != (unsigned int) slot) {
+            fprintf(stderr, "CRC16 slot table: key '%s' mapped to slot %u "
+                            "instead of %d\n", key, keyslot, slot);
+            exit(1);
+        }
+        sdsclear(key);
+        in_string = 0;
+        slot++;
+    }
+    sdsfree(key);
+    fclose(f);
+    if (slot != CLUSTER_SLOTS) {
+        fprintf(stderr, "CRC16 slot table: found %d keys instead of %d\n",
+                slot, CLUSTER_SLOTS);
+        exit(1);
+    }
+    return slot;
+}
+
+/* Check crc16 against the byte-wise implementation, and clusterKeyHashSlot
+ * against the hash tags rules and the fixture of the test suite. */
+static void checkCRC16(void) {
+    char buf[1024];
+    int len, i;
+    if (crc16("123456789", 9) != 0x31C3) {
+        fprintf(stderr, "CRC16 check value mismatch\n");
+        exit(1);
+    }
+    srand(1234);
+    for (i = 0; i < (int) sizeof(buf); i++) buf[i] = rand() & 0xFF;
+    for (len = 0; len <= (int) sizeof(buf); len++) {
+        for (i = 0; i < 8 && i < len; i++) {
+            if (crc16(buf + i, len - i) == crc16Bytewise(buf + i, len - i))
+                continue;
+            fprintf(stderr, "CRC16 mismatch (offset %d, length %d)\n",
+                    i, len - i);
+            exit(1);
+        }
+    }
+    /* Hash tags, in both short and long keys, since short keys are not
+     * scanned with memchr (see CRC16_SLICING_MIN_LEN in crc16.c). */
+    struct {
+        const char *key;
+        const char *hashed;
+    } tags[] = {
+        {"{user1000}.following", "user1000"},
+        {"foo{}{bar}", "foo{}{bar}"},
+        {"foo{{bar}}zap", "{bar"},
+        {"foo{bar}{zap}", "bar"},
+        {"{", "{"},
+        {"}{", "}{"},
+        {"a{b", "a{b"},
+        {"{u1}.x", "u1"},
+        {"a-longer-key-foo{}{bar}", "a-longer-key-foo{}{bar}"},
+        {"a-longer-key-foo{{bar}}zap", "{bar"},
+        {"a-longer-key-foo{bar}{zap}", "bar"},
+        {"a-longer-key-without-tags{", "a-longer-key-without-tags{"},
+        {NULL, NULL}
+    };
+    for (i = 0; tags[i].key != NULL; i++) {
+        unsigned int slot = clusterKeyHashSlot(tags[i].key,
+                                               strlen(tags[i].key)),
+            expected = crc16Bytewise(tags[i].hashed,
+                                     strlen(tags[i].hashed)) & 0x3FFF;
+        if (slot == expected) continue;
+        fprintf(stderr, "Wrong slot for key '%s'\n", tags[i].key);
+        exit(1);
+    }
+    int keys = checkCRC16SlotTable();
+    if (keys < 0)
+        fprintf(stderr, "CRC16 slot table: %s not found, skipped\n",
+                CRC16_SLOT_TABLE_PATH);
+}
+
+static long long benchCRC16Len(int len, int bytewise) {
+    volatile uint16_t crc = 0;
+    int i;
+    for (i = 0; i < CRC16_BENCH_KEYS; i++) {
+        if (bytewise) crc ^= crc16Bytewise(crc16_buf + (i & 7), len);
+        else crc ^= crc16(crc16_buf + (i & 7), len);
+    }
+    return CRC16_BENCH_KEYS;
+}
+
+static long long benchCRC16_4(void) { return benchCRC16Len(4, 0); }
+static long long benchCRC16_4Bytewise(void) { return benchCRC16Len(4, 1); }
+static long long benchCRC16_8(void) { return benchCRC16Len(8, 0); }
+static long long benchCRC16_8Bytewise(void) { return benchCRC16Len(8, 1); }
+static long long benchCRC16_16(void) { return benchCRC16Len(16, 0); }
+static long long benchCRC16_16Bytewise(void) { return benchCRC16Len(16, 1); }
+static long long benchCRC16_64(void) { return benchCRC16Len(64, 0); }
+static long long benchCRC16_64Bytewise(void) { return benchCRC16Len(64, 1); }
+static long long benchCRC16_4k(void) { return benchCRC16Len(4000, 0); }
+static long long benchCRC16_4kBytewise(void) { return benchCRC16Len(4000, 1); }
+
+static void initCRC16(void) {
+    int i;
+    for (i = 0; i < (int) sizeof(crc16_buf); i++)
+        crc16_buf[i] = 'a' + (i % 26);
+    checkCRC16();
+}
+
+static microBenchmark benchmarks[] = {
+    {"parse-inline", "createRequest + parseRequest + freeRequest of an "
+     "inline GET", benchParseInline},
+    {"parse-get", "same for a multibulk GET", benchParseGet},
+    {"parse-set-1k", "same for a SET with a 1KB value", benchParseSet},
+    {"parse-pipeline-16", "same for every query of a 16 GETs pipeline",
+     benchParsePipeline16},
+    {"parse-pipeline-128", "same for every query of a 128 GETs pipeline",
+     benchParsePipeline128},
+    {"parse-mset-128", "same for an MSET of 128 keys", benchParseMset},
+    {"request-create-free", "createRequest + freeRequest",
+     benchCreateRequest},
+    {"command-lookup", "getRedisCommand", benchCommandLookup},
+    {"key-slot", "clusterKeyHashSlot + searchNodeBySlot", benchKeySlot},
+    {"split-mget-16", "parse of an MGET of 16 keys split by "
+     "splitMultiSlotRequest", benchSplitMultiSlot},
+    {"merge-mget-16", "mergeReplies of the replies to the split MGET",
+     benchMergeReplies},
+    {"unordered-replies-16", "addReplyRaw of 16 replies in reverse order "
+     "(addUnorderedReply + appendUnorderedRepliesToBuffer)",
+     benchUnorderedReplies},
+    {"replies-16", "consumption of 16 pipelined replies read at once",
+     benchReplies16},
+    {"replies-16-legacy", "same, trimming the buffer after every reply",
+     benchReplies16Legacy},
+    {"replies-1024", "consumption of 1024 pipelined replies read at once",
+     benchReplies1024},
+    {"replies-1024-legacy", "same, trimming the buffer after every reply",
+     benchReplies1024Legacy},
+    {"scan-inline-1000", "scan of a pipeline of 1000 inline SETs",
+     benchScanInline},
+    {"scan-inline-1000-legacy", "same with the strchr based scanner",
+     benchScanInlineLegacy},
+    {"scan-multibulk-1000", "scan of a pipeline of 1000 multibulk queries",
+     benchScanMultibulk},
+    {"scan-multibulk-1000-legacy", "same with the strchr based scanner",
+     benchScanMultibulkLegacy},
+    {"scan-argv-100k", "scan of a query of 100000 arguments",
+     benchScanHugeArgv},
+    {"scan-argv-100k-legacy", "same with the strchr based scanner",
+     benchScanHugeArgvLegacy},
+    {"scan-args-64k", "scan of a query of 3 arguments of 64KB",
+     benchScanBigArgs},
+    {"scan-args-64k-legacy", "same with the strchr based scanner",
+     benchScanBigArgsLegacy},
+    {"crc16-4", "crc16 of a 4 bytes key", benchCRC16_4},
+    {"crc16-4-bytewise", "same with the byte-wise table",
+     benchCRC16_4Bytewise},
+    {"crc16-8", "crc16 of an 8 bytes key", benchCRC16_8},
+    {"crc16-8-bytewise", "same with the byte-wise table",
+     benchCRC16_8Bytewise},
+    {"crc16-16", "crc16 of a 16 bytes key", benchCRC16_16},
+    {"crc16-16-bytewise", "same with the byte-wise table",
+     benchCRC16_16Bytewise},
+    {"crc16-64", "crc16 of a 64 bytes key", benchCRC16_64},
+    {"crc16-64-bytewise", "same with the byte-wise table",
+     benchCRC16_64Bytewise},
+    {"crc16-4k", "crc16 of a 4000 bytes key", benchCRC16_4k},
+    {"crc16-4k-bytewise", "same with the byte-wise table",
+     benchCRC16_4kBytewise},
+    {NULL, NULL, NULL}
+};
+
+/* Run rounds of the benchmark until it ran for at least 'min_time'
+ * milliseconds. */
+static void runBenchmark(microBenchmark *b, long long min_time,
+                         microBenchResult *result)
+{
+    long long ops = 0;
+    /* Warm up caches and let lazily created structures get created. */
+    b->proc();
+    resetTimer();
+    startTimer();
+    while (timer.elapsed + (nstime() - timer.started) < min_time * 1000000LL)
+        ops += b->proc();
+    stopTimer();
+    snprintf(result->name, sizeof(result->name), "%s", b->name);
+    result->ns_per_op = (double) timer.elapsed / ops;
+    result->allocs_per_op = (double) timer.allocations / ops;
+}
+
+/* Load the results saved with --json. Return the number of loaded results
+ * or -1 if the file can't be read. */
+static int loadBaseline(const char *filename, microBenchResult *results) {
+    FILE *fp = fopen(filename, "r");
+    char line[1024];
+    int count = 0;
+    if (fp == NULL) return -1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (count == MICROBENCH_MAX_RESULTS) break;
+        microBenchResult *r = results + count;
+        char *name = strstr(line, "\"name\": \"");
+        char *ns = strstr(line, "\"ns_per_op\": ");
+        char *allocs = strstr(line, "\"allocs_per_op\": ");
+        if (name == NULL || ns == NULL || allocs == NULL) continue;
+        if (sscanf(name, "\"name\": \"%63[^\"]\"", r->name) != 1 ||
+            sscanf(ns, "\"ns_per_op\": %lf", &r->ns_per_op) != 1 ||
+            sscanf(allocs, "\"allocs_per_op\": %lf", &r->allocs_per_op) != 1)
+            continue;
+        count++;
+    }
+    fclose(fp);
+    return count;
+}
+
+/* Compare the results with the baseline and return the number of
+ * regressions, that are benchmarks slower than the baseline by more than
+ * 'threshold' percent, or performing more allocations per operation. */
+static int compareWithBaseline(FILE *out, microBenchResult *results,
+                               int count, microBenchResult *baseline,
+                               int baseline_count, double threshold)
+{
+    int i, j, regressions = 0;
+    fprintf(out, "\n%-28s %12s %12s %8s %12s %12s\n", "benchmark",
+            "base ns/op", "ns/op", "delta", "base allocs", "allocs/op");
+    for (i = 0; i < count; i++) {
+        microBenchResult *r = results + i, *base = NULL;
+        for (j = 0; j < baseline_count; j++) {
+            if (!strcmp(baseline[j].name, r->name)) {
+                base = baseline + j;
+                break;
+            }
+        }
+        if (base == NULL) {
+            fprintf(out, "%-28s %12s\n", r->name, "(new)");
+            continue;
+        }
+        double delta = ((r->ns_per_op - base->ns_per_op) * 100) /
+                       base->ns_per_op;
+        int slower = (delta > threshold);
+        int allocs = (r->allocs_per_op > base->allocs_per_op + 0.01);
+        fprintf(out, "%-28s %12.1f %12.1f %+7.1f%% %12.2f %12.2f%s\n",
+                r->name, base->ns_per_op, r->ns_per_op, delta,
+                base->allocs_per_op, r->allocs_per_op,
+                (slower || allocs ? "  REGRESSION" : ""));
+        if (slower || allocs) regressions++;
+    }
+    return regressions;
+}
+
+static void usage(void) {
+    microBenchmark *b;
+    fprintf(stderr,
+        "Usage: redis-cluster-proxy-microbench [OPTIONS] [BENCHMARK ...]\n\n"
+        "  --json             Output the results as JSON, that can be\n"
+        "                     saved and used as baseline.\n"
+        "  --baseline <file>  Compare the results with the ones saved in\n"
+        "                     <file> and exit with an error if any\n"
+        "                     benchmark regressed.\n"
+        "  --threshold <perc> Slowdown percentage considered a regression\n"
+        "                     (default: %d).\n"
+        "  --min-time <ms>    Minimum duration of every benchmark\n"
+        "                     (default: %d).\n"
+        "  -h, --help         Output this help and exit.\n\n"
+        "Without benchmark names, all the benchmarks are executed:\n\n",
+        MICROBENCH_DEFAULT_THRESHOLD, MICROBENCH_DEFAULT_MIN_TIME);
+    for (b = benchmarks; b->name != NULL; b++)
+        fprintf(stderr, "  %-28s %s\n", b->name, b->description);
+}
+
+int main(int argc, char **argv) {
+    microBenchResult results[MICROBENCH_MAX_RESULTS],
+                     baseline[MICROBENCH_MAX_RESULTS];
+    microBenchmark *selected[MICROBENCH_MAX_RESULTS], *b;
+    char *baseline_file = NULL;
+    double threshold = MICROBENCH_DEFAULT_THRESHOLD;
+    long long min_time = MICROBENCH_DEFAULT_MIN_TIME;
+    int json = 0, count = 0, i;
+    for (i = 1; i < argc; i++) {
+        int lastarg = (i == argc - 1);
+        if (!strcmp(argv[i], "--json")) json = 1;
+        else if (!strcmp(argv[i], "--baseline") && !lastarg)
+            baseline_file = argv[++i];
+        else if (!strcmp(argv[i], "--threshold") && !lastarg)
+            threshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--min-time") && !lastarg)
+            min_time = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            usage();
+            return 0;
+        } else {
+            for (b = benchmarks; b->name != NULL; b++)
+                if (!strcmp(argv[i], b->name)) break;
+            if (b->name == NULL) {
+                fprintf(stderr, "Unknown option or benchmark '%s'\n\n",
+                        argv[i]);
+                usage();
+                return 1;
+            }
+            if (count < MICROBENCH_MAX_RESULTS) selected[count++] = b;
+        }
+    }
+    if (count == 0) {
+        for (b = benchmarks; b->name != NULL; b++) {
+            if (count == MICROBENCH_MAX_RESULTS) break;
+            selected[count++] = b;
+        }
+    }
+    if (min_time <= 0) min_time = MICROBENCH_DEFAULT_MIN_TIME;
+    initConfig(&config);
+    config.loglevel = LOGLEVEL_ERROR;
+    config.cross_slot_enabled = 1;
+    initCommandTable();
+    initCluster();
+    initClient();
+    initQueries();
+    initReplies();
+    initScanQueries();
+    initCRC16();
+    if (json) printf("{\n  \"benchmarks\": [\n");
+    else printf("%-28s %12s %12s\n", "benchmark", "ns/op", "allocs/op");
+    for (i = 0; i < count; i++) {
+        microBenchResult *r = results + i;
+        runBenchmark(selected[i], min_time, r);
+        if (json) {
+            printf("    {\"name\": \"%s\", \"ns_per_op\": %.2f, "
+                   "\"allocs_per_op\": %.2f}%s\n", r->name, r->ns_per_op,
+                   r->allocs_per_op, (i < count - 1 ? "," : ""));
+        } else {
+            printf("%-28s %12.1f %12.2f\n", r->name, r->ns_per_op,
+                   r->allocs_per_op);
+        }
+        fflush(stdout);
+    }
+    if (json) printf("  ]\n}\n");
+    if (baseline_file == NULL) return 0;
+    int baseline_count = loadBaseline(baseline_file, baseline);
+    if (baseline_count < 0) {
+        fprintf(stderr, "Failed to read baseline '%s': %s\n", baseline_file,
+                strerror(errno));
+        return 1;
+    }
+    /* Keep the JSON output clean, so that it can still be saved. */
+    FILE *out = (json ? stderr : stdout);
+    int regressions = compareWithBaseline(out, results, count, baseline,
+                                          baseline_count, threshold);
+    if (regressions > 0) {
+        fprintf(out, "\n%d regression(s) over the baseline.\n", regressions);
+        return 1;
+    }
+    return 0;
+}
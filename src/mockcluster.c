@@ -0,0 +1,1043 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Mock Redis Cluster.
+ *
+ * A single process, single threaded fake Redis Cluster, that listens on
+ * one localhost port for every node. It speaks just enough RESP in order to
+ * let the proxy fetch the cluster's configuration and to serve simple string
+ * commands (GET, SET, MGET, ...) from a keyspace shared by all the nodes.
+ * Since it doesn't need any external Redis binary and it always behaves the
+ * same way for a given seed, it can be used to benchmark the proxy and to
+ * reproduce its behavior in presence of MOVED/ASK redirections, slow nodes
+ * and dropped connections, that can be injected with the --moved-rate,
+ * --ask-rate, --latency and --disconnect-rate options or at runtime by
+ * using the MOCK command. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include "ae.h"
+#include "anet.h"
+#include "adlist.h"
+#include "rax.h"
+#include "sds.h"
+#include "zmalloc.h"
+#include "util.h"
+#include "resp.h"
+#include "crc16.h"
+
+#define MOCK_DEFAULT_BIND           "127.0.0.1"
+#define MOCK_DEFAULT_PORT           7000
+#define MOCK_DEFAULT_MASTERS        3
+#define MOCK_DEFAULT_MAX_CLIENTS    10000
+#define MOCK_CLUSTER_SLOTS          16384
+#define MOCK_NODE_NAME_LEN          40
+#define MOCK_IOBUF_LEN              (1024*16)
+#define MOCK_MAX_INLINE_LEN         (1024*64)
+#define MOCK_TCP_BACKLOG            511
+#define MOCK_IP_STR_LEN             46 /* INET6_ADDRSTRLEN */
+
+typedef struct mockNode {
+    int index;
+    char name[MOCK_NODE_NAME_LEN + 1];
+    int port;
+    int fd;
+    struct mockNode *master; /* NULL for masters. */
+} mockNode;
+
+typedef struct mockClient {
+    mockNode *node;
+    int fd;
+    sds querybuf;
+    sds obuf;
+    list *delayed_replies;   /* Replies waiting for --latency to elapse. */
+    long long delay_timer_id;
+    int asking;
+    int readonly;
+    int close_after_reply;
+} mockClient;
+
+typedef struct mockDelayedReply {
+    long long when;
+    sds reply;
+} mockDelayedReply;
+
+typedef void mockCommandProc(mockClient *c, int argc, sds *argv);
+
+typedef struct mockCommand {
+    const char *name;
+    int arity;      /* Negative arity means "at least -arity" arguments. */
+    int first_key;  /* 0 if the command has no keys. */
+    int last_key;   /* -1 means the last argument. */
+    int key_step;
+    int readonly;
+    mockCommandProc *proc;
+} mockCommand;
+
+static struct {
+    aeEventLoop *el;
+    char *bind;
+    int port;
+    int masters;
+    int replicas;
+    int max_clients;
+    int latency;
+    double moved_rate;
+    double ask_rate;
+    double disconnect_rate;
+    uint64_t seed;
+    uint64_t rand_state;
+    mockNode *nodes;
+    int numnodes;
+    mockNode *slots[MOCK_CLUSTER_SLOTS];
+    rax *keys;
+    int connected_clients;
+    long long stat_commands;
+    long long stat_moved;
+    long long stat_ask;
+    long long stat_disconnects;
+} mock;
+
+static void freeClient(mockClient *c);
+static int writeToClient(mockClient *c);
+
+/* Small deterministic PRNG (xorshift64*), so that the same seed always
+ * injects the same sequence of errors. */
+static double mockRandom(void) {
+    uint64_t x = mock.rand_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    mock.rand_state = x;
+    return (double) ((x * 0x2545F4914F6CDD1DULL) >> 11) /
+           (double) (1ULL << 53);
+}
+
+static void freeKeyValue(void *val) {
+    sdsfree(val);
+}
+
+/* -----------------------------------------------------------------------------
+ * Replies
+ * -------------------------------------------------------------------------- */
+
+static void addReplyLen(mockClient *c, const char *s, size_t len) {
+    c->obuf = sdscatlen(c->obuf, s, len);
+}
+
+static void addReplyStatus(mockClient *c, const char *status) {
+    c->obuf = sdscatfmt(c->obuf, "+%s\r\n", status);
+}
+
+static void addReplyError(mockClient *c, const char *err) {
+    c->obuf = sdscatfmt(c->obuf, "-%s\r\n", err);
+}
+
+static void addReplyLongLong(mockClient *c, long long ll) {
+    c->obuf = sdscatfmt(c->obuf, ":%I\r\n", ll);
+}
+
+static void addReplyArrayLen(mockClient *c, long len) {
+    c->obuf = sdscatfmt(c->obuf, "*%I\r\n", (long long) len);
+}
+
+static void addReplyBulk(mockClient *c, const char *s, size_t len) {
+    c->obuf = sdscatfmt(c->obuf, "$%U\r\n", (unsigned long long) len);
+    c->obuf = sdscatlen(c->obuf, s, len);
+    c->obuf = sdscatlen(c->obuf, "\r\n", 2);
+}
+
+static void addReplyBulkSds(mockClient *c, sds s) {
+    addReplyBulk(c, s, sdslen(s));
+}
+
+static void addReplyNull(mockClient *c) {
+    addReplyLen(c, "$-1\r\n", 5);
+}
+
+static void addReplyRedirect(mockClient *c, const char *type, int slot,
+                             mockNode *node)
+{
+    c->obuf = sdscatfmt(c->obuf, "-%s %i %s:%i\r\n", type, slot, mock.bind,
+                        node->port);
+}
+
+/* -----------------------------------------------------------------------------
+ * Cluster topology
+ * -------------------------------------------------------------------------- */
+
+static mockNode *getMaster(mockNode *node) {
+    return (node->master ? node->master : node);
+}
+
+static void initNodes(void) {
+    int i, slot;
+    mock.numnodes = mock.masters * (1 + mock.replicas);
+    mock.nodes = zcalloc(sizeof(mockNode) * mock.numnodes);
+    for (i = 0; i < mock.numnodes; i++) {
+        mockNode *node = &mock.nodes[i];
+        node->index = i;
+        node->port = mock.port + i;
+        node->fd = -1;
+        snprintf(node->name, sizeof(node->name), "%040x", i + 1);
+        if (i >= mock.masters)
+            node->master = &mock.nodes[(i - mock.masters) % mock.masters];
+    }
+    for (slot = 0; slot < MOCK_CLUSTER_SLOTS; slot++) {
+        int owner = (int) (((long long) slot * mock.masters) /
+                           MOCK_CLUSTER_SLOTS);
+        mock.slots[slot] = &mock.nodes[owner];
+    }
+}
+
+/* Append the slots served by 'master' to 's' in the CLUSTER NODES format
+ * ("0-5460 5462 ..."). */
+static sds catNodeSlots(sds s, mockNode *master) {
+    int slot = 0;
+    while (slot < MOCK_CLUSTER_SLOTS) {
+        if (mock.slots[slot] != master) {
+            slot++;
+            continue;
+        }
+        int start = slot;
+        while (slot < MOCK_CLUSTER_SLOTS && mock.slots[slot] == master)
+            slot++;
+        if (start == slot - 1) s = sdscatfmt(s, " %i", start);
+        else s = sdscatfmt(s, " %i-%i", start, slot - 1);
+    }
+    return s;
+}
+
+static sds getClusterNodes(mockNode *myself) {
+    sds s = sdsempty();
+    int i;
+    for (i = 0; i < mock.numnodes; i++) {
+        mockNode *node = &mock.nodes[i];
+        s = sdscatfmt(s, "%s %s:%i@%i %s%s %s 0 0 %i connected",
+                      node->name, mock.bind, node->port, node->port + 10000,
+                      (node == myself ? "myself," : ""),
+                      (node->master ? "slave" : "master"),
+                      (node->master ? node->master->name : "-"),
+                      getMaster(node)->index + 1);
+        if (node->master == NULL) s = catNodeSlots(s, node);
+        s = sdscat(s, "\n");
+    }
+    return s;
+}
+
+static void addReplyNodeInfo(mockClient *c, mockNode *node) {
+    addReplyArrayLen(c, 3);
+    addReplyBulk(c, mock.bind, strlen(mock.bind));
+    addReplyLongLong(c, node->port);
+    addReplyBulk(c, node->name, strlen(node->name));
+}
+
+static void addReplyClusterSlots(mockClient *c) {
+    int slot = 0, ranges = 0, i;
+    sds reply;
+    sds obuf = c->obuf;
+    c->obuf = sdsempty();
+    while (slot < MOCK_CLUSTER_SLOTS) {
+        mockNode *master = mock.slots[slot];
+        int start = slot;
+        while (slot < MOCK_CLUSTER_SLOTS && mock.slots[slot] == master)
+            slot++;
+        addReplyArrayLen(c, 3 + mock.replicas);
+        addReplyLongLong(c, start);
+        addReplyLongLong(c, slot - 1);
+        addReplyNodeInfo(c, master);
+        for (i = 0; i < mock.numnodes; i++) {
+            if (mock.nodes[i].master == master)
+                addReplyNodeInfo(c, &mock.nodes[i]);
+        }
+        ranges++;
+    }
+    reply = c->obuf;
+    c->obuf = obuf;
+    addReplyArrayLen(c, ranges);
+    addReplyLen(c, reply, sdslen(reply));
+    sdsfree(reply);
+}
+
+/* -----------------------------------------------------------------------------
+ * Commands
+ * -------------------------------------------------------------------------- */
+
+static void pingCommand(mockClient *c, int argc, sds *argv) {
+    if (argc > 1) addReplyBulkSds(c, argv[1]);
+    else addReplyStatus(c, "PONG");
+}
+
+static void echoCommand(mockClient *c, int argc, sds *argv) {
+    (void) argc;
+    addReplyBulkSds(c, argv[1]);
+}
+
+static void okCommand(mockClient *c, int argc, sds *argv) {
+    (void) argc;
+    (void) argv;
+    addReplyStatus(c, "OK");
+}
+
+static void quitCommand(mockClient *c, int argc, sds *argv) {
+    okCommand(c, argc, argv);
+    c->close_after_reply = 1;
+}
+
+static void askingCommand(mockClient *c, int argc, sds *argv) {
+    okCommand(c, argc, argv);
+    c->asking = 1;
+}
+
+static void readonlyCommand(mockClient *c, int argc, sds *argv) {
+    okCommand(c, argc, argv);
+    c->readonly = 1;
+}
+
+static void readwriteCommand(mockClient *c, int argc, sds *argv) {
+    okCommand(c, argc, argv);
+    c->readonly = 0;
+}
+
+static void commandCommand(mockClient *c, int argc, sds *argv) {
+    (void) argc;
+    (void) argv;
+    addReplyArrayLen(c, 0);
+}
+
+static void dbsizeCommand(mockClient *c, int argc, sds *argv) {
+    (void) argc;
+    (void) argv;
+    addReplyLongLong(c, raxSize(mock.keys));
+}
+
+static void flushallCommand(mockClient *c, int argc, sds *argv) {
+    raxFreeWithCallback(mock.keys, freeKeyValue);
+    mock.keys = raxNew();
+    okCommand(c, argc, argv);
+}
+
+static sds lookupKey(sds key) {
+    void *val = raxFind(mock.keys, (unsigned char *) key, sdslen(key));
+    return (val == raxNotFound ? NULL : val);
+}
+
+static void setKey(sds key, sds val) {
+    void *old = NULL;
+    if (!raxInsert(mock.keys, (unsigned char *) key, sdslen(key),
+                   sdsdup(val), &old))
+        sdsfree(old);
+}
+
+static void getCommand(mockClient *c, int argc, sds *argv) {
+    (void) argc;
+    sds val = lookupKey(argv[1]);
+    if (val == NULL) addReplyNull(c);
+    else addReplyBulkSds(c, val);
+}
+
+static void setCommand(mockClient *c, int argc, sds *argv) {
+    (void) argc;
+    setKey(argv[1], argv[2]);
+    addReplyStatus(c, "OK");
+}
+
+static void mgetCommand(mockClient *c, int argc, sds *argv) {
+    int i;
+    addReplyArrayLen(c, argc - 1);
+    for (i = 1; i < argc; i++) getCommand(c, 2, argv + i - 1);
+}
+
+static void msetCommand(mockClient *c, int argc, sds *argv) {
+    int i;
+    if ((argc % 2) == 0) {
+        addReplyError(c, "ERR wrong number of arguments for MSET");
+        return;
+    }
+    for (i = 1; i < argc; i += 2) setKey(argv[i], argv[i + 1]);
+    addReplyStatus(c, "OK");
+}
+
+static void delCommand(mockClient *c, int argc, sds *argv) {
+    int i, deleted = 0;
+    for (i = 1; i < argc; i++) {
+        void *old = NULL;
+        if (raxRemove(mock.keys, (unsigned char *) argv[i], sdslen(argv[i]),
+                      &old))
+        {
+            sdsfree(old);
+            deleted++;
+        }
+    }
+    addReplyLongLong(c, deleted);
+}
+
+static void existsCommand(mockClient *c, int argc, sds *argv) {
+    int i, count = 0;
+    for (i = 1; i < argc; i++) count += (lookupKey(argv[i]) != NULL);
+    addReplyLongLong(c, count);
+}
+
+static void incrCommand(mockClient *c, int argc, sds *argv) {
+    (void) argc;
+    long long value = 0;
+    sds val = lookupKey(argv[1]);
+    if (val != NULL &&
+        !respStringToLongLong(val, sdslen(val), &value))
+    {
+        addReplyError(c, "ERR value is not an integer or out of range");
+        return;
+    }
+    value++;
+    sds newval = sdsfromlonglong(value);
+    setKey(argv[1], newval);
+    sdsfree(newval);
+    addReplyLongLong(c, value);
+}
+
+static void clusterCommand(mockClient *c, int argc, sds *argv) {
+    if (!strcasecmp(argv[1], "nodes") && argc == 2) {
+        sds nodes = getClusterNodes(c->node);
+        addReplyBulkSds(c, nodes);
+        sdsfree(nodes);
+    } else if (!strcasecmp(argv[1], "slots") && argc == 2) {
+        addReplyClusterSlots(c);
+    } else if (!strcasecmp(argv[1], "info") && argc == 2) {
+        sds info = sdscatfmt(sdsempty(),
+            "cluster_state:ok\r\n"
+            "cluster_slots_assigned:%i\r\n"
+            "cluster_slots_ok:%i\r\n"
+            "cluster_known_nodes:%i\r\n"
+            "cluster_size:%i\r\n"
+            "cluster_current_epoch:%i\r\n"
+            "cluster_my_epoch:%i\r\n",
+            MOCK_CLUSTER_SLOTS, MOCK_CLUSTER_SLOTS, mock.numnodes,
+            mock.masters, mock.masters, getMaster(c->node)->index + 1);
+        addReplyBulkSds(c, info);
+        sdsfree(info);
+    } else if (!strcasecmp(argv[1], "myid") && argc == 2) {
+        addReplyBulk(c, c->node->name, strlen(c->node->name));
+    } else if (!strcasecmp(argv[1], "keyslot") && argc == 3) {
+        addReplyLongLong(c, clusterKeyHashSlot(argv[2], sdslen(argv[2])));
+    } else {
+        addReplyError(c, "ERR Unknown subcommand or wrong number of "
+                         "arguments for CLUSTER");
+    }
+}
+
+static int parseRate(sds arg, double *rate) {
+    char *eptr = NULL;
+    double value = strtod(arg, &eptr);
+    if (sdslen(arg) == 0 || *eptr != '\0' || value < 0 || value > 1)
+        return 0;
+    *rate = value;
+    return 1;
+}
+
+static int getConfigParam(const char *name, sds *value) {
+    if (!strcasecmp(name, "latency"))
+        *value = sdsfromlonglong(mock.latency);
+    else if (!strcasecmp(name, "moved-rate"))
+        *value = sdscatprintf(sdsempty(), "%g", mock.moved_rate);
+    else if (!strcasecmp(name, "ask-rate"))
+        *value = sdscatprintf(sdsempty(), "%g", mock.ask_rate);
+    else if (!strcasecmp(name, "disconnect-rate"))
+        *value = sdscatprintf(sdsempty(), "%g", mock.disconnect_rate);
+    else return 0;
+    return 1;
+}
+
+static int setConfigParam(const char *name, sds value) {
+    long long ll;
+    if (!strcasecmp(name, "latency")) {
+        if (!respStringToLongLong(value, sdslen(value), &ll) || ll < 0 ||
+            ll > INT_MAX) return 0;
+        mock.latency = (int) ll;
+    } else if (!strcasecmp(name, "moved-rate")) {
+        return parseRate(value, &mock.moved_rate);
+    } else if (!strcasecmp(name, "ask-rate")) {
+        return parseRate(value, &mock.ask_rate);
+    } else if (!strcasecmp(name, "disconnect-rate")) {
+        return parseRate(value, &mock.disconnect_rate);
+    } else return 0;
+    return 1;
+}
+
+/* MOCK CONFIG GET <param>
+ * MOCK CONFIG SET <param> <value>
+ * MOCK SETSLOT <slot>|<start>-<end> <master-index>
+ * MOCK STATS
+ * MOCK RESETSTATS */
+static void mockSubCommand(mockClient *c, int argc, sds *argv) {
+    if (!strcasecmp(argv[1], "config") && argc == 4 &&
+        !strcasecmp(argv[2], "get"))
+    {
+        sds value = NULL;
+        if (!getConfigParam(argv[3], &value)) {
+            addReplyError(c, "ERR Unknown config parameter");
+            return;
+        }
+        addReplyBulkSds(c, value);
+        sdsfree(value);
+    } else if (!strcasecmp(argv[1], "config") && argc == 5 &&
+               !strcasecmp(argv[2], "set"))
+    {
+        if (!setConfigParam(argv[3], argv[4])) {
+            addReplyError(c, "ERR Invalid config parameter or value");
+            return;
+        }
+        addReplyStatus(c, "OK");
+    } else if (!strcasecmp(argv[1], "setslot") && argc == 4) {
+        long long start, end, index;
+        char *sep = strchr(argv[2], '-');
+        int ok;
+        if (sep != NULL) {
+            ok = respStringToLongLong(argv[2], sep - argv[2], &start) &&
+                 respStringToLongLong(sep + 1, strlen(sep + 1), &end);
+        } else {
+            ok = respStringToLongLong(argv[2], sdslen(argv[2]), &start);
+            end = start;
+        }
+        if (!ok || start < 0 || end < start || end >= MOCK_CLUSTER_SLOTS) {
+            addReplyError(c, "ERR Invalid slot");
+            return;
+        }
+        if (!respStringToLongLong(argv[3], sdslen(argv[3]), &index) ||
+            index < 0 || index >= mock.masters)
+        {
+            addReplyError(c, "ERR Invalid master index");
+            return;
+        }
+        for (; start <= end; start++)
+            mock.slots[start] = &mock.nodes[index];
+        addReplyStatus(c, "OK");
+    } else if (!strcasecmp(argv[1], "stats") && argc == 2) {
+        sds stats = sdscatfmt(sdsempty(),
+            "connected_clients:%i\r\n"
+            "keys:%U\r\n"
+            "total_commands_processed:%I\r\n"
+            "moved_injected:%I\r\n"
+            "ask_injected:%I\r\n"
+            "disconnects_injected:%I\r\n",
+            mock.connected_clients, raxSize(mock.keys), mock.stat_commands,
+            mock.stat_moved, mock.stat_ask, mock.stat_disconnects);
+        addReplyBulkSds(c, stats);
+        sdsfree(stats);
+    } else if (!strcasecmp(argv[1], "resetstats") && argc == 2) {
+        mock.stat_commands = 0;
+        mock.stat_moved = 0;
+        mock.stat_ask = 0;
+        mock.stat_disconnects = 0;
+        addReplyStatus(c, "OK");
+    } else {
+        addReplyError(c, "ERR Unknown subcommand or wrong number of "
+                         "arguments for MOCK");
+    }
+}
+
+static mockCommand mockCommandTable[] = {
+    {"ping", -1, 0, 0, 0, 1, pingCommand},
+    {"echo", 2, 0, 0, 0, 1, echoCommand},
+    {"auth", -2, 0, 0, 0, 1, okCommand},
+    {"select", 2, 0, 0, 0, 1, okCommand},
+    {"quit", 1, 0, 0, 0, 1, quitCommand},
+    {"asking", 1, 0, 0, 0, 1, askingCommand},
+    {"readonly", 1, 0, 0, 0, 1, readonlyCommand},
+    {"readwrite", 1, 0, 0, 0, 1, readwriteCommand},
+    {"command", -1, 0, 0, 0, 1, commandCommand},
+    {"dbsize", 1, 0, 0, 0, 1, dbsizeCommand},
+    {"flushall", -1, 0, 0, 0, 0, flushallCommand},
+    {"flushdb", -1, 0, 0, 0, 0, flushallCommand},
+    {"cluster", -2, 0, 0, 0, 1, clusterCommand},
+    {"mock", -2, 0, 0, 0, 1, mockSubCommand},
+    {"get", 2, 1, 1, 1, 1, getCommand},
+    {"set", -3, 1, 1, 1, 0, setCommand},
+    {"mget", -2, 1, -1, 1, 1, mgetCommand},
+    {"mset", -3, 1, -1, 2, 0, msetCommand},
+    {"del", -2, 1, -1, 1, 0, delCommand},
+    {"exists", -2, 1, -1, 1, 1, existsCommand},
+    {"incr", 2, 1, 1, 1, 0, incrCommand},
+    {NULL, 0, 0, 0, 0, 0, NULL}
+};
+
+static mockCommand *lookupCommand(sds name) {
+    mockCommand *cmd;
+    for (cmd = mockCommandTable; cmd->name != NULL; cmd++)
+        if (!strcasecmp(cmd->name, name)) return cmd;
+    return NULL;
+}
+
+/* Returns the slot of the keys of the command, -1 if the command has no
+ * keys or -2 if keys belong to different slots. */
+static int getCommandSlot(mockCommand *cmd, int argc, sds *argv) {
+    int slot = -1, i, last;
+    if (cmd->first_key == 0) return -1;
+    last = (cmd->last_key < 0 ? argc + cmd->last_key : cmd->last_key);
+    for (i = cmd->first_key; i <= last; i += cmd->key_step) {
+        int keyslot = clusterKeyHashSlot(argv[i], sdslen(argv[i]));
+        if (slot >= 0 && keyslot != slot) return -2;
+        slot = keyslot;
+    }
+    return slot;
+}
+
+static mockNode *getRandomMaster(mockNode *exclude) {
+    int index = (int) (mockRandom() * mock.masters);
+    if (index >= mock.masters) index = mock.masters - 1;
+    if (&mock.nodes[index] == exclude && mock.masters > 1)
+        index = (index + 1) % mock.masters;
+    return &mock.nodes[index];
+}
+
+/* Execute the command. Returns 0 if the client has been disconnected. */
+static int processCommand(mockClient *c, int argc, sds *argv) {
+    mockCommand *cmd = lookupCommand(argv[0]);
+    int asking = c->asking;
+    mock.stat_commands++;
+    c->asking = 0;
+    if (cmd == NULL) {
+        sds err = sdscatfmt(sdsempty(), "ERR unknown command `%S`", argv[0]);
+        addReplyError(c, err);
+        sdsfree(err);
+        return 1;
+    }
+    if ((cmd->arity > 0 && argc != cmd->arity) || argc < -cmd->arity) {
+        sds err = sdscatfmt(sdsempty(), "ERR wrong number of arguments for "
+                            "'%s' command", cmd->name);
+        addReplyError(c, err);
+        sdsfree(err);
+        return 1;
+    }
+    int slot = getCommandSlot(cmd, argc, argv);
+    if (slot == -2) {
+        addReplyError(c, "CROSSSLOT Keys in request don't hash to the same "
+                         "slot");
+        return 1;
+    }
+    if (slot >= 0) {
+        mockNode *owner = mock.slots[slot];
+        if (!asking) {
+            double r = mockRandom();
+            if (r < mock.disconnect_rate) {
+                mock.stat_disconnects++;
+                freeClient(c);
+                return 0;
+            }
+            r -= mock.disconnect_rate;
+            if (r < mock.moved_rate) {
+                mock.stat_moved++;
+                addReplyRedirect(c, "MOVED", slot, owner);
+                return 1;
+            }
+            r -= mock.moved_rate;
+            if (r < mock.ask_rate) {
+                mock.stat_ask++;
+                addReplyRedirect(c, "ASK", slot, getRandomMaster(owner));
+                return 1;
+            }
+        }
+        int can_serve = (c->node == owner || asking ||
+                         (c->node->master == owner && c->readonly &&
+                          cmd->readonly));
+        if (!can_serve) {
+            addReplyRedirect(c, "MOVED", slot, owner);
+            return 1;
+        }
+    }
+    cmd->proc(c, argc, argv);
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+ * Networking
+ * -------------------------------------------------------------------------- */
+
+static mockClient *createClient(mockNode *node, int fd) {
+    mockClient *c = zmalloc(sizeof(*c));
+    c->node = node;
+    c->fd = fd;
+    c->querybuf = sdsempty();
+    c->obuf = sdsempty();
+    c->delayed_replies = listCreate();
+    c->delay_timer_id = -1;
+    c->asking = 0;
+    c->readonly = 0;
+    c->close_after_reply = 0;
+    mock.connected_clients++;
+    return c;
+}
+
+static void freeClient(mockClient *c) {
+    listIter li;
+    listNode *ln;
+    aeDeleteFileEvent(mock.el, c->fd, AE_READABLE | AE_WRITABLE);
+    close(c->fd);
+    if (c->delay_timer_id != -1) aeDeleteTimeEvent(mock.el, c->delay_timer_id);
+    listRewind(c->delayed_replies, &li);
+    while ((ln = listNext(&li))) {
+        mockDelayedReply *dr = ln->value;
+        sdsfree(dr->reply);
+        zfree(dr);
+    }
+    listRelease(c->delayed_replies);
+    sdsfree(c->querybuf);
+    sdsfree(c->obuf);
+    zfree(c);
+    mock.connected_clients--;
+}
+
+static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    (void) el;
+    (void) fd;
+    (void) mask;
+    writeToClient(privdata);
+}
+
+/* Write as much of the output buffer as possible, installing the write
+ * handler if the socket can't accept the whole buffer.
+ * Returns 0 if the client has been freed. */
+static int writeToClient(mockClient *c) {
+    while (sdslen(c->obuf) > 0) {
+        ssize_t nwritten = write(c->fd, c->obuf, sdslen(c->obuf));
+        if (nwritten <= 0) {
+            if (nwritten == -1 && errno == EAGAIN) break;
+            freeClient(c);
+            return 0;
+        }
+        sdsrange(c->obuf, nwritten, -1);
+    }
+    int installed = aeGetFileEvents(mock.el, c->fd) & AE_WRITABLE;
+    if (sdslen(c->obuf) == 0) {
+        if (installed) aeDeleteFileEvent(mock.el, c->fd, AE_WRITABLE);
+        if (c->close_after_reply && listLength(c->delayed_replies) == 0) {
+            freeClient(c);
+            return 0;
+        }
+    } else if (!installed) {
+        if (aeCreateFileEvent(mock.el, c->fd, AE_WRITABLE, writeHandler, c)
+            == AE_ERR)
+        {
+            freeClient(c);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int delayedRepliesTimer(aeEventLoop *el, long long id, void *privdata)
+{
+    mockClient *c = privdata;
+    long long now = mstime();
+    listNode *ln;
+    (void) el;
+    (void) id;
+    while ((ln = listFirst(c->delayed_replies)) != NULL) {
+        mockDelayedReply *dr = ln->value;
+        if (dr->when > now) break;
+        c->obuf = sdscatsds(c->obuf, dr->reply);
+        sdsfree(dr->reply);
+        zfree(dr);
+        listDelNode(c->delayed_replies, ln);
+    }
+    if (ln != NULL) {
+        mockDelayedReply *dr = ln->value;
+        return (int) (dr->when - now);
+    }
+    /* The timer is going to be deleted by the event loop: forget its ID
+     * before writing, since writing could free the client. */
+    c->delay_timer_id = -1;
+    writeToClient(c);
+    return AE_NOMORE;
+}
+
+/* Send the replies accumulated while processing the last read, after
+ * --latency milliseconds if a latency has been configured. */
+static void flushReplies(mockClient *c) {
+    if (sdslen(c->obuf) == 0 && !c->close_after_reply) return;
+    if (mock.latency <= 0 && listLength(c->delayed_replies) == 0) {
+        writeToClient(c);
+        return;
+    }
+    mockDelayedReply *dr = zmalloc(sizeof(*dr));
+    dr->when = mstime() + mock.latency;
+    dr->reply = c->obuf;
+    c->obuf = sdsempty();
+    listAddNodeTail(c->delayed_replies, dr);
+    if (c->delay_timer_id == -1) {
+        c->delay_timer_id = aeCreateTimeEvent(mock.el, mock.latency,
+                                              delayedRepliesTimer, c, NULL);
+    }
+}
+
+/* Parse and execute all the complete commands contained in the query
+ * buffer. Returns 0 if the client has been freed. */
+static int processInputBuffer(mockClient *c) {
+    size_t pos = 0, len = sdslen(c->querybuf);
+    int *offsets = NULL, *lengths = NULL, argc = 0, i, ok = 1;
+    while (pos < len && !c->close_after_reply) {
+        const char *p = c->querybuf + pos;
+        long long qlen;
+        sds *argv;
+        if (*p == '*') {
+            qlen = respScanMultibulk(p, len - pos, LLONG_MAX, &argc,
+                                     NULL, NULL);
+            if (qlen == 0) break;
+            if (qlen < 0) {
+                addReplyError(c, "ERR Protocol error: invalid multibulk");
+                c->close_after_reply = 1;
+                break;
+            }
+            offsets = zrealloc(offsets, sizeof(int) * argc);
+            lengths = zrealloc(lengths, sizeof(int) * argc);
+            respScanMultibulk(p, qlen, LLONG_MAX, &argc, offsets, lengths);
+            argv = zmalloc(sizeof(sds) * argc);
+            for (i = 0; i < argc; i++)
+                argv[i] = sdsnewlen(p + offsets[i], lengths[i]);
+        } else {
+            const char *nl = memchr(p, '\n', len - pos);
+            if (nl == NULL) {
+                if ((len - pos) > MOCK_MAX_INLINE_LEN) {
+                    addReplyError(c, "ERR Protocol error: too big inline "
+                                     "request");
+                    c->close_after_reply = 1;
+                }
+                break;
+            }
+            qlen = (nl - p) + 1;
+            size_t linelen = nl - p;
+            if (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+            sds line = sdsnewlen(p, linelen);
+            argv = sdssplitargs(line, &argc);
+            sdsfree(line);
+            if (argv == NULL) {
+                addReplyError(c, "ERR Protocol error: unbalanced quotes in "
+                                 "request");
+                c->close_after_reply = 1;
+                break;
+            }
+        }
+        pos += qlen;
+        if (argc > 0) ok = processCommand(c, argc, argv);
+        for (i = 0; i < argc; i++) sdsfree(argv[i]);
+        zfree(argv);
+        if (!ok) break;
+    }
+    zfree(offsets);
+    zfree(lengths);
+    if (!ok) return 0;
+    sdsrange(c->querybuf, pos, -1);
+    return 1;
+}
+
+static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    mockClient *c = privdata;
+    (void) el;
+    (void) mask;
+    size_t qlen = sdslen(c->querybuf);
+    c->querybuf = sdsMakeRoomFor(c->querybuf, MOCK_IOBUF_LEN);
+    ssize_t nread = read(fd, c->querybuf + qlen, MOCK_IOBUF_LEN);
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        freeClient(c);
+        return;
+    }
+    sdsIncrLen(c->querybuf, nread);
+    if (!processInputBuffer(c)) return;
+    flushReplies(c);
+}
+
+static void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    mockNode *node = privdata;
+    char ip[MOCK_IP_STR_LEN], err[ANET_ERR_LEN];
+    int port, cfd;
+    (void) mask;
+    cfd = anetTcpAccept(err, fd, ip, sizeof(ip), &port);
+    if (cfd == ANET_ERR) {
+        if (errno != EWOULDBLOCK)
+            fprintf(stderr, "Accepting client connection: %s\n", err);
+        return;
+    }
+    if (mock.connected_clients >= mock.max_clients) {
+        close(cfd);
+        return;
+    }
+    anetNonBlock(NULL, cfd);
+    anetEnableTcpNoDelay(NULL, cfd);
+    mockClient *c = createClient(node, cfd);
+    if (aeCreateFileEvent(el, cfd, AE_READABLE, readHandler, c) == AE_ERR)
+        freeClient(c);
+}
+
+static int listenNodes(void) {
+    char err[ANET_ERR_LEN];
+    int i;
+    for (i = 0; i < mock.numnodes; i++) {
+        mockNode *node = &mock.nodes[i];
+        node->fd = anetTcpServer(err, node->port, mock.bind, MOCK_TCP_BACKLOG);
+        if (node->fd == ANET_ERR) {
+            fprintf(stderr, "Could not listen on %s:%d: %s\n", mock.bind,
+                    node->port, err);
+            return 0;
+        }
+        anetNonBlock(NULL, node->fd);
+        if (aeCreateFileEvent(mock.el, node->fd, AE_READABLE, acceptHandler,
+                              node) == AE_ERR)
+        {
+            fprintf(stderr, "Could not create accept handler\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+ * Main
+ * -------------------------------------------------------------------------- */
+
+static void usage(void) {
+    fprintf(stderr,
+"Usage: redis-cluster-proxy-mock [OPTIONS]\n\n"
+"  --bind <address>         Address nodes listen on (default: %s)\n"
+"  --port <port>            Port of the first node, the other nodes use\n"
+"                           the following ones (default: %d)\n"
+"  --masters <n>            Number of master nodes (default: %d)\n"
+"  --replicas <n>           Number of replicas per master (default: 0)\n"
+"  --maxclients <n>         Max number of client connections\n"
+"                           (default: %d)\n"
+"  --latency <ms>           Delay every reply by <ms> milliseconds\n"
+"  --moved-rate <0..1>      Ratio of keyed commands answered with a\n"
+"                           MOVED redirection\n"
+"  --ask-rate <0..1>        Ratio of keyed commands answered with an\n"
+"                           ASK redirection to another master\n"
+"  --disconnect-rate <0..1> Ratio of keyed commands that make the node\n"
+"                           close the connection\n"
+"  --seed <n>               Seed used for errors injection (default: 1)\n"
+"  -h, --help               Print this help\n\n"
+"Nodes share the same keyspace and support PING, ECHO, AUTH, SELECT,\n"
+"QUIT, ASKING, READONLY, READWRITE, COMMAND, DBSIZE, FLUSHALL, CLUSTER\n"
+"(NODES, SLOTS, INFO, MYID, KEYSLOT), GET, SET, MGET, MSET, DEL, EXISTS\n"
+"and INCR. Injected errors can be changed at runtime with\n"
+"MOCK CONFIG SET <param> <value>, slots can be moved to another master\n"
+"with MOCK SETSLOT <slot>|<start>-<end> <master-index>, and counters are\n"
+"available through MOCK STATS.\n",
+    MOCK_DEFAULT_BIND, MOCK_DEFAULT_PORT, MOCK_DEFAULT_MASTERS,
+    MOCK_DEFAULT_MAX_CLIENTS);
+}
+
+static int parseIntOption(const char *arg, const char *value, int min,
+                          int max, int *result)
+{
+    long long ll;
+    if (!respStringToLongLong(value, strlen(value), &ll) || ll < min ||
+        ll > max)
+    {
+        fprintf(stderr, "Invalid value for %s: %s\n", arg, value);
+        return 0;
+    }
+    *result = (int) ll;
+    return 1;
+}
+
+static int parseRateOption(const char *arg, const char *value,
+                           double *result)
+{
+    sds s = sdsnew(value);
+    int ok = parseRate(s, result);
+    sdsfree(s);
+    if (!ok) fprintf(stderr, "Invalid value for %s: %s\n", arg, value);
+    return ok;
+}
+
+static int parseOptions(int argc, char **argv) {
+    int i, seed = 1;
+    for (i = 1; i < argc; i++) {
+        int lastarg = (i == (argc - 1)), ok = 1;
+        const char *arg = argv[i];
+        if (!strcmp("-h", arg) || !strcmp("--help", arg)) {
+            usage();
+            exit(0);
+        } else if (!strcmp("--bind", arg) && !lastarg)
+            mock.bind = argv[++i];
+        else if (!strcmp("--port", arg) && !lastarg)
+            ok = parseIntOption(arg, argv[++i], 1, 65535, &mock.port);
+        else if (!strcmp("--masters", arg) && !lastarg)
+            ok = parseIntOption(arg, argv[++i], 1, MOCK_CLUSTER_SLOTS,
+                                &mock.masters);
+        else if (!strcmp("--replicas", arg) && !lastarg)
+            ok = parseIntOption(arg, argv[++i], 0, 16, &mock.replicas);
+        else if (!strcmp("--maxclients", arg) && !lastarg)
+            ok = parseIntOption(arg, argv[++i], 1, 1000000,
+                                &mock.max_clients);
+        else if (!strcmp("--latency", arg) && !lastarg)
+            ok = parseIntOption(arg, argv[++i], 0, INT_MAX, &mock.latency);
+        else if (!strcmp("--moved-rate", arg) && !lastarg)
+            ok = parseRateOption(arg, argv[++i], &mock.moved_rate);
+        else if (!strcmp("--ask-rate", arg) && !lastarg)
+            ok = parseRateOption(arg, argv[++i], &mock.ask_rate);
+        else if (!strcmp("--disconnect-rate", arg) && !lastarg)
+            ok = parseRateOption(arg, argv[++i], &mock.disconnect_rate);
+        else if (!strcmp("--seed", arg) && !lastarg)
+            ok = parseIntOption(arg, argv[++i], 0, INT_MAX, &seed);
+        else {
+            fprintf(stderr, "Invalid option: %s\n\n", arg);
+            usage();
+            return 0;
+        }
+        if (!ok) return 0;
+    }
+    if ((mock.port + mock.masters * (1 + mock.replicas) - 1) > 55535) {
+        fprintf(stderr, "Too many nodes for port %d (nodes also need their "
+                        "cluster bus port)\n", mock.port);
+        return 0;
+    }
+    mock.seed = (uint64_t) seed;
+    /* xorshift needs a non-zero state */
+    mock.rand_state = mock.seed * 0x9E3779B97F4A7C15ULL + 1;
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    memset(&mock, 0, sizeof(mock));
+    mock.bind = MOCK_DEFAULT_BIND;
+    mock.port = MOCK_DEFAULT_PORT;
+    mock.masters = MOCK_DEFAULT_MASTERS;
+    mock.max_clients = MOCK_DEFAULT_MAX_CLIENTS;
+    if (!parseOptions(argc, argv)) return 1;
+    signal(SIGPIPE, SIG_IGN);
+    initNodes();
+    mock.keys = raxNew();
+    mock.el = aeCreateEventLoop(mock.max_clients + mock.numnodes + 128);
+    if (mock.el == NULL) {
+        fprintf(stderr, "Could not create event loop\n");
+        return 1;
+    }
+    if (!listenNodes()) return 1;
+    printf("Mock cluster ready: %d master(s), %d replica(s) per master, "
+           "listening on %s:%d-%d\n", mock.masters, mock.replicas, mock.bind,
+           mock.port, mock.port + mock.numnodes - 1);
+    fflush(stdout);
+    aeMain(mock.el);
+    aeDeleteEventLoop(mock.el);
+    return 0;
+}
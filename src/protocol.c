@@ -144,13 +144,15 @@ void addReplyErrorWrongArgc(client *c, const char *cmdname, uint64_t req_id) {
 
 void addReplyRaw(client *c, const char *buf, size_t len, uint64_t req_id) {
     /* If the smallest request ID written is smaller than reply's request ID,
-     *  replies are not ordered, so add the reply to the unordered_replies rax
-     * using the request ID as the key. */
+     *  replies are not ordered, so add the reply to the unordered_replies
+     * ring buffer, using the request ID as the index. */
     if (req_id > c->min_reply_id) {
         addUnorderedReply(c, sdsnewlen(buf, len), req_id);
+        checkClientOutputBufferLimits(c);
         return;
     }
     c->obuf = sdscatlen(c->obuf, buf, len);
     c->min_reply_id = req_id + 1;
     appendUnorderedRepliesToBuffer(c);
+    checkClientOutputBufferLimits(c);
 }
@@ -25,6 +25,11 @@
 #include "util.h"
 #include "help.h"
 #include "reply_order.h"
+#include "resp.h"
+#include "capture.h"
+#include "ratelimit.h"
+#include "upgrade.h"
+#include "tls.h"
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
@@ -35,19 +40,20 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
 #include "assert.h" /* Use proxy's assert */
 
 #define QUERY_OFFSETS_MIN_SIZE              10
-#define MAX_THREADS                         500
+#define QUERY_OFFSETS_PREALLOC_MAX          1024
 #define EL_INSTALL_HANDLER_FAIL             9999
 #define REQ_STATUS_UNKNOWN                  -1
-#define PARSE_STATUS_INCOMPLETE             -1
-#define PARSE_STATUS_ERROR                  0
-#define PARSE_STATUS_OK                     1
 #define UNDEFINED_SLOT                      -1
 #define PROTO_INLINE_MAX_SIZE               (1024*64)
+#define FAILOVER_CHECK_INTERVAL             100 /* Milliseconds */
 
 #define MAX_ACCEPTS                         1000
 #define NET_IP_STR_LEN                      46
@@ -57,10 +63,38 @@
 
 #define QUEUE_TYPE_SENDING                  1
 #define QUEUE_TYPE_PENDING                  2
+/* Bytes added to the deficit of a client's send queue at every round. */
+#define SEND_QUEUE_QUANTUM                  (1024*16)
 
 #define THREAD_MSG_STOP                     1
+#define THREAD_MSG_RETIRE                   2
 
 #define CLIENT_CLOSE_AFTER_REPLY            (1 << 1)
+#define CLIENT_CLOSE_ASAP                   (1 << 2)
+#define CLIENT_READ_PAUSED                  (1 << 3)
+#define CLIENT_READ_THROTTLED               (1 << 4)
+#define CLIENT_READ_DRAINING                (1 << 5)
+#define CLIENT_READ_MIGRATING               (1 << 6)
+#define CLIENT_READ_PAUSED_FLAGS \
+    (CLIENT_READ_PAUSED | CLIENT_READ_THROTTLED | CLIENT_READ_DRAINING | \
+     CLIENT_READ_MIGRATING)
+/* The private cluster of the client must be re-created by the thread it's
+ * being migrated to. */
+#define CLIENT_MIGRATE_PRIVATE              (1 << 7)
+
+/* Reads from a shared node connection are paused while its next reply is
+ * for a client over its output buffer soft limit that holds at least this
+ * percentage of the output buffer bytes of all the thread's clients. */
+#define BACKPRESSURE_CLIENT_OBUF_PERC       50
+#define PROTO_IOBUF_LEN                     (1024*16)
+#define EVENT_LOOP_INITIAL_SIZE             1024
+#define CLIENTS_CRON_INTERVAL               100
+#define CLIENTS_CRON_MIN_ITERATIONS         200
+#define CLIENT_IDLE_COMPACT_TIME            2
+#define CLIENT_EVICTION_INTERVAL            100
+#define CLIENT_EVICTION_MIN_MEMORY          (1024*64)
+#define BACKPRESSURE_CHECK_INTERVAL         100 /* Milliseconds */
+#define MAIN_CRON_INTERVAL                  100 /* Milliseconds */
 
 #define UNUSED(V) ((void) V)
 
@@ -97,7 +131,6 @@
 
 #define REQID_PRINTF_FMT "%d:%" PRId64 ":%" PRId64
 #define REQID_PRINTF_ARG(r) r->client->thread_id, r->client->id, r->id
-#define getClientPeerIP(c) (c->ip ? c->ip : config.unixsocket)
 #define strRepr(s) (sdscatrepr(sdsempty(), s, strlen(s)))
 #define sdsRepr(s) (sdscatrepr(sdsempty(), s, sdslen(s)))
 #define PROXY_CMD_LOG_MAX_LEN   4096
@@ -110,6 +143,20 @@ static struct utsname proxy_os;
 redisCommandDef *authCommandDef = NULL;
 redisCommandDef *scanCommandDef = NULL;
 int ae_api_kqueue = 0;
+/* Space separated addresses of the cluster's nodes, passed to the new
+ * process in case of binary upgrade (see saveClusterTopology). */
+static sds cluster_topology = NULL;
+static pthread_mutex_t topology_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes configuration reloads and the readers of the options that are
+ * replaced by them (ie. entry points). */
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Strings replaced by configuration reloads, freed at exit since other
+ * threads could still be using them. */
+static list *retired_config_strings = NULL;
+/* Clients detached by retiring threads, waiting to be assigned to another
+ * thread by the main thread (see resizeThreads). */
+static list *migrating_clients = NULL;
+static pthread_mutex_t migrating_clients_lock = PTHREAD_MUTEX_INITIALIZER;
 
 #ifdef __GNUC__
 __thread int thread_id;
@@ -125,19 +172,21 @@ static void *execProxyThread(void *ptr);
 static client *createClient(int fd, char *ip);
 static void unlinkClient(client *c);
 static void freeClient(client *c);
-static clientRequest *createRequest(client *c);
 void readQuery(aeEventLoop *el, int fd, void *privdata, int mask);
 static int writeToClient(client *c);
 static int writeToCluster(aeEventLoop *el, int fd, clientRequest *req);
 static void writeToClusterHandler(aeEventLoop *el, int fd, void *privdata,
                                   int mask);
 static void readClusterReply(aeEventLoop *el, int fd, void *privdata, int mask);
-static clusterNode *getRequestNode(clientRequest *req, sds *err);
 static clientRequest *handleNextRequestsToCluster(clusterNode *node,
     clientRequest **failed);
 static clientRequest *getFirstQueuedRequest(list *queue, int *is_empty);
+static clientRequest *getNextRequestToSend(clusterNode *node);
 static int enqueueRequest(clientRequest *req, int queue_type);
 static void dequeueRequest(clientRequest *req, int queue_type);
+static int holdRequest(clientRequest *req);
+static void resumeNodeReads(proxyThread *thread);
+static void markClusterNodeAsFailed(clusterNode *node);
 static int sendMessageToThread(proxyThread *thread, sds buf);
 static int installIOHandler(aeEventLoop *el, int fd, int mask, aeFileProc *proc,
                             void *data, int retried);
@@ -146,62 +195,17 @@ char *redisClusterProxyGitSHA1(void);
 char *redisClusterProxyGitDirty(void);
 char *redisClusterProxyGitBranch(void);
 static int processThreadPipeBufferForNewClients(proxyThread *thread);
+static int threadClientsCron(aeEventLoop *el, long long id, void *data);
+static void drainThreadClients(proxyThread *thread);
+static void retireThreadClients(proxyThread *thread);
+static int isThreadsResizeInProgress(void);
+static void startDrain(int timeout);
+static int reloadConfig(sds *err);
 static redisClusterConnection *getRequestConnection(clientRequest *req);
 #ifdef HAVE_BACKTRACE
 void sigsegvHandler(int sig, siginfo_t *info, void *secret);
 #endif
 
-/* Hiredis helpers */
-
-int processItem(redisReader *r);
-
-/* This function does the same things as redisReaderGetReply, but
- * it does not trim the reader's buffer, in order to let the proxy's
- * read handler to get the full reply's buffer. Consuming and trimming
- * ther reader's buffer is up to the proxy. */
-
-static int __hiredisReadReplyFromBuffer(redisReader *r, void **reply) {
-    /* Default target pointer to NULL. */
-    if (reply != NULL)
-        *reply = NULL;
-
-    /* Return early when this reader is in an erroneous state. */
-    if (r->err)
-        return REDIS_ERR;
-
-    /* When the buffer is empty, there will never be a reply. */
-    if (r->len == 0)
-        return REDIS_OK;
-
-    /* Set first item to process when the stack is empty. */
-    if (r->ridx == -1) {
-        r->rstack[0].type = -1;
-        r->rstack[0].elements = -1;
-        r->rstack[0].idx = -1;
-        r->rstack[0].obj = NULL;
-        r->rstack[0].parent = NULL;
-        r->rstack[0].privdata = r->privdata;
-        r->ridx = 0;
-    }
-
-    /* Process items in reply. */
-    while (r->ridx >= 0)
-        if (processItem(r) != REDIS_OK)
-            break;
-
-    /* Return ASAP when an error occurred. */
-    if (r->err)
-        return REDIS_ERR;
-
-    /* Emit a reply when there is one. */
-    if (r->ridx == -1) {
-        if (reply != NULL)
-            *reply = r->reply;
-        r->reply = NULL;
-    }
-    return REDIS_OK;
-}
-
 /* Utils */
 
 int getCurrentThreadID(void) {
@@ -241,14 +245,13 @@ static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
     sds reply = NULL;
     int ok = 0;
     int is_int = 0, is_float = 0, is_string = 0, read_only = 0;
-    int max_int = -1;
+    int is_memory = 0, max_int = -1;
     UNUSED(is_float);
     if (strcmp("log-level", option) == 0) {
         opt = &(config.loglevel);
     } else if (strcmp("threads", option) == 0) {
         is_int = 1;
         opt = &(config.num_threads);
-        read_only = 1;
     } else if (strcmp("maxclients", option) == 0) {
         is_int = 1;
         opt = &(config.maxclients);
@@ -267,6 +270,76 @@ static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
     } else if (strcmp("connections-pool-spawn-rate", option) == 0) {
         is_int = 1;
         opt = &(config.connections_pool.spawn_rate);
+    } else if (strcmp("failover-hold-time", option) == 0) {
+        is_int = 1;
+        opt = &(config.failover_hold_time);
+    } else if (strcmp("failover-hold-max-requests", option) == 0) {
+        is_int = 1;
+        opt = &(config.failover_hold_max_requests);
+    } else if (strcmp("client-output-buffer-limit", option) == 0) {
+        opt = &(config.client_obuf_limits);
+    } else if (strcmp("client-query-buffer-limit", option) == 0) {
+        is_int = 1;
+        is_memory = 1;
+        opt = &(config.client_query_buffer_limit);
+    } else if (strcmp("proto-max-bulk-len", option) == 0) {
+        is_int = 1;
+        is_memory = 1;
+        opt = &(config.proto_max_bulk_len);
+    } else if (strcmp("maxmemory", option) == 0) {
+        opt = &(config.maxmemory);
+    } else if (strcmp("io-read-max-len", option) == 0) {
+        is_int = 1;
+        is_memory = 1;
+        opt = &(config.io_read_max_len);
+    } else if (strcmp("io-read-budget", option) == 0) {
+        is_int = 1;
+        is_memory = 1;
+        opt = &(config.io_read_budget);
+    } else if (strcmp("bulk-weight", option) == 0) {
+        is_int = 1;
+        max_int = 100;
+        opt = &(config.bulk_weight);
+    } else if (strcmp("bulk-min-keys", option) == 0) {
+        is_int = 1;
+        opt = &(config.bulk_min_keys);
+    } else if (strcmp("bulk-users", option) == 0) {
+        read_only = 1;
+        is_string = 1;
+        opt = &(config.bulk_users);
+    } else if (strcmp("client-max-ops-per-sec", option) == 0) {
+        is_int = 1;
+        opt = &(config.client_max_ops);
+    } else if (strcmp("client-max-bytes-per-sec", option) == 0) {
+        is_int = 1;
+        is_memory = 1;
+        opt = &(config.client_max_bytes);
+    } else if (strcmp("user-max-ops-per-sec", option) == 0) {
+        is_int = 1;
+        opt = &(config.user_max_ops);
+    } else if (strcmp("user-max-bytes-per-sec", option) == 0) {
+        is_int = 1;
+        is_memory = 1;
+        opt = &(config.user_max_bytes);
+    } else if (strcmp("node-max-inflight-requests", option) == 0) {
+        is_int = 1;
+        opt = &(config.node_max_inflight_requests);
+    } else if (strcmp("node-max-inflight-bytes", option) == 0) {
+        is_int = 1;
+        is_memory = 1;
+        opt = &(config.node_max_inflight_bytes);
+    } else if (strcmp("node-max-queued-requests", option) == 0) {
+        is_int = 1;
+        opt = &(config.node_max_queued_requests);
+    } else if (strcmp("upgrade-drain-timeout", option) == 0) {
+        is_int = 1;
+        opt = &(config.upgrade_drain_timeout);
+    } else if (strcmp("drain-timeout", option) == 0) {
+        is_int = 1;
+        opt = &(config.drain_timeout);
+    } else if (strcmp("threads-retire-timeout", option) == 0) {
+        is_int = 1;
+        opt = &(config.threads_retire_timeout);
     } else if (strcmp("tcpkeepalive", option) == 0) {
         is_int = 1;
         opt = &(config.tcpkeepalive);
@@ -310,6 +383,26 @@ static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
     } else if (strcmp("bind", option) == 0) {
         opt = &(config.bindaddr);
         read_only = 1;
+    } else if (strcmp("tls", option) == 0) {
+        is_int = 1;
+        read_only = 1;
+        opt = &(config.tls);
+    } else if (strcmp("tls-cluster", option) == 0) {
+        is_int = 1;
+        read_only = 1;
+        opt = &(config.tls_cluster);
+    } else if (strcmp("tls-auth-clients", option) == 0) {
+        is_int = 1;
+        read_only = 1;
+        opt = &(config.tls_auth_clients);
+    } else if (strcmp("tls-cert-file", option) == 0) {
+        is_string = 1;
+        read_only = 1;
+        opt = &(config.tls_cert_file);
+    } else if (strcmp("tls-ca-cert-file", option) == 0) {
+        is_string = 1;
+        read_only = 1;
+        opt = &(config.tls_ca_cert_file);
     }
     if (opt == NULL) {
         if (err) *err = sdsnew("Invalid config option");
@@ -333,6 +426,70 @@ static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
         } else {
             reply = sdsnew(redisProxyLogLevels[config.loglevel]);
         }
+    } else if (opt == &(config.client_obuf_limits)) {
+        if (value != NULL) {
+            int argc = 0;
+            char *limit_err = NULL;
+            sds *argv = sdssplitargs(value, &argc);
+            ok = (argv != NULL &&
+                  setClientOutputBufferLimit(&config, argv, argc,
+                                             &limit_err));
+            if (argv != NULL) sdsfreesplitres(argv, argc);
+            if (!ok) {
+                *err = sdsnew(limit_err ? limit_err : "Invalid arguments");
+                return NULL;
+            }
+        } else {
+            if (!initReplyArray(r->client)) {
+                *err = sdsnew(ERROR_OOM);
+                return NULL;
+            }
+            sds limits = getClientOutputBufferLimitString();
+            addReplyString(r->client, option, r->id);
+            addReplyString(r->client, limits, r->id);
+            addReplyArray(r->client, r->id);
+            sdsfree(limits);
+        }
+    } else if (opt == &(config.maxmemory)) {
+        if (value != NULL) {
+            int memerr = 0;
+            long long maxmemory = memtoll(value, &memerr);
+            if (memerr || maxmemory < 0) {
+                *err = sdscatfmt(sdsempty(), "Invalid value for '%s'", option);
+                return NULL;
+            }
+            config.maxmemory = (unsigned long long) maxmemory;
+            ok = 1;
+        } else {
+            if (!initReplyArray(r->client)) {
+                *err = sdsnew(ERROR_OOM);
+                return NULL;
+            }
+            addReplyString(r->client, option, r->id);
+            addReplyInt(r->client, (int64_t) config.maxmemory, r->id);
+            addReplyArray(r->client, r->id);
+        }
+    } else if (opt == &(config.num_threads) && value != NULL) {
+        /* Threads are started or retired by the main thread (see
+         * resizeThreads), so the value returned by CONFIG GET only changes
+         * once the resize has been performed. A new resize is refused until
+         * the previous one is complete, since it would only be performed
+         * after the retiring threads have stopped. */
+        char *eptr = NULL;
+        long val = strtol(value, &eptr, 10);
+        if (sdslen(value) == 0 || *eptr != '\0' || val < 1 ||
+            val > MAX_THREADS)
+        {
+            *err = sdscatprintf(sdsempty(), "Number of threads must be "
+                                "between 1 and %d", MAX_THREADS);
+            return NULL;
+        }
+        if (isThreadsResizeInProgress()) {
+            *err = sdsnew("A threads resize is already in progress");
+            return NULL;
+        }
+        proxy.requested_threads = (int) val;
+        ok = 1;
     } else if (opt == &(config.bindaddr)) {
         if (value != NULL) {
             if (err) *err = sdsnew("This config option is read-only");
@@ -368,7 +525,13 @@ static sds proxySubCommandConfig(clientRequest *r, sds option, sds value,
             if (read_only) *err = sdsnew("This config option is read-only");
             else {
                 if (is_int) {
-                    int val = atoi(value);
+                    int val;
+                    if (!is_memory) val = atoi(value);
+                    else if (!parseMemoryValue(value, &val)) {
+                        *err = sdscatfmt(sdsempty(),
+                            "Invalid value for '%s'", option);
+                        return NULL;
+                    }
                     if (max_int >= 0 && val > max_int) {
                         *err = sdscatfmt(sdsempty(),
                             "Maximum value for '%s' is %i", option, max_int);
@@ -437,6 +600,45 @@ static void proxySubCommandClient(clientRequest *req, sds subcmd) {
         sdsfree(id);
     } else if (strcasecmp("thread", subcmd) == 0) {
         addReplyInt(req->client, req->client->thread_id, req->id);
+    } else if (strcasecmp("memory", subcmd) == 0) {
+        client *c = req->client;
+        if (!initReplyArray(c)) {
+            addReplyError(c, ERROR_OOM, req->id);
+            return;
+        }
+        addReplyString(c, "qbuf", req->id);
+        addReplyInt(c, getClientQueryBufferMemoryUsage(c), req->id);
+        addReplyString(c, "obuf", req->id);
+        addReplyInt(c, getClientOutputBufferMemoryUsage(c), req->id);
+        addReplyString(c, "unordered-replies", req->id);
+        addReplyInt(c, c->unordered_replies_size, req->id);
+        addReplyArray(c, req->id);
+    } else if (strcasecmp("priority", subcmd) == 0) {
+        client *c = req->client;
+        if (req->argc > 4) {
+            addReplyError(c, "Usage: PROXY CLIENT PRIORITY "
+                          "[interactive|bulk]", req->id);
+            return;
+        } else if (req->argc == 4) {
+            sds priority = sdsnewlen(req->buffer + req->offsets[3],
+                                     req->lengths[3]);
+            if (!strcasecmp("interactive", priority))
+                c->priority = PRIORITY_INTERACTIVE;
+            else if (!strcasecmp("bulk", priority))
+                c->priority = PRIORITY_BULK;
+            else {
+                addReplyError(c, "Invalid priority, it must be "
+                              "'interactive' or 'bulk'", req->id);
+                sdsfree(priority);
+                return;
+            }
+            sdsfree(priority);
+            addReplyString(c, "OK", req->id);
+        } else {
+            addReplyString(c, (c->priority == PRIORITY_BULK ? "bulk" :
+                                                               "interactive"),
+                           req->id);
+        }
     } else if (strcasecmp("help", subcmd) == 0) {
         addReplyHelp(req->client, proxyCommandSubcommandClientHelp, req->id);
     } else {
@@ -445,6 +647,81 @@ static void proxySubCommandClient(clientRequest *req, sds subcmd) {
     }
 }
 
+/* PROXY CAPTURE START <file> [sample-rate] | STOP | STATUS */
+static void proxySubCommandCapture(clientRequest *req, sds subcmd) {
+    client *c = req->client;
+    if (strcasecmp("start", subcmd) == 0) {
+        if (req->argc < 4 || req->argc > 5) {
+            addReplyError(c, "Usage: PROXY CAPTURE START <file> "
+                          "[sample-rate]", req->id);
+            return;
+        }
+        double sample_rate = 1;
+        char *err = NULL;
+        sds filename = sdsnewlen(req->buffer + req->offsets[3],
+                                 req->lengths[3]);
+        if (req->argc == 5) {
+            sds rate = sdsnewlen(req->buffer + req->offsets[4],
+                                 req->lengths[4]);
+            char *eptr = NULL;
+            sample_rate = strtod(rate, &eptr);
+            int valid = (*eptr == '\0' && sample_rate > 0 &&
+                         sample_rate <= 1);
+            sdsfree(rate);
+            if (!valid) {
+                addReplyError(c, "Invalid sample rate, it must be a number "
+                              "greater than 0 and not greater than 1",
+                              req->id);
+                sdsfree(filename);
+                return;
+            }
+        }
+        if (captureStart(filename, sample_rate, &err))
+            addReplyString(c, "OK", req->id);
+        else {
+            sds errmsg = sdscatfmt(sdsempty(), "Failed to start capture: %s",
+                                   err);
+            addReplyError(c, errmsg, req->id);
+            sdsfree(errmsg);
+        }
+        sdsfree(filename);
+    } else if (strcasecmp("stop", subcmd) == 0) {
+        if (captureStop()) addReplyString(c, "OK", req->id);
+        else addReplyError(c, "No capture in progress", req->id);
+    } else if (strcasecmp("status", subcmd) == 0) {
+        captureInfo info;
+        if (!initReplyArray(c)) {
+            addReplyError(c, ERROR_OOM, req->id);
+            return;
+        }
+        captureGetInfo(&info);
+        addReplyString(c, "active", req->id);
+        addReplyInt(c, info.active, req->id);
+        addReplyString(c, "file", req->id);
+        if (info.filename) addReplyString(c, info.filename, req->id);
+        else addReplyString(c, "", req->id);
+        addReplyString(c, "sample-rate", req->id);
+        sds rate = sdscatprintf(sdsempty(), "%.4g", info.sample_rate);
+        addReplyString(c, rate, req->id);
+        addReplyString(c, "start-time", req->id);
+        addReplyInt(c, info.start_time, req->id);
+        addReplyString(c, "records", req->id);
+        addReplyInt(c, info.records, req->id);
+        addReplyString(c, "bytes", req->id);
+        addReplyInt(c, info.bytes, req->id);
+        addReplyString(c, "dropped-records", req->id);
+        addReplyInt(c, info.dropped_records, req->id);
+        addReplyArray(c, req->id);
+        sdsfree(rate);
+        if (info.filename) sdsfree(info.filename);
+    } else if (strcasecmp("help", subcmd) == 0) {
+        addReplyHelp(c, proxyCommandSubcommandCaptureHelp, req->id);
+    } else {
+        addReplyErrorUnknownSubcommand(c, "PROXY CAPTURE",
+            "PROXY CAPTURE HELP", req->id);
+    }
+}
+
 static void proxySubCommandCluster(clientRequest *req, sds subcmd) {
     int fetch_info = 0;
     sds info_field = NULL;
@@ -576,7 +853,8 @@ sds genInfoString(sds section, redisCluster *cluster) {
             "uptime_in_seconds:%jd\r\n"
             "uptime_in_days:%jd\r\n"
             "config_file:%s\r\n"
-            "acl_user:%s\r\n",
+            "acl_user:%s\r\n"
+            "proxy_draining:%d\r\n",
             REDIS_CLUSTER_PROXY_VERSION,
             redisClusterProxyGitSHA1(),
             strtol(redisClusterProxyGitDirty(), NULL, 10) > 0,
@@ -595,7 +873,8 @@ sds genInfoString(sds section, redisCluster *cluster) {
             (intmax_t)uptime,
             (intmax_t)(uptime/(3600*24)),
             (proxy.configfile ? proxy.configfile : ""),
-            (config.auth_user ? config.auth_user : "default")
+            (config.auth_user ? config.auth_user : "default"),
+            (proxy.draining || proxy.listeners_handed_off)
         );
         if (proxy.unixsocket_fd != -1) {
             info = sdscatprintf(info,
@@ -613,6 +892,27 @@ sds genInfoString(sds section, redisCluster *cluster) {
         char total_system_hmem[64];
         size_t zmalloc_used = zmalloc_used_memory();
         size_t total_system_mem = proxy.system_memory_size;
+        size_t clients_qbuf = 0, clients_obuf = 0, clients_mem = 0;
+        uint64_t evicted_clients = 0;
+        char maxmemory_hmem[64];
+        char rss_hmem[64];
+        size_t rss = zmalloc_get_rss();
+        size_t allocator_allocated, allocator_active, allocator_resident;
+        int i;
+        for (i = 0; i < config.num_threads; i++) {
+            proxyThread *thread = proxy.threads[i];
+            if (thread == NULL) continue;
+            clients_qbuf += thread->clients_qbuf_size;
+            clients_obuf += thread->clients_obuf_size;
+            clients_mem += thread->clients_memory;
+            evicted_clients += thread->evicted_clients;
+        }
+        zmalloc_get_allocator_info(&allocator_allocated, &allocator_active,
+                                   &allocator_resident);
+        bytesToHuman(maxmemory_hmem, config.maxmemory);
+        bytesToHuman(rss_hmem, rss);
+        uint64_t numclients = proxy.numclients;
+        if (numclients == 0) numclients = 1;
 
         bytesToHuman(hmem,zmalloc_used);
         bytesToHuman(total_system_hmem,total_system_mem);
@@ -621,12 +921,54 @@ sds genInfoString(sds section, redisCluster *cluster) {
             "# Memory\r\n"
             "used_memory:%zu\r\n"
             "used_memory_human:%s\r\n"
+            "used_memory_rss:%zu\r\n"
+            "used_memory_rss_human:%s\r\n"
+            "mem_fragmentation_ratio:%.2f\r\n"
+            "allocator_allocated:%zu\r\n"
+            "allocator_active:%zu\r\n"
+            "allocator_resident:%zu\r\n"
+            "allocator_frag_ratio:%.2f\r\n"
+            "allocator_rss_ratio:%.2f\r\n"
+            "mem_allocator:%s\r\n"
             "total_system_memory:%lu\r\n"
-            "total_system_memory_human:%s\r\n",
+            "total_system_memory_human:%s\r\n"
+            "clients_query_buffers:%zu\r\n"
+            "clients_output_buffers:%zu\r\n"
+            "clients_memory:%zu\r\n"
+            "client_avg_memory:%zu\r\n"
+            "client_avg_query_buffer:%zu\r\n"
+            "client_avg_output_buffer:%zu\r\n"
+            "maxmemory:%llu\r\n"
+            "maxmemory_human:%s\r\n"
+            "evicted_clients:%" PRIu64 "\r\n"
+            "client_query_buffer_limit:%d\r\n"
+            "proto_max_bulk_len:%d\r\n",
             zmalloc_used,
             hmem,
+            rss,
+            rss_hmem,
+            (zmalloc_used ? (float) rss / zmalloc_used : 0),
+            allocator_allocated,
+            allocator_active,
+            allocator_resident,
+            (allocator_allocated ?
+                (float) allocator_active / allocator_allocated : 0),
+            (allocator_active ?
+                (float) allocator_resident / allocator_active : 0),
+            ZMALLOC_LIB,
             (unsigned long)total_system_mem,
-            total_system_hmem
+            total_system_hmem,
+            clients_qbuf,
+            clients_obuf,
+            clients_mem,
+            (size_t) (clients_mem / numclients),
+            (size_t) (clients_qbuf / numclients),
+            (size_t) (clients_obuf / numclients),
+            config.maxmemory,
+            maxmemory_hmem,
+            evicted_clients,
+            config.client_query_buffer_limit,
+            config.proto_max_bulk_len
         );
     }
     if (default_section || all_sections ||
@@ -648,6 +990,65 @@ sds genInfoString(sds section, redisCluster *cluster) {
             );
         }
     }
+    if (default_section || all_sections ||
+        !strcasecmp("stats", section))
+    {
+        uint64_t input_bytes = 0, cluster_input_bytes = 0, client_reads = 0,
+                 cluster_reads = 0, budget_exhausted = 0, throttles = 0,
+                 busy_errors = 0, queued_requests = 0, queue_wait = 0;
+        int i, throttled_clients = 0;
+        for (i = 0; i < config.num_threads; i++) {
+            proxyThread *thread = proxy.threads[i];
+            if (thread == NULL) continue;
+            input_bytes += atomic_load_explicit(&thread->stat_net_input_bytes,
+                                                memory_order_relaxed);
+            cluster_input_bytes += atomic_load_explicit(
+                &thread->stat_net_cluster_input_bytes, memory_order_relaxed);
+            client_reads += atomic_load_explicit(&thread->stat_client_reads,
+                                                 memory_order_relaxed);
+            cluster_reads += atomic_load_explicit(&thread->stat_cluster_reads,
+                                                  memory_order_relaxed);
+            budget_exhausted += atomic_load_explicit(
+                &thread->stat_read_budget_exhausted, memory_order_relaxed);
+            throttles += thread->stat_client_throttles;
+            throttled_clients += thread->throttled_clients;
+            busy_errors += thread->stat_node_busy_errors;
+            queued_requests += thread->stat_node_queued_requests;
+            queue_wait += thread->stat_node_queue_wait;
+        }
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Stats\r\n"
+            "total_net_input_bytes:%" PRIu64 "\r\n"
+            "total_net_cluster_input_bytes:%" PRIu64 "\r\n"
+            "total_client_reads:%" PRIu64 "\r\n"
+            "total_cluster_reads:%" PRIu64 "\r\n"
+            "avg_client_read_size:%" PRIu64 "\r\n"
+            "avg_cluster_read_size:%" PRIu64 "\r\n"
+            "read_budget_exhausted:%" PRIu64 "\r\n"
+            "io_read_max_len:%d\r\n"
+            "io_read_budget:%d\r\n"
+            "throttled_clients:%d\r\n"
+            "total_client_throttles:%" PRIu64 "\r\n"
+            "total_node_busy_errors:%" PRIu64 "\r\n"
+            "total_node_queued_requests:%" PRIu64 "\r\n"
+            "avg_node_queue_wait_us:%" PRIu64 "\r\n",
+            input_bytes,
+            cluster_input_bytes,
+            client_reads,
+            cluster_reads,
+            (client_reads ? input_bytes / client_reads : 0),
+            (cluster_reads ? cluster_input_bytes / cluster_reads : 0),
+            budget_exhausted,
+            config.io_read_max_len,
+            config.io_read_budget,
+            throttled_clients,
+            throttles,
+            busy_errors,
+            queued_requests,
+            (queued_requests ? queue_wait / queued_requests : 0)
+        );
+    }
     if (default_section || all_sections ||
         !strcasecmp("cluster", section))
     {
@@ -764,6 +1165,21 @@ int execOrDiscardCommand(void *r) {
     return PROXY_COMMAND_UNHANDLED;
 }
 
+/* Check whether the user is listed in bulk-users. */
+static int isBulkUser(sds user) {
+    if (config.bulk_users == NULL) return 0;
+    int i, count = 0, found = 0;
+    sds *users = sdssplitlen(config.bulk_users, strlen(config.bulk_users),
+                             ",", 1, &count);
+    if (users == NULL) return 0;
+    for (i = 0; i < count && !found; i++) {
+        sdstrim(users[i], " ");
+        found = (strcmp(users[i], user) == 0);
+    }
+    sdsfreesplitres(users, count);
+    return found;
+}
+
 int authCommand(void *r) {
     int status = PROXY_COMMAND_UNHANDLED;
     clientRequest *req = r;
@@ -789,6 +1205,8 @@ int authCommand(void *r) {
         user = sdsnewlen(req->buffer + req->offsets[1], req->lengths[1]);
         passw = sdsnewlen(req->buffer + req->offsets[2], req->lengths[2]);
     }
+    if (user && isBulkUser(user)) c->priority = PRIORITY_BULK;
+    if (user) c->user_rate_limit = getUserRateLimit(user);
     if ((user && (!config.auth_user || strcmp(user, config.auth_user)) != 0) ||
         (!user && config.auth_user))
     {
@@ -926,6 +1344,11 @@ int proxyCommand(void *r) {
         int is_set_action = 0;
         if (strcasecmp("get", action) == 0 || strcasecmp("set", action) == 0) {
             is_set_action = (action[0] == 's' || action[0] == 'S');
+        } else if (strcasecmp("reload", action) == 0) {
+            sdsfree(action);
+            if (reloadConfig(&err))
+                addReplyString(req->client, "OK", req->id);
+            goto final;
         } else {
             addReplyErrorUnknownSubcommand(req->client, "PROXY CONFIG",
                 "PROXY HELP", req->id);
@@ -1027,6 +1450,16 @@ int proxyCommand(void *r) {
         sds arg = sdsnewlen(req->buffer + offset, len);
         proxySubCommandClient(req, arg);
         if (arg) sdsfree(arg);
+    } else if (strcasecmp("capture", subcmd) == 0) {
+        if (req->argc < 3) {
+            addReplyErrorUnknownSubcommand(req->client, "PROXY CAPTURE",
+                "PROXY CAPTURE HELP", req->id);
+            goto final;
+        }
+        assert(req->offsets_size >= 3);
+        sds arg = sdsnewlen(req->buffer + req->offsets[2], req->lengths[2]);
+        proxySubCommandCapture(req, arg);
+        sdsfree(arg);
     } else if (strcasecmp("cluster", subcmd) == 0) {
         sds arg = NULL;
         if (req->argc > 2) {
@@ -1146,6 +1579,25 @@ int proxyCommand(void *r) {
             goto final;
         }
         sdsfree(type);
+    } else if (strcasecmp("drain", subcmd) == 0) {
+        int timeout = config.drain_timeout;
+        if (req->argc > 2) {
+            assert(req->offsets_size >= 3);
+            sds arg = sdsnewlen(req->buffer + req->offsets[2],
+                                req->lengths[2]);
+            char *eptr = NULL;
+            long val = strtol(arg, &eptr, 10);
+            int valid = (sdslen(arg) > 0 && *eptr == '\0' && val >= 0 &&
+                         val <= INT_MAX);
+            sdsfree(arg);
+            if (!valid) {
+                err = sdsnew("Invalid drain timeout");
+                goto final;
+            }
+            timeout = (int) val;
+        }
+        startDrain(timeout);
+        addReplyString(req->client, "OK", req->id);
     } else if (strcasecmp("shutdown", subcmd) == 0) {
         int asap = 0;
         if (req->argc > 2) {
@@ -1684,74 +2136,219 @@ void printHelp(void) {
         DEFAULT_UNIXSOCKETPERM, DEFAULT_CONNECTIONS_POOL_SIZE, MAX_POOL_SIZE,
         DEFAULT_CONNECTIONS_POOL_MINSIZE, DEFAULT_CONNECTIONS_POOL_INTERVAL,
         DEFAULT_CONNECTIONS_POOL_SPAWNRATE);
+    fprintf(stderr, mainHelpStringLimits,
+        DEFAULT_FAILOVER_HOLD_TIME, DEFAULT_FAILOVER_HOLD_MAX_REQUESTS,
+        DEFAULT_CLIENT_QUERY_BUFFER_LIMIT, DEFAULT_PROTO_MAX_BULK_LEN,
+        DEFAULT_IO_READ_MAX_LEN, DEFAULT_IO_READ_BUDGET, DEFAULT_BULK_WEIGHT,
+        DEFAULT_BULK_MIN_KEYS);
+    fprintf(stderr, "%s", mainHelpStringNodes);
+    fprintf(stderr, mainHelpStringTLS, DEFAULT_TLS_SESSION_CACHE_SIZE,
+        DEFAULT_TLS_SESSION_CACHE_TIMEOUT);
+    fprintf(stderr, "%s", mainHelpStringTail);
 }
 
-int parseOptions(int argc, char **argv) {
+int parseOptions(redisClusterProxyConfig *cfg, int argc, char **argv) {
     int i;
     for (i = 1; i < argc; i++) {
         int lastarg = (i == (argc - 1));
         char *arg = argv[i];
         if ((!strcmp("-p", arg) || !strcmp("--port", arg)) && !lastarg)
-            config.port = atoi(argv[++i]);
+            cfg->port = atoi(argv[++i]);
         else if ((!strcmp(argv[i],"-a") || !strcmp("--auth", arg)) && !lastarg)
-            config.auth = zstrdup(argv[++i]);
+            cfg->auth = zstrdup(argv[++i]);
         else if (!strcmp("--auth-user", arg) && !lastarg)
-            config.auth_user = zstrdup(argv[++i]);
+            cfg->auth_user = zstrdup(argv[++i]);
         else if (!strcmp("--disable-colors", arg))
-            config.use_colors = 0;
+            cfg->use_colors = 0;
         else if (!strcmp("--daemonize", arg))
-            config.daemonize = 1;
+            cfg->daemonize = 1;
         else if (!strcmp("--pidfile", arg) && !lastarg)
-            config.pidfile = zstrdup(argv[++i]);
+            cfg->pidfile = zstrdup(argv[++i]);
         else if (!strcmp("--logfile", arg) && !lastarg)
-            config.logfile = zstrdup(argv[++i]);
+            cfg->logfile = zstrdup(argv[++i]);
         else if (!strcmp("--maxclients", arg) && !lastarg)
-            config.maxclients = atoi(argv[++i]);
+            cfg->maxclients = atoi(argv[++i]);
         else if (!strcmp("--tcpkeepalive", arg) && !lastarg)
-            config.tcpkeepalive = atoi(argv[++i]);
+            cfg->tcpkeepalive = atoi(argv[++i]);
         else if (!strcmp("--tcp-backlog", arg) && !lastarg)
-            config.tcp_backlog = atoi(argv[++i]);
+            cfg->tcp_backlog = atoi(argv[++i]);
         else if (!strcmp("--connections-pool-size", arg) && !lastarg)
-            config.connections_pool.size = atoi(argv[++i]);
+            cfg->connections_pool.size = atoi(argv[++i]);
         else if (!strcmp("--connections-pool-min-size", arg) && !lastarg)
-            config.connections_pool.min_size = atoi(argv[++i]);
+            cfg->connections_pool.min_size = atoi(argv[++i]);
         else if (!strcmp("--connections-pool-spawn-every", arg) && !lastarg)
-            config.connections_pool.spawn_every = atoi(argv[++i]);
+            cfg->connections_pool.spawn_every = atoi(argv[++i]);
         else if (!strcmp("--connections-pool-spawn-rate", arg) && !lastarg)
-            config.connections_pool.spawn_rate = atoi(argv[++i]);
+            cfg->connections_pool.spawn_rate = atoi(argv[++i]);
+        else if (!strcmp("--failover-hold-time", arg) && !lastarg)
+            cfg->failover_hold_time = atoi(argv[++i]);
+        else if (!strcmp("--failover-hold-max-requests", arg) && !lastarg)
+            cfg->failover_hold_max_requests = atoi(argv[++i]);
+        else if (!strcmp("--client-query-buffer-limit", arg) && !lastarg) {
+            if (!parseMemoryValue(argv[++i],
+                                  &cfg->client_query_buffer_limit)) {
+                fprintf(stderr, "Invalid client-query-buffer-limit: %s\n",
+                        argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp("--maxmemory", arg) && !lastarg) {
+            int memerr = 0;
+            long long maxmemory = memtoll(argv[++i], &memerr);
+            if (memerr || maxmemory < 0) {
+                fprintf(stderr, "Invalid maxmemory: %s\n", argv[i]);
+                return -1;
+            }
+            cfg->maxmemory = (unsigned long long) maxmemory;
+        }
+        else if (!strcmp("--proto-max-bulk-len", arg) && !lastarg) {
+            if (!parseMemoryValue(argv[++i], &cfg->proto_max_bulk_len)) {
+                fprintf(stderr, "Invalid proto-max-bulk-len: %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp("--io-read-max-len", arg) && !lastarg) {
+            if (!parseMemoryValue(argv[++i], &cfg->io_read_max_len)) {
+                fprintf(stderr, "Invalid io-read-max-len: %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp("--io-read-budget", arg) && !lastarg) {
+            if (!parseMemoryValue(argv[++i], &cfg->io_read_budget)) {
+                fprintf(stderr, "Invalid io-read-budget: %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp("--bulk-weight", arg) && !lastarg) {
+            cfg->bulk_weight = atoi(argv[++i]);
+            if (cfg->bulk_weight < 0 || cfg->bulk_weight > 100) {
+                fprintf(stderr, "Invalid bulk-weight: %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp("--bulk-min-keys", arg) && !lastarg)
+            cfg->bulk_min_keys = atoi(argv[++i]);
+        else if (!strcmp("--bulk-users", arg) && !lastarg) {
+            if (cfg->bulk_users) zfree(cfg->bulk_users);
+            cfg->bulk_users = zstrdup(argv[++i]);
+        }
+        else if (!strcmp("--client-max-ops-per-sec", arg) && !lastarg)
+            cfg->client_max_ops = atoi(argv[++i]);
+        else if (!strcmp("--client-max-bytes-per-sec", arg) && !lastarg) {
+            if (!parseMemoryValue(argv[++i], &cfg->client_max_bytes)) {
+                fprintf(stderr, "Invalid client-max-bytes-per-sec: %s\n",
+                        argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp("--user-max-ops-per-sec", arg) && !lastarg)
+            cfg->user_max_ops = atoi(argv[++i]);
+        else if (!strcmp("--node-max-inflight-requests", arg) && !lastarg)
+            cfg->node_max_inflight_requests = atoi(argv[++i]);
+        else if (!strcmp("--node-max-inflight-bytes", arg) && !lastarg) {
+            if (!parseMemoryValue(argv[++i],
+                                  &cfg->node_max_inflight_bytes))
+            {
+                fprintf(stderr, "Invalid node-max-inflight-bytes: %s\n",
+                        argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp("--node-max-queued-requests", arg) && !lastarg)
+            cfg->node_max_queued_requests = atoi(argv[++i]);
+        else if (!strcmp("--upgrade-drain-timeout", arg) && !lastarg)
+            cfg->upgrade_drain_timeout = atoi(argv[++i]);
+        else if (!strcmp("--drain-timeout", arg) && !lastarg)
+            cfg->drain_timeout = atoi(argv[++i]);
+        else if (!strcmp("--threads-retire-timeout", arg) && !lastarg)
+            cfg->threads_retire_timeout = atoi(argv[++i]);
+        else if (!strcmp("--upgrade-fd", arg) && !lastarg)
+            proxy.upgrade_fd = atoi(argv[++i]);
+        else if (!strcmp("--tls", arg) || !strcmp("--tls-cluster", arg)) {
+            if (!TLS_SUPPORTED) {
+                fprintf(stderr, "%s\n", TLS_UNSUPPORTED_MSG);
+                return -1;
+            }
+            if (!strcmp("--tls", arg)) cfg->tls = 1;
+            else cfg->tls_cluster = 1;
+        }
+        else if (!strcmp("--tls-auth-clients", arg))
+            cfg->tls_auth_clients = 1;
+        else if (!strcmp("--tls-ktls", arg))
+            cfg->tls_ktls = 1;
+        else if (!strcmp("--tls-session-cache-size", arg) && !lastarg)
+            cfg->tls_session_cache_size = atoi(argv[++i]);
+        else if (!strcmp("--tls-session-cache-timeout", arg) && !lastarg)
+            cfg->tls_session_cache_timeout = atoi(argv[++i]);
+        else if (!strcmp("--tls-cert-file", arg) && !lastarg) {
+            zfree(cfg->tls_cert_file);
+            cfg->tls_cert_file = zstrdup(argv[++i]);
+        }
+        else if (!strcmp("--tls-key-file", arg) && !lastarg) {
+            zfree(cfg->tls_key_file);
+            cfg->tls_key_file = zstrdup(argv[++i]);
+        }
+        else if (!strcmp("--tls-ca-cert-file", arg) && !lastarg) {
+            zfree(cfg->tls_ca_cert_file);
+            cfg->tls_ca_cert_file = zstrdup(argv[++i]);
+        }
+        else if (!strcmp("--tls-ca-cert-dir", arg) && !lastarg) {
+            zfree(cfg->tls_ca_cert_dir);
+            cfg->tls_ca_cert_dir = zstrdup(argv[++i]);
+        }
+        else if (!strcmp("--user-max-bytes-per-sec", arg) && !lastarg) {
+            if (!parseMemoryValue(argv[++i], &cfg->user_max_bytes)) {
+                fprintf(stderr, "Invalid user-max-bytes-per-sec: %s\n",
+                        argv[i]);
+                return -1;
+            }
+        }
+        else if (!strcmp("--client-output-buffer-limit", arg) &&
+                 (i + 4) < argc)
+        {
+            char *err = NULL;
+            if (!setClientOutputBufferLimit(cfg, argv + i + 1, 4, &err)) {
+                fprintf(stderr, "%s\n", err);
+                return -1;
+            }
+            i += 4;
+        }
         else if (!strcmp("--dump-queries", arg))
-            config.dump_queries = 1;
+            cfg->dump_queries = 1;
         else if (!strcmp("--dump-buffer", arg))
-            config.dump_buffer = 1;
+            cfg->dump_buffer = 1;
         else if (!strcmp("--dump-queues", arg))
-            config.dump_queues = 1;
+            cfg->dump_queues = 1;
         else if (!strcmp(argv[i], "--unixsocket") && !lastarg)
-            config.unixsocket = zstrdup(argv[++i]);
+            cfg->unixsocket = zstrdup(argv[++i]);
         else if (!strcmp(argv[i], "--unixsocketperm") && !lastarg) {
             errno = 0;
-            config.unixsocketperm = (mode_t)strtol(argv[++i], NULL, 8);
-            if (errno || config.unixsocketperm > 0777) {
+            cfg->unixsocketperm = (mode_t)strtol(argv[++i], NULL, 8);
+            if (errno || cfg->unixsocketperm > 0777) {
                 fprintf(stderr,"Invalid socket file permissions:%s\n",argv[i]);
-                exit(1);
+                return -1;
             }
         } else if (!strcmp("--bind", arg) && !lastarg) {
-            if (config.bindaddr_count >= BINDADDR_MAX) {
+            if (cfg->bindaddr_count >= BINDADDR_MAX) {
                 fprintf(stderr, "You can bind max. %d interfaces\n",
                         BINDADDR_MAX);
-                exit(1);
+                return -1;
             }
-            config.bindaddr[config.bindaddr_count++] = zstrdup(argv[++i]);
+            cfg->bindaddr[cfg->bindaddr_count++] = zstrdup(argv[++i]);
         } else if (!strcmp("-c", arg) && !lastarg) {
             char *cfgfile = argv[++i];
-            if (!parseOptionsFromFile(cfgfile)) exit(1);
-            proxy.configfile = sdsnew(cfgfile);
+            if (!parseOptionsFromFile(cfg, cfgfile)) return -1;
+            if (cfg == &config) {
+                sdsfree(proxy.configfile);
+                proxy.configfile = sdsnew(cfgfile);
+            }
         } else if (!strcmp("--threads", arg) && !lastarg) {
-            config.num_threads = atoi(argv[++i]);
-            if (config.num_threads > MAX_THREADS) {
+            cfg->num_threads = atoi(argv[++i]);
+            if (cfg->num_threads > MAX_THREADS) {
                 fprintf(stderr, "Warning: maximum threads allowed: %d\n",
                                 MAX_THREADS);
-                config.num_threads = MAX_THREADS;
-            } else if (config.num_threads < 1) config.num_threads = 1;
+                cfg->num_threads = MAX_THREADS;
+            } else if (cfg->num_threads < 1) cfg->num_threads = 1;
         } else if (!strcmp("--log-level", arg) && !lastarg) {
             char *level_name = argv[++i];
             int j = 0, level = -1;
@@ -1768,22 +2365,22 @@ int parseOptions(int argc, char **argv) {
                     fprintf(stderr, "%s", redisProxyLogLevels[j]);
                 }
                 fprintf(stderr, "\n");
-                exit(1);
+                return -1;
             }
-            config.loglevel = level;
+            cfg->loglevel = level;
         } else if (!strcmp("--disable-multiplexing", arg) && !lastarg) {
             char *val = argv[++i];
             if (!strcasecmp("always", val))
-                config.disable_multiplexing = CFG_DISABLE_MULTIPLEXING_ALWAYS;
+                cfg->disable_multiplexing = CFG_DISABLE_MULTIPLEXING_ALWAYS;
             else if (!strcasecmp("auto", val))
-                config.disable_multiplexing = CFG_DISABLE_MULTIPLEXING_AUTO;
+                cfg->disable_multiplexing = CFG_DISABLE_MULTIPLEXING_AUTO;
             else {
                 fprintf(stderr, "Invalid option for --disable-multiplexing, "
                         "valid options are:\nauto|always\n");
-                exit(1);
+                return -1;
             }
         } else if (!strcmp("--enable-cross-slot", arg)) {
-            config.cross_slot_enabled = 1;
+            cfg->cross_slot_enabled = 1;
         } else if (!strcmp("--help", arg) || !strcmp("-h", arg)) {
             printHelp();
             exit(0);
@@ -1796,8 +2393,248 @@ int parseOptions(int argc, char **argv) {
 invalid:
     fprintf(stderr, "Invalid option '%s' or invalid number of option "
                     "arguments\n\n", argv[i]);
-    printHelp();
-    exit(1);
+    if (cfg == &config) printHelp();
+    return -1;
+}
+
+/* Configuration reload (SIGHUP or PROXY CONFIG RELOAD).
+ *
+ * The command line, including the configuration file, is parsed again into
+ * a staging configuration starting from the defaults, so that options
+ * removed from the file get their default values back. Options that can be
+ * changed at runtime are then published to the active configuration, just
+ * like PROXY CONFIG SET does, while changes to options requiring a restart
+ * are only logged. Nothing is applied if the configuration is invalid. */
+
+#define reloadLiveOption(cfg, field, name) do { \
+    if ((cfg)->field != config.field) { \
+        proxyLogInfo("Config reload: '%s' set to %lld", name, \
+                     (long long) (cfg)->field); \
+        config.field = (cfg)->field; \
+    } \
+} while (0)
+
+#define reloadRestartOption(cfg, field, name) do { \
+    if ((cfg)->field != config.field) { \
+        proxyLogWarn("Config reload: '%s' requires a restart", name); \
+    } \
+} while (0)
+
+static int configStringsEqual(const char *a, const char *b) {
+    if (a == NULL || b == NULL) return (a == b);
+    return (strcmp(a, b) == 0);
+}
+
+static void reloadLiveString(char **active, char *value, char *name) {
+    if (configStringsEqual(*active, value)) return;
+    proxyLogInfo("Config reload: '%s' set to '%s'", name,
+                 (value ? value : ""));
+    if (*active != NULL) listAddNodeTail(retired_config_strings, *active);
+    *active = (value ? zstrdup(value) : NULL);
+}
+
+static int entryPointsChanged(redisClusterProxyConfig *cfg) {
+    int i;
+    if (cfg->entry_points_count != config.entry_points_count) return 1;
+    for (i = 0; i < cfg->entry_points_count; i++) {
+        if (!configStringsEqual(cfg->entry_points[i].address,
+                                config.entry_points[i].address)) return 1;
+    }
+    return 0;
+}
+
+static int bindAddressesChanged(redisClusterProxyConfig *cfg) {
+    int i;
+    if (cfg->bindaddr_count != config.bindaddr_count) return 1;
+    for (i = 0; i < cfg->bindaddr_count; i++) {
+        if (!configStringsEqual(cfg->bindaddr[i], config.bindaddr[i]))
+            return 1;
+    }
+    return 0;
+}
+
+static void freeStagingConfig(redisClusterProxyConfig *cfg) {
+    int i;
+    zfree(cfg->unixsocket);
+    zfree(cfg->auth);
+    zfree(cfg->auth_user);
+    zfree(cfg->pidfile);
+    zfree(cfg->logfile);
+    zfree(cfg->bulk_users);
+    zfree(cfg->tls_cert_file);
+    zfree(cfg->tls_key_file);
+    zfree(cfg->tls_ca_cert_file);
+    zfree(cfg->tls_ca_cert_dir);
+    for (i = 0; i < cfg->bindaddr_count; i++) zfree(cfg->bindaddr[i]);
+    freeEntryPoints(cfg->entry_points, cfg->entry_points_count);
+    zfree(cfg);
+}
+
+static void applyStagingConfig(redisClusterProxyConfig *cfg) {
+    /* Connections pool and failovers */
+    reloadLiveOption(cfg, connections_pool.size, "connections-pool-size");
+    reloadLiveOption(cfg, connections_pool.min_size,
+                     "connections-pool-min-size");
+    reloadLiveOption(cfg, connections_pool.spawn_every,
+                     "connections-pool-spawn-every");
+    reloadLiveOption(cfg, connections_pool.spawn_rate,
+                     "connections-pool-spawn-rate");
+    reloadLiveOption(cfg, failover_hold_time, "failover-hold-time");
+    reloadLiveOption(cfg, failover_hold_max_requests,
+                     "failover-hold-max-requests");
+    /* Routing */
+    reloadLiveOption(cfg, cross_slot_enabled, "enable-cross-slot");
+    reloadLiveOption(cfg, disable_multiplexing, "disable-multiplexing");
+    /* Timeouts */
+    reloadLiveOption(cfg, tcpkeepalive, "tcpkeepalive");
+    reloadLiveOption(cfg, upgrade_drain_timeout, "upgrade-drain-timeout");
+    reloadLiveOption(cfg, drain_timeout, "drain-timeout");
+    reloadLiveOption(cfg, threads_retire_timeout, "threads-retire-timeout");
+    /* Limits */
+    reloadLiveOption(cfg, client_query_buffer_limit,
+                     "client-query-buffer-limit");
+    reloadLiveOption(cfg, proto_max_bulk_len, "proto-max-bulk-len");
+    reloadLiveOption(cfg, maxmemory, "maxmemory");
+    reloadLiveOption(cfg, io_read_max_len, "io-read-max-len");
+    reloadLiveOption(cfg, io_read_budget, "io-read-budget");
+    reloadLiveOption(cfg, bulk_weight, "bulk-weight");
+    reloadLiveOption(cfg, bulk_min_keys, "bulk-min-keys");
+    reloadLiveOption(cfg, client_max_ops, "client-max-ops-per-sec");
+    reloadLiveOption(cfg, client_max_bytes, "client-max-bytes-per-sec");
+    reloadLiveOption(cfg, user_max_ops, "user-max-ops-per-sec");
+    reloadLiveOption(cfg, user_max_bytes, "user-max-bytes-per-sec");
+    reloadLiveOption(cfg, node_max_inflight_requests,
+                     "node-max-inflight-requests");
+    reloadLiveOption(cfg, node_max_inflight_bytes, "node-max-inflight-bytes");
+    reloadLiveOption(cfg, node_max_queued_requests,
+                     "node-max-queued-requests");
+    if (memcmp(cfg->client_obuf_limits, config.client_obuf_limits,
+               sizeof(config.client_obuf_limits)) != 0)
+    {
+        memcpy(config.client_obuf_limits, cfg->client_obuf_limits,
+               sizeof(config.client_obuf_limits));
+        proxyLogInfo("Config reload: 'client-output-buffer-limit' changed");
+    }
+    /* The file descriptors limit has been raised at startup, so maxclients
+     * can only be changed within that limit. */
+    if (cfg->maxclients != config.maxclients) {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+            (limit.rlim_cur == RLIM_INFINITY ||
+             (rlim_t) cfg->maxclients + proxy.min_reserved_fds <=
+             limit.rlim_cur))
+        {
+            reloadLiveOption(cfg, maxclients, "maxclients");
+        } else reloadRestartOption(cfg, maxclients, "maxclients");
+    }
+    /* Memory and logging */
+    reloadLiveOption(cfg, loglevel, "log-level");
+    reloadLiveOption(cfg, dump_queries, "dump-queries");
+    reloadLiveOption(cfg, dump_buffer, "dump-buffer");
+    reloadLiveOption(cfg, dump_queues, "dump-queues");
+    reloadLiveString(&config.logfile, cfg->logfile, "logfile");
+    reloadLiveString(&config.bulk_users, cfg->bulk_users, "bulk-users");
+    /* Entry points are only used to fetch the cluster's configuration when
+     * a thread starts, so they can be safely replaced under config_lock. */
+    if (entryPointsChanged(cfg)) {
+        freeEntryPoints(config.entry_points, config.entry_points_count);
+        memcpy(config.entry_points, cfg->entry_points,
+               cfg->entry_points_count * sizeof(*cfg->entry_points));
+        config.entry_points_count = cfg->entry_points_count;
+        cfg->entry_points_count = 0;
+        proxyLogInfo("Config reload: %d entry point(s) set",
+                     config.entry_points_count);
+    }
+    /* Options that require a restart */
+    reloadRestartOption(cfg, port, "port");
+    reloadRestartOption(cfg, unixsocketperm, "unixsocketperm");
+    if (cfg->num_threads != proxy.requested_threads) {
+        proxyLogInfo("Config reload: 'threads' set to %d", cfg->num_threads);
+        proxy.requested_threads = cfg->num_threads;
+    }
+    reloadRestartOption(cfg, tcp_backlog, "tcp-backlog");
+    reloadRestartOption(cfg, daemonize, "daemonize");
+    if (!configStringsEqual(cfg->unixsocket, config.unixsocket))
+        proxyLogWarn("Config reload: 'unixsocket' requires a restart");
+    if (!configStringsEqual(cfg->pidfile, config.pidfile))
+        proxyLogWarn("Config reload: 'pidfile' requires a restart");
+    if (bindAddressesChanged(cfg))
+        proxyLogWarn("Config reload: 'bind' requires a restart");
+    /* TLS contexts are only created at startup. */
+    reloadRestartOption(cfg, tls, "tls");
+    reloadRestartOption(cfg, tls_cluster, "tls-cluster");
+    reloadRestartOption(cfg, tls_auth_clients, "tls-auth-clients");
+    reloadRestartOption(cfg, tls_ktls, "tls-ktls");
+    reloadRestartOption(cfg, tls_session_cache_size,
+                        "tls-session-cache-size");
+    reloadRestartOption(cfg, tls_session_cache_timeout,
+                        "tls-session-cache-timeout");
+    if (!configStringsEqual(cfg->tls_cert_file, config.tls_cert_file) ||
+        !configStringsEqual(cfg->tls_key_file, config.tls_key_file) ||
+        !configStringsEqual(cfg->tls_ca_cert_file, config.tls_ca_cert_file) ||
+        !configStringsEqual(cfg->tls_ca_cert_dir, config.tls_ca_cert_dir))
+    {
+        proxyLogWarn("Config reload: TLS certificates require a restart");
+    }
+    /* See main() for the normalization of the authentication options. */
+    char *auth_user = cfg->auth_user, *auth = cfg->auth;
+    if (auth_user != NULL && strcmp("default", auth_user) == 0)
+        auth_user = NULL;
+    if (auth_user != NULL && auth == NULL) auth = "";
+    if (!configStringsEqual(auth, config.auth) ||
+        !configStringsEqual(auth_user, config.auth_user))
+    {
+        proxyLogWarn("Config reload: 'auth' and 'auth-user' require a "
+                     "restart");
+    }
+}
+
+static int reloadConfig(sds *err) {
+    int i, parsed;
+    if (proxy.configfile == NULL) {
+        *err = sdsnew("The proxy has not been started with a config file");
+        return 0;
+    }
+    redisClusterProxyConfig *cfg = zcalloc(sizeof(*cfg));
+    if (cfg == NULL) {
+        *err = sdsnew(ERROR_OOM);
+        return 0;
+    }
+    pthread_mutex_lock(&config_lock);
+    proxyLogInfo("Reloading configuration from '%s'", proxy.configfile);
+    initConfig(cfg);
+    parsed = parseOptions(cfg, proxy.argc, proxy.argv);
+    if (parsed < 0) {
+        pthread_mutex_unlock(&config_lock);
+        proxyLogErr("Invalid configuration, nothing has been reloaded");
+        *err = sdsnew("Invalid configuration, see the proxy's log");
+        freeStagingConfig(cfg);
+        return 0;
+    }
+    for (i = parsed; i < proxy.argc; i++) {
+        if (cfg->entry_points_count >= MAX_ENTRY_POINTS) break;
+        char *addr = zstrdup(proxy.argv[i]);
+        if (parseAddress(addr, &(cfg->entry_points[cfg->entry_points_count])))
+            cfg->entry_points_count++;
+        else freeEntryPoints(&(cfg->entry_points[cfg->entry_points_count]), 1);
+        zfree(addr);
+    }
+    checkConfig(cfg);
+    if (cfg->entry_points_count == 0) {
+        pthread_mutex_unlock(&config_lock);
+        *err = sdsnew("Missing cluster address");
+        freeStagingConfig(cfg);
+        return 0;
+    }
+    if (retired_config_strings == NULL) {
+        retired_config_strings = listCreate();
+        listSetFreeMethod(retired_config_strings, zfree);
+    }
+    applyStagingConfig(cfg);
+    proxyLogInfo("Configuration reloaded");
+    pthread_mutex_unlock(&config_lock);
+    freeStagingConfig(cfg);
+    return 1;
 }
 
 /* This function will try to raise the max number of open files accordingly to
@@ -1903,15 +2740,8 @@ static void checkTcpBacklogSettings(void) {
 #endif
 }
 
-static void initProxy(void) {
+void initCommandTable(void) {
     int i;
-    proxy.exit_asap = 0;
-    proxy.neterr[0] = '\0';
-    proxy.numclients = 0;
-    proxy.system_memory_size = zmalloc_get_memory_size();
-    proxy.min_reserved_fds = 10 + (config.num_threads * 3) +
-                             (proxy.fd_count * 2);
-    /* Populate commands table. */
     proxy.commands = raxNew();
     int command_count = sizeof(redisCommandTable) / sizeof(redisCommandDef);
     for (i = 0; i < command_count; i++) {
@@ -1921,24 +2751,58 @@ static void initProxy(void) {
         if (strcasecmp("auth", cmd->name) == 0) authCommandDef = cmd;
         else if (strcasecmp("scan", cmd->name) == 0) scanCommandDef = cmd;
     }
+}
+
+static int startProxyThread(int index) {
+    proxyLogDebug("Creating thread %d...", index);
+    proxyThread *thread = createProxyThread(index);
+    if (thread == NULL) return 0;
+    proxy.threads[index] = thread;
+    int nodecount = thread->cluster->masters_count +
+                    thread->cluster->replicas_count;
+    int poolsize = config.connections_pool.size;
+    if (poolsize <= 0) poolsize = 1;
+    thread->reserved_fds = 3 + (nodecount * poolsize);
+    /* File descriptors of threads started at runtime are reserved here,
+     * since the ones of the first threads are reserved at startup (see
+     * initProxy and createProxyThread). They're released by resizeThreads
+     * when the thread retires. */
+    if (index >= proxy.running_threads)
+        proxy.min_reserved_fds += thread->reserved_fds;
+    if (pthread_create(&(thread->thread), NULL, execProxyThread, thread)) {
+        freeProxyThread(thread);
+        return 0;
+    }
+    return 1;
+}
+
+static void initProxy(void) {
+    int i;
+    proxy.exit_asap = 0;
+    proxy.neterr[0] = '\0';
+    proxy.numclients = 0;
+    proxy.system_memory_size = zmalloc_get_memory_size();
+    proxy.min_reserved_fds = 10 + (config.num_threads * 3) +
+                             (proxy.fd_count * 2);
+    initCommandTable();
     proxy.main_loop = aeCreateEventLoop(proxy.min_reserved_fds);
-    proxy.threads = zmalloc(config.num_threads *
-                            sizeof(proxyThread *));
+    /* Slots are allocated for the max. number of threads, since threads can
+     * be added at runtime while other threads are reading the array. */
+    proxy.threads = zcalloc(MAX_THREADS * sizeof(proxyThread *));
     if (proxy.threads == NULL) {
         fprintf(stderr, "FATAL: failed to allocate memory for threads.\n");
         exit(1);
     }
+    proxy.requested_threads = config.num_threads;
+    proxy.running_threads = config.num_threads;
+    migrating_clients = listCreate();
+    if (migrating_clients == NULL) {
+        fprintf(stderr, "FATAL: failed to allocate memory for threads.\n");
+        exit(1);
+    }
     proxyLogHdr("Starting %d threads...", config.num_threads);
     for (i = 0; i < config.num_threads; i++) {
-        proxyLogDebug("Creating thread %d...", i);
-        proxy.threads[i] = NULL;
-        proxy.threads[i] = createProxyThread(i);
-        if (proxy.threads[i] == NULL) {
-            proxyLogErr("FATAL: failed to create thread %d.", i);
-            exit(1);
-        }
-        pthread_t *t = &(proxy.threads[i]->thread);
-        if (pthread_create(t, NULL, execProxyThread, proxy.threads[i])){
+        if (!startProxyThread(i)) {
             fprintf(stderr, "FATAL: Failed to start thread %d.\n", i);
             proxyLogErr("FATAL: Failed to start thread %d.", i);
             exit(1);
@@ -1947,11 +2811,17 @@ static void initProxy(void) {
     proxyLogHdr("All thread(s) started!");
 }
 
+/* Listening sockets (and the pidfile) belong to the new process once they
+ * have been handed off, or while the handoff is in progress. */
+static int ownsListeningSockets(void) {
+    return !proxy.listeners_handed_off && proxy.upgrade_fd == -1;
+}
+
 void closeListeningSockets() {
     int j;
     proxyLogInfo("Closing listening sockets.");
     for (j = 0; j < proxy.fd_count; j++) close(proxy.fds[j]);
-    if (config.unixsocket) {
+    if (config.unixsocket && ownsListeningSockets()) {
         proxyLogInfo("Removing the unix socket file.");
         unlink(config.unixsocket); /* don't care if this fails */
     }
@@ -1959,13 +2829,22 @@ void closeListeningSockets() {
 
 static void releaseProxy(void) {
     int i;
+    captureStop();
     if (proxy.main_loop != NULL) {
         aeStop(proxy.main_loop);
         aeDeleteEventLoop(proxy.main_loop);
         proxy.main_loop = NULL;
     }
+    if (migrating_clients != NULL) {
+        listIter li;
+        listNode *ln;
+        listRewind(migrating_clients, &li);
+        while ((ln = listNext(&li))) freeClient(ln->value);
+        listRelease(migrating_clients);
+        migrating_clients = NULL;
+    }
     if (proxy.threads != NULL) {
-        for (i = 0; i < config.num_threads; i++) {
+        for (i = 0; i < proxy.running_threads; i++) {
             proxyThread *thread =  proxy.threads[i];
             if (thread) freeProxyThread(thread);
             proxy.threads[i] = NULL;
@@ -1974,11 +2853,22 @@ static void releaseProxy(void) {
     }
     if (proxy.commands)
         raxFree(proxy.commands);
+    freeUserRateLimits();
     closeListeningSockets();
+    if (proxy.upgrade_fd != -1) close(proxy.upgrade_fd);
     for (i = 0; i < config.bindaddr_count; i++) {
         zfree(config.bindaddr[i]);
     }
-    if (config.pidfile && config.pidfile[0] != '\0') unlink(config.pidfile);
+    if (config.pidfile && config.pidfile[0] != '\0' && ownsListeningSockets())
+        unlink(config.pidfile);
+    pthread_mutex_lock(&topology_lock);
+    sdsfree(cluster_topology);
+    cluster_topology = NULL;
+    pthread_mutex_unlock(&topology_lock);
+    if (retired_config_strings != NULL) {
+        listRelease(retired_config_strings);
+        retired_config_strings = NULL;
+    }
 }
 
 void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -2000,6 +2890,10 @@ static void writeRepliesToClients(struct aeEventLoop *el) {
     while ((ln = listNext(&li)) != NULL) {
         client *c = ln->value;
         if (c->status == CLIENT_STATUS_UNLINKED) continue;
+        if (c->flags & CLIENT_CLOSE_ASAP) {
+            unlinkClient(c);
+            continue;
+        }
         if (!writeToClient(c)) continue;
         if (c->written > 0 && c->written < sdslen(c->obuf)) {
             if (installIOHandler(el, c->fd, AE_WRITABLE, writeHandler, c, 0)) {
@@ -2051,7 +2945,8 @@ static int processThreadPipeBufferForNewClients(proxyThread *thread) {
         /* If thread is going to be freed, free all clients that were
          * still waiting to be added on the thread itself. */
         if (thread->loop == NULL) {
-            if (c != NULL && c != (void*) THREAD_MSG_STOP) freeClient(c);
+            if (c != NULL && c != (void*) THREAD_MSG_STOP &&
+                c != (void*) THREAD_MSG_RETIRE) freeClient(c);
             processed++;
             continue;
         }
@@ -2062,8 +2957,28 @@ static int processThreadPipeBufferForNewClients(proxyThread *thread) {
             sdsrange(thread->msgbuffer, processed * msgsize, -1);
             return processed;
         }
+        if (c == (void*) THREAD_MSG_RETIRE) {
+            proxyLogInfo("Retiring thread %d", thread->thread_id);
+            int timeout = config.threads_retire_timeout;
+            thread->is_retiring = 1;
+            thread->retire_deadline =
+                (timeout > 0 ? mstime() + timeout * 1000LL : 0);
+            processed++;
+            continue;
+        }
         aeEventLoop *el = thread->loop;
         int added = 0;
+        if ((c->flags & CLIENT_MIGRATE_PRIVATE)) {
+            c->flags &= ~CLIENT_MIGRATE_PRIVATE;
+            if (!disableMultiplexingForClient(c)) {
+                proxyLogErr("Failed to create private connection for "
+                            "migrated client %d:%" PRId64, c->thread_id,
+                            c->id);
+                freeClient(c);
+                processed++;
+                continue;
+            }
+        }
         int *p_added = &added;
         addObjectToList(c, thread, clients, p_added);
         if (!added) {
@@ -2179,6 +3094,13 @@ static int populateConnectionsPool(proxyThread *thread, int rate) {
             if (conn == NULL) break;
             conn->context = redisConnectNonBlock(node->ip, node->port);
             if (conn->context == NULL) continue;
+            if (!clusterConnectionStartTLS(conn)) {
+                proxyLogWarn("Populate connection pool: failed to connect "
+                    "to node %s:%d: %s", node->ip, node->port,
+                    conn->context->errstr);
+                freeClusterConnection(conn);
+                continue;
+            }
             if (!installIOHandler(el, conn->context->fd, AE_WRITABLE,
                 writeToClusterHandler, conn, 0)) {
                 proxyLogWarn("Populate connection pool: failed to install "
@@ -2250,8 +3172,14 @@ static int recyclePrivateClusterConnection(client *c) {
             if (req != NULL) goto fail;
         }
         /* Reset connection lists and node.*/
+        listRewind(conn->requests_to_send, &nli);
+        while ((nln = listNext(&nli))) {
+            clientRequest *req = listNodeValue(nln);
+            if (req != NULL) dequeueRequestToSend(req);
+        }
         listEmpty(conn->requests_to_send);
         listEmpty(conn->requests_pending);
+        conn->inflight_bytes = 0;
         conn->node = NULL;
         /* Insert the connection by mapping it to the node's name. */
         raxInsert(connections, (unsigned char*) node->name,
@@ -2292,21 +3220,188 @@ finished:
     return AE_NOMORE;
 }
 
-static proxyThread *createProxyThread(int index) {
-    int is_first = (index == 0);
-    proxyThread *thread = zcalloc(sizeof(*thread));
-    if (thread == NULL) return NULL;
-    thread->loop = NULL;
-    if (pipe(thread->io) == -1) {
-        proxyLogErr("ERROR: failed to open pipe for thread!");
-        zfree(thread);
-        return NULL;
-    }
+/* Reply with an error to all the requests that have been held for longer
+ * than 'failover-hold-time' and free them. */
+static void expireHeldRequests(redisCluster *cluster) {
+    long long now = mstime();
+    listIter li;
+    listNode *ln;
+    listRewind(cluster->held_requests, &li);
+    while ((ln = listNext(&li))) {
+        clientRequest *req = ln->value;
+        if (config.failover_hold_time > 0 &&
+            (now - req->held_since) < config.failover_hold_time) continue;
+        proxyLogDebug("Request " REQID_PRINTF_FMT " held for too long, "
+                      "failover did not happen", REQID_PRINTF_ARG(req));
+        addReplyError(req->client, ERROR_FAILOVER_TIMEOUT, req->id);
+        freeRequest(req);
+    }
+}
+
+/* Function used by a time event (aeTimeEvent) that is registered whenever
+ * a request gets held while waiting for the failover of a failed master
+ * (configurable via '--failover-hold-time').
+ * At every cycle, requests held for too long are replied with an error and
+ * the cluster is checked in order to find out whether the failover has
+ * happened (or whether the failed masters are back again): in this case,
+ * held requests are processed again, after updating the cluster
+ * configuration if needed.
+ * The time event stops when there are no more held requests. */
+static int threadFailoverCron(aeEventLoop *el, long long id, void *data) {
+    proxyThread *thread = el->privdata;
+    UNUSED(id);
+    UNUSED(data);
+    redisCluster *cluster = thread->cluster;
+    if (cluster == NULL || cluster->held_requests == NULL) goto finished;
+    expireHeldRequests(cluster);
+    if (listLength(cluster->held_requests) == 0) goto finished;
+    if (cluster->is_updating) return FAILOVER_CHECK_INTERVAL;
+    if (cluster->broken) {
+        /* Held requests will be replied with an error by processRequest. */
+        processHeldRequests(cluster);
+        goto finished;
+    }
+    int status = clusterCheckFailedNodes(cluster);
+    if (status == CLUSTER_FAILOVER_RECOVERED) {
+        proxyLogInfo("Failed nodes are reachable again, processing %lu held "
+                     "request(s) (thread: %d)",
+                     listLength(cluster->held_requests), thread->thread_id);
+        processHeldRequests(cluster);
+    } else if (status == CLUSTER_FAILOVER_COMPLETED) {
+        proxyLogInfo("Failover detected, updating cluster configuration "
+                     "(thread: %d)", thread->thread_id);
+        cluster->is_updating = 1;
+        /* If the reconfiguration ends, held requests are processed by
+         * updateCluster itself. */
+        if (updateCluster(cluster) == CLUSTER_RECONFIG_ERR) {
+            proxyLogErr("Cluster reconfiguration failed! (thread %d)",
+                        thread->thread_id);
+            processHeldRequests(cluster);
+        }
+    }
+    if (listLength(cluster->held_requests) == 0) goto finished;
+    return FAILOVER_CHECK_INTERVAL;
+finished:
+    thread->is_checking_failover = 0;
+    return AE_NOMORE;
+}
+
+/* Flag the master node as failed, so that requests directed to it will be
+ * held until the failover happens. Only used if 'failover-hold-time' is
+ * enabled. */
+static void markClusterNodeAsFailed(clusterNode *node) {
+    if (node == NULL || node->is_replica || node->failed) return;
+    if (config.failover_hold_time <= 0) return;
+    if (node->cluster->is_updating || node->cluster->owner != NULL) return;
+    proxyLogWarn("Master node %s:%d failed, holding its requests for max. "
+                 "%d ms (thread: %d)", node->ip, node->port,
+                 config.failover_hold_time, node->cluster->thread_id);
+    node->failed = 1;
+}
+
+/* Hold the request while waiting for the failover of the failed master it
+ * was directed to: the request is removed from the node's queue and added
+ * to the cluster's `held_requests` list, from where it will be processed
+ * again as soon as the failover happens (see threadFailoverCron).
+ * Only requests using the thread's shared cluster can be held, excluding
+ * requests having child requests and requests under a MULTI transaction.
+ * Return 1 if the request has been held, 0 otherwise. */
+static int holdRequest(clientRequest *req) {
+    if (config.failover_hold_time <= 0) return 0;
+    client *c = req->client;
+    if (c->status == CLIENT_STATUS_UNLINKED || c->multi_transaction) return 0;
+    if (req->child_requests != NULL || req->parent_request != NULL) return 0;
+    if (req->owned_by_client || req->need_reprocessing) return 0;
+    proxyThread *thread = getThread(c);
+    redisCluster *cluster = thread->cluster;
+    if (cluster == NULL || getCluster(c) != cluster) return 0;
+    if (cluster->held_requests == NULL) return 0;
+    long long now = mstime();
+    if (req->held_since > 0 &&
+        (now - req->held_since) >= config.failover_hold_time) return 0;
+    if ((long) listLength(cluster->held_requests) >=
+        config.failover_hold_max_requests) return 0;
+    if (req->has_write_handler) {
+        redisContext *ctx = NULL;
+        if (req->node) ctx = getClusterNodeContext(req->node);
+        if (ctx != NULL && ctx->fd >= 0)
+            aeDeleteFileEvent(thread->loop, ctx->fd, AE_WRITABLE);
+        req->has_write_handler = 0;
+        c->requests_with_write_handler--;
+    }
+    if (req->node != NULL) dequeueRequestToSend(req);
+    req->node = NULL;
+    req->slot = UNDEFINED_SLOT;
+    req->written = 0;
+    if (req->held_since == 0) req->held_since = now;
+    if (listAddNodeTail(cluster->held_requests, req) == NULL) return 0;
+    req->held_requests_lnode = listLast(cluster->held_requests);
+    proxyLogDebug("Request " REQID_PRINTF_FMT " held while waiting for "
+                  "failover", REQID_PRINTF_ARG(req));
+    if (!thread->is_checking_failover) {
+        thread->is_checking_failover = 1;
+        aeCreateTimeEvent(thread->loop, FAILOVER_CHECK_INTERVAL,
+                          threadFailoverCron, NULL, NULL);
+    }
+    return 1;
+}
+
+/* Process again all the requests held while waiting for a failover. Requests
+ * directed to a master that is still flagged as failed will be held again. */
+void processHeldRequests(redisCluster *cluster) {
+    list *held = cluster->held_requests;
+    if (held == NULL || listLength(held) == 0) return;
+    cluster->held_requests = listCreate();
+    if (cluster->held_requests == NULL) {
+        cluster->held_requests = held;
+        return;
+    }
+    proxyLogDebug("Processing %lu held request(s) (thread: %d)",
+                  listLength(held), cluster->thread_id);
+    listIter li;
+    listNode *ln;
+    listRewind(held, &li);
+    while ((ln = listNext(&li))) {
+        clientRequest *req = ln->value;
+        req->held_requests_lnode = NULL;
+        processRequest(req, NULL, NULL);
+    }
+    listRelease(held);
+}
+
+static proxyThread *createProxyThread(int index) {
+    int is_first = (index == 0);
+    proxyThread *thread = zcalloc(sizeof(*thread));
+    if (thread == NULL) return NULL;
+    thread->loop = NULL;
+    if (pipe(thread->io) == -1) {
+        proxyLogErr("ERROR: failed to open pipe for thread!");
+        zfree(thread);
+        return NULL;
+    }
     thread->thread_id = index;
     thread->next_client_id = 0;
     thread->process_clients = 0;
+    thread->stat_net_input_bytes = 0;
+    thread->stat_net_cluster_input_bytes = 0;
+    thread->stat_client_reads = 0;
+    thread->stat_cluster_reads = 0;
+    thread->stat_read_budget_exhausted = 0;
+    thread->stat_client_throttles = 0;
+    thread->throttled_clients = 0;
+    thread->stat_node_busy_errors = 0;
+    thread->stat_node_queued_requests = 0;
+    thread->stat_node_queue_wait = 0;
     thread->connections_pool = listCreate();
     thread->is_spawning_connections = 0;
+    thread->is_checking_failover = 0;
+    thread->clients_obuf_size = 0;
+    thread->clients_qbuf_size = 0;
+    thread->clients_memory = 0;
+    thread->evicted_clients = 0;
+    thread->is_evicting_clients = 0;
+    thread->backpressure_client = NULL;
+    thread->is_checking_backpressure = 0;
     thread->cluster = createCluster(index);
     if (thread->cluster == NULL) {
         proxyLogErr("ERROR: failed to allocate cluster for thread: %d",
@@ -2315,9 +3410,12 @@ static proxyThread *createProxyThread(int index) {
         return NULL;
     }
     if (is_first) proxyLogHdr("Fetching cluster configuration...");
-    if (!fetchClusterConfiguration(thread->cluster, config.entry_points,
-                                   config.entry_points_count))
-    {
+    pthread_mutex_lock(&config_lock);
+    int fetched = fetchClusterConfiguration(thread->cluster,
+                                            config.entry_points,
+                                            config.entry_points_count);
+    pthread_mutex_unlock(&config_lock);
+    if (!fetched) {
         proxyLogErr("ERROR: Failed to fetch cluster configuration!");
         freeProxyThread(thread);
         return NULL;
@@ -2338,7 +3436,13 @@ static proxyThread *createProxyThread(int index) {
     thread->pending_messages = listCreate();
     if (thread->pending_messages == NULL) goto fail;
     listSetFreeMethod(thread->pending_messages, zfree);
-    int loopsize = proxy.min_reserved_fds + config.maxclients;
+    /* The event loop starts small and it grows (see installIOHandler)
+     * only when file descriptors that don't fit into it get registered, so
+     * that threads don't need to allocate events for every possible client
+     * (maxclients) from the start. */
+    int loopsize = proxy.min_reserved_fds + EVENT_LOOP_INITIAL_SIZE;
+    int maxloopsize = proxy.min_reserved_fds + config.maxclients;
+    if (loopsize > maxloopsize) loopsize = maxloopsize;
     thread->loop = aeCreateEventLoop(loopsize);
     if (thread->loop == NULL) {
         proxyLogErr("Failed to allocate event loop for thread %d", index);
@@ -2355,6 +3459,14 @@ static proxyThread *createProxyThread(int index) {
         goto fail;
     }
     thread->msgbuffer = sdsempty();
+    thread->readbuf = zmalloc(PROTO_IOBUF_LEN);
+    if (thread->readbuf == NULL) goto fail;
+    if (aeCreateTimeEvent(thread->loop, CLIENTS_CRON_INTERVAL,
+                          threadClientsCron, NULL, NULL) == AE_ERR)
+    {
+        proxyLogErr("Failed to create clients cron for thread %d", index);
+        goto fail;
+    }
     if (config.connections_pool.size > 0) populateConnectionsPool(thread, 0);
     return thread;
 fail:
@@ -2427,17 +3539,25 @@ static int awakeThreadForNewClient(proxyThread *thread, client *c) {
     return sendMessageToThread(thread, buf);
 }
 
-int sendStopMessageToThread(proxyThread *thread) {
-    proxyLogDebug("Sending stop message to thread %d", thread->thread_id);
+static int sendControlMessageToThread(proxyThread *thread, int msg) {
     sds buf = sdsempty();
     buf = sdsMakeRoomFor(buf, sizeof(void*));
-    int msg = THREAD_MSG_STOP;
     memset(buf, 0, sizeof(void*));
     memcpy(buf, &msg, sizeof(msg));
     sdsIncrLen(buf, sizeof(void*));
     return sendMessageToThread(thread, buf);
 }
 
+int sendStopMessageToThread(proxyThread *thread) {
+    proxyLogDebug("Sending stop message to thread %d", thread->thread_id);
+    return sendControlMessageToThread(thread, THREAD_MSG_STOP);
+}
+
+static int sendRetireMessageToThread(proxyThread *thread) {
+    proxyLogDebug("Sending retire message to thread %d", thread->thread_id);
+    return sendControlMessageToThread(thread, THREAD_MSG_RETIRE);
+}
+
 static void freeProxyThread(proxyThread *thread) {
     proxyLogDebug("Freeing thread %d", thread->thread_id);
     if (thread->loop != NULL) {
@@ -2482,6 +3602,7 @@ static void freeProxyThread(proxyThread *thread) {
     if (thread->io[0]) close(thread->io[0]);
     if (thread->io[1]) close(thread->io[1]);
     if (thread->msgbuffer) sdsfree(thread->msgbuffer);
+    if (thread->readbuf) zfree(thread->readbuf);
     if (thread->cluster != NULL) freeCluster(thread->cluster);
     if (thread->connections_pool != NULL) {
         listRewind(thread->connections_pool, &li);
@@ -2515,23 +3636,27 @@ static client *createClient(int fd, char *ip) {
         close(fd);
         return NULL;
     }
-    c->requests = listCreate();
-    if (c->requests == NULL) {
-        freeClient(c);
-        return NULL;
-    }
-    c->unordered_replies = raxNew();
-    if (c->unordered_replies == NULL) {
-        freeClient(c);
-        return NULL;
-    }
+    /* The requests list and the unordered replies are lazily created, in
+     * order to keep the footprint of idle clients as small as possible. */
+    c->requests = NULL;
     c->status = CLIENT_STATUS_NONE;
     c->flags = 0;
     c->fd = fd;
-    c->ip = ip ? sdsnew(ip) : NULL;
+    c->tls = NULL;
     c->port = 0;
     c->addr = NULL;
     c->obuf = sdsempty();
+    c->unordered_replies = NULL;
+    c->unordered_replies_slots = 0;
+    c->unordered_replies_count = 0;
+    c->unordered_replies_size = 0;
+    c->obuf_accounted_size = 0;
+    c->obuf_soft_limit_reached_time = 0;
+    c->qbuf_accounted_size = 0;
+    c->requests_memory = 0;
+    c->memory_accounted = 0;
+    c->last_interaction = time(NULL);
+    c->readlen = PROTO_IOBUF_LEN;
     c->reply_array = NULL;
     c->current_request = NULL;
     c->cluster = NULL;
@@ -2549,12 +3674,16 @@ static client *createClient(int fd, char *ip) {
     c->next_request_id = 0;
     c->min_reply_id = 0;
     c->requests_with_write_handler = 0;
-    c->requests_to_reprocess = listCreate();
+    c->requests_to_reprocess = NULL;
     c->pending_multiplex_requests = 0;
     c->multi_transaction = 0;
     c->multi_request = NULL;
     c->multi_transaction_node = NULL;
     c->auth_user = NULL;
+    c->priority = PRIORITY_INTERACTIVE;
+    initRateLimit(&c->rate_limit);
+    c->user_rate_limit = NULL;
+    c->throttle_timer_id = -1;
     c->auth_passw = NULL;
     c->clients_lnode = NULL;
     c->unlinked_clients_lnode = NULL;
@@ -2651,10 +3780,9 @@ static int disableMultiplexingForClient(client *c) {
                 continue;
             }
             /* Replace request node with duplicated node owned by the client */
+            dequeueRequestToSend(req);
             req->node = node;
-            int *p_ok = NULL;
-            addObjectToList(req, node->connection, requests_to_send, p_ok);
-            listDelNode(conn->requests_to_send, ln);
+            enqueueRequestToSend(req);
             req->owned_by_client = 1;
         }
         if (c->pending_multiplex_requests == 0) {
@@ -2724,8 +3852,7 @@ static void closeClientPrivateConnection(client *c) {
             aeDeleteFileEvent(el, ctx->fd, AE_WRITABLE);
         }
         conn->has_read_handler = 0;
-        redisFree(ctx);
-        conn->context = NULL;
+        clusterConnectionClose(conn);
     }
 }
 
@@ -2734,13 +3861,23 @@ static void unlinkClient(client *c) {
     proxyLogDebug("Unlink client %d:%" PRId64, c->thread_id, c->id);
     aeEventLoop *el = getClientLoop(c);
     if (c->fd >= 0) {
+        if (isCaptureActive()) captureClose(c->thread_id, c->id);
         if (el != NULL) {
             aeDeleteFileEvent(el, c->fd, AE_READABLE);
             aeDeleteFileEvent(el, c->fd, AE_WRITABLE);
         }
+        if (c->tls != NULL) {
+            tlsFree(c->tls);
+            c->tls = NULL;
+        }
         close(c->fd);
         c->fd = -1;
         proxy.numclients--;
+        if (c->throttle_timer_id != -1) {
+            if (el != NULL) aeDeleteTimeEvent(el, c->throttle_timer_id);
+            c->throttle_timer_id = -1;
+            getThread(c)->throttled_clients--;
+        }
         getThread(c)->process_clients--;
     }
     if (c->cluster != NULL) {
@@ -2752,9 +3889,15 @@ static void unlinkClient(client *c) {
         } else closeClientPrivateConnection(c);
     }
     proxyThread *thread = getThread(c);
+    if (thread->backpressure_client == c) resumeNodeReads(thread);
     int *p_ok = NULL;
     addObjectToList(c, thread, unlinked_clients, p_ok);
     removeObjectFromList(c, thread, clients);
+    /* Unlinked clients don't count against 'maxmemory' anymore, otherwise
+     * the eviction cron would evict more clients while the unlinked ones are
+     * waiting to be freed. */
+    thread->clients_memory -= c->memory_accounted;
+    c->memory_accounted = 0;
     c->status = CLIENT_STATUS_UNLINKED;
 }
 
@@ -2763,6 +3906,7 @@ static void freeAllClientRequests(client *c) {
     int unlinked = (c->status == CLIENT_STATUS_UNLINKED);
     listIter li;
     listNode *ln;
+    if (c->requests == NULL) return;
     listRewind(c->requests, &li);
     while ((ln = listNext(&li))) {
         clientRequest *req = ln->value;
@@ -2805,16 +3949,17 @@ static void freeClient(client *c) {
     proxyThread *thread = proxy.threads[thread_id];
     assert(thread != NULL);
     removeObjectFromList(c, thread, clients);
-    if (c->ip != NULL) sdsfree(c->ip);
+    thread->clients_obuf_size -= c->obuf_accounted_size;
+    thread->clients_qbuf_size -= c->qbuf_accounted_size;
+    if (thread->backpressure_client == c) resumeNodeReads(thread);
     if (c->addr != NULL) sdsfree(c->addr);
     if (c->obuf != NULL) sdsfree(c->obuf);
     if (c->reply_array != NULL) listRelease(c->reply_array);
     if (c->current_request) freeRequest(c->current_request);
     freeAllClientRequests(c);
-    listRelease(c->requests_to_reprocess);
-    listRelease(c->requests);
-    if (c->unordered_replies)
-        raxFreeWithCallback(c->unordered_replies, (void (*)(void*))sdsfree);
+    if (c->requests_to_reprocess) listRelease(c->requests_to_reprocess);
+    if (c->requests) listRelease(c->requests);
+    freeUnorderedReplies(c);
     if (c->cluster != NULL) {
         freeCluster(c->cluster);
     }
@@ -2825,12 +3970,580 @@ static void freeClient(client *c) {
     zfree(c);
 }
 
+/* Return the number of bytes still waiting to be written to the client,
+ * including replies that cannot be written yet since they're not ordered. */
+size_t getClientOutputBufferMemoryUsage(client *c) {
+    size_t used = c->unordered_replies_size;
+    if (c->obuf != NULL) used += sdslen(c->obuf) - c->written;
+    return used;
+}
+
+/* Return the memory used by the query buffer of the request that is
+ * currently being read from the client. */
+size_t getClientQueryBufferMemoryUsage(client *c) {
+    clientRequest *req = c->current_request;
+    if (req == NULL || req->buffer == NULL) return 0;
+    return sdsAllocSize(req->buffer);
+}
+
+/* Update the query buffer size accounted for the client in
+ * thread->clients_qbuf_size. */
+static void updateClientQueryBufferMemoryUsage(client *c) {
+    proxyThread *thread = getThread(c);
+    size_t used = getClientQueryBufferMemoryUsage(c);
+    thread->clients_qbuf_size -= c->qbuf_accounted_size;
+    thread->clients_qbuf_size += used;
+    c->qbuf_accounted_size = used;
+}
+
+/* Return the total memory used by the client: the client itself, query
+ * buffer, output buffer, unordered replies and requests that have been
+ * parsed but not replied yet. */
+size_t getClientMemoryUsage(client *c) {
+    return sizeof(*c) + getClientQueryBufferMemoryUsage(c) +
+           getClientOutputBufferMemoryUsage(c) +
+           c->requests_memory;
+}
+
+static int clientMemoryCompare(const void *a, const void *b) {
+    const client *ca = *((client **) a), *cb = *((client **) b);
+    if (ca->memory_accounted == cb->memory_accounted) return 0;
+    return (ca->memory_accounted < cb->memory_accounted ? 1 : -1);
+}
+
+/* Return the memory used by the clients of all the threads. */
+static size_t getClientsMemoryUsage(void) {
+    size_t total = 0;
+    int i;
+    for (i = 0; i < config.num_threads; i++) {
+        proxyThread *t = proxy.threads[i];
+        if (t != NULL) total += t->clients_memory;
+    }
+    return total;
+}
+
+/* Evict the thread's clients using the most memory, until the thread has
+ * released its share of the client memory exceeding 'maxmemory'. The share
+ * is proportional to the memory used by the thread's clients compared to the
+ * memory used by all the clients, so that threads don't evict more clients
+ * than needed. Only memory owned by clients is compared to the limit, so
+ * that memory used by the proxy itself never causes evictions, and clients
+ * using less than CLIENT_EVICTION_MIN_MEMORY are never evicted.
+ * Return 1 if client memory is still over the limit and the thread still
+ * has clients that can be evicted. */
+static int evictClients(proxyThread *thread) {
+    size_t total = getClientsMemoryUsage();
+    if (config.maxmemory == 0 || total <= config.maxmemory) return 0;
+    size_t excess = total - config.maxmemory;
+    int i, count = 0;
+    size_t thread_mem = thread->clients_memory;
+    if (thread_mem == 0) return 0;
+    size_t to_free = (size_t) ((double) excess * thread_mem / total);
+    if (to_free == 0) to_free = 1;
+    unsigned long numclients = listLength(thread->clients);
+    if (numclients == 0) return 0;
+    client **clients = zmalloc(sizeof(client *) * numclients);
+    if (clients == NULL) return 1;
+    listIter li;
+    listNode *ln;
+    listRewind(thread->clients, &li);
+    while ((ln = listNext(&li))) {
+        client *c = ln->value;
+        if (c == NULL || c->status == CLIENT_STATUS_UNLINKED) continue;
+        if (c->memory_accounted < CLIENT_EVICTION_MIN_MEMORY) continue;
+        clients[count++] = c;
+    }
+    if (count == 0) {
+        zfree(clients);
+        return 0;
+    }
+    qsort(clients, count, sizeof(client *), clientMemoryCompare);
+    size_t freed = 0;
+    for (i = 0; i < count && freed < to_free; i++) {
+        client *c = clients[i];
+        proxyLogWarn("Evicting client %d:%" PRId64 " from %s using %zu bytes "
+                     "(clients memory: %zu, maxmemory: %llu)", c->thread_id,
+                     c->id, c->addr, c->memory_accounted, total,
+                     config.maxmemory);
+        freed += c->memory_accounted;
+        thread->evicted_clients++;
+        unlinkClient(c);
+    }
+    zfree(clients);
+    return (count > i);
+}
+
+/* Function used by a time event (aeTimeEvent) that is registered whenever
+ * the memory used by the clients goes over 'maxmemory'. Memory is checked
+ * again at every cycle, since other threads may be evicting their clients
+ * too, and the event stops as soon as client memory is back under the limit
+ * or there are no more clients that can be evicted. */
+static int threadClientEvictionCron(aeEventLoop *el, long long id,
+                                    void *data)
+{
+    proxyThread *thread = el->privdata;
+    UNUSED(id);
+    UNUSED(data);
+    if (evictClients(thread)) return CLIENT_EVICTION_INTERVAL;
+    thread->is_evicting_clients = 0;
+    return AE_NOMORE;
+}
+
+/* Update the memory accounted for the client in thread->clients_memory and
+ * start evicting clients if client memory is over 'maxmemory'. Eviction is
+ * always performed by a time event, since clients cannot be safely unlinked
+ * while they're being processed. */
+static void updateClientMemoryUsage(client *c) {
+    if (c->status == CLIENT_STATUS_UNLINKED) return;
+    proxyThread *thread = getThread(c);
+    size_t used = getClientMemoryUsage(c);
+    if (used != c->memory_accounted) {
+        thread->clients_memory -= c->memory_accounted;
+        thread->clients_memory += used;
+        c->memory_accounted = used;
+    }
+    if (config.maxmemory == 0 || thread->is_evicting_clients) return;
+    if (getClientsMemoryUsage() <= config.maxmemory) return;
+    if (aeCreateTimeEvent(thread->loop, 1, threadClientEvictionCron, NULL,
+                          NULL) == AE_ERR)
+    {
+        proxyLogErr("Failed to start client eviction on thread %d",
+                    thread->thread_id);
+        return;
+    }
+    thread->is_evicting_clients = 1;
+}
+
+/* Release the memory that an idle client doesn't need anymore: free space in
+ * its buffers, the unordered replies ring and the requests list. Its read
+ * size also gets reset. */
+static void compactIdleClient(client *c) {
+    c->readlen = PROTO_IOBUF_LEN;
+    if (c->obuf != NULL && sdsavail(c->obuf) > 0)
+        c->obuf = sdsRemoveFreeSpace(c->obuf);
+    clientRequest *req = c->current_request;
+    if (req != NULL && req->buffer != NULL && sdsavail(req->buffer) > 0)
+        req->buffer = sdsRemoveFreeSpace(req->buffer);
+    if (c->unordered_replies != NULL && c->unordered_replies_count == 0)
+        freeUnorderedReplies(c);
+    if (c->requests != NULL && listLength(c->requests) == 0) {
+        listRelease(c->requests);
+        c->requests = NULL;
+    }
+    if (c->requests_to_reprocess != NULL &&
+        listLength(c->requests_to_reprocess) == 0)
+    {
+        listRelease(c->requests_to_reprocess);
+        c->requests_to_reprocess = NULL;
+    }
+    updateClientQueryBufferMemoryUsage(c);
+    updateClientMemoryUsage(c);
+}
+
+/* Function used by a time event (aeTimeEvent) that is always active on every
+ * thread. At every cycle, it checks a part of the thread's clients (so that
+ * every client gets checked about once per second) and it compacts clients
+ * that have been idle for more than CLIENT_IDLE_COMPACT_TIME seconds.
+ * Clients over their output buffer soft limit are checked again, so that
+ * they get closed when they stay over it for too long even if they're not
+ * receiving new replies. */
+static int threadClientsCron(aeEventLoop *el, long long id, void *data) {
+    proxyThread *thread = el->privdata;
+    UNUSED(id);
+    UNUSED(data);
+    if (proxy.draining) drainThreadClients(thread);
+    else if (thread->is_retiring) retireThreadClients(thread);
+    unsigned long numclients = listLength(thread->clients);
+    unsigned long iterations = numclients / (1000 / CLIENTS_CRON_INTERVAL);
+    if (iterations < CLIENTS_CRON_MIN_ITERATIONS)
+        iterations = CLIENTS_CRON_MIN_ITERATIONS;
+    if (iterations > numclients) iterations = numclients;
+    time_t now = time(NULL);
+    while (iterations--) {
+        /* Rotate the list, take the current head and process it. */
+        listRotate(thread->clients);
+        listNode *head = listFirst(thread->clients);
+        client *c = listNodeValue(head);
+        if (c == NULL || c->status == CLIENT_STATUS_UNLINKED) continue;
+        if (c->obuf_soft_limit_reached_time != 0)
+            checkClientOutputBufferLimits(c);
+        if ((now - c->last_interaction) < CLIENT_IDLE_COMPACT_TIME) continue;
+        compactIdleClient(c);
+    }
+    return CLIENTS_CRON_INTERVAL;
+}
+
+static int getClientType(client *c) {
+    if (c->cluster != NULL) return CLIENT_TYPE_PRIVATE;
+    return CLIENT_TYPE_NORMAL;
+}
+
+/* Reads from a client can be paused because of its output buffer
+ * (CLIENT_READ_PAUSED), because of its rate limits (CLIENT_READ_THROTTLED),
+ * because the proxy is draining (CLIENT_READ_DRAINING) or because the
+ * client is being migrated to another thread (CLIENT_READ_MIGRATING): reads
+ * are only resumed after all the flags have been cleared. */
+static void pauseClientReads(client *c, int flag) {
+    if (c->flags & flag) return;
+    int paused = (c->flags & CLIENT_READ_PAUSED_FLAGS);
+    c->flags |= flag;
+    if (paused) return;
+    aeEventLoop *el = getClientLoop(c);
+    if (c->fd >= 0) aeDeleteFileEvent(el, c->fd, AE_READABLE);
+    proxyLogDebug("Client %d:%" PRId64 " reads paused (%s)", c->thread_id,
+                  c->id, (flag == CLIENT_READ_PAUSED ?
+                          "output buffer soft limit reached" :
+                          (flag == CLIENT_READ_THROTTLED ? "throttled" :
+                           (flag == CLIENT_READ_DRAINING ?
+                            "draining" : "migrating"))));
+}
+
+static void resumeClientReads(client *c, int flag) {
+    if (!(c->flags & flag)) return;
+    c->flags &= ~flag;
+    if (c->flags & CLIENT_READ_PAUSED_FLAGS) return;
+    if (c->fd < 0) return;
+    aeEventLoop *el = getClientLoop(c);
+    if (!installIOHandler(el, c->fd, AE_READABLE, readQuery, c, 0)) {
+        proxyLogErr("Failed to resume reads for client %d:%" PRId64,
+                    c->thread_id, c->id);
+        c->flags |= CLIENT_CLOSE_ASAP;
+        return;
+    }
+    proxyLogDebug("Client %d:%" PRId64 " reads resumed", c->thread_id, c->id);
+}
+
+/* Drain mode.
+ *
+ * While draining, the proxy doesn't accept new connections and doesn't read
+ * new queries from its clients, but requests already read are still sent to
+ * the cluster and their replies written to clients. Every thread closes its
+ * clients as soon as they have no more pending requests nor replies to
+ * write, and the proxy exits when all the clients are gone or when the drain
+ * timeout expires (see proxyCron). */
+
+static void startDrain(int timeout) {
+    long long deadline = (timeout > 0 ? mstime() + timeout * 1000LL : 0);
+    int draining = proxy.draining;
+    proxy.drain_deadline = deadline;
+    proxy.draining = 1;
+    if (timeout > 0)
+        proxyLogHdr("%s drain mode (timeout: %ds)",
+                    (draining ? "Updating" : "Entering"), timeout);
+    else
+        proxyLogHdr("%s drain mode (no timeout)",
+                    (draining ? "Updating" : "Entering"));
+}
+
+/* Requests that have been read from the client and are still waiting for
+ * their replies. The request currently being read is not counted, since it
+ * will never be completed while draining. */
+static int hasPendingRequests(client *c) {
+    listIter li;
+    listNode *ln;
+    if (c->requests == NULL) return 0;
+    listRewind(c->requests, &li);
+    while ((ln = listNext(&li))) {
+        clientRequest *req = ln->value;
+        if (req != NULL && req != c->current_request) return 1;
+    }
+    return 0;
+}
+
+static void drainThreadClients(proxyThread *thread) {
+    listIter li;
+    listNode *ln;
+    listRewind(thread->clients, &li);
+    while ((ln = listNext(&li))) {
+        client *c = ln->value;
+        if (c == NULL || c->status == CLIENT_STATUS_UNLINKED) continue;
+        pauseClientReads(c, CLIENT_READ_DRAINING);
+        if (hasPendingRequests(c) || c->unordered_replies_count > 0 ||
+            (c->obuf != NULL && sdslen(c->obuf) > 0)) continue;
+        proxyLogDebug("Closing idle client %d:%" PRId64 " (draining)",
+                      c->thread_id, c->id);
+        freeClient(c);
+    }
+}
+
+/* Threads resize.
+ *
+ * New threads are started by the main thread and they immediately receive
+ * new clients. Retiring threads don't receive new clients anymore: they
+ * pause reads from their clients and, as soon as a client has no more
+ * pending requests nor replies to write, they detach it from their event
+ * loop and hand it over to the main thread, which assigns it to the
+ * thread with less clients, just like a new client (see resizeThreads).
+ * Clients in a MULTI transaction are migrated after EXEC or DISCARD.
+ * Clients that still can't be migrated when the retire timeout expires
+ * (ie. clients that never leave MULTI or that always have a pending request)
+ * are closed. Once all its clients are gone, the retiring thread stops and
+ * it's joined by the main thread. */
+
+static int canMigrateClient(client *c) {
+    if (c->status != CLIENT_STATUS_LINKED) return 0;
+    if (c->flags & (CLIENT_CLOSE_AFTER_REPLY | CLIENT_CLOSE_ASAP)) return 0;
+    if (c->flags & (CLIENT_READ_PAUSED_FLAGS & ~CLIENT_READ_MIGRATING))
+        return 0;
+    if (c->multi_transaction || c->throttle_timer_id != -1) return 0;
+    if (hasPendingRequests(c) || c->requests_with_write_handler > 0 ||
+        c->pending_multiplex_requests > 0) return 0;
+    if (c->requests_to_reprocess != NULL &&
+        listLength(c->requests_to_reprocess) > 0) return 0;
+    if (c->unordered_replies_count > 0 || c->has_write_handler) return 0;
+    if (c->obuf != NULL && sdslen(c->obuf) > 0) return 0;
+    /* The request being read can be completed by the new thread, as long
+     * as it has not been routed yet. */
+    if (c->current_request != NULL && c->current_request->node != NULL)
+        return 0;
+    return 1;
+}
+
+static void migrateClient(client *c) {
+    proxyThread *thread = getThread(c);
+    proxyLogDebug("Migrating client %d:%" PRId64, c->thread_id, c->id);
+    aeDeleteFileEvent(thread->loop, c->fd, AE_READABLE | AE_WRITABLE);
+    if (isCaptureActive()) captureClose(c->thread_id, c->id);
+    /* Connections of private clusters are registered into the thread's
+     * event loop, so the private cluster is re-created by the new thread
+     * (authenticating with the client's credentials). */
+    if (c->cluster != NULL) {
+        if (!recyclePrivateClusterConnection(c))
+            closeClientPrivateConnection(c);
+        freeCluster(c->cluster);
+        c->cluster = NULL;
+        c->flags |= CLIENT_MIGRATE_PRIVATE;
+    }
+    removeObjectFromList(c, thread, clients);
+    if (thread->backpressure_client == c) resumeNodeReads(thread);
+    thread->clients_obuf_size -= c->obuf_accounted_size;
+    thread->clients_qbuf_size -= c->qbuf_accounted_size;
+    thread->clients_memory -= c->memory_accounted;
+    c->obuf_accounted_size = 0;
+    c->qbuf_accounted_size = 0;
+    c->memory_accounted = 0;
+    c->flags &= ~CLIENT_READ_MIGRATING;
+    c->status = CLIENT_STATUS_NONE;
+    thread->process_clients--;
+    pthread_mutex_lock(&migrating_clients_lock);
+    listAddNodeTail(migrating_clients, c);
+    pthread_mutex_unlock(&migrating_clients_lock);
+}
+
+static void retireThreadClients(proxyThread *thread) {
+    listIter li;
+    listNode *ln;
+    int timedout = (thread->retire_deadline > 0 &&
+                    mstime() >= thread->retire_deadline);
+    if (timedout && listLength(thread->clients) > 0) {
+        proxyLogWarn("Retire timeout reached on thread %d, closing the "
+                     "clients that can't be migrated", thread->thread_id);
+    }
+    listRewind(thread->clients, &li);
+    while ((ln = listNext(&li))) {
+        client *c = ln->value;
+        if (c == NULL || c->status == CLIENT_STATUS_UNLINKED) continue;
+        if (!c->multi_transaction) pauseClientReads(c, CLIENT_READ_MIGRATING);
+        if (canMigrateClient(c)) migrateClient(c);
+        else if (timedout) {
+            proxyLogDebug("Closing client %d:%" PRId64 " (retire timeout)",
+                          c->thread_id, c->id);
+            freeClient(c);
+        }
+    }
+    if (listLength(thread->clients) > 0 || sdslen(thread->msgbuffer) > 0 ||
+        listLength(thread->pending_messages) > 0) return;
+    proxyLogInfo("All clients of thread %d migrated", thread->thread_id);
+    thread->is_retiring = 0;
+    thread->retired = 1;
+    aeStop(thread->loop);
+}
+
+static int hasClientRateLimits(client *c) {
+    if (config.client_max_ops > 0 || config.client_max_bytes > 0) return 1;
+    return (c->user_rate_limit != NULL &&
+            (config.user_max_ops > 0 || config.user_max_bytes > 0));
+}
+
+/* Charge the rate limits of the client (and of its user, if any) with the
+ * queries and the bytes that have just been read from it, and return the
+ * milliseconds during which reads from the client have to be paused. */
+static long long chargeClientRateLimits(client *c, long long ops,
+                                        long long bytes)
+{
+    long long now = ustime();
+    long long delay = chargeRateLimit(&c->rate_limit, config.client_max_ops,
+                                      config.client_max_bytes, ops, bytes,
+                                      now);
+    if (c->user_rate_limit != NULL) {
+        long long user_delay =
+            chargeUserRateLimit(c->user_rate_limit, config.user_max_ops,
+                                config.user_max_bytes, ops, bytes, now);
+        if (user_delay > delay) delay = user_delay;
+    }
+    return delay;
+}
+
+static int clientThrottleTimer(aeEventLoop *el, long long id, void *data) {
+    UNUSED(el);
+    UNUSED(id);
+    client *c = data;
+    long long delay = chargeClientRateLimits(c, 0, 0);
+    if (delay > 0) return delay;
+    c->throttle_timer_id = -1;
+    getThread(c)->throttled_clients--;
+    resumeClientReads(c, CLIENT_READ_THROTTLED);
+    return AE_NOMORE;
+}
+
+/* Pause reads from a client that exceeded its rate limits for 'delay'
+ * milliseconds. Queries already read are still processed: the client just
+ * stops sending new ones until the rate limits have been refilled. */
+static void throttleClient(client *c, long long delay) {
+    if (delay <= 0 || c->throttle_timer_id != -1) return;
+    if (c->flags & (CLIENT_CLOSE_AFTER_REPLY | CLIENT_CLOSE_ASAP)) return;
+    aeEventLoop *el = getClientLoop(c);
+    long long id = aeCreateTimeEvent(el, delay, clientThrottleTimer, c, NULL);
+    if (id == AE_ERR) {
+        proxyLogErr("Failed to throttle client %d:%" PRId64, c->thread_id,
+                    c->id);
+        return;
+    }
+    c->throttle_timer_id = id;
+    proxyThread *thread = getThread(c);
+    thread->stat_client_throttles++;
+    thread->throttled_clients++;
+    pauseClientReads(c, CLIENT_READ_THROTTLED);
+}
+
+/* Resume reads on all the shared node connections that have been paused
+ * because of the output buffer of `thread->backpressure_client`. */
+static void resumeNodeReads(proxyThread *thread) {
+    thread->backpressure_client = NULL;
+    if (thread->cluster == NULL || thread->cluster->nodes == NULL) return;
+    listIter li;
+    listNode *ln;
+    listRewind(thread->cluster->nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *node = ln->value;
+        redisClusterConnection *conn = node->connection;
+        if (conn == NULL || !conn->reads_paused) continue;
+        conn->reads_paused = 0;
+        redisContext *ctx = conn->context;
+        if (ctx == NULL || ctx->fd < 0 || conn->has_read_handler) continue;
+        if (installIOHandler(thread->loop, ctx->fd, AE_READABLE,
+                             readClusterReply, conn, 0))
+        {
+            conn->has_read_handler = 1;
+        } else {
+            proxyLogErr("Failed to resume reads from node %s:%d",
+                        node->ip, node->port);
+        }
+    }
+}
+
+/* Function used by a time event (aeTimeEvent) that is registered whenever
+ * a client starts causing backpressure on shared node connections. It
+ * checks the client's output buffer limits, so that the client gets closed
+ * if it stays over its soft limit for too long, and it stops as soon as the
+ * client is not causing backpressure anymore. */
+static int threadBackpressureCron(aeEventLoop *el, long long id, void *data) {
+    proxyThread *thread = el->privdata;
+    UNUSED(id);
+    UNUSED(data);
+    client *c = thread->backpressure_client;
+    if (c == NULL) goto finished;
+    checkClientOutputBufferLimits(c);
+    if (thread->backpressure_client == NULL) goto finished;
+    return BACKPRESSURE_CHECK_INTERVAL;
+finished:
+    thread->is_checking_backpressure = 0;
+    return AE_NOMORE;
+}
+
+/* Flag the client as causing backpressure if, being over its soft limit, it
+ * holds most of the bytes buffered by the thread's clients: shared node
+ * connections then stop being read while their next reply is for the
+ * client (see readClusterReply). Backpressure is only applied if the soft
+ * limit has a time limit, so that reads will be resumed at the latest when
+ * the client gets closed. */
+static void checkClientBackpressure(client *c, clientBufferLimitsConfig *limits,
+                                    size_t used)
+{
+    proxyThread *thread = getThread(c);
+    if (thread->backpressure_client != NULL) return;
+    if (limits->soft_limit_seconds <= 0) return;
+    if (used * 100 < thread->clients_obuf_size * BACKPRESSURE_CLIENT_OBUF_PERC)
+        return;
+    proxyLogDebug("Client %d:%" PRId64 " holds %zu of %zu output buffer bytes,"
+                  " pausing its replies on shared connections", c->thread_id,
+                  c->id, used, (size_t) thread->clients_obuf_size);
+    thread->backpressure_client = c;
+    if (!thread->is_checking_backpressure) {
+        thread->is_checking_backpressure = 1;
+        aeCreateTimeEvent(thread->loop, BACKPRESSURE_CHECK_INTERVAL,
+                          threadBackpressureCron, NULL, NULL);
+    }
+}
+
+/* Update the thread's output buffers accounting and check the client's
+ * output buffer against the limits configured for its class (see the
+ * 'client-output-buffer-limit' option):
+ *  - Over the soft limit, reads from the client are paused until its buffer
+ *    gets drained. If the client also holds most of the bytes buffered by
+ *    the thread, shared node connections stop being read while their next
+ *    reply is for the client, so that the nodes buffer its replies. The
+ *    other connections are still read, so that the other clients are only
+ *    delayed by replies queued behind the client's ones.
+ *  - Over the hard limit, or over the soft limit for more than the
+ *    configured seconds, the client is flagged to be closed ASAP. */
+void checkClientOutputBufferLimits(client *c) {
+    if (c->status == CLIENT_STATUS_UNLINKED) return;
+    proxyThread *thread = getThread(c);
+    size_t used = getClientOutputBufferMemoryUsage(c);
+    thread->clients_obuf_size -= c->obuf_accounted_size;
+    thread->clients_obuf_size += used;
+    c->obuf_accounted_size = used;
+    updateClientMemoryUsage(c);
+    clientBufferLimitsConfig *limits =
+        &(config.client_obuf_limits[getClientType(c)]);
+    int hard = (limits->hard_limit_bytes && used >= limits->hard_limit_bytes);
+    int soft = (limits->soft_limit_bytes && used >= limits->soft_limit_bytes);
+    if (soft) {
+        time_t now = time(NULL);
+        if (c->obuf_soft_limit_reached_time == 0)
+            c->obuf_soft_limit_reached_time = now;
+        else if (limits->soft_limit_seconds > 0 &&
+                 (now - c->obuf_soft_limit_reached_time) >
+                 limits->soft_limit_seconds) hard = 1;
+    } else c->obuf_soft_limit_reached_time = 0;
+    if (hard) {
+        if (!(c->flags & CLIENT_CLOSE_ASAP)) {
+            proxyLogWarn("Client %d:%" PRId64 " scheduled to be closed ASAP "
+                         "for overcoming of output buffer limits "
+                         "(%zu bytes)", c->thread_id, c->id, used);
+            c->flags |= CLIENT_CLOSE_ASAP;
+        }
+        if (thread->backpressure_client == c) resumeNodeReads(thread);
+        return;
+    }
+    if (soft) {
+        pauseClientReads(c, CLIENT_READ_PAUSED);
+        checkClientBackpressure(c, limits, used);
+    } else {
+        resumeClientReads(c, CLIENT_READ_PAUSED);
+        if (thread->backpressure_client == c) resumeNodeReads(thread);
+    }
+}
+
 static int writeToClient(client *c) {
     if (c->status == CLIENT_STATUS_UNLINKED) return 0;
     int success = 1, buflen = sdslen(c->obuf), nwritten = 0;
     if (buflen == 0) return 1;
     while (c->written < (size_t) buflen) {
-        nwritten = write(c->fd, c->obuf + c->written, buflen - c->written);
+        char *p = c->obuf + c->written;
+        size_t len = buflen - c->written;
+        nwritten = (c->tls ? tlsWrite(c->tls, p, len) : write(c->fd, p, len));
         if (nwritten <= 0) break;
         c->written += nwritten;
     }
@@ -2857,6 +4570,7 @@ static int writeToClient(client *c) {
         }
         if (c->flags & CLIENT_CLOSE_AFTER_REPLY) unlinkClient(c);
     }
+    if (c->status != CLIENT_STATUS_UNLINKED) checkClientOutputBufferLimits(c);
     return success;
 }
 
@@ -2874,7 +4588,7 @@ static void writeToClusterHandler(aeEventLoop *el, int fd, void *privdata,
     int thread_id = thread->thread_id;
     char *ip = ctx->tcp.host;
     int port = ctx->tcp.port;
-    if (node != NULL) req = getFirstRequestToSend(node, NULL);
+    if (node != NULL) req = getNextRequestToSend(node);
     if (req != NULL && req->owned_by_client &&
         req->client->status == CLIENT_STATUS_UNLINKED)
     {
@@ -2888,7 +4602,7 @@ static void writeToClusterHandler(aeEventLoop *el, int fd, void *privdata,
         return;
     }
     if (connection->authenticating) {
-        if (redisBufferWrite(ctx, NULL) == REDIS_ERR) {
+        if (clusterConnectionFlush(connection, NULL) == REDIS_ERR) {
             if (req != NULL) {
                 addReplyError(req->client, "AUTH failed", req->id);
                 freeRequest(req);
@@ -2898,6 +4612,12 @@ static void writeToClusterHandler(aeEventLoop *el, int fd, void *privdata,
     }
     if (ctx->err) {
         proxyLogErr("Failed to connect to node %s:%d", ip, port);
+        markClusterNodeAsFailed(node);
+        if (node != NULL && node->failed) {
+            /* Requests to send will be held by onClusterNodeDisconnection */
+            clusterNodeDisconnect(node);
+            return;
+        }
         if (req != NULL) {
             sds err = sdsnew(ERROR_NODE_DISCONNECTED);
             err = sdscatprintf(err, "%s:%d", ip, port);
@@ -2907,7 +4627,7 @@ static void writeToClusterHandler(aeEventLoop *el, int fd, void *privdata,
         }
         return;
     }
-    if (!connection->has_read_handler) {
+    if (!connection->has_read_handler && !connection->reads_paused) {
         if (!installIOHandler(el, ctx->fd, AE_READABLE, readClusterReply,
                               connection, 0))
         {
@@ -2939,6 +4659,7 @@ static void writeToClusterHandler(aeEventLoop *el, int fd, void *privdata,
         }
     }
     connection->connected = 1;
+    if (node != NULL) node->failed = 0;
     /* Try to automatically authenticate if config.auth has been set.
      * It the connection is private (no multiplexing), check if the client
      * tried to authenticate with different credentials from the ones
@@ -3007,8 +4728,12 @@ static int writeToCluster(aeEventLoop *el, int fd, clientRequest *req) {
     }
     size_t buflen = sdslen(req->buffer);
     int nwritten = 0;
+    redisClusterConnection *conn = getRequestConnection(req);
+    tlsConnection *tls = (conn ? conn->tls : NULL);
     while (req->written < buflen) {
-        nwritten = write(fd, req->buffer + req->written, buflen - req->written);
+        char *p = req->buffer + req->written;
+        size_t len = buflen - req->written;
+        nwritten = (tls ? tlsWrite(tls, p, len) : write(fd, p, len));
         if (nwritten <= 0) break;
         req->written += nwritten;
     }
@@ -3018,6 +4743,15 @@ static int writeToCluster(aeEventLoop *el, int fd, clientRequest *req) {
         } else {
             proxyLogWarn("Error writing request " REQID_PRINTF_FMT
                 "to cluster: %s", REQID_PRINTF_ARG(req), strerror(errno));
+            clusterNode *node = req->node;
+            if (errno == EPIPE || errno == ECONNREFUSED ||
+                errno == ECONNRESET) markClusterNodeAsFailed(node);
+            if (node->failed && holdRequest(req)) {
+                /* Disconnecting the node will also hold all the other
+                 * requests still waiting to be sent to it. */
+                clusterNodeDisconnect(node);
+                return 1;
+            }
             if (errno == EPIPE) {
                 clusterNodeDisconnect(req->node);
             } else {
@@ -3085,7 +4819,7 @@ static int writeToCluster(aeEventLoop *el, int fd, clientRequest *req) {
         /* Request has not been completely written, so try to install the write
          * handler. */
         if (!installIOHandler(el, fd, AE_WRITABLE, writeToClusterHandler,
-            req->node, 0))
+            req->node->connection, 0))
         {
             addReplyError(req->client, ERROR_CLUSTER_WRITE_FAIL, req->id);
             proxyLogErr("Failed to create write handler for request "
@@ -3124,6 +4858,7 @@ void onClusterNodeDisconnection(clusterNode *node) {
         if (thread != NULL && (el = thread->loop))
             aeDeleteFileEvent(el, ctx->fd, AE_WRITABLE | AE_READABLE);
         connection->has_read_handler = 0;
+        connection->reads_paused = 0;
         redisCluster *cluster = node->cluster;
         assert(cluster != NULL);
         if (cluster->is_updating) return;
@@ -3139,6 +4874,10 @@ void onClusterNodeDisconnection(clusterNode *node) {
             clientRequest *req = ln->value;
             if (req == NULL) continue;
             assert(req->node == node);
+            /* If the node has been flagged as failed, requests that have
+             * not been completely written can be held until the failover
+             * happens. */
+            if (node->failed && holdRequest(req)) continue;
             /* If the request has a write handler installed, it means that
              * it could not have completely written its buffer to the node.
              * In this case, the client should receive the reply error and
@@ -3164,6 +4903,10 @@ void onClusterNodeDisconnection(clusterNode *node) {
             dequeuePendingRequest(req);
             freeRequest(req);
         }
+        /* Ghost requests left in the queue will never get a reply, since
+         * replies for the new connection will start from scratch. */
+        listEmpty(connection->requests_pending);
+        connection->inflight_bytes = 0;
         sdsfree(err);
     }
 }
@@ -3238,9 +4981,14 @@ static int listen(void) {
     return fd_idx;
 }
 
+/* Ensure that the request's offsets and lengths can hold the argument at
+ * index 'argc'. They're grown geometrically, so that parsing a query with
+ * many arguments only reallocates them a few times. */
 static int requestMakeRoomForArgs(clientRequest *req, int argc) {
     if (argc >= req->offsets_size) {
         int new_size = argc + QUERY_OFFSETS_MIN_SIZE;
+        if (new_size < req->offsets_size * 2)
+            new_size = req->offsets_size * 2;
         size_t sz = new_size * sizeof(int);
         req->offsets = zrealloc(req->offsets, sz);
         req->lengths = zrealloc(req->lengths, sz);
@@ -3254,6 +5002,34 @@ static int requestMakeRoomForArgs(clientRequest *req, int argc) {
     return 1;
 }
 
+/* Create an already parsed request for the complete multibulk query at the
+ * beginning of 'buf'. Returns the length of the query, or 0 if the query is
+ * not complete or if it cannot be parsed by the fast path (in the latter
+ * case, it will be parsed by parseRequest, that will take care of errors). */
+static long long createParsedRequest(client *c, const char *buf, size_t len) {
+    int argc = 0;
+    long long qlen = respScanMultibulk(buf, len, config.proto_max_bulk_len,
+                                       &argc, NULL, NULL);
+    if (qlen <= 0) return 0;
+    clientRequest *req = createRequest(c);
+    if (req == NULL) return -1;
+    if (!requestMakeRoomForArgs(req, argc)) {
+        freeRequest(req);
+        return -1;
+    }
+    sdsfree(req->buffer);
+    req->buffer = sdsnewlen(buf, qlen);
+    respScanMultibulk(req->buffer, qlen, config.proto_max_bulk_len, &argc,
+                      req->offsets, req->lengths);
+    req->argc = argc;
+    req->is_multibulk = 1;
+    req->num_commands = 1;
+    req->pending_bulks = 0;
+    req->query_offset = qlen;
+    req->parsing_status = PARSE_STATUS_OK;
+    return qlen;
+}
+
 static int splitPipelinedQueries(clientRequest *req, char *p, int is_inline) {
     /* Multiple commands (queries) from a pipelined request.
      * Split current requestinto multiple requests. */
@@ -3263,27 +5039,38 @@ static int splitPipelinedQueries(clientRequest *req, char *p, int is_inline) {
                   req->num_commands,
                   REQID_PRINTF_ARG(req));
     int buflen = sdslen(req->buffer);
+    char *end = req->buffer + buflen;
     client *c = req->client;
     /* Truncate current request buffer */
     req->query_offset = p - req->buffer;
-    sds newbuf = sdsnewlen(p, buflen - req->query_offset);
     sds reqbuf = sdsnewlen(req->buffer, req->query_offset);
-    sdsfree(req->buffer);
-    req->buffer = reqbuf;
     req->num_commands = 1;
     req->pending_bulks = 0;
-    /* Create a new request with the remaining buffer */
-    clientRequest *new = createRequest(c);
-    new->buffer = sdscat(new->buffer, newbuf);
-    sdsfree(newbuf);
-    /* Set the new request as current in order to accept
-     * new bytes read from client. */
-    c->current_request = new;
+    /* All the complete multibulk queries that follow are parsed in a single
+     * pass and every one of them gets its own (already parsed) request, so
+     * that the remaining buffer doesn't need to be copied again for every
+     * query of the pipeline. */
+    if (!is_inline && !config.dump_queries) {
+        while (p < end) {
+            long long qlen = createParsedRequest(c, p, end - p);
+            if (qlen <= 0) break;
+            p += qlen;
+        }
+    }
+    /* Create a new request with the remaining buffer: it also becomes the
+     * current request (see createRequest) in order to accept new bytes read
+     * from client. */
+    if (p < end) {
+        clientRequest *new = createRequest(c);
+        if (new != NULL) new->buffer = sdscatlen(new->buffer, p, end - p);
+    }
+    sdsfree(req->buffer);
+    req->buffer = reqbuf;
     buflen = req->query_offset;
     return buflen;
 }
 
-static int parseRequest(clientRequest *req, sds *err) {
+int parseRequest(clientRequest *req, sds *err) {
     int status = req->parsing_status, lf_len = 2, len, i, real_offset = 0;
     proxyLogDebug("Parsing request " REQID_PRINTF_FMT ", status: %d",
                   REQID_PRINTF_ARG(req), status);
@@ -3296,7 +5083,7 @@ static int parseRequest(clientRequest *req, sds *err) {
         sdsfree(repr);
     }
     char *p = req->buffer + req->query_offset, *nl = NULL;
-    sds line = NULL;
+    const char *next = NULL, *end = req->buffer + buflen;
     /* Ensure that parsing always start from a new line. */
     if (p > req->buffer) {
         if (*p == '\r') {
@@ -3345,9 +5132,9 @@ static int parseRequest(clientRequest *req, sds *err) {
             /* If pending bulks count is still unkownn, try to determine
              * it by reading the number after the '*' char. */
             if (lc == REQ_STATUS_UNKNOWN) {
-                nl = strchr(p, '\r');
-                if (nl == NULL) {
-                    if (((req->buffer+buflen) - p) > PROTO_INLINE_MAX_SIZE) {
+                int rstatus = respParseLength(p, end, &lc, &next);
+                if (rstatus == RESP_INCOMPLETE) {
+                    if ((end - p) > PROTO_INLINE_MAX_SIZE) {
                         if (err) {
                             *err = sdsnew("Protocol error: too big bulk count "
                                 "string");
@@ -3356,21 +5143,25 @@ static int parseRequest(clientRequest *req, sds *err) {
                     } else status = PARSE_STATUS_INCOMPLETE;
                     goto cleanup;
                 }
-                int len = nl - p;
-                if (line != NULL) sdsfree(line);
-                line = sdsnewlen(p, len);
-                char *errptr = NULL;
-                lc = strtoll(line, &errptr, 10);
-                if (lc <= 0 || (errptr && errptr < (line + len))) {
+                if (rstatus != RESP_OK || lc <= 0 || lc > INT_MAX) {
                     if (err) {
                         *err = sdsnew("Protocol error: invalid multibulk "
                                       "length");
-                        status = PARSE_STATUS_ERROR;
-                        goto cleanup;
                     }
+                    status = PARSE_STATUS_ERROR;
+                    goto cleanup;
                 }
-                req->query_offset += (len + 2);
+                req->query_offset += (next - p);
                 req->pending_bulks = lc;
+                /* Make room for all the arguments at once. The count is
+                 * capped, since it's not known yet if the client will
+                 * really send all of them. */
+                int prealloc = (lc > QUERY_OFFSETS_PREALLOC_MAX ?
+                                QUERY_OFFSETS_PREALLOC_MAX : (int) lc);
+                if (!requestMakeRoomForArgs(req, req->argc + prealloc - 1)) {
+                    status = PARSE_STATUS_ERROR;
+                    goto cleanup;
+                }
                 if (req->query_offset >= buflen) {
                     status = PARSE_STATUS_INCOMPLETE;
                     goto cleanup;
@@ -3398,19 +5189,23 @@ static int parseRequest(clientRequest *req, sds *err) {
                         status = PARSE_STATUS_ERROR;
                         goto cleanup;
                     }
-                    /* Search the '\r' at the end of the bulk line and
-                     * advance the pointer from 1 position from '$'. */
-                    nl = strchr(++p, '\r');
-                    if (nl == NULL) {
-                        status = PARSE_STATUS_INCOMPLETE;
+                    /* Parse the bulk length after the '$' char, up to the
+                     * '\r' at the end of the bulk line. */
+                    int rstatus = respParseLength(++p, end, &arglen, &next);
+                    if (rstatus == RESP_INCOMPLETE) {
+                        if ((end - p) > PROTO_INLINE_MAX_SIZE) {
+                            if (err) {
+                                *err = sdsnew("Protocol error: too big bulk "
+                                              "count string");
+                            }
+                            status = PARSE_STATUS_ERROR;
+                        } else status = PARSE_STATUS_INCOMPLETE;
                         goto cleanup;
                     }
-                    len = nl - p;
-                    if (line != NULL) sdsfree(line);
-                    line = sdsnewlen(p, len);
-                    char *errptr = NULL;
-                    arglen = strtoll(line, &errptr, 10);
-                    if (arglen <= 0 || (errptr && errptr < (line + len))) {
+                    len = (next - p) - 2;
+                    if (rstatus != RESP_OK || arglen <= 0 ||
+                        arglen > config.proto_max_bulk_len)
+                    {
                         if (err) {
                             *err =
                                 sdsnew("Protocol error: invalid bulk length");
@@ -3418,6 +5213,25 @@ static int parseRequest(clientRequest *req, sds *err) {
                         status = PARSE_STATUS_ERROR;
                         goto cleanup;
                     }
+                    /* Reject the query before buffering the bulk if the
+                     * whole request would exceed the query buffer limit:
+                     * the request buffer must hold every argument. */
+                    if (config.client_query_buffer_limit > 0 &&
+                        ((long long) req->query_offset + len + 3 + arglen + 2)
+                        > config.client_query_buffer_limit)
+                    {
+                        proxyLogWarn("Client %d:%" PRId64 " from %s "
+                            "reached max query buffer length (%d bytes), "
+                            "closing it", req->client->thread_id,
+                            req->client->id, req->client->addr,
+                            config.client_query_buffer_limit);
+                        if (err) {
+                            *err = sdsnew("Protocol error: query buffer "
+                                          "limit exceeded");
+                        }
+                        status = PARSE_STATUS_ERROR;
+                        goto cleanup;
+                    }
                     req->current_bulk_length = arglen;
                     /* Increment the query offset by the bulk length + 3,
                      * since it still was pointing to '$', so '$' + '\r\n'
@@ -3486,9 +5300,15 @@ static int parseRequest(clientRequest *req, sds *err) {
                 buflen = splitPipelinedQueries(req, p, 1);
                 break;
             }
-            nl = strchr(p, '\n');
+            nl = memchr(p, '\n', end - p);
             if (nl == NULL) {
-                status = PARSE_STATUS_INCOMPLETE;
+                if ((end - p) > PROTO_INLINE_MAX_SIZE) {
+                    if (err) {
+                        *err = sdsnew("Protocol error: too big inline "
+                                      "request");
+                    }
+                    status = PARSE_STATUS_ERROR;
+                } else status = PARSE_STATUS_INCOMPLETE;
                 goto cleanup;
             }
             lf_len = 1;
@@ -3514,7 +5334,7 @@ static int parseRequest(clientRequest *req, sds *err) {
                     status = PARSE_STATUS_ERROR;
                     goto cleanup;
                 }
-                char *sep = strchr(p, ' ');
+                char *sep = memchr(p, ' ', nl - p);
                 if (!sep) sep = nl;
                 req->offsets[idx] = p - req->buffer;
                 req->lengths[idx] = sep - p;
@@ -3541,7 +5361,6 @@ cleanup:
             status = PARSE_STATUS_OK;
     }
     req->parsing_status = status;
-    if (line != NULL) sdsfree(line);
     if (status == PARSE_STATUS_ERROR) {
         proxyLogDebug("Failed to parse request " REQID_PRINTF_FMT,
                       REQID_PRINTF_ARG(req));
@@ -3742,7 +5561,7 @@ cleanup:
     return success;
 }
 
-static clusterNode *getRequestNode(clientRequest *req, sds *err) {
+clusterNode *getRequestNode(clientRequest *req, sds *err) {
     clusterNode *node = NULL;
     if (req->node && req->command == scanCommandDef) return req->node;
     int first_key = req->command->first_key,
@@ -3876,6 +5695,10 @@ void freeRequest(clientRequest *req) {
     if (req->buffer != NULL) sdsfree(req->buffer);
     if (req->offsets != NULL) zfree(req->offsets);
     if (req->lengths != NULL) zfree(req->lengths);
+    if (req->accounted_size > 0) {
+        req->client->requests_memory -= req->accounted_size;
+        updateClientMemoryUsage(req->client);
+    }
     if (req->client->current_request == req)
         req->client->current_request = NULL;
     if (req->client->multi_request == req)
@@ -3909,6 +5732,7 @@ void freeRequest(clientRequest *req) {
         listNode *ln = req->requests_to_send_lnode;
         if (ln) listDelNode(conn->requests_to_send, ln);
         req->requests_to_send_lnode = NULL;
+        removeRequestFromSendQueue(req);
         /* We cannot delete the request's list node from the requests_pending
          * queue, since this would break the reply processing order. So we just
          * set its value to NULL. The resulting NULL placeholder (we can call
@@ -3917,11 +5741,21 @@ void freeRequest(clientRequest *req) {
         ln = req->requests_pending_lnode;
         if (ln) ln->value = NULL;
         req->requests_pending_lnode = NULL;
+        conn->inflight_bytes -= req->inflight_bytes;
+        req->inflight_bytes = 0;
     }
-    listNode *ln = listSearchKey(req->client->requests_to_reprocess, req);
-    if (ln) listDelNode(req->client->requests_to_reprocess, ln);
+    list *to_reprocess = req->client->requests_to_reprocess;
+    listNode *ln = (to_reprocess ? listSearchKey(to_reprocess, req) : NULL);
+    if (ln) listDelNode(to_reprocess, ln);
     redisCluster *cluster = getCluster(req->client);
     if (cluster) clusterRemoveRequestToReprocess(cluster, req);
+    if (req->held_requests_lnode != NULL) {
+        /* Held requests always belong to the thread's shared cluster. */
+        redisCluster *shared = getThread(req->client)->cluster;
+        if (shared != NULL && shared->held_requests != NULL)
+            listDelNode(shared->held_requests, req->held_requests_lnode);
+        req->held_requests_lnode = NULL;
+    }
     if (config.dump_queues)
         dumpQueue(req->node, req->client->thread_id, QUEUE_TYPE_PENDING);
     ln = req->requests_lnode;
@@ -3970,6 +5804,206 @@ static redisClusterConnection *getRequestConnection(clientRequest *req) {
     return node->connection;
 }
 
+/* Return the priority class of the request: queries of commands flagged as
+ * bulk, multi-key queries with at least bulk-min-keys keys and all the
+ * queries sent by bulk clients are bulk requests. Child requests of queries
+ * split across multiple nodes share the class of their parent. */
+static int getRequestPriority(clientRequest *req) {
+    if (req->parent_request != NULL) req = req->parent_request;
+    if (req->client->priority == PRIORITY_BULK) return PRIORITY_BULK;
+    redisCommandDef *cmd = req->command;
+    if (cmd == NULL) return PRIORITY_INTERACTIVE;
+    if (cmd->proxy_flags & CMDFLAG_BULK) return PRIORITY_BULK;
+    if (config.bulk_min_keys > 0 && cmd->last_key < 0 && cmd->key_step > 0) {
+        int numkeys = (req->argc - cmd->first_key) / cmd->key_step;
+        if (numkeys >= config.bulk_min_keys) return PRIORITY_BULK;
+    }
+    return PRIORITY_INTERACTIVE;
+}
+
+static void freeSendQueue(clientSendQueue *queue) {
+    redisClusterConnection *conn = queue->connection;
+    raxRemove(conn->send_queues, (unsigned char *) &queue->client_id,
+              sizeof(queue->client_id), NULL);
+    if (queue->active_lnode != NULL) {
+        listDelNode(conn->active_send_queues[queue->priority],
+                    queue->active_lnode);
+    }
+    listRelease(queue->requests);
+    zfree(queue);
+}
+
+/* Append the request to the send queue of its client on the connection,
+ * creating the queue if the client has no other request waiting to be
+ * written to the connection. */
+static int addRequestToSendQueue(clientRequest *req,
+                                 redisClusterConnection *conn)
+{
+    uint64_t client_id = req->client->id;
+    clientSendQueue *queue = raxFind(conn->send_queues,
+                                     (unsigned char *) &client_id,
+                                     sizeof(client_id));
+    if (queue == raxNotFound) {
+        queue = zmalloc(sizeof(*queue));
+        if (queue == NULL) return 0;
+        queue->client_id = client_id;
+        queue->deficit = 0;
+        queue->priority = getRequestPriority(req);
+        queue->connection = conn;
+        queue->active_lnode = NULL;
+        queue->requests = listCreate();
+        if (queue->requests == NULL) {
+            zfree(queue);
+            return 0;
+        }
+        list *active = conn->active_send_queues[queue->priority];
+        if (!raxInsert(conn->send_queues, (unsigned char *) &client_id,
+                       sizeof(client_id), queue, NULL) ||
+            listAddNodeTail(active, queue) == NULL)
+        {
+            freeSendQueue(queue);
+            return 0;
+        }
+        queue->active_lnode = listLast(active);
+    }
+    if (listAddNodeTail(queue->requests, req) == NULL) {
+        if (listLength(queue->requests) == 0) freeSendQueue(queue);
+        return 0;
+    }
+    req->send_queue = queue;
+    req->send_queue_lnode = listLast(queue->requests);
+    return 1;
+}
+
+/* A send queue always belongs to the round robin list of the priority class
+ * of its first request, so that the requests of a client are never
+ * reordered. Move the queue to the right list after its first request
+ * changed. */
+static void updateSendQueuePriority(clientSendQueue *queue) {
+    listNode *ln = listFirst(queue->requests);
+    if (ln == NULL) return;
+    int priority = getRequestPriority(ln->value);
+    if (priority == queue->priority) return;
+    redisClusterConnection *conn = queue->connection;
+    listDelNode(conn->active_send_queues[queue->priority],
+                queue->active_lnode);
+    queue->priority = priority;
+    listAddNodeTail(conn->active_send_queues[priority], queue);
+    queue->active_lnode = listLast(conn->active_send_queues[priority]);
+}
+
+void removeRequestFromSendQueue(clientRequest *req) {
+    clientSendQueue *queue = req->send_queue;
+    if (queue == NULL) return;
+    int was_first = (req->send_queue_lnode == listFirst(queue->requests));
+    listDelNode(queue->requests, req->send_queue_lnode);
+    req->send_queue = NULL;
+    req->send_queue_lnode = NULL;
+    if (listLength(queue->requests) == 0) freeSendQueue(queue);
+    else if (was_first) updateSendQueuePriority(queue);
+}
+
+/* Return the priority class whose requests have to be sent next. While both
+ * classes have requests waiting, bulk requests get bulk-weight percent of
+ * the bytes sent to the connection (none if bulk-weight is 0). */
+static int getNextSendPriority(redisClusterConnection *conn) {
+    long long *sent = conn->priority_sent_bytes;
+    int interactive =
+        (listLength(conn->active_send_queues[PRIORITY_INTERACTIVE]) > 0);
+    int bulk = (listLength(conn->active_send_queues[PRIORITY_BULK]) > 0);
+    if (!interactive || !bulk) {
+        sent[PRIORITY_INTERACTIVE] = 0;
+        sent[PRIORITY_BULK] = 0;
+        return (bulk ? PRIORITY_BULK : PRIORITY_INTERACTIVE);
+    }
+    long long total = sent[PRIORITY_INTERACTIVE] + sent[PRIORITY_BULK];
+    if (sent[PRIORITY_BULK] * 100 < total * config.bulk_weight)
+        return PRIORITY_BULK;
+    return PRIORITY_INTERACTIVE;
+}
+
+/* In-flight limits only apply to shared connections: when they're reached,
+ * requests wait in requests_to_send until the node replies to the pending
+ * ones. */
+static int hasNodeInflightLimits(clusterNode *node) {
+    if (node->cluster->owner != NULL) return 0;
+    return (config.node_max_inflight_requests > 0 ||
+            config.node_max_inflight_bytes > 0);
+}
+
+static int isNodeInflightLimitReached(clusterNode *node) {
+    if (!hasNodeInflightLimits(node)) return 0;
+    redisClusterConnection *conn = node->connection;
+    if (config.node_max_inflight_requests > 0 &&
+        listLength(conn->requests_pending) >=
+        (unsigned long) config.node_max_inflight_requests) return 1;
+    return (config.node_max_inflight_bytes > 0 &&
+            conn->inflight_bytes >= (size_t) config.node_max_inflight_bytes);
+}
+
+/* Return 1 if a new request directed to the node must be rejected, since
+ * the node reached its in-flight limits and too many requests are already
+ * waiting for them (see node-max-queued-requests). */
+static int isNodeQueueFull(clusterNode *node) {
+    if (config.node_max_queued_requests < 0) return 0;
+    if (node->connection == NULL) return 0;
+    if (!isNodeInflightLimitReached(node)) return 0;
+    return (listLength(node->connection->requests_to_send) >=
+            (unsigned long) config.node_max_queued_requests);
+}
+
+/* Return the next request that has to be written to the node.
+ * The first request in requests_to_send is the one currently being written,
+ * if any. Otherwise, after choosing the priority class (see
+ * getNextSendPriority), the next request is picked from the send queues of
+ * the clients in that class in deficit round robin: every time a client's
+ * turn comes, its deficit is increased by SEND_QUEUE_QUANTUM bytes, and its
+ * requests are written until their size exceeds the deficit. The picked
+ * request is then moved to the head of requests_to_send. */
+static clientRequest *getNextRequestToSend(clusterNode *node) {
+    redisClusterConnection *conn = node->connection;
+    listNode *ln = listFirst(conn->requests_to_send);
+    if (ln == NULL) return NULL;
+    clientRequest *req = ln->value;
+    if (req == NULL || req->send_queue == NULL) return req;
+    if (isNodeInflightLimitReached(node)) return NULL;
+    int priority = getNextSendPriority(conn);
+    list *active = conn->active_send_queues[priority];
+    clientSendQueue *queue = NULL;
+    while (1) {
+        listNode *qln = listFirst(active);
+        assert(qln != NULL);
+        queue = qln->value;
+        req = listFirst(queue->requests)->value;
+        long long size = (long long) sdslen(req->buffer);
+        if (queue->deficit >= size || listLength(active) == 1) break;
+        /* End of the client's turn: move it to the tail. */
+        queue->deficit += SEND_QUEUE_QUANTUM;
+        listDelNode(active, qln);
+        listAddNodeTail(active, queue);
+        queue->active_lnode = listLast(active);
+    }
+    /* A client that is alone in its class is not charged for what it
+     * sends, otherwise its deficit would keep decreasing and the client
+     * would be starved by the next one joining the round robin. */
+    if (listLength(active) > 1) queue->deficit -= sdslen(req->buffer);
+    else queue->deficit = 0;
+    conn->priority_sent_bytes[priority] += sdslen(req->buffer);
+    removeRequestFromSendQueue(req);
+    if (req->queued_since > 0) {
+        proxyThread *thread = getThread(req->client);
+        thread->stat_node_queued_requests++;
+        thread->stat_node_queue_wait += ustime() - req->queued_since;
+        req->queued_since = 0;
+    }
+    if (req->requests_to_send_lnode != listFirst(conn->requests_to_send)) {
+        listDelNode(conn->requests_to_send, req->requests_to_send_lnode);
+        listAddNodeHead(conn->requests_to_send, req);
+        req->requests_to_send_lnode = listFirst(conn->requests_to_send);
+    }
+    return req;
+}
+
 static int enqueueRequest(clientRequest *req, int queue_type) {
     redisClusterConnection *conn = getRequestConnection(req);
     if (conn == NULL) return 0;
@@ -3977,8 +6011,18 @@ static int enqueueRequest(clientRequest *req, int queue_type) {
     int *sp = &success;
     if (queue_type == QUEUE_TYPE_SENDING) {
         addObjectToList(req, conn, requests_to_send, sp);
+        if (success && !addRequestToSendQueue(req, conn)) {
+            removeObjectFromList(req, conn, requests_to_send);
+            success = 0;
+        }
+        if (success && hasNodeInflightLimits(req->node))
+            req->queued_since = ustime();
     } else if (queue_type == QUEUE_TYPE_PENDING) {
         addObjectToList(req, conn, requests_pending, sp);
+        if (success) {
+            req->inflight_bytes = sdslen(req->buffer);
+            conn->inflight_bytes += req->inflight_bytes;
+        }
     }
     return success;
 }
@@ -3988,19 +6032,26 @@ static void dequeueRequest(clientRequest *req, int queue_type) {
     if (conn == NULL) return;
     if (queue_type == QUEUE_TYPE_SENDING) {
         removeObjectFromList(req, conn, requests_to_send);
+        removeRequestFromSendQueue(req);
     } else if (queue_type == QUEUE_TYPE_PENDING) {
         removeObjectFromList(req, conn, requests_pending);
+        conn->inflight_bytes -= req->inflight_bytes;
+        req->inflight_bytes = 0;
     }
 }
 
-static clientRequest *createRequest(client *c) {
+clientRequest *createRequest(client *c) {
     clientRequest *req = zcalloc(sizeof(*req));
     if (req == NULL) goto alloc_failure;
+    req->client = c;
+    if (c->requests == NULL) {
+        c->requests = listCreate();
+        if (c->requests == NULL) goto alloc_failure;
+    }
     int added = 0;
     int *p_added = &added;
     addObjectToList(req, c, requests, p_added);
     if (!added) goto alloc_failure;
-    req->client = c;
     req->buffer = sdsempty();
     if (req->buffer ==  NULL) goto alloc_failure;
     req->query_offset = 0;
@@ -4035,6 +6086,13 @@ static clientRequest *createRequest(client *c) {
     req->child_replies = NULL;
     req->requests_pending_lnode = NULL;
     req->requests_to_send_lnode = NULL;
+    req->held_requests_lnode = NULL;
+    req->send_queue = NULL;
+    req->send_queue_lnode = NULL;
+    req->held_since = 0;
+    req->queued_since = 0;
+    req->inflight_bytes = 0;
+    req->accounted_size = 0;
     req->max_child_reply_id = req->id;
     proxyLogDebug("Created Request " REQID_PRINTF_FMT  " with address %p",
                   REQID_PRINTF_ARG(req), (void *)req);
@@ -4047,7 +6105,9 @@ alloc_failure:
 }
 
 /* Try to call aeCreateFileEvent, and if ERANGE error has been issued, try to
- * resize event loop's setsize to fd + proxy.min_reserved_fds.
+ * grow the event loop's setsize geometrically, until it can contain the fd.
+ * The setsize is never grown over proxy.min_reserved_fds + config.maxclients,
+ * unless the fd itself is greater.
  * The 'retried' argument is used to ensure that resizing will be tried only
  * once. */
 static int installIOHandler(aeEventLoop *el, int fd, int mask, aeFileProc *proc,
@@ -4059,7 +6119,11 @@ static int installIOHandler(aeEventLoop *el, int fd, int mask, aeFileProc *proc,
         if (!retried && errno == ERANGE) {
             proxyThread *thread = el->privdata;
             assert(thread != NULL);
-            int newsize = fd + proxy.min_reserved_fds;
+            int maxsize = proxy.min_reserved_fds + config.maxclients;
+            int newsize = aeGetSetSize(el);
+            if (newsize <= 0) newsize = EVENT_LOOP_INITIAL_SIZE;
+            while (newsize <= fd) newsize *= 2;
+            if (newsize > maxsize) newsize = (fd < maxsize ? maxsize : fd + 1);
             proxyLogDebug("Resizing event loop on thread %d to %d",
                 thread->thread_id, newsize);
             if (aeResizeSetSize(el, newsize) == AE_ERR)
@@ -4100,6 +6164,8 @@ static int sendRequestToCluster(clientRequest *req, sds *errmsg)
     redisContext *ctx = getClusterNodeContext(req->node);
     if (ctx == NULL) {
         if ((ctx = clusterNodeConnect(req->node)) == NULL) {
+            markClusterNodeAsFailed(req->node);
+            if (req->node->failed && holdRequest(req)) return 1;
             sds err = sdsnew("Could not connect to node ");
             err = sdscatfmt(err, "%s:%u", req->node->ip, req->node->port);
             addReplyError(req->client, err, req->id);
@@ -4134,7 +6200,7 @@ static int sendRequestToCluster(clientRequest *req, sds *errmsg)
     }
     redisClusterConnection *conn = req->node->connection;
     assert(conn != NULL);
-    if (!conn->has_read_handler) {
+    if (!conn->has_read_handler && !conn->reads_paused) {
         if (!installIOHandler(el, ctx->fd, AE_READABLE, readClusterReply,
                               conn, 0))
         {
@@ -4166,7 +6232,7 @@ static clientRequest *handleNextRequestsToCluster(clusterNode *node,
 {
 
     clientRequest *req = NULL;
-    while ((req = getFirstRequestToSend(node, NULL))) {
+    while ((req = getNextRequestToSend(node))) {
         int sent = sendRequestToCluster(req, NULL);
         if (!sent) {
             /* Sending request failed and request has already been freed. */
@@ -4231,6 +6297,9 @@ int processRequest(clientRequest *req, int *parsing_status,
             return 0;
         }
         req->parsed = 1;
+        req->accounted_size = sdsAllocSize(req->buffer);
+        c->requests_memory += req->accounted_size;
+        updateClientMemoryUsage(c);
         proxyLogDebug("Parsing complete for request " REQID_PRINTF_FMT,
             REQID_PRINTF_ARG(req));
     }
@@ -4296,6 +6365,12 @@ int processRequest(clientRequest *req, int *parsing_status,
                       REQID_PRINTF_ARG(req));
         goto invalid_request;
     }
+    /* If the master is flagged as failed, try to hold the request until the
+     * failover happens. */
+    if (node->failed && holdRequest(req)) {
+        if (command_name) sdsfree(command_name);
+        return 1;
+    }
     /* In we are under a MULTI transaction and there's no target node yet
      * we use the current request's node as the node for the whole transaction.
      * In this case we'll enqueue the client's MULTI request (multi_request),
@@ -4318,6 +6393,12 @@ int processRequest(clientRequest *req, int *parsing_status,
             req->client->multi_transaction_node = node;
         else node = req->node = req->client->multi_transaction_node;
     }
+    if (!req->client->multi_transaction && isNodeQueueFull(node)) {
+        errmsg = sdscatprintf(sdsnew(ERROR_NODE_BUSY), "%s:%d",
+                              node->ip, node->port);
+        getThread(c)->stat_node_busy_errors++;
+        goto invalid_request;
+    }
     if (!enqueueRequestToSend(req)) goto invalid_request;
     clientRequest *failed_req = NULL;
     uint64_t min_reply_id = c->min_reply_id;
@@ -4344,7 +6425,9 @@ int processRequest(clientRequest *req, int *parsing_status,
             clientRequest *r = ln->value;
             if (!enqueueRequestToSend(r)) goto invalid_request;
             clientRequest *next_req = getFirstRequestToSend(r->node, NULL);
-            if (r->node != last_node || next_req == r) {
+            if (r->node != last_node || next_req == NULL ||
+                !next_req->has_write_handler)
+            {
                 last_node = r->node;
                 clientRequest *failed_req = NULL;
                 handleNextRequestsToCluster(r->node, &failed_req);
@@ -4366,67 +6449,170 @@ invalid_request:
     return (invalid_request_replied ? 1 : 0);
 }
 
+/* Return the size of the next read from a connection whose last read was
+ * 'nread' bytes long with a buffer of 'readlen' bytes: the size is doubled
+ * (up to io-read-max-len) when the read filled the whole buffer, since more
+ * data is probably waiting in the socket. */
+static int growReadLen(int readlen, int nread) {
+    int maxlen = config.io_read_max_len;
+    if (maxlen < PROTO_IOBUF_LEN) maxlen = PROTO_IOBUF_LEN;
+    if (nread < readlen) return readlen;
+    if (readlen < maxlen) readlen *= 2;
+    return (readlen > maxlen ? maxlen : readlen);
+}
+
+/* Halve the size of the next read from a connection if the last readable
+ * event used less than a quarter of it ('totread' bytes), down to
+ * PROTO_IOBUF_LEN. */
+static int shrinkReadLen(int readlen, int totread) {
+    if (readlen <= PROTO_IOBUF_LEN || totread >= readlen / 4) return readlen;
+    readlen /= 2;
+    return (readlen < PROTO_IOBUF_LEN ? PROTO_IOBUF_LEN : readlen);
+}
+
+/* Read from the client's socket into its current request buffer. Reads
+ * are repeated until the socket is drained or until io-read-budget bytes
+ * have been read during the same event, so that a single client can't
+ * starve the others. The size of every read adapts to the traffic of the
+ * client (see growReadLen and shrinkReadLen).
+ * Returns the number of bytes read, or -1 if the client has been freed
+ * or unlinked. */
+static int readClientSocket(client *c, int fd) {
+    proxyThread *thread = getThread(c);
+    clientRequest *req = c->current_request;
+    int nread, totread = 0;
+    while (1) {
+        int readlen = c->readlen;
+        /* Small reads go into the thread's shared buffer and then get
+         * copied into a request buffer sized after the bytes actually read,
+         * so that idle clients don't keep a whole read buffer allocated.
+         * Read directly into the request buffer if it already has enough
+         * free space (ie. while reading a big argument) or if the client is
+         * sending more data than the shared buffer can hold. */
+        char *readbuf = thread->readbuf;
+        int direct = (req != NULL &&
+                      sdsavail(req->buffer) >= (size_t) readlen);
+        if (!direct && readlen > PROTO_IOBUF_LEN) {
+            if (req == NULL && (req = createRequest(c)) == NULL) {
+                proxyLogErr("Failed to create request");
+                freeClient(c);
+                return -1;
+            }
+            req->buffer = sdsMakeRoomFor(req->buffer, readlen);
+            direct = 1;
+        }
+        if (direct) readbuf = req->buffer + sdslen(req->buffer);
+        nread = (c->tls ? tlsRead(c->tls, readbuf, readlen) :
+                          read(fd, readbuf, readlen));
+        if (nread == -1) {
+            if (errno == EAGAIN || totread > 0) break;
+            proxyLogDebug("Error reading from client %d:%" PRId64 " %s : %s",
+                          c->thread_id, c->id, c->addr, strerror(errno));
+            unlinkClient(c); /* TODO: Free? */
+            return -1;
+        } else if (nread == 0) {
+            /* Process the queries already read: the closed connection will
+             * be detected by the next readable event. */
+            if (totread > 0) break;
+            proxyLogDebug("Client %d:%" PRId64 " from %s closed connection "
+                          "(thread: %d)",
+                          c->thread_id, c->id, c->addr, c->thread_id);
+            freeClient(c);
+            return -1;
+        }
+        if (isCaptureActive())
+            captureQuery(c->thread_id, c->id, readbuf, nread);
+        if (direct) sdsIncrLen(req->buffer, nread);
+        else {
+            if (req == NULL) {
+                req = createRequest(c);
+                if (req == NULL) {
+                    proxyLogErr("Failed to create request");
+                    freeClient(c);
+                    return -1;
+                }
+            }
+            if (sdslen(req->buffer) == 0) {
+                sdsfree(req->buffer);
+                req->buffer = sdsnewlen(readbuf, nread);
+            } else req->buffer = sdscatlen(req->buffer, readbuf, nread);
+        }
+        proxyLogDebug("Read %d bytes into req. " REQID_PRINTF_FMT ", buffer "
+                      "is %zu bytes", nread, REQID_PRINTF_ARG(req),
+                      sdslen(req->buffer));
+        atomic_fetch_add_explicit(&thread->stat_client_reads, 1,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&thread->stat_net_input_bytes, nread,
+                                  memory_order_relaxed);
+        totread += nread;
+        c->readlen = growReadLen(readlen, nread);
+        if (nread < readlen) break;
+        if (totread >= config.io_read_budget) {
+            atomic_fetch_add_explicit(&thread->stat_read_budget_exhausted, 1,
+                                      memory_order_relaxed);
+            break;
+        }
+    }
+    c->readlen = shrinkReadLen(c->readlen, totread);
+    return totread;
+}
+
 void readQuery(aeEventLoop *el, int fd, void *privdata, int mask){
     UNUSED(el);
     UNUSED(mask);
     client *c = (client *) privdata;
     /* Do not process incoming queries anymore if client is set to be closed
      * after all replies are written. */
-    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
-    int nread, readlen = (1024*16);
+    if (c->flags & (CLIENT_CLOSE_AFTER_REPLY | CLIENT_CLOSE_ASAP)) return;
+    int totread = readClientSocket(c, fd);
+    if (totread <= 0) return;
+    c->last_interaction = time(NULL);
     clientRequest *req = c->current_request;
-    if (req == NULL) {
-        req = createRequest(c);
-        if (req == NULL) {
-            proxyLogErr("Failed to create request");
-            freeClient(c);
-            return;
-        }
-    }
-    size_t iblen = sdslen(req->buffer);
-    req->buffer = sdsMakeRoomFor(req->buffer, readlen);
-    nread = read(fd, req->buffer + iblen, readlen);
-    if (nread == -1) {
-        if (errno == EAGAIN) {
-            return;
-        } else {
-            proxyLogDebug("Error reading from client %d:%" PRId64 " %s : %s",
-                          c->thread_id, c->id, c->addr, strerror(errno));
-            unlinkClient(c); /* TODO: Free? */
-            return;
-        }
-    } else if (nread == 0) {
-        proxyLogDebug("Client %d:%" PRId64 " from %s closed connection "
-                      "(thread: %d)",
-                      c->thread_id, c->id, c->addr, c->thread_id);
-        freeClient(c);
-        return;
-    }
-    sdsIncrLen(req->buffer, nread);
-    proxyLogDebug("Read %d bytes into req. " REQID_PRINTF_FMT ", buffer is "
-                  "%zu bytes", nread, REQID_PRINTF_ARG(req),
-                  sdslen(req->buffer));
-    /*TODO: support max query buffer length */
     int parsing_status = PARSE_STATUS_OK;
     clientRequest *next = req;
+    int queries = 0;
     while (next != NULL) {
         if (!processRequest(next, &parsing_status, &next)) {
             unlinkClient(c);
-            break;
+            return;
         }
         /* If parsing status of the current request is incomplete or the
          * client is set to be closed after reply, just stop here. */
         if (parsing_status == PARSE_STATUS_INCOMPLETE ||
-            c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+            c->flags & CLIENT_CLOSE_AFTER_REPLY) break;
+        queries++;
+    }
+    if (c->status == CLIENT_STATUS_UNLINKED) return;
+    if (hasClientRateLimits(c))
+        throttleClient(c, chargeClientRateLimits(c, queries, totread));
+    /* Oversized bulks are already rejected by parseRequest before being
+     * buffered, but bytes that have been read and not parsed yet could
+     * still make the query buffer exceed the limit. */
+    req = c->current_request;
+    if (config.client_query_buffer_limit > 0 && req != NULL &&
+        !(c->flags & CLIENT_CLOSE_AFTER_REPLY) &&
+        sdslen(req->buffer) > (size_t) config.client_query_buffer_limit)
+    {
+        proxyLogWarn("Closing client %d:%" PRId64 " from %s that reached "
+                     "max query buffer length (%zu bytes)", c->thread_id,
+                     c->id, c->addr, sdslen(req->buffer));
+        unlinkClient(c);
+        return;
     }
+    updateClientQueryBufferMemoryUsage(c);
+    updateClientMemoryUsage(c);
 }
 
+/* Clients connected via TCP use TLS if --tls is enabled. Errors occurring
+ * before the TLS handshake cannot be sent to them, so they're just
+ * disconnected. */
 static void acceptHandler(int fd, char *ip, int port) {
+    int use_tls = (ip != NULL && config.tls);
     if (proxy.numclients >= (uint64_t) config.maxclients) {
         char *err = "-ERR max number of clients reached\r\n";
         static int errlen = 0;
         if (errlen == 0) errlen = strlen(err);
-        write(fd, err, errlen);
+        if (!use_tls) write(fd, err, errlen);
         close(fd);
         return;
     }
@@ -4435,11 +6621,17 @@ static void acceptHandler(int fd, char *ip, int port) {
         proxyLogDebug("Failed to allocate memory for client from %s",
             ip ? ip : config.unixsocket);
         sds err = sdscatprintf(sdsempty(), "-ERR %s\r\n", ERROR_OOM);
-        write(fd, err, sdslen(err));
+        if (!use_tls) write(fd, err, sdslen(err));
         close(fd);
         sdsfree(err);
         return;
     }
+    if (use_tls && (c->tls = tlsAccept(fd)) == NULL) {
+        proxyLogWarn("Failed to create TLS connection for client %s:%d",
+                     ip, port);
+        freeClient(c);
+        return;
+    }
     c->port = port;
     if (ip) c->addr = sdscatprintf(sdsempty(), "%s:%d", ip, port);
     else c->addr = sdscatprintf(sdsempty(), "unix://%s", config.unixsocket);
@@ -4451,7 +6643,7 @@ static void acceptHandler(int fd, char *ip, int port) {
         proxyLogDebug("Failed to awake thread %d for client %" PRId64,
                       thread->thread_id, c->id);
         char *err = "-ERR failed to awake thread\r\n";
-        write(fd, err, strlen(err));
+        if (!use_tls) write(fd, err, strlen(err));
         freeClient(c);
     }
 }
@@ -4533,6 +6725,13 @@ static int addChildRequestReply(clientRequest *req, char *replybuf, int len) {
     return completed;
 }
 
+/* Process all the complete replies in the reader's buffer. Replies are
+ * consumed by advancing a cursor ('start', the offset of the current reply)
+ * and the consumed bytes are trimmed from the buffer only once, after all
+ * the replies have been processed, so that a deep pipeline of replies
+ * doesn't require to move the remaining bytes of the buffer after every
+ * single reply. When the function returns, the buffer always starts with
+ * the (incomplete) reply that has still to be read. */
 static int processClusterReplyBuffer(redisContext *ctx, clusterNode *node,
                                      int thread_id)
 {
@@ -4540,11 +6739,12 @@ static int processClusterReplyBuffer(redisContext *ctx, clusterNode *node,
     char *errmsg = NULL;
     void *_reply = NULL;
     redisReply *reply = NULL;
-    int replies = 0;
-    while (ctx->reader->len > 0) {
+    int replies = 0, do_break = 0;
+    size_t start = 0;
+    while (start < ctx->reader->len) {
         int ok =
             (__hiredisReadReplyFromBuffer(ctx->reader, &_reply) == REDIS_OK);
-        int do_break = 0, is_cluster_err = 0;
+        int is_cluster_err = 0;
         redisCluster *cluster = NULL;
         if (!ok) {
             proxyLogErr("Error reading from node %s:%d on thread %d: %s",
@@ -4618,10 +6818,10 @@ static int processClusterReplyBuffer(redisContext *ctx, clusterNode *node,
         }
         if (errmsg != NULL) addReplyError(req->client, errmsg, req->id);
         else {
-            char *obuf = ctx->reader->buf;
-            /*size_t len = ctx->reader->len;*/
+            char *obuf = ctx->reader->buf + start;
             size_t len = ctx->reader->pos;
             if (len > ctx->reader->len) len = ctx->reader->len;
+            len -= start;
             if (config.dump_buffer) {
                 sds rstr = sdscatrepr(sdsempty(), obuf, len);
                 proxyLogDebug("Reply for request " REQID_PRINTF_FMT
@@ -4669,6 +6869,10 @@ consume_buffer:
         /* If cluster has been set is reconfiguring state, we call the
          * startClusterReconfiguration function. */
         if (cluster && cluster->is_updating) {
+            /* Trim the replies already consumed, since the reconfiguration
+             * could free the connection and interrupt the loop. */
+            trimRedisReaderBuffer(ctx, start);
+            start = 0;
             int reconfig_status = updateCluster(cluster);
             do_break = (reconfig_status == CLUSTER_RECONFIG_ENDED);
             if (!do_break) {
@@ -4700,16 +6904,93 @@ consume_buffer:
             }
             if (do_break) goto clean;
         }
-        /* Consume reader buffer */
-        consumeRedisReaderBuffer(ctx);
+        /* Consume the reply by moving the cursor to the next one. */
+        start = ctx->reader->pos;
+        if (start > ctx->reader->len) start = ctx->reader->len;
 clean:
         freeReplyObject(reply);
         if (req && free_req) freeRequest(req);
         if (!ok || do_break) break;
     }
+    /* If the loop has been interrupted by a cluster reconfiguration, the
+     * connection could have been freed, so don't touch it (the consumed
+     * replies have already been trimmed before the reconfiguration). */
+    if (!do_break) {
+        trimRedisReaderBuffer(ctx, start);
+        /* Replies could have freed room for the requests waiting for the
+         * in-flight limits of the node. */
+        redisClusterConnection *conn = node->connection;
+        if (replies > 0 && ctx->err == 0 && node->cluster->owner == NULL &&
+            listLength(conn->requests_to_send) > 0)
+            handleNextRequestsToCluster(node, NULL);
+    }
     return replies;
 }
 
+/* Read from the socket of a node directly into the buffer of its hiredis
+ * reader. Just like clients (see readClientSocket), reads are repeated
+ * until the socket is drained or the io-read-budget is exhausted, and their
+ * size adapts to the traffic of the connection, so that big replies only
+ * need a few iterations of the event loop.
+ * Returns REDIS_OK or REDIS_ERR (in this case the error is set into the
+ * context, just like redisBufferRead does). */
+static int readClusterConnection(proxyThread *thread,
+                                 redisClusterConnection *conn)
+{
+    redisContext *ctx = conn->context;
+    redisReader *r = ctx->reader;
+    int nread, totread = 0;
+    if (ctx->err) return REDIS_ERR;
+    if (conn->readlen == 0) conn->readlen = PROTO_IOBUF_LEN;
+    /* Release the reader's buffer if it's empty and much bigger than needed
+     * by the current read size (redisReaderFeed does the same). */
+    if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf &&
+        sdsavail(r->buf) > (size_t) conn->readlen * 2)
+    {
+        sdsfree(r->buf);
+        r->buf = sdsempty();
+        r->pos = 0;
+    }
+    while (1) {
+        int readlen = conn->readlen;
+        sds buf = sdsMakeRoomFor(r->buf, readlen);
+        if (buf == NULL) {
+            setClusterConnectionError(ctx, REDIS_ERR_OOM, "Out of memory");
+            return REDIS_ERR;
+        }
+        r->buf = buf;
+        char *p = r->buf + sdslen(r->buf);
+        nread = (conn->tls ? tlsRead(conn->tls, p, readlen) :
+                             read(ctx->fd, p, readlen));
+        if (nread == -1) {
+            if (errno == EAGAIN || errno == EINTR || totread > 0) break;
+            setClusterConnectionError(ctx, REDIS_ERR_IO, strerror(errno));
+            return REDIS_ERR;
+        } else if (nread == 0) {
+            if (totread > 0) break;
+            setClusterConnectionError(ctx, REDIS_ERR_EOF,
+                                      "Server closed the connection");
+            return REDIS_ERR;
+        }
+        sdsIncrLen(r->buf, nread);
+        r->len = sdslen(r->buf);
+        atomic_fetch_add_explicit(&thread->stat_cluster_reads, 1,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&thread->stat_net_cluster_input_bytes,
+                                  nread, memory_order_relaxed);
+        totread += nread;
+        conn->readlen = growReadLen(readlen, nread);
+        if (nread < readlen) break;
+        if (totread >= config.io_read_budget) {
+            atomic_fetch_add_explicit(&thread->stat_read_budget_exhausted, 1,
+                                      memory_order_relaxed);
+            break;
+        }
+    }
+    conn->readlen = shrinkReadLen(conn->readlen, totread);
+    return REDIS_OK;
+}
+
 static void readClusterReply(aeEventLoop *el, int fd,
                              void *privdata, int mask)
 {
@@ -4725,15 +7006,26 @@ static void readClusterReply(aeEventLoop *el, int fd,
     list *queue = connection->requests_pending;
     if (node != NULL)
         req = getFirstRequestPending(node, NULL);
+    /* If the next reply is for the client flooding the thread's output
+     * buffers, stop reading from the shared connection until the client's
+     * buffer gets drained (see checkClientBackpressure). */
+    if (req != NULL && req->client == thread->backpressure_client &&
+        node->cluster->owner == NULL && !connection->authenticating)
+    {
+        aeDeleteFileEvent(el, fd, AE_READABLE);
+        connection->has_read_handler = 0;
+        connection->reads_paused = 1;
+        return;
+    }
     sds errmsg = NULL;
     char *ip = ctx->tcp.host;
     int port = ctx->tcp.port;
     proxyLogDebug("Reading reply from %s:%d on thread %d...",
                   ip, port, thread_id);
-    int success = (redisBufferRead(ctx) == REDIS_OK), replies = 0,
-                  node_disconnected = 0;
+    int success = (readClusterConnection(thread, connection) == REDIS_OK),
+        replies = 0, node_disconnected = 0;
     if (!success) {
-        proxyLogDebug("Failed redisBufferRead from %s:%d on thread %d",
+        proxyLogDebug("Failed to read from %s:%d on thread %d",
                       ip, port, thread_id);
         int err = ctx->err;
         node_disconnected = (err & (REDIS_ERR_IO | REDIS_ERR_EOF));
@@ -4767,7 +7059,10 @@ static void readClusterReply(aeEventLoop *el, int fd,
         }
         if (node_disconnected) {
             proxyLogDebug("%s", errmsg);
-            if (node) clusterNodeDisconnect(node);
+            if (node) {
+                markClusterNodeAsFailed(node);
+                clusterNodeDisconnect(node);
+            }
         }
         sdsfree(errmsg);
         /* Exit, since an error occurred. */
@@ -4842,6 +7137,23 @@ static void sigShutdownHandler(int sig) {
     }
 }
 
+/* The binary upgrade, the drain mode and the configuration reload are
+ * started by proxyCron, on the main thread. */
+static void sigUpgradeHandler(int sig) {
+    UNUSED(sig);
+    proxy.upgrade_requested = 1;
+}
+
+static void sigDrainHandler(int sig) {
+    UNUSED(sig);
+    proxy.drain_requested = 1;
+}
+
+static void sigReloadHandler(int sig) {
+    UNUSED(sig);
+    proxy.reload_requested = 1;
+}
+
 static void setupSignalHandlers(void) {
     struct sigaction act;
 
@@ -4852,6 +7164,12 @@ static void setupSignalHandlers(void) {
     act.sa_handler = sigShutdownHandler;
     sigaction(SIGTERM, &act, NULL);
     sigaction(SIGINT, &act, NULL);
+    act.sa_handler = sigUpgradeHandler;
+    sigaction(SIGUSR2, &act, NULL);
+    act.sa_handler = sigDrainHandler;
+    sigaction(SIGUSR1, &act, NULL);
+    act.sa_handler = sigReloadHandler;
+    sigaction(SIGHUP, &act, NULL);
 
 #ifdef HAVE_BACKTRACE
     sigemptyset(&act.sa_mask);
@@ -4894,18 +7212,400 @@ void createPidFile(void) {
     proxyLogInfo("Pidfile: '%s'", config.pidfile);
 }
 
-int main(int argc, char **argv) {
+/* Binary upgrade.
+ *
+ * On SIGUSR2 the proxy executes its own binary again (so that a new version
+ * installed at the same path gets started) and hands its listening sockets
+ * over to the new process, together with the addresses of the cluster's
+ * nodes (see upgrade.h). As soon as the new process is accepting
+ * connections, the old one stops accepting new clients and keeps serving
+ * the connected ones until they're all gone or 'upgrade-drain-timeout'
+ * expires. If the new process fails to start, the old one just keeps
+ * running as before. */
+
+void saveClusterTopology(redisCluster *cluster) {
+    sds topology = sdsempty();
+    listIter li;
+    listNode *ln;
+    listRewind(cluster->nodes, &li);
+    while ((ln = listNext(&li))) {
+        clusterNode *node = ln->value;
+        /* Entry points don't support IPv6 addresses. */
+        if (node->ip == NULL || !node->port || strchr(node->ip, ':') != NULL)
+            continue;
+        if (sdslen(topology) > 0) topology = sdscatlen(topology, " ", 1);
+        topology = sdscatprintf(topology, "%s:%d", node->ip, node->port);
+    }
+    pthread_mutex_lock(&topology_lock);
+    sdsfree(cluster_topology);
+    cluster_topology = topology;
+    pthread_mutex_unlock(&topology_lock);
+}
+
+/* Use the nodes received from the old process as the first entry points,
+ * falling back to the configured ones. */
+static void useUpgradeTopology(sds topology) {
+    redisClusterEntryPoint entry_points[MAX_ENTRY_POINTS];
+    int count = 0, addrcount = 0, i;
+    sds *addrs = sdssplitlen(topology, sdslen(topology), " ", 1, &addrcount);
+    if (addrs == NULL) return;
+    for (i = 0; i < addrcount && count < MAX_ENTRY_POINTS; i++) {
+        if (sdslen(addrs[i]) == 0) continue;
+        if (parseAddress(addrs[i], &entry_points[count])) count++;
+        else freeEntryPoints(&entry_points[count], 1);
+    }
+    sdsfreesplitres(addrs, addrcount);
+    proxyLogInfo("Using %d cluster node(s) received from the old process as "
+                 "entry points", count);
+    for (i = 0; i < config.entry_points_count; i++) {
+        if (count < MAX_ENTRY_POINTS)
+            entry_points[count++] = config.entry_points[i];
+        else
+            freeEntryPoints(&config.entry_points[i], 1);
+    }
+    memcpy(config.entry_points, entry_points, count * sizeof(*entry_points));
+    config.entry_points_count = count;
+}
+
+/* Called by the new process instead of listen(). */
+static int receiveListeningSockets(void) {
+    int unixsocket_idx = -1;
+    sds topology = NULL;
+    if (!upgradeReceiveSockets(proxy.upgrade_fd, proxy.fds, BINDADDR_MAX + 1,
+                               &proxy.fd_count, &unixsocket_idx, &topology))
+    {
+        proxyLogErr("FATAL: Failed to receive the listening sockets from the "
+                    "old process");
+        return 0;
+    }
+    if (unixsocket_idx >= 0) proxy.unixsocket_fd = proxy.fds[unixsocket_idx];
+    proxyLogInfo("Received %d listening socket(s) from the old process",
+                 proxy.fd_count);
+    if (sdslen(topology) > 0) useUpgradeTopology(topology);
+    sdsfree(topology);
+    return 1;
+}
+
+/* Tell the old process that the new one is accepting connections. */
+static void ackListeningSockets(void) {
+    if (write(proxy.upgrade_fd, UPGRADE_ACK, UPGRADE_ACK_LEN) !=
+        UPGRADE_ACK_LEN)
+    {
+        proxyLogWarn("Failed to notify the old process: %s", strerror(errno));
+    }
+    close(proxy.upgrade_fd);
+    proxy.upgrade_fd = -1;
+}
+
+static void abortUpgrade(void) {
+    if (proxy.upgrade_fd != -1) {
+        aeDeleteFileEvent(proxy.main_loop, proxy.upgrade_fd, AE_READABLE);
+        close(proxy.upgrade_fd);
+        proxy.upgrade_fd = -1;
+    }
+    proxyLogErr("Binary upgrade failed, still accepting connections");
+}
+
+static void stopAcceptingConnections(void) {
+    int i;
+    for (i = 0; i < proxy.fd_count; i++) {
+        aeDeleteFileEvent(proxy.main_loop, proxy.fds[i], AE_READABLE);
+        close(proxy.fds[i]);
+    }
+    proxy.fd_count = 0;
+    proxy.unixsocket_fd = -1;
+}
+
+static void handOffListeningSockets(void) {
+    int timeout = config.upgrade_drain_timeout;
+    stopAcceptingConnections();
+    proxy.listeners_handed_off = 1;
+    proxy.drain_deadline = (timeout > 0 ? mstime() + timeout * 1000LL : 0);
+    proxyLogHdr("New process (PID %d) is accepting connections, waiting for "
+                "%" PRIu64 " client(s) to disconnect", (int) proxy.upgrade_pid,
+                (uint64_t) proxy.numclients);
+}
+
+static void readUpgradeAck(aeEventLoop *el, int fd, void *privdata,
+                           int mask)
+{
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+    char buf[UPGRADE_ACK_LEN];
+    ssize_t nread = read(fd, buf, UPGRADE_ACK_LEN);
+    if (nread < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (nread != UPGRADE_ACK_LEN || memcmp(buf, UPGRADE_ACK, nread) != 0) {
+        proxyLogErr("New process (PID %d) failed to start",
+                    (int) proxy.upgrade_pid);
+        abortUpgrade();
+        return;
+    }
+    aeDeleteFileEvent(proxy.main_loop, fd, AE_READABLE);
+    close(fd);
+    proxy.upgrade_fd = -1;
+    handOffListeningSockets();
+}
+
+static void startUpgrade(void) {
+    int sv[2], i, j, unixsocket_idx = -1, argc = 0, maxfd = 1024;
+    char fdstr[32];
+    struct rlimit limit;
+    if (proxy.upgrade_fd != -1 || proxy.listeners_handed_off) {
+        proxyLogWarn("Binary upgrade already in progress, ignoring SIGUSR2");
+        return;
+    }
+    if (proxy.draining) {
+        proxyLogWarn("Proxy is draining, ignoring SIGUSR2");
+        return;
+    }
+    if (proxy.fd_count == 0) {
+        proxyLogWarn("No listening sockets, ignoring SIGUSR2");
+        return;
+    }
+    proxyLogHdr("Binary upgrade requested, executing '%s'", proxy.argv[0]);
+    if (!upgradeSocketPair(sv)) {
+        proxyLogErr("Failed to create upgrade socket: %s", strerror(errno));
+        return;
+    }
+    /* Prepare everything before forking, since the child cannot allocate
+     * memory: other threads could hold the allocator's locks. The upgrade
+     * socket is passed as the first option. */
+    snprintf(fdstr, sizeof(fdstr), "%d", sv[1]);
+    char **argv = zmalloc((proxy.argc + 3) * sizeof(char *));
+    argv[argc++] = proxy.argv[0];
+    argv[argc++] = "--upgrade-fd";
+    argv[argc++] = fdstr;
+    for (i = 1; i < proxy.argc; i++) argv[argc++] = proxy.argv[i];
+    argv[argc] = NULL;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY) maxfd = (int) limit.rlim_cur;
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Don't leak the sockets of this process to the new one. */
+        for (j = STDERR_FILENO + 1; j < maxfd; j++)
+            if (j != sv[1]) close(j);
+        execvp(argv[0], argv);
+        _exit(1);
+    }
+    zfree(argv);
+    close(sv[1]);
+    if (pid == -1) {
+        proxyLogErr("Failed to fork the new process: %s", strerror(errno));
+        close(sv[0]);
+        return;
+    }
+    proxy.upgrade_pid = pid;
+    proxy.upgrade_fd = sv[0];
+    for (i = 0; i < proxy.fd_count; i++)
+        if (proxy.fds[i] == proxy.unixsocket_fd) unixsocket_idx = i;
+    pthread_mutex_lock(&topology_lock);
+    sds topology = (cluster_topology ? sdsdup(cluster_topology) : NULL);
+    pthread_mutex_unlock(&topology_lock);
+    int sent = upgradeSendSockets(sv[0], proxy.fds, proxy.fd_count,
+                                  unixsocket_idx, topology);
+    sdsfree(topology);
+    /* The main loop is sized for the listening sockets only. */
+    if (sv[0] >= aeGetSetSize(proxy.main_loop) &&
+        aeResizeSetSize(proxy.main_loop, sv[0] + 1) == AE_ERR) sent = 0;
+    if (!sent || anetNonBlock(NULL, sv[0]) == ANET_ERR ||
+        aeCreateFileEvent(proxy.main_loop, sv[0], AE_READABLE,
+                          readUpgradeAck, NULL) == AE_ERR)
+    {
+        abortUpgrade();
+        return;
+    }
+    proxyLogInfo("Listening sockets sent to the new process (PID %d)",
+                 (int) pid);
+}
+
+/* Retired threads' cumulative stats are added to the first thread, which
+ * is never retired, so that they're still reported by PROXY INFO. */
+static void mergeThreadStats(proxyThread *thread) {
+    proxyThread *first = proxy.threads[0];
+    first->evicted_clients += thread->evicted_clients;
+    first->stat_net_input_bytes += thread->stat_net_input_bytes;
+    first->stat_net_cluster_input_bytes +=
+        thread->stat_net_cluster_input_bytes;
+    first->stat_client_reads += thread->stat_client_reads;
+    first->stat_cluster_reads += thread->stat_cluster_reads;
+    first->stat_read_budget_exhausted += thread->stat_read_budget_exhausted;
+    first->stat_client_throttles += thread->stat_client_throttles;
+    first->stat_node_busy_errors += thread->stat_node_busy_errors;
+    first->stat_node_queued_requests += thread->stat_node_queued_requests;
+    first->stat_node_queue_wait += thread->stat_node_queue_wait;
+}
+
+/* Assign the clients migrated by retiring threads to the active threads. */
+static void dispatchMigratingClients(void) {
+    pthread_mutex_lock(&migrating_clients_lock);
+    if (listLength(migrating_clients) == 0) {
+        pthread_mutex_unlock(&migrating_clients_lock);
+        return;
+    }
+    list *clients = migrating_clients;
+    migrating_clients = listCreate();
+    pthread_mutex_unlock(&migrating_clients_lock);
+    if (migrating_clients == NULL) {
+        /* Try again at the next iteration. */
+        migrating_clients = clients;
+        return;
+    }
+    listIter li;
+    listNode *ln;
+    listRewind(clients, &li);
+    while ((ln = listNext(&li))) {
+        client *c = ln->value;
+        int from = c->thread_id;
+        uint64_t from_id = c->id;
+        c->thread_id = selectThreadWithLessClients();
+        proxyThread *thread = proxy.threads[c->thread_id];
+        thread->process_clients++;
+        c->id = thread->next_client_id++;
+        if (thread->next_client_id == UINT64_MAX) thread->next_client_id = 0;
+        proxyLogDebug("Client %d:%" PRId64 " migrated to %d:%" PRId64,
+                      from, from_id, c->thread_id, c->id);
+        if (!awakeThreadForNewClient(thread, c)) {
+            proxyLogDebug("Failed to awake thread %d for client %" PRId64,
+                          thread->thread_id, c->id);
+            freeClient(c);
+        }
+    }
+    listRelease(clients);
+}
+
+/* Return 1 if threads are still being started or retired. */
+static int isThreadsResizeInProgress(void) {
+    int num_threads = config.num_threads;
+    return (proxy.requested_threads != num_threads ||
+            proxy.running_threads != num_threads);
+}
+
+/* Start or retire threads until config.num_threads matches the number
+ * of threads requested via PROXY CONFIG SET threads. A new resize is only
+ * started after the threads retired by the previous one have been joined,
+ * so that their slots can be reused. */
+static void resizeThreads(void) {
+    int i, retiring = 0, retired[MAX_THREADS];
+    for (i = config.num_threads; i < proxy.running_threads; i++) {
+        proxyThread *thread = proxy.threads[i];
+        retired[i] = (thread != NULL && thread->retired);
+        if (thread != NULL && !retired[i]) retiring++;
+    }
+    /* Clients are dispatched after checking the retired threads, since a
+     * thread is only flagged as retired after all its clients have been
+     * handed over. */
+    dispatchMigratingClients();
+    for (i = config.num_threads; i < proxy.running_threads; i++) {
+        if (!retired[i]) continue;
+        proxyThread *thread = proxy.threads[i];
+        pthread_join(thread->thread, NULL);
+        mergeThreadStats(thread);
+        proxy.min_reserved_fds -= thread->reserved_fds;
+        freeProxyThread(thread);
+        proxyLogHdr("Thread %d retired", i);
+    }
+    if (retiring > 0) return;
+    proxy.running_threads = config.num_threads;
+    int requested = proxy.requested_threads;
+    if (requested == config.num_threads) return;
+    if (proxy.draining || proxy.listeners_handed_off) return;
+    if (requested > config.num_threads) {
+        proxyLogHdr("Starting %d new thread(s)...",
+                    requested - config.num_threads);
+        for (i = config.num_threads; i < requested; i++) {
+            if (!startProxyThread(i)) {
+                proxyLogErr("Failed to start thread %d", i);
+                proxy.requested_threads = config.num_threads;
+                break;
+            }
+            /* Publish the new thread only after it has been started. */
+            config.num_threads = i + 1;
+            proxy.running_threads = config.num_threads;
+        }
+        proxyLogHdr("Running %d thread(s)", config.num_threads);
+    } else {
+        proxyLogHdr("Retiring %d thread(s)...",
+                    config.num_threads - requested);
+        /* New clients are not assigned to retiring threads anymore. */
+        config.num_threads = requested;
+        for (i = requested; i < proxy.running_threads; i++)
+            sendRetireMessageToThread(proxy.threads[i]);
+    }
+}
+
+static int proxyCron(aeEventLoop *el, long long id, void *data) {
+    UNUSED(id);
+    UNUSED(data);
+    if (proxy.upgrade_requested) {
+        proxy.upgrade_requested = 0;
+        startUpgrade();
+    }
+    if (proxy.drain_requested) {
+        proxy.drain_requested = 0;
+        startDrain(config.drain_timeout);
+    }
+    resizeThreads();
+    if (proxy.reload_requested) {
+        sds err = NULL;
+        proxy.reload_requested = 0;
+        if (!reloadConfig(&err)) {
+            proxyLogErr("Failed to reload configuration: %s", err);
+            sdsfree(err);
+        }
+    }
+    /* Reap the new process if it failed (or daemonized). */
+    if (proxy.upgrade_pid != -1) while (waitpid(-1, NULL, WNOHANG) > 0);
+    if (proxy.draining && proxy.fd_count > 0) {
+        proxyLogHdr("Not accepting new connections anymore");
+        stopAcceptingConnections();
+    }
+    if (proxy.draining || proxy.listeners_handed_off) {
+        uint64_t numclients = proxy.numclients;
+        long long deadline = proxy.drain_deadline;
+        if (numclients == 0) {
+            proxyLogHdr("All clients disconnected, drain completed");
+            aeStop(el);
+        } else if (deadline > 0 && mstime() >= deadline) {
+            proxyLogHdr("Drain timeout reached, closing %" PRIu64
+                        " client(s)", numclients);
+            aeStop(el);
+        }
+    }
+    return MAIN_CRON_INTERVAL;
+}
+
+int proxyMain(int argc, char **argv) {
     int exit_status = 0, i;
     signal(SIGPIPE, SIG_IGN);
     setupSignalHandlers();
     uname(&proxy_os);
     ae_api_kqueue = (strcmp("kqueue", aeGetApiName()) == 0);
     thread_id = PROXY_MAIN_THREAD_ID;
-    initConfig();
+    initConfig(&config);
     proxy.configfile = NULL;
     proxy.threads = NULL;
-    int parsed_opts = parseOptions(argc, argv);
-    checkConfig();
+    /* Keep a copy of the arguments for binary upgrades and configuration
+     * reloads, since entry points are parsed in place. The upgrade socket
+     * only makes sense for this process. */
+    proxy.argc = 0;
+    proxy.argv = zmalloc((argc + 1) * sizeof(char *));
+    for (i = 0; i < argc; i++) {
+        if (!strcmp("--upgrade-fd", argv[i]) && i < argc - 1) i++;
+        else proxy.argv[proxy.argc++] = zstrdup(argv[i]);
+    }
+    proxy.argv[proxy.argc] = NULL;
+    proxy.upgrade_requested = 0;
+    proxy.upgrade_fd = -1;
+    proxy.upgrade_pid = -1;
+    proxy.listeners_handed_off = 0;
+    proxy.draining = 0;
+    proxy.drain_deadline = 0;
+    proxy.drain_requested = 0;
+    proxy.reload_requested = 0;
+    int parsed_opts = parseOptions(&config, argc, argv);
+    if (parsed_opts < 0) return 1;
+    checkConfig(&config);
     while (parsed_opts < argc) {
         if (config.entry_points_count >= MAX_ENTRY_POINTS) break;
         char *addr = argv[parsed_opts++];
@@ -4952,10 +7652,25 @@ int main(int argc, char **argv) {
         if (strcmp("default", config.auth_user) == 0) config.auth_user = NULL;
         else if (config.auth == NULL) config.auth = "";
     }
+    if (config.tls || config.tls_cluster) {
+        sds tlserr = NULL;
+        if (!tlsInit(&tlserr)) {
+            fprintf(stderr, "FATAL: %s\n", tlserr);
+            sdsfree(tlserr);
+            return 1;
+        }
+        proxyLogHdr("TLS enabled for:%s%s", (config.tls ? " clients" : ""),
+                    (config.tls_cluster ? " cluster" : ""));
+    }
     proxy.unixsocket_fd = -1;
     proxy.tcp_backlog = config.tcp_backlog;
     checkTcpBacklogSettings();
-    if (!listen()) {
+    if (proxy.upgrade_fd != -1) {
+        if (!receiveListeningSockets()) {
+            exit_status = 1;
+            goto cleanup;
+        }
+    } else if (!listen()) {
         exit_status = 1;
         goto cleanup;
     }
@@ -4976,25 +7691,46 @@ int main(int argc, char **argv) {
             goto cleanup;
         }
     }
+    if (aeCreateTimeEvent(proxy.main_loop, MAIN_CRON_INTERVAL, proxyCron,
+                          NULL, NULL) == AE_ERR)
+    {
+        proxyLogErr("FATAL: Failed to create main cron, aborting...");
+        exit_status = 1;
+        goto cleanup;
+    }
+    if (proxy.upgrade_fd != -1) ackListeningSockets();
     proxy.main_thread = pthread_self();
     proxy.start_time = time(NULL);
     aeMain(proxy.main_loop);
 cleanup:
     proxyLogHdr("Redis Cluster Proxy is going to exit...");
     if (proxy.threads != NULL) {
-        for (i = 0; i < config.num_threads; i++)
-            sendStopMessageToThread(proxy.threads[i]);
-        for (i = 0; i < config.num_threads; i++)
-            pthread_join(proxy.threads[i]->thread, NULL);
+        /* Also stop the threads that are still retiring. */
+        for (i = 0; i < proxy.running_threads; i++) {
+            if (proxy.threads[i] != NULL)
+                sendStopMessageToThread(proxy.threads[i]);
+        }
+        for (i = 0; i < proxy.running_threads; i++) {
+            if (proxy.threads[i] != NULL)
+                pthread_join(proxy.threads[i]->thread, NULL);
+        }
         proxyLogHdr("All thread(s) stopped.");
     }
     releaseProxy();
+    tlsCleanup();
     proxyLogHdr("Bye bye!");
     if (config.unixsocket) zfree(config.unixsocket);
     if (config.pidfile) zfree(config.pidfile);
     if (config.logfile) zfree(config.logfile);
     if (config.auth) zfree(config.auth);
     if (config.auth_user) zfree(config.auth_user);
+    if (config.bulk_users) zfree(config.bulk_users);
+    zfree(config.tls_cert_file);
+    zfree(config.tls_key_file);
+    zfree(config.tls_ca_cert_file);
+    zfree(config.tls_ca_cert_dir);
     freeEntryPoints(config.entry_points, config.entry_points_count);
+    for (i = 0; i < proxy.argc; i++) zfree(proxy.argv[i]);
+    zfree(proxy.argv);
     return exit_status;
 }
@@ -23,6 +23,7 @@
 #endif
 
 #include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <sys/resource.h>
 #include <hiredis.h>
@@ -34,12 +35,18 @@
 #include "sds.h"
 #include "rax.h"
 #include "config.h"
+#include "ratelimit.h"
+#include "tls.h"
 #include "version.h"
 
 #define CLIENT_STATUS_NONE          0
 #define CLIENT_STATUS_LINKED        1
 #define CLIENT_STATUS_UNLINKED      2
 
+#define PARSE_STATUS_INCOMPLETE     -1
+#define PARSE_STATUS_ERROR          0
+#define PARSE_STATUS_OK             1
+
 #define PROXY_MAIN_THREAD_ID -1
 #define PROXY_UNKN_THREAD_ID -999
 
@@ -57,9 +64,40 @@ typedef struct proxyThread {
     list *pending_messages;
     list *connections_pool;
     int is_spawning_connections;
+    int is_checking_failover;
+    size_t clients_obuf_size; /* Output buffer bytes of all the clients */
+    size_t clients_qbuf_size; /* Query buffer bytes of all the clients */
+    _Atomic size_t clients_memory; /* Memory used by all the clients */
+    _Atomic uint64_t evicted_clients;
+    int is_evicting_clients;
+    char *readbuf; /* Buffer shared by all the clients for reading queries */
+    struct client *backpressure_client; /* Client whose output buffer is
+                                         * causing reads from shared node
+                                         * connections to be paused. */
+    int is_checking_backpressure;
     uint64_t next_client_id;
     _Atomic uint64_t process_clients;
+    _Atomic uint64_t stat_net_input_bytes; /* Bytes read from clients */
+    _Atomic uint64_t stat_net_cluster_input_bytes; /* Bytes read from nodes */
+    _Atomic uint64_t stat_client_reads; /* Reads from clients' sockets */
+    _Atomic uint64_t stat_cluster_reads; /* Reads from nodes' sockets */
+    _Atomic uint64_t stat_read_budget_exhausted; /* Readable events stopped
+                                                  * by the read budget */
+    _Atomic uint64_t stat_client_throttles; /* Times reads from a client have
+                                             * been paused by rate limits */
+    _Atomic int throttled_clients; /* Clients currently throttled */
+    _Atomic uint64_t stat_node_busy_errors; /* Requests rejected because
+                                             * of in-flight limits */
+    _Atomic uint64_t stat_node_queued_requests; /* Requests that waited for
+                                                 * in-flight limits */
+    _Atomic uint64_t stat_node_queue_wait; /* Microseconds spent by requests
+                                            * waiting for in-flight limits */
     sds msgbuffer;
+    int is_retiring; /* Migrating its clients to the other threads */
+    long long retire_deadline; /* Milliseconds, clients that can't be
+                                * migrated by then are closed (0 if none) */
+    _Atomic int retired; /* All clients migrated, the thread is stopping */
+    int reserved_fds; /* Share of proxy.min_reserved_fds */
 } proxyThread;
 
 typedef struct clientRequest {
@@ -89,6 +127,12 @@ typedef struct clientRequest {
     rax  *child_replies;
     uint64_t max_child_reply_id;
     struct clientRequest *parent_request;
+    long long held_since; /* Time (in ms) the request has been held at
+                           * while waiting for a failover, 0 if never held. */
+    long long queued_since; /* Time (in us) the request has been queued at
+                             * while node in-flight limits are enabled. */
+    size_t inflight_bytes; /* Bytes accounted to the node's in-flight
+                            * bytes while the request is pending. */
     /* Pointers to *listNode used in various list. They allow to quickly
      * have a reference to the node instead of searching it via listSearchKey.
      */
@@ -99,6 +143,14 @@ typedef struct clientRequest {
     listNode *requests_pending_lnode; /* Pointer to node in
                                        * redisClusterConnection->
                                        * requests_pending list */
+    listNode *held_requests_lnode; /* Pointer to node in
+                                    * redisCluster->held_requests list */
+    clientSendQueue *send_queue; /* Client's send queue on the node's
+                                  * connection, NULL if the request is not
+                                  * waiting for its turn to be written */
+    listNode *send_queue_lnode; /* Pointer to node in send_queue->requests */
+    size_t accounted_size; /* Buffer size accounted in
+                            * client->requests_memory */
 } clientRequest;
 
 typedef struct {
@@ -117,12 +169,40 @@ typedef struct {
     size_t system_memory_size;
     pthread_t main_thread;
     _Atomic int exit_asap;
+    /* Binary upgrade (see SIGUSR2) */
+    int argc;
+    char **argv;
+    volatile sig_atomic_t upgrade_requested;
+    int upgrade_fd;                 /* Handoff socket: connected to the new
+                                     * process in the old one and vice versa,
+                                     * -1 if no handoff is in progress */
+    pid_t upgrade_pid;              /* PID of the new process */
+    int listeners_handed_off;       /* Listening sockets passed to the new
+                                     * process: the old one is draining */
+    /* Drain mode (see PROXY DRAIN and SIGUSR1) */
+    _Atomic int draining;
+    _Atomic long long drain_deadline; /* Milliseconds, 0 if none */
+    volatile sig_atomic_t drain_requested;
+    /* Configuration reload (see PROXY CONFIG RELOAD and SIGHUP) */
+    volatile sig_atomic_t reload_requested;
+    /* Threads resize (see PROXY CONFIG SET threads): config.num_threads
+     * threads accept new clients, while threads in the slots up to
+     * running_threads are retiring. */
+    _Atomic int requested_threads;
+    _Atomic int running_threads;
 } redisClusterProxy;
 
+/* Reply that cannot be written to the client yet, since replies to previous
+ * requests are still missing. */
+typedef struct unorderedReply {
+    uint64_t req_id;
+    sds reply;
+} unorderedReply;
+
 typedef struct client {
     uint64_t id;
     int fd;
-    sds ip;
+    tlsConnection *tls; /* TLS connection (--tls), or NULL */
     int port;
     sds addr;
     int thread_id;
@@ -135,7 +215,22 @@ typedef struct client {
     uint64_t next_request_id;
     struct clientRequest *current_request; /* Currently reading */
     uint64_t min_reply_id;
-    rax *unordered_replies;
+    unorderedReply *unordered_replies; /* Ring buffer of unordered replies,
+                                        * indexed by request ID */
+    size_t unordered_replies_slots;    /* Ring buffer's size (power of 2) */
+    size_t unordered_replies_count;
+    size_t unordered_replies_size;  /* Bytes used by unordered replies */
+    size_t obuf_accounted_size;     /* Output buffer size last accounted in
+                                     * thread->clients_obuf_size */
+    time_t obuf_soft_limit_reached_time;
+    size_t qbuf_accounted_size;     /* Query buffer size last accounted in
+                                     * thread->clients_qbuf_size */
+    size_t requests_memory;         /* Memory used by parsed requests that
+                                     * are still pending */
+    size_t memory_accounted;        /* Memory last accounted in
+                                     * thread->clients_memory */
+    time_t last_interaction;        /* Time of the last query read */
+    int readlen;                    /* Size of the next read from socket */
     list *requests;                  /* All client's requests */
     list *requests_to_process;       /* Requests not completely parsed */
     int requests_with_write_handler; /* Number of request that are still
@@ -154,6 +249,13 @@ typedef struct client {
                                      * itself with different credentials from
                                      * the ones used in the proxy config */
     sds auth_passw;
+    int priority;                   /* PRIORITY_BULK if all the client's
+                                     * requests are bulk requests */
+    rateLimit rate_limit;           /* See client-max-ops-per-sec and
+                                     * client-max-bytes-per-sec */
+    userRateLimit *user_rate_limit; /* Shared by the clients of auth_user */
+    long long throttle_timer_id;    /* Timer resuming reads paused by rate
+                                     * limits, -1 if not throttled */
     /* Pointers to *listNode used in various list. They allow to quickly
      * have a reference to the node instead of searching it via listSearchKey.
      */
@@ -162,11 +264,25 @@ typedef struct client {
                                        * thread->unlinked_clients list */
 } client;
 
+int proxyMain(int argc, char **argv);
 int getCurrentThreadID(void);
+void initCommandTable(void);
+redisCommandDef *getRedisCommand(sds name);
+clientRequest *createRequest(client *c);
+int parseRequest(clientRequest *req, sds *err);
+clusterNode *getRequestNode(clientRequest *req, sds *err);
+int mergeReplies(void *reply, void *request, char *buf, int len);
 int processRequest(clientRequest *req, int *parsing_status,
     clientRequest **next);
 void freeRequest(clientRequest *req);
 void freeRequestList(list *request_list);
+void removeRequestFromSendQueue(clientRequest *req);
 void onClusterNodeDisconnection(clusterNode *node);
+void processHeldRequests(redisCluster *cluster);
+void saveClusterTopology(redisCluster *cluster);
+size_t getClientOutputBufferMemoryUsage(client *c);
+size_t getClientQueryBufferMemoryUsage(client *c);
+size_t getClientMemoryUsage(client *c);
+void checkClientOutputBufferLimits(client *c);
 
 #endif /* __REDIS_CLUSTER_PROXY_H__ */
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "ratelimit.h"
+#include "rax.h"
+#include "zmalloc.h"
+
+/* Users' rate limits are never released until the proxy exits, since they
+ * can be referenced by clients of any thread. */
+static rax *user_rate_limits = NULL;
+static pthread_mutex_t user_rate_limits_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void initTokenBucket(tokenBucket *b) {
+    b->tokens = 0;
+    b->last_refill = 0;
+}
+
+void initRateLimit(rateLimit *rl) {
+    initTokenBucket(&rl->ops);
+    initTokenBucket(&rl->bytes);
+}
+
+/* Refill the bucket with the tokens accrued since its last refill, charge
+ * it with 'amount' tokens and return the milliseconds needed for the bucket
+ * to get out of debt (0 if it's not in debt). A 'rate' of 0 means that
+ * there's no limit. */
+static long long chargeTokenBucket(tokenBucket *b, long long rate,
+                                   long long amount, long long now)
+{
+    if (rate <= 0) {
+        /* Start with a full bucket as soon as a limit gets configured. */
+        b->last_refill = 0;
+        return 0;
+    }
+    if (b->last_refill == 0) b->tokens = rate;
+    else if (now > b->last_refill)
+        b->tokens += (double) (now - b->last_refill) * rate / 1000000;
+    if (b->tokens > rate) b->tokens = rate;
+    b->last_refill = now;
+    b->tokens -= amount;
+    if (b->tokens >= 0) return 0;
+    return (long long) (-b->tokens * 1000 / rate) + 1;
+}
+
+/* Charge the rate limit with the queries and the bytes read from a client
+ * and return the milliseconds during which reads from the client have to be
+ * paused (0 if the client is within its limits). Use 0 for 'ops' and
+ * 'bytes' in order to just check whether the client is still throttled. */
+long long chargeRateLimit(rateLimit *rl, long long max_ops,
+                          long long max_bytes, long long ops,
+                          long long bytes, long long now)
+{
+    long long ops_delay = chargeTokenBucket(&rl->ops, max_ops, ops, now);
+    long long bytes_delay = chargeTokenBucket(&rl->bytes, max_bytes, bytes,
+                                              now);
+    return (ops_delay > bytes_delay ? ops_delay : bytes_delay);
+}
+
+long long chargeUserRateLimit(userRateLimit *url, long long max_ops,
+                              long long max_bytes, long long ops,
+                              long long bytes, long long now)
+{
+    pthread_mutex_lock(&url->lock);
+    long long delay = chargeRateLimit(&url->limit, max_ops, max_bytes, ops,
+                                      bytes, now);
+    pthread_mutex_unlock(&url->lock);
+    return delay;
+}
+
+/* Return the rate limit shared by the clients of the user, creating it if
+ * needed. Return NULL on allocation failure. */
+userRateLimit *getUserRateLimit(const char *user) {
+    userRateLimit *url = NULL;
+    pthread_mutex_lock(&user_rate_limits_lock);
+    if (user_rate_limits == NULL) user_rate_limits = raxNew();
+    if (user_rate_limits == NULL) goto cleanup;
+    url = raxFind(user_rate_limits, (unsigned char *) user, strlen(user));
+    if (url != raxNotFound) goto cleanup;
+    url = zmalloc(sizeof(*url));
+    if (url == NULL) goto cleanup;
+    pthread_mutex_init(&url->lock, NULL);
+    initRateLimit(&url->limit);
+    if (!raxInsert(user_rate_limits, (unsigned char *) user, strlen(user),
+                   url, NULL))
+    {
+        pthread_mutex_destroy(&url->lock);
+        zfree(url);
+        url = NULL;
+    }
+cleanup:
+    pthread_mutex_unlock(&user_rate_limits_lock);
+    return url;
+}
+
+static void freeUserRateLimit(void *ptr) {
+    userRateLimit *url = ptr;
+    pthread_mutex_destroy(&url->lock);
+    zfree(url);
+}
+
+void freeUserRateLimits(void) {
+    pthread_mutex_lock(&user_rate_limits_lock);
+    if (user_rate_limits != NULL) {
+        raxFreeWithCallback(user_rate_limits, freeUserRateLimit);
+        user_rate_limits = NULL;
+    }
+    pthread_mutex_unlock(&user_rate_limits_lock);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REDIS_CLUSTER_PROXY_RATELIMIT_H__
+#define __REDIS_CLUSTER_PROXY_RATELIMIT_H__
+
+#include <pthread.h>
+
+/* Token buckets used to limit the queries (and the bytes) that clients and
+ * users can send every second. Buckets hold up to one second of traffic,
+ * and they're charged after queries have been read, so that they can go
+ * below zero: reads from the client are then paused until the debt has been
+ * paid (see chargeRateLimit). */
+typedef struct tokenBucket {
+    double tokens;
+    long long last_refill; /* Microseconds, 0 if never refilled */
+} tokenBucket;
+
+typedef struct rateLimit {
+    tokenBucket ops;
+    tokenBucket bytes;
+} rateLimit;
+
+/* Rate limit shared by all the clients authenticated with the same user,
+ * that can belong to different threads. */
+typedef struct userRateLimit {
+    pthread_mutex_t lock;
+    rateLimit limit;
+} userRateLimit;
+
+void initRateLimit(rateLimit *rl);
+long long chargeRateLimit(rateLimit *rl, long long max_ops,
+                          long long max_bytes, long long ops,
+                          long long bytes, long long now);
+long long chargeUserRateLimit(userRateLimit *url, long long max_ops,
+                              long long max_bytes, long long ops,
+                              long long bytes, long long now);
+userRateLimit *getUserRateLimit(const char *user);
+void freeUserRateLimits(void);
+
+#endif /* __REDIS_CLUSTER_PROXY_RATELIMIT_H__ */
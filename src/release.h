@@ -0,0 +1,4 @@
+#define REDIS_CLUSTER_PROXY_GIT_SHA1 "3d832571"
+#define REDIS_CLUSTER_PROXY_GIT_DIRTY "0"
+#define REDIS_CLUSTER_PROXY_GIT_BRANCH "master"
+#define REDIS_CLUSTER_PROXY_BUILD_ID "vm-1792262697"
@@ -0,0 +1,568 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Replay of the traffic captured with PROXY CAPTURE.
+ *
+ * Every captured client gets its own connection, opened when its first
+ * query is replayed and closed when the capture recorded its disconnection
+ * (after all the replies to its queries have been received), so that the
+ * concurrency of the original traffic is preserved. Records are
+ * sent at the time they were captured, divided by '--speed' (with speed 0
+ * they are all sent as soon as possible), and since the raw bytes read from
+ * every client are written to its connection in the same order, pipelines
+ * and query boundaries are replayed exactly as they were received.
+ *
+ * The schedule lag (how late records were sent compared to their scheduled
+ * time) shows whether the replay itself kept up with the requested speed. */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <hiredis.h>
+#include "ae.h"
+#include "anet.h"
+#include "sds.h"
+#include "rax.h"
+#include "zmalloc.h"
+#include "util.h"
+#include "capture.h"
+#include "resp.h"
+
+#define REPLAY_DEFAULT_HOST         "127.0.0.1"
+#define REPLAY_DEFAULT_PORT         7777
+#define REPLAY_DEFAULT_SPEED        1.0
+#define REPLAY_DEFAULT_WAIT         1000 /* Milliseconds */
+#define REPLAY_IOBUF_LEN            (1024*16)
+#define REPLAY_CRON_PERIOD          1 /* Milliseconds */
+
+typedef struct replayRecord {
+    long long time; /* Microseconds since the start of the capture */
+    long long seq;  /* Position in the file, to keep the sort stable */
+    int type;
+    int client;     /* Index of the client in replay.clients */
+    int queries;    /* Queries completed by the record's data */
+    const char *data;
+    size_t len;
+} replayRecord;
+
+typedef struct replayClient {
+    int thread_id;
+    uint64_t client_id;
+    int fd;
+    int closing;    /* Close the connection after all the replies */
+    int failed;     /* Could not connect, skip all the client's records */
+    sds obuf;
+    redisReader *reader;
+    long long queries;  /* Queries sent */
+    long long replies;  /* Replies received */
+    sds qbuf;       /* Incomplete query, only used while loading */
+    int invalid;    /* Queries can't be counted, only used while loading */
+} replayClient;
+
+static struct {
+    char *host;
+    int port;
+    double speed;
+    long long wait;
+    int quiet;
+    char *filename;
+    sds file;
+    long long capture_start;
+    replayRecord *records;
+    long long records_count;
+    long long next_record;
+    replayClient *clients;
+    int clients_count;
+    int open_connections;
+    aeEventLoop *el;
+    long long start;
+    long long last_activity;
+    long long bytes_sent;
+    long long replies;
+    long long errors;
+    long long disconnections;
+    long long connect_failures;
+    long long skipped_records;
+    long long lag_total;
+    long long lag_max;
+    sds first_error;
+} replay;
+
+/* -----------------------------------------------------------------------------
+ * Capture file loading
+ * -------------------------------------------------------------------------- */
+
+/* Decode the varint at 'p' into 'value'. Return the pointer to the next
+ * byte, or NULL if the varint is truncated. */
+static const unsigned char *readVarint(const unsigned char *p,
+                                       const unsigned char *end,
+                                       uint64_t *value)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    while (p < end && shift < 64) {
+        unsigned char b = *(p++);
+        v |= (uint64_t) (b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+static int getClientIndex(rax *index, int thread_id, uint64_t client_id) {
+    unsigned char key[12];
+    int i;
+    for (i = 0; i < 4; i++) key[i] = (unsigned char) (thread_id >> (i * 8));
+    for (i = 0; i < 8; i++)
+        key[4 + i] = (unsigned char) (client_id >> (i * 8));
+    void *found = raxFind(index, key, sizeof(key));
+    if (found != raxNotFound) return (int) (intptr_t) found;
+    int idx = replay.clients_count++;
+    replay.clients = zrealloc(replay.clients,
+                              sizeof(replayClient) * replay.clients_count);
+    replayClient *c = replay.clients + idx;
+    c->thread_id = thread_id;
+    c->client_id = client_id;
+    c->fd = -1;
+    c->closing = 0;
+    c->failed = 0;
+    c->obuf = sdsempty();
+    c->reader = NULL;
+    c->queries = 0;
+    c->replies = 0;
+    c->qbuf = sdsempty();
+    c->invalid = 0;
+    raxInsert(index, key, sizeof(key), (void *) (intptr_t) idx, NULL);
+    return idx;
+}
+
+/* Count the queries completed by the data of a new record of the client
+ * 'c', so that its connection can be closed after receiving all of their
+ * replies. Queries are split with the same rules used by the proxy. */
+static int countQueries(replayClient *c, const char *data, size_t len) {
+    int count = 0, argc;
+    size_t pos = 0;
+    if (c->invalid) return 0;
+    c->qbuf = sdscatlen(c->qbuf, data, len);
+    while (pos < sdslen(c->qbuf)) {
+        char *p = c->qbuf + pos;
+        size_t avail = sdslen(c->qbuf) - pos;
+        if (*p == '*') {
+            long long qlen = respScanMultibulk(p, avail, LLONG_MAX, &argc,
+                                               NULL, NULL);
+            if (qlen == 0) break;
+            if (qlen < 0) {
+                c->invalid = 1;
+                break;
+            }
+            pos += qlen;
+            count++;
+        } else {
+            char *nl = memchr(p, '\n', avail);
+            if (nl == NULL) break;
+            /* Empty lines between queries are skipped. */
+            if (nl > p && !(nl == p + 1 && *p == '\r')) count++;
+            pos += (nl - p) + 1;
+        }
+    }
+    sdsrange(c->qbuf, pos, -1);
+    return count;
+}
+
+static sds readFile(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) return NULL;
+    sds buf = sdsempty();
+    while (1) {
+        buf = sdsMakeRoomFor(buf, REPLAY_IOBUF_LEN);
+        size_t nread = fread(buf + sdslen(buf), 1, sdsavail(buf), fp);
+        if (nread == 0) break;
+        sdsIncrLen(buf, nread);
+    }
+    int err = ferror(fp);
+    fclose(fp);
+    if (err) {
+        sdsfree(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static int compareRecords(const void *a, const void *b) {
+    const replayRecord *ra = a, *rb = b;
+    if (ra->time != rb->time) return (ra->time < rb->time ? -1 : 1);
+    return (ra->seq < rb->seq ? -1 : (ra->seq > rb->seq));
+}
+
+static void loadCapture(const char *filename) {
+    replay.file = readFile(filename);
+    if (replay.file == NULL) {
+        fprintf(stderr, "Could not read '%s': %s\n", filename,
+                strerror(errno));
+        exit(1);
+    }
+    const unsigned char *p = (unsigned char *) replay.file,
+                        *end = p + sdslen(replay.file);
+    int i;
+    if (sdslen(replay.file) < CAPTURE_HEADER_LEN ||
+        memcmp(p, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "'%s' is not a capture file\n", filename);
+        exit(1);
+    }
+    if (p[CAPTURE_MAGIC_LEN] != CAPTURE_VERSION) {
+        fprintf(stderr, "Unsupported capture version: %d\n",
+                p[CAPTURE_MAGIC_LEN]);
+        exit(1);
+    }
+    replay.capture_start = 0;
+    for (i = 0; i < 8; i++)
+        replay.capture_start |= (long long) p[8 + i] << (i * 8);
+    p += CAPTURE_HEADER_LEN;
+    rax *index = raxNew();
+    long long size = 0;
+    while (p < end) {
+        uint64_t time, thread_id, client_id, len = 0;
+        const unsigned char *rec = p;
+        int type = *(p++);
+        if (type != CAPTURE_RECORD_QUERY && type != CAPTURE_RECORD_CLOSE) {
+            fprintf(stderr, "Invalid record type %d at offset %ld\n", type,
+                    (long) (rec - (unsigned char *) replay.file));
+            exit(1);
+        }
+        if ((p = readVarint(p, end, &time)) == NULL ||
+            (p = readVarint(p, end, &thread_id)) == NULL ||
+            (p = readVarint(p, end, &client_id)) == NULL ||
+            (type == CAPTURE_RECORD_QUERY &&
+             ((p = readVarint(p, end, &len)) == NULL ||
+              len > (uint64_t) (end - p))))
+        {
+            /* The capture could have been copied while it was still being
+             * written: just ignore the truncated record. */
+            fprintf(stderr, "WARNING: truncated record at offset %ld\n",
+                    (long) (rec - (unsigned char *) replay.file));
+            break;
+        }
+        if (replay.records_count == size) {
+            size = (size ? size * 2 : 1024);
+            replay.records = zrealloc(replay.records,
+                                      sizeof(replayRecord) * size);
+        }
+        replayRecord *r = replay.records + replay.records_count;
+        r->time = (long long) time;
+        r->seq = replay.records_count++;
+        r->type = type;
+        r->client = getClientIndex(index, (int) thread_id, client_id);
+        r->data = (const char *) p;
+        r->len = (size_t) len;
+        r->queries = countQueries(replay.clients + r->client, r->data,
+                                  r->len);
+        p += len;
+    }
+    raxFree(index);
+    for (i = 0; i < replay.clients_count; i++) {
+        sdsfree(replay.clients[i].qbuf);
+        replay.clients[i].qbuf = NULL;
+    }
+    /* Records of different threads can be slightly out of order. */
+    qsort(replay.records, replay.records_count, sizeof(replayRecord),
+          compareRecords);
+}
+
+/* -----------------------------------------------------------------------------
+ * Connections
+ * -------------------------------------------------------------------------- */
+
+static void closeClient(replayClient *c) {
+    if (c->fd == -1) return;
+    aeDeleteFileEvent(replay.el, c->fd, AE_READABLE | AE_WRITABLE);
+    close(c->fd);
+    c->fd = -1;
+    c->closing = 0;
+    sdsclear(c->obuf);
+    redisReaderFree(c->reader);
+    c->reader = NULL;
+    replay.open_connections--;
+}
+
+static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+static void writeToClient(replayClient *c) {
+    while (sdslen(c->obuf) > 0) {
+        ssize_t nwritten = write(c->fd, c->obuf, sdslen(c->obuf));
+        if (nwritten <= 0) {
+            if (nwritten == -1 && errno == EAGAIN) break;
+            replay.disconnections++;
+            closeClient(c);
+            return;
+        }
+        replay.bytes_sent += nwritten;
+        sdsrange(c->obuf, nwritten, -1);
+    }
+    if (sdslen(c->obuf) == 0 && c->closing && c->replies >= c->queries) {
+        closeClient(c);
+        return;
+    }
+    int installed = aeGetFileEvents(replay.el, c->fd) & AE_WRITABLE;
+    if (sdslen(c->obuf) == 0 && installed)
+        aeDeleteFileEvent(replay.el, c->fd, AE_WRITABLE);
+    else if (sdslen(c->obuf) > 0 && !installed)
+        aeCreateFileEvent(replay.el, c->fd, AE_WRITABLE, writeHandler, c);
+}
+
+static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    (void) el;
+    (void) fd;
+    (void) mask;
+    writeToClient(privdata);
+}
+
+static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    replayClient *c = privdata;
+    char buf[REPLAY_IOBUF_LEN];
+    void *reply = NULL;
+    (void) el;
+    (void) mask;
+    ssize_t nread = read(fd, buf, sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        replay.disconnections++;
+        closeClient(c);
+        return;
+    }
+    replay.last_activity = ustime();
+    if (redisReaderFeed(c->reader, buf, nread) != REDIS_OK) {
+        closeClient(c);
+        return;
+    }
+    while (1) {
+        if (redisReaderGetReply(c->reader, &reply) != REDIS_OK) {
+            if (replay.first_error == NULL)
+                replay.first_error = sdsnew("Protocol error");
+            closeClient(c);
+            return;
+        }
+        if (reply == NULL) break;
+        redisReply *r = reply;
+        if (r->type == REDIS_REPLY_ERROR) {
+            if (replay.first_error == NULL)
+                replay.first_error = sdsnewlen(r->str, r->len);
+            replay.errors++;
+        }
+        replay.replies++;
+        c->replies++;
+        freeReplyObject(reply);
+    }
+    if (c->closing && c->replies >= c->queries && sdslen(c->obuf) == 0)
+        closeClient(c);
+}
+
+static int connectClient(replayClient *c) {
+    char err[ANET_ERR_LEN];
+    c->fd = anetTcpConnect(err, replay.host, replay.port);
+    if (c->fd == ANET_ERR) {
+        if (replay.first_error == NULL)
+            replay.first_error = sdsnew(err);
+        c->fd = -1;
+        c->failed = 1;
+        replay.connect_failures++;
+        return 0;
+    }
+    anetNonBlock(NULL, c->fd);
+    anetEnableTcpNoDelay(NULL, c->fd);
+    c->reader = redisReaderCreate();
+    aeCreateFileEvent(replay.el, c->fd, AE_READABLE, readHandler, c);
+    replay.open_connections++;
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+ * Scheduling
+ * -------------------------------------------------------------------------- */
+
+static void replayRecordNow(replayRecord *r, long long now) {
+    replayClient *c = replay.clients + r->client;
+    if (replay.speed > 0) {
+        long long lag = (now - replay.start) -
+                        (long long) (r->time / replay.speed);
+        if (lag < 0) lag = 0;
+        replay.lag_total += lag;
+        if (lag > replay.lag_max) replay.lag_max = lag;
+    }
+    if (c->failed) {
+        replay.skipped_records++;
+        return;
+    }
+    if (r->type == CAPTURE_RECORD_CLOSE) {
+        if (c->fd == -1) return;
+        c->closing = 1;
+        writeToClient(c);
+        return;
+    }
+    if (c->fd == -1 && !connectClient(c)) {
+        replay.skipped_records++;
+        return;
+    }
+    c->obuf = sdscatlen(c->obuf, r->data, r->len);
+    c->queries += r->queries;
+    writeToClient(c);
+}
+
+static int isOutputPending(void) {
+    int i;
+    for (i = 0; i < replay.clients_count; i++)
+        if (replay.clients[i].fd != -1 && sdslen(replay.clients[i].obuf))
+            return 1;
+    return 0;
+}
+
+static int replayCron(aeEventLoop *el, long long id, void *privdata) {
+    (void) id;
+    (void) privdata;
+    long long now = ustime();
+    while (replay.next_record < replay.records_count) {
+        replayRecord *r = replay.records + replay.next_record;
+        if (replay.speed > 0 &&
+            (long long) (r->time / replay.speed) > now - replay.start) break;
+        replayRecordNow(r, now);
+        replay.next_record++;
+        replay.last_activity = now;
+    }
+    /* After the last record, wait for the replies to the queries still
+     * pending until connections are idle for --wait milliseconds. */
+    if (replay.next_record == replay.records_count && !isOutputPending()) {
+        if (replay.open_connections == 0 ||
+            (now - replay.last_activity) >= replay.wait * 1000)
+        {
+            aeStop(el);
+            return AE_NOMORE;
+        }
+    }
+    return REPLAY_CRON_PERIOD;
+}
+
+/* -----------------------------------------------------------------------------
+ * Main
+ * -------------------------------------------------------------------------- */
+
+static void printReport(long long end) {
+    double elapsed = (double) (end - replay.start) / 1000000;
+    double captured = 0;
+    if (replay.records_count > 0)
+        captured = (double) replay.records[replay.records_count - 1].time /
+                   1000000;
+    printf("Replayed %lld records of %d clients in %.2f seconds "
+           "(captured in %.2f seconds)\n", replay.records_count,
+           replay.clients_count, elapsed, captured);
+    printf("Bytes sent: %lld\n", replay.bytes_sent);
+    printf("Replies: %lld (%.2f replies/s), errors: %lld\n", replay.replies,
+           (elapsed > 0 ? replay.replies / elapsed : 0), replay.errors);
+    if (replay.speed > 0 && replay.records_count > 0) {
+        printf("Schedule lag: avg %.3f ms, max %.3f ms\n",
+               (double) replay.lag_total / replay.records_count / 1000,
+               (double) replay.lag_max / 1000);
+    }
+    if (replay.disconnections || replay.connect_failures) {
+        printf("Disconnections: %lld, failed connections: %lld, skipped "
+               "records: %lld\n", replay.disconnections,
+               replay.connect_failures, replay.skipped_records);
+    }
+    if (replay.first_error != NULL)
+        printf("First error: %s\n", replay.first_error);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+"Usage: redis-cluster-proxy-replay [OPTIONS] <capture-file>\n"
+"  -h <hostname>        Proxy hostname (default %s)\n"
+"  -p <port>            Proxy port (default %d)\n"
+"  --speed <factor>     Replay speed: 1 replays the capture in real time,\n"
+"                       2 twice as fast, 0 as fast as possible (default 1)\n"
+"  --wait <ms>          After the last record, wait for pending replies\n"
+"                       until connections are idle for <ms> milliseconds\n"
+"                       (default %d)\n"
+"  -q                   Quiet: only output the report\n"
+"  --help               Output this help and exit\n",
+    REPLAY_DEFAULT_HOST, REPLAY_DEFAULT_PORT, REPLAY_DEFAULT_WAIT);
+}
+
+static void parseOptions(int argc, char **argv) {
+    int i;
+    for (i = 1; i < argc; i++) {
+        int lastarg = (i == argc - 1);
+        if (!strcmp(argv[i], "-h") && !lastarg) replay.host = argv[++i];
+        else if (!strcmp(argv[i], "-p") && !lastarg)
+            replay.port = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--speed") && !lastarg)
+            replay.speed = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--wait") && !lastarg)
+            replay.wait = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "-q")) replay.quiet = 1;
+        else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+            usage();
+            exit(0);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Invalid option '%s'\n\n", argv[i]);
+            usage();
+            exit(1);
+        } else if (replay.filename == NULL) replay.filename = argv[i];
+        else {
+            usage();
+            exit(1);
+        }
+    }
+    if (replay.filename == NULL) {
+        usage();
+        exit(1);
+    }
+    if (replay.speed < 0) replay.speed = 0;
+    if (replay.wait < 0) replay.wait = 0;
+}
+
+int main(int argc, char **argv) {
+    memset(&replay, 0, sizeof(replay));
+    replay.host = REPLAY_DEFAULT_HOST;
+    replay.port = REPLAY_DEFAULT_PORT;
+    replay.speed = REPLAY_DEFAULT_SPEED;
+    replay.wait = REPLAY_DEFAULT_WAIT;
+    parseOptions(argc, argv);
+    loadCapture(replay.filename);
+    if (!replay.quiet) {
+        fprintf(stderr, "Loaded %lld records of %d clients from '%s'\n",
+                replay.records_count, replay.clients_count, replay.filename);
+    }
+    replay.el = aeCreateEventLoop(replay.clients_count + 1024);
+    if (replay.el == NULL) {
+        fprintf(stderr, "Failed to create the event loop\n");
+        return 1;
+    }
+    replay.start = ustime();
+    replay.last_activity = replay.start;
+    aeCreateTimeEvent(replay.el, REPLAY_CRON_PERIOD, replayCron, NULL, NULL);
+    aeMain(replay.el);
+    printReport(ustime());
+    return (replay.connect_failures > 0);
+}
@@ -19,53 +19,127 @@
 #include <inttypes.h>
 #include "reply_order.h"
 #include "logger.h"
-#include "endianconv.h"
+#include "zmalloc.h"
 
-void addUnorderedReply(client *c, sds reply, uint64_t req_id) {
-    uint64_t be_id = htonu64(req_id); /* Big-endian request ID */
-    sds oldreply = NULL;
-    raxInsert(c->unordered_replies, (unsigned char *) &be_id,
-              sizeof(be_id), reply, (void **)&oldreply);
-    if (oldreply != NULL) {
-        proxyLogDebug("WARN: Unordered reply for request %d:%" PRId64 ":%"
-            PRId64 " was already set to: '%s', and new reply " " is '%s'",
-            c->thread_id, c->id, req_id, oldreply, reply);
-        sdsfree(oldreply);
+/* Unordered replies are stored in a ring buffer whose size is always a power
+ * of two, so that the slot of a reply is simply given by its request ID
+ * masked with the ring's size. Since request IDs are sequential, every reply
+ * still waiting to be written has an ID in the window starting from the
+ * client's min_reply_id, so the ring only needs to be as big as the window
+ * of in-flight requests, and it grows when the window grows. Every slot also
+ * stores the request ID, since replies to requests that have been skipped
+ * (ie. when min_reply_id is moved after the last child request of a
+ * multi-node query) can stay into the ring until their slot gets reused. */
+
+#define UNORDERED_REPLIES_MIN_SLOTS 16
+
+static void freeUnorderedReplySlot(client *c, unorderedReply *slot) {
+    if (slot->reply == NULL) return;
+    c->unordered_replies_size -= sdslen(slot->reply);
+    c->unordered_replies_count--;
+    sdsfree(slot->reply);
+    slot->reply = NULL;
+}
+
+/* Resize the ring so that it can contain every reply with an ID between the
+ * client's min_reply_id and `req_id`, dropping replies to skipped requests.
+ * Return 1 on success, 0 on failure. */
+static int resizeUnorderedReplies(client *c, uint64_t req_id) {
+    uint64_t window = req_id - c->min_reply_id, i;
+    unorderedReply *old = c->unordered_replies;
+    size_t oldslots = c->unordered_replies_slots;
+    /* Also make room for replies added before min_reply_id was moved
+     * backwards. */
+    for (i = 0; i < oldslots; i++) {
+        unorderedReply *slot = old + i;
+        if (slot->reply == NULL) continue;
+        if (slot->req_id < c->min_reply_id) freeUnorderedReplySlot(c, slot);
+        else if (slot->req_id - c->min_reply_id > window)
+            window = slot->req_id - c->min_reply_id;
     }
+    size_t slots = (oldslots ? oldslots : UNORDERED_REPLIES_MIN_SLOTS);
+    while (slots <= window) slots <<= 1;
+    if (slots == oldslots) return 1;
+    unorderedReply *ring = zcalloc(slots * sizeof(*ring));
+    if (ring == NULL) return 0;
+    for (i = 0; i < oldslots; i++) {
+        unorderedReply *slot = old + i;
+        if (slot->reply == NULL) continue;
+        ring[slot->req_id & (slots - 1)] = *slot;
+    }
+    zfree(old);
+    c->unordered_replies = ring;
+    c->unordered_replies_slots = slots;
+    proxyLogDebug("Resized unordered replies of client %d:%" PRIu64 " to %zu "
+                  "slots", c->thread_id, c->id, slots);
+    return 1;
 }
 
-int appendUnorderedRepliesToBuffer(client *c) {
-    raxIterator iter;
-    raxStart(&iter, c->unordered_replies);
-    uint64_t min_id = htonu64(c->min_reply_id);
-    if (!raxSeek(&iter, ">=", (unsigned char*) &min_id, sizeof(min_id))) {
-        proxyLogDebug("Failed to seek client %" PRIu64 " unordered requests "
-                      ">= %" PRIu64 ".", c->id, c->min_reply_id);
-        raxStop(&iter);
-        return -1;
+int addUnorderedReply(client *c, sds reply, uint64_t req_id) {
+    unorderedReply *slot = NULL;
+    if (req_id - c->min_reply_id >= c->unordered_replies_slots) {
+        if (!resizeUnorderedReplies(c, req_id)) {
+            proxyLogErr("Failed to resize unordered replies of client "
+                        "%d:%" PRIu64, c->thread_id, c->id);
+            sdsfree(reply);
+            return 0;
+        }
     }
-    int count = 0;
-    while (raxNext(&iter)) {
-        uint64_t req_id = ntohu64(*((uint64_t *)iter.key));
-        if (req_id == c->min_reply_id) {
-            sds reply = (sds) iter.data;
-            c->obuf = sdscat(c->obuf, reply);
-            c->min_reply_id++;
-            count++;
-            if (raxRemove(c->unordered_replies, iter.key, iter.key_len, NULL)){
-                raxSeek(&iter, ">", iter.key, iter.key_len);
+    slot = c->unordered_replies + (req_id & (c->unordered_replies_slots - 1));
+    if (slot->reply != NULL) {
+        if (slot->req_id == req_id) {
+            proxyLogDebug("WARN: Unordered reply for request %d:%" PRId64 ":%"
+                PRId64 " was already set to: '%s', and new reply " " is '%s'",
+                c->thread_id, c->id, req_id, slot->reply, reply);
+        } else if (slot->req_id >= c->min_reply_id) {
+            /* The slot is used by a reply within the window, this can only
+             * happen if min_reply_id has been moved backwards. */
+            if (!resizeUnorderedReplies(c, req_id +
+                                        c->unordered_replies_slots))
+            {
                 sdsfree(reply);
+                return 0;
             }
-        } else break;
+            return addUnorderedReply(c, reply, req_id);
+        }
+        freeUnorderedReplySlot(c, slot);
+    }
+    slot->req_id = req_id;
+    slot->reply = reply;
+    c->unordered_replies_size += sdslen(reply);
+    c->unordered_replies_count++;
+    return 1;
+}
+
+int appendUnorderedRepliesToBuffer(client *c) {
+    int count = 0;
+    while (c->unordered_replies_count > 0) {
+        size_t mask = c->unordered_replies_slots - 1;
+        unorderedReply *slot = c->unordered_replies +
+                               (c->min_reply_id & mask);
+        if (slot->reply == NULL || slot->req_id != c->min_reply_id) break;
+        c->obuf = sdscatsds(c->obuf, slot->reply);
+        freeUnorderedReplySlot(c, slot);
+        c->min_reply_id++;
+        count++;
     }
-    raxStop(&iter);
     return count;
 }
 
 sds getUnorderedReplyForRequestWithID(client *c, uint64_t req_id) {
-    uint64_t be_id = htonu64(req_id); /* Big-endian request ID */
-    sds reply = raxFind(c->unordered_replies, (unsigned char *) &be_id,
-        sizeof(be_id));
-    if (reply == raxNotFound) return NULL;
-    return reply;
+    if (c->unordered_replies_count == 0) return NULL;
+    size_t mask = c->unordered_replies_slots - 1;
+    unorderedReply *slot = c->unordered_replies + (req_id & mask);
+    if (slot->reply == NULL || slot->req_id != req_id) return NULL;
+    return slot->reply;
+}
+
+void freeUnorderedReplies(client *c) {
+    size_t i;
+    if (c->unordered_replies == NULL) return;
+    for (i = 0; i < c->unordered_replies_slots; i++)
+        freeUnorderedReplySlot(c, c->unordered_replies + i);
+    zfree(c->unordered_replies);
+    c->unordered_replies = NULL;
+    c->unordered_replies_slots = 0;
 }
@@ -22,8 +22,9 @@
 #include "sds.h"
 #include "proxy.h"
 
-void addUnorderedReply(client *c, sds reply, uint64_t req_id);
+int addUnorderedReply(client *c, sds reply, uint64_t req_id);
 int appendUnorderedRepliesToBuffer(client *c);
 sds getUnorderedReplyForRequestWithID(client *c, uint64_t req_id);
+void freeUnorderedReplies(client *c);
 
 #endif /* __REDIS_CLUSTER_PROXY_REPLY_ORDER_H__ */
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Allocation-free scanning of RESP queries.
+ *
+ * Since every bulk of a multibulk query is prefixed by its length, the only
+ * bytes that actually need to be scanned are the ones of the short '*<count>'
+ * and '$<len>' lines: arguments are skipped by using their declared length.
+ * Lines are searched with memchr(), that libc already implements with
+ * vectorized (SSE2/AVX2) kernels selected at runtime according to the CPU,
+ * and numbers are parsed in place, without copying the line. */
+
+#include <string.h>
+#include <limits.h>
+#include "resp.h"
+
+/* Convert the string 's' of length 'len' into a long long, with the same
+ * strict rules used by Redis for protocol lengths: no spaces, no '+' sign,
+ * no leading zeroes and no overflows. Returns 1 on success, 0 otherwise. */
+int respStringToLongLong(const char *s, size_t len, long long *value) {
+    const char *p = s, *end = s + len;
+    unsigned long long v;
+    int negative = 0;
+    if (len == 0 || len > 20) return 0;
+    if (len == 1 && *p == '0') {
+        *value = 0;
+        return 1;
+    }
+    if (*p == '-') {
+        negative = 1;
+        if (++p == end) return 0;
+    }
+    if (*p < '1' || *p > '9') return 0;
+    v = *p++ - '0';
+    while (p < end) {
+        if (*p < '0' || *p > '9') return 0;
+        if (v > (ULLONG_MAX / 10)) return 0;
+        v *= 10;
+        if (v > (ULLONG_MAX - (*p - '0'))) return 0;
+        v += *p++ - '0';
+    }
+    if (negative) {
+        if (v > ((unsigned long long) (-(LLONG_MIN + 1)) + 1)) return 0;
+        *value = -v;
+    } else {
+        if (v > LLONG_MAX) return 0;
+        *value = v;
+    }
+    return 1;
+}
+
+/* Parse the number contained in the line starting at 'p' and terminated by
+ * "\r\n" (the line is searched up to 'end'). On success, the number is
+ * stored into 'value' and 'next' is set to the first byte after the line.
+ * Returns RESP_OK, RESP_INCOMPLETE if the buffer doesn't contain the whole
+ * line yet, or RESP_ERR if the line is not a valid number. */
+int respParseLength(const char *p, const char *end, long long *value,
+                    const char **next)
+{
+    if (p >= end) return RESP_INCOMPLETE;
+    const char *cr = memchr(p, '\r', end - p);
+    if (cr == NULL) return RESP_INCOMPLETE;
+    if ((cr + 1) < end && cr[1] != '\n') return RESP_ERR;
+    if (!respStringToLongLong(p, cr - p, value)) return RESP_ERR;
+    *next = cr + 2;
+    return RESP_OK;
+}
+
+/* Scan 'count' bulks ("$<len>\r\n<argument>\r\n") starting at 'buf + pos'.
+ * If 'offsets' and 'lengths' are not NULL, the offset (relative to 'buf')
+ * and the length of every argument are stored into them (they must be able
+ * to hold 'count' elements).
+ * Returns the offset of the first byte after the last bulk, 0 if the buffer
+ * doesn't contain all the bulks yet, or -1 if a bulk is invalid, empty or
+ * bigger than 'max_bulk_len'. */
+long long respScanBulks(const char *buf, size_t len, size_t pos,
+                        long long count, long long max_bulk_len,
+                        int *offsets, int *lengths)
+{
+    const char *p = buf + pos, *end = buf + len;
+    long long i, arglen;
+    for (i = 0; i < count; i++) {
+        if (p >= end) return 0;
+        if (*p != '$') return -1;
+        int status = respParseLength(p + 1, end, &arglen, &p);
+        if (status == RESP_INCOMPLETE) return 0;
+        if (status != RESP_OK || arglen <= 0 || arglen > max_bulk_len)
+            return -1;
+        if (p > end || (end - p) < (arglen + 2)) return 0;
+        if (p[arglen] != '\r' || p[arglen + 1] != '\n') return -1;
+        if (offsets != NULL) {
+            offsets[i] = p - buf;
+            lengths[i] = arglen;
+        }
+        p += arglen + 2;
+    }
+    return p - buf;
+}
+
+/* Scan the whole multibulk query at the beginning of 'buf'. The number of
+ * arguments of the query is stored into 'argc', so that callers can call
+ * the function with NULL 'offsets' and 'lengths' in order to know how many
+ * arguments they have to make room for, and then call it again to fill
+ * them (see respScanBulks).
+ * Returns the length of the query, 0 if the buffer doesn't contain the
+ * whole query yet or -1 if the query is invalid. */
+long long respScanMultibulk(const char *buf, size_t len,
+                            long long max_bulk_len, int *argc,
+                            int *offsets, int *lengths)
+{
+    const char *p;
+    long long count;
+    if (len == 0) return 0;
+    if (*buf != '*') return -1;
+    int status = respParseLength(buf + 1, buf + len, &count, &p);
+    if (status == RESP_INCOMPLETE) return 0;
+    if (status != RESP_OK || count <= 0 || count > INT_MAX) return -1;
+    if (p > buf + len) return 0;
+    *argc = (int) count;
+    return respScanBulks(buf, len, p - buf, count, max_bulk_len, offsets,
+                         lengths);
+}
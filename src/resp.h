@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REDIS_CLUSTER_PROXY_RESP_H__
+#define __REDIS_CLUSTER_PROXY_RESP_H__
+
+#include <stddef.h>
+
+#define RESP_OK             0
+#define RESP_INCOMPLETE     1
+#define RESP_ERR            2
+
+int respStringToLongLong(const char *s, size_t len, long long *value);
+int respParseLength(const char *p, const char *end, long long *value,
+                    const char **next);
+long long respScanBulks(const char *buf, size_t len, size_t pos,
+                        long long count, long long max_bulk_len,
+                        int *offsets, int *lengths);
+long long respScanMultibulk(const char *buf, size_t len,
+                            long long max_bulk_len, int *argc,
+                            int *offsets, int *lengths);
+
+#endif /* __REDIS_CLUSTER_PROXY_RESP_H__ */
@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include "tls.h"
+#include "config.h"
+#include "logger.h"
+#include "zmalloc.h"
+#include "util.h"
+
+#ifdef USE_OPENSSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define TLS_SESSION_ID_CONTEXT "redis-cluster-proxy"
+
+struct tlsConnection {
+    SSL *ssl;
+    int fd;
+    int established;    /* Handshake completed */
+    int failed;         /* A fatal error occurred, so SSL_shutdown must not
+                         * be called. */
+};
+
+static SSL_CTX *server_ctx = NULL;  /* Client connections (--tls) */
+static SSL_CTX *cluster_ctx = NULL; /* Node connections (--tls-cluster) */
+
+/* Append the first error of the OpenSSL error queue (if any) to the
+ * `prefix` message and clear the queue. */
+static sds tlsErrorString(const char *prefix) {
+    char buf[256];
+    unsigned long code = ERR_get_error();
+    sds err = sdsnew(prefix);
+    if (code != 0) {
+        ERR_error_string_n(code, buf, sizeof(buf));
+        err = sdscatfmt(err, ": %s", buf);
+    }
+    ERR_clear_error();
+    return err;
+}
+
+static SSL_CTX *tlsCreateContext(int server, sds *err) {
+    SSL_CTX *ctx = SSL_CTX_new(server ? TLS_server_method() :
+                                        TLS_client_method());
+    if (ctx == NULL) {
+        *err = tlsErrorString("Failed to create TLS context");
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    long options = SSL_OP_NO_COMPRESSION;
+#ifdef SSL_OP_NO_RENEGOTIATION
+    options |= SSL_OP_NO_RENEGOTIATION;
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* Peers closing the socket without close_notify are just treated as
+     * disconnected, just like plain TCP connections. */
+    options |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    /* Let the kernel encrypt and decrypt records when both OpenSSL and the
+     * kernel support it for the negotiated cipher: SSL_read and SSL_write
+     * then fall back to plain socket I/O. */
+    if (config.tls_ktls) options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options(ctx, options);
+    /* Output buffers are retried at their current position after partial
+     * writes (see writeToClient), that may have been moved in memory by
+     * the buffer's reallocation. Record buffers of idle connections are
+     * released, since the proxy can hold a lot of them. */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+    if (config.tls_cert_file != NULL) {
+        char *keyfile = config.tls_key_file;
+        if (keyfile == NULL) keyfile = config.tls_cert_file;
+        if (SSL_CTX_use_certificate_chain_file(ctx,
+                                               config.tls_cert_file) <= 0)
+        {
+            *err = tlsErrorString("Failed to load tls-cert-file");
+            goto fail;
+        }
+        if (SSL_CTX_use_PrivateKey_file(ctx, keyfile, SSL_FILETYPE_PEM) <= 0)
+        {
+            *err = tlsErrorString("Failed to load tls-key-file");
+            goto fail;
+        }
+        if (!SSL_CTX_check_private_key(ctx)) {
+            *err = tlsErrorString("Private key does not match certificate");
+            goto fail;
+        }
+    }
+    if (config.tls_ca_cert_file != NULL || config.tls_ca_cert_dir != NULL) {
+        if (!SSL_CTX_load_verify_locations(ctx, config.tls_ca_cert_file,
+                                           config.tls_ca_cert_dir))
+        {
+            *err = tlsErrorString("Failed to load CA certificates");
+            goto fail;
+        }
+    }
+    return ctx;
+fail:
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+
+/* Create the TLS contexts required by the configuration. Return 1 on
+ * success, 0 on failure (in this case `err` will be set). */
+int tlsInit(sds *err) {
+    int has_ca = (config.tls_ca_cert_file != NULL ||
+                  config.tls_ca_cert_dir != NULL);
+    if (!config.tls && !config.tls_cluster) return 1;
+    if (config.tls && config.tls_cert_file == NULL) {
+        *err = sdsnew("TLS requires a certificate (tls-cert-file)");
+        return 0;
+    }
+    if (config.tls && config.tls_auth_clients && !has_ca) {
+        *err = sdsnew("tls-auth-clients requires tls-ca-cert-file or "
+                      "tls-ca-cert-dir");
+        return 0;
+    }
+    OPENSSL_init_ssl(0, NULL);
+    if (config.tls) {
+        server_ctx = tlsCreateContext(1, err);
+        if (server_ctx == NULL) return 0;
+        int verify = SSL_VERIFY_NONE;
+        if (config.tls_auth_clients)
+            verify = SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT;
+        SSL_CTX_set_verify(server_ctx, verify, NULL);
+        /* Sessions are cached by the server (TLS 1.2 session IDs) and can
+         * also be resumed through session tickets, so that reconnecting
+         * clients can skip the full handshake. */
+        SSL_CTX_set_session_id_context(server_ctx,
+            (const unsigned char *) TLS_SESSION_ID_CONTEXT,
+            strlen(TLS_SESSION_ID_CONTEXT));
+        if (config.tls_session_cache_size > 0) {
+            SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(server_ctx,
+                                        config.tls_session_cache_size);
+            SSL_CTX_set_timeout(server_ctx,
+                                config.tls_session_cache_timeout);
+        } else {
+            SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+            SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+        }
+    }
+    if (config.tls_cluster) {
+        cluster_ctx = tlsCreateContext(0, err);
+        if (cluster_ctx == NULL) {
+            tlsCleanup();
+            return 0;
+        }
+        /* Nodes' certificates are only verified if some CA has been
+         * configured. */
+        SSL_CTX_set_verify(cluster_ctx,
+                           (has_ca ? SSL_VERIFY_PEER : SSL_VERIFY_NONE),
+                           NULL);
+    }
+    return 1;
+}
+
+void tlsCleanup(void) {
+    if (server_ctx != NULL) SSL_CTX_free(server_ctx);
+    if (cluster_ctx != NULL) SSL_CTX_free(cluster_ctx);
+    server_ctx = NULL;
+    cluster_ctx = NULL;
+}
+
+static tlsConnection *tlsCreateConnection(SSL_CTX *ctx, int fd) {
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL) return NULL;
+    if (!SSL_set_fd(ssl, fd)) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    tlsConnection *conn = zmalloc(sizeof(*conn));
+    if (conn == NULL) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    conn->ssl = ssl;
+    conn->fd = fd;
+    conn->established = 0;
+    conn->failed = 0;
+    return conn;
+}
+
+static void tlsLogEstablished(tlsConnection *conn, const char *peer) {
+    conn->established = 1;
+    if (config.loglevel != LOGLEVEL_DEBUG) return;
+    int ktls = 0;
+#ifdef BIO_get_ktls_send
+    ktls = BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+#endif
+    proxyLogDebug("TLS connection established with %s (fd: %d, %s, %s, "
+                  "resumed: %s, kTLS: %s)", peer, conn->fd,
+                  SSL_get_version(conn->ssl),
+                  SSL_get_cipher_name(conn->ssl),
+                  (SSL_session_reused(conn->ssl) ? "yes" : "no"),
+                  (ktls ? "yes" : "no"));
+}
+
+/* Create the server side of a client's TLS connection. The handshake is
+ * performed by the first reads from the client (see tlsRead). */
+tlsConnection *tlsAccept(int fd) {
+    if (server_ctx == NULL) return NULL;
+    tlsConnection *conn = tlsCreateConnection(server_ctx, fd);
+    if (conn == NULL) {
+        ERR_clear_error();
+        return NULL;
+    }
+    SSL_set_accept_state(conn->ssl);
+    return conn;
+}
+
+/* Perform the handshake with a cluster node over the socket `fd`, that can
+ * be non-blocking and still connecting: the function waits for the socket
+ * at most `timeout` milliseconds in total. Return NULL on failure (in this
+ * case `err` will be set). */
+tlsConnection *tlsConnect(int fd, int timeout, sds *err) {
+    if (cluster_ctx == NULL) {
+        *err = sdsnew("TLS is not enabled for cluster connections");
+        return NULL;
+    }
+    tlsConnection *conn = tlsCreateConnection(cluster_ctx, fd);
+    if (conn == NULL) {
+        *err = tlsErrorString("Failed to create TLS connection");
+        return NULL;
+    }
+    long long deadline = mstime() + timeout;
+    while (1) {
+        ERR_clear_error();
+        errno = 0;
+        int ret = SSL_connect(conn->ssl), events = 0;
+        if (ret == 1) break;
+        int sslerr = SSL_get_error(conn->ssl, ret);
+        if (sslerr == SSL_ERROR_WANT_READ) events = POLLIN;
+        else if (sslerr == SSL_ERROR_WANT_WRITE) events = POLLOUT;
+        else {
+            if (sslerr == SSL_ERROR_SYSCALL && errno != 0) {
+                *err = sdscatfmt(sdsempty(), "TLS handshake failed: %s",
+                                 strerror(errno));
+                ERR_clear_error();
+            } else *err = tlsErrorString("TLS handshake failed");
+            conn->failed = 1;
+            goto fail;
+        }
+        long long remaining = deadline - mstime();
+        struct pollfd pfd = {.fd = fd, .events = events, .revents = 0};
+        if (remaining <= 0 || poll(&pfd, 1, (int) remaining) <= 0) {
+            *err = sdsnew("TLS handshake timed out");
+            goto fail;
+        }
+    }
+    tlsLogEstablished(conn, "node");
+    return conn;
+fail:
+    tlsFree(conn);
+    return NULL;
+}
+
+/* Handle the result of SSL_read/SSL_write returning `ret` <= 0, mapping it
+ * to the return value and errno that read/write would have produced. */
+static ssize_t tlsHandleIOError(tlsConnection *conn, int ret) {
+    int sslerr = SSL_get_error(conn->ssl, ret);
+    switch (sslerr) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        conn->failed = 1;
+        ERR_clear_error();
+        if (errno == 0) return 0;
+        return -1;
+    default:
+        conn->failed = 1;
+        if (config.loglevel == LOGLEVEL_DEBUG) {
+            sds err = tlsErrorString("TLS error");
+            proxyLogDebug("%s (fd: %d)", err, conn->fd);
+            sdsfree(err);
+        } else ERR_clear_error();
+        errno = EIO;
+        return -1;
+    }
+}
+
+/* Read at most `len` bytes of decrypted data. Reads are never smaller than
+ * PROTO_IOBUF_LEN (16KB), that is the maximum size of a TLS record, so
+ * every call consumes whole records and no decrypted data is left pending
+ * inside the TLS layer, where the event loop could not see it: as long as
+ * read ahead is disabled, the socket remains readable until every record
+ * has been read. */
+ssize_t tlsRead(tlsConnection *conn, void *buf, size_t len) {
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_read(conn->ssl, buf, (int) len);
+    if (!conn->established && SSL_is_init_finished(conn->ssl))
+        tlsLogEstablished(conn, "client");
+    if (ret > 0) return ret;
+    return tlsHandleIOError(conn, ret);
+}
+
+/* Write at most `len` bytes. After a partial write (-1 with EAGAIN), the
+ * same data must be written again, as required by SSL_write. */
+ssize_t tlsWrite(tlsConnection *conn, const void *buf, size_t len) {
+    if (len == 0) return 0;
+    ERR_clear_error();
+    errno = 0;
+    int ret = SSL_write(conn->ssl, buf, (int) len);
+    if (ret > 0) return ret;
+    return tlsHandleIOError(conn, ret);
+}
+
+/* Free the TLS connection, sending the close_notify alert to the peer if
+ * the connection is still healthy. The socket itself is not closed. */
+void tlsFree(tlsConnection *conn) {
+    if (conn == NULL) return;
+    if (conn->established && !conn->failed) SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    ERR_clear_error();
+    zfree(conn);
+}
+
+#else /* !USE_OPENSSL */
+
+#define UNUSED(V) ((void) V)
+
+int tlsInit(sds *err) {
+    if (!config.tls && !config.tls_cluster) return 1;
+    *err = sdsnew(TLS_UNSUPPORTED_MSG);
+    return 0;
+}
+
+void tlsCleanup(void) {}
+
+tlsConnection *tlsAccept(int fd) {
+    UNUSED(fd);
+    return NULL;
+}
+
+tlsConnection *tlsConnect(int fd, int timeout, sds *err) {
+    UNUSED(fd);
+    UNUSED(timeout);
+    *err = sdsnew(TLS_UNSUPPORTED_MSG);
+    return NULL;
+}
+
+ssize_t tlsRead(tlsConnection *conn, void *buf, size_t len) {
+    UNUSED(conn);
+    UNUSED(buf);
+    UNUSED(len);
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t tlsWrite(tlsConnection *conn, const void *buf, size_t len) {
+    UNUSED(conn);
+    UNUSED(buf);
+    UNUSED(len);
+    errno = ENOTSUP;
+    return -1;
+}
+
+void tlsFree(tlsConnection *conn) {
+    UNUSED(conn);
+}
+
+#endif /* USE_OPENSSL */
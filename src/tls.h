@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REDIS_CLUSTER_PROXY_TLS_H__
+#define __REDIS_CLUSTER_PROXY_TLS_H__
+
+#include <sys/types.h>
+#include "sds.h"
+
+/* TLS for client connections (--tls) and cluster node connections
+ * (--tls-cluster), only available if the proxy has been built with
+ * BUILD_TLS=yes.
+ *
+ * TLS connections are opaque handles wrapping a socket whose I/O is done
+ * through tlsRead and tlsWrite, that behave like read(2) and write(2) on
+ * a non-blocking socket: when the TLS layer needs to wait for the socket,
+ * they return -1 with errno set to EAGAIN. */
+
+#ifdef USE_OPENSSL
+#define TLS_SUPPORTED 1
+#else
+#define TLS_SUPPORTED 0
+#endif
+#define TLS_UNSUPPORTED_MSG \
+    "TLS requires the proxy to be built with TLS support (make BUILD_TLS=yes)"
+
+#define TLS_CONNECT_TIMEOUT 3000 /* Milliseconds */
+
+typedef struct tlsConnection tlsConnection;
+
+int tlsInit(sds *err);
+void tlsCleanup(void);
+tlsConnection *tlsAccept(int fd);
+tlsConnection *tlsConnect(int fd, int timeout, sds *err);
+ssize_t tlsRead(tlsConnection *conn, void *buf, size_t len);
+ssize_t tlsWrite(tlsConnection *conn, const void *buf, size_t len);
+void tlsFree(tlsConnection *conn);
+
+#endif /* __REDIS_CLUSTER_PROXY_TLS_H__ */
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Listening sockets handoff used by binary upgrades (see upgrade.h for the
+ * protocol). Both ends use blocking sockets: the handoff only happens once
+ * per upgrade and it's tiny. */
+
+#include "fmacros.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "upgrade.h"
+#include "logger.h"
+
+static int writeAll(int sock, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t nwritten = write(sock, buf, len);
+        if (nwritten < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        buf += nwritten;
+        len -= nwritten;
+    }
+    return 1;
+}
+
+static int readAll(int sock, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t nread = read(sock, buf, len);
+        if (nread < 0 && errno == EINTR) continue;
+        if (nread <= 0) return 0;
+        buf += nread;
+        len -= nread;
+    }
+    return 1;
+}
+
+/* Create the socket used for the handoff: fds[0] is kept by the old process,
+ * fds[1] by the new one. Returns 1 on success, 0 on failure. */
+int upgradeSocketPair(int *fds) {
+    return socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0;
+}
+
+/* Send the listening sockets and the cluster topology to the new process.
+ * Returns 1 on success, 0 on failure. */
+int upgradeSendSockets(int sock, int *fds, int fd_count, int unixsocket_idx,
+                       sds topology)
+{
+    upgradeHandoff handoff;
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    size_t topology_len = (topology ? sdslen(topology) : 0);
+    ssize_t nwritten;
+
+    if (fd_count <= 0 || fd_count > UPGRADE_MAX_FDS) return 0;
+    if (topology_len > UPGRADE_MAX_TOPOLOGY) topology_len = 0;
+    handoff.magic = UPGRADE_MAGIC;
+    handoff.fd_count = fd_count;
+    handoff.unixsocket_idx = unixsocket_idx;
+    handoff.topology_len = topology_len;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &handoff;
+    iov.iov_len = sizeof(handoff);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+
+    do {
+        nwritten = sendmsg(sock, &msg, 0);
+    } while (nwritten < 0 && errno == EINTR);
+    if (nwritten < 0) {
+        proxyLogErr("Failed to send listening sockets: %s", strerror(errno));
+        return 0;
+    }
+    /* Ancillary data goes with the first byte, so the rest of the header
+     * can be safely written with plain writes. */
+    if (!writeAll(sock, ((char *) &handoff) + nwritten,
+                  sizeof(handoff) - nwritten) ||
+        (topology_len && !writeAll(sock, topology, topology_len)))
+    {
+        proxyLogErr("Failed to send cluster topology: %s", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/* Receive the listening sockets and the cluster topology from the old
+ * process. On success returns 1, the received sockets are stored into `fds`
+ * and `topology` is set to a new sds string (possibly empty). */
+int upgradeReceiveSockets(int sock, int *fds, int max_fds, int *fd_count,
+                          int *unixsocket_idx, sds *topology)
+{
+    upgradeHandoff handoff;
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t nread;
+    int count = 0, i;
+
+    *topology = NULL;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &handoff;
+    iov.iov_len = sizeof(handoff);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    do {
+        nread = recvmsg(sock, &msg, 0);
+    } while (nread < 0 && errno == EINTR);
+    if (nread <= 0) {
+        proxyLogErr("Failed to receive listening sockets: %s",
+                    (nread == 0 ? "connection closed" : strerror(errno)));
+        return 0;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (count > max_fds) {
+            int *received = (int *) CMSG_DATA(cmsg);
+            for (i = 0; i < count; i++) close(received[i]);
+            proxyLogErr("Too many listening sockets received: %d", count);
+            return 0;
+        }
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+        break;
+    }
+    if (!readAll(sock, ((char *) &handoff) + nread, sizeof(handoff) - nread))
+        goto invalid;
+    if (handoff.magic != UPGRADE_MAGIC || (int) handoff.fd_count != count ||
+        count == 0 || handoff.unixsocket_idx >= count ||
+        handoff.topology_len > UPGRADE_MAX_TOPOLOGY) goto invalid;
+    *topology = sdsnewlen(NULL, handoff.topology_len);
+    if (!readAll(sock, *topology, handoff.topology_len)) {
+        sdsfree(*topology);
+        *topology = NULL;
+        goto invalid;
+    }
+    *fd_count = count;
+    *unixsocket_idx = handoff.unixsocket_idx;
+    return 1;
+invalid:
+    proxyLogErr("Invalid listening sockets handoff");
+    for (i = 0; i < count; i++) close(fds[i]);
+    return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REDIS_CLUSTER_PROXY_UPGRADE_H__
+#define __REDIS_CLUSTER_PROXY_UPGRADE_H__
+
+#include <stdint.h>
+#include "sds.h"
+
+/* Listening sockets handoff used by binary upgrades (see SIGUSR2).
+ *
+ * The running proxy forks and executes its own binary again, passing to it
+ * one end of a unix socket pair with the --upgrade-fd option. It then sends
+ * a single upgradeHandoff header over the socket, carrying the listening
+ * sockets as SCM_RIGHTS ancillary data, followed by `topology_len` bytes
+ * containing the space separated addresses of the cluster's nodes, that the
+ * new process uses as its first entry points, so that it doesn't depend on
+ * the configured ones still being reachable.
+ * The new process replies with UPGRADE_ACK as soon as it's accepting
+ * connections on the received sockets, or just closes the socket if it
+ * fails to start. */
+
+#define UPGRADE_MAGIC           0x52435055 /* "RCPU" */
+#define UPGRADE_MAX_FDS         32
+#define UPGRADE_MAX_TOPOLOGY    (1024*1024)
+#define UPGRADE_ACK             "OK"
+#define UPGRADE_ACK_LEN         2
+
+typedef struct upgradeHandoff {
+    uint32_t magic;
+    uint32_t fd_count;
+    int32_t unixsocket_idx;     /* Index of the unix socket in the received
+                                 * sockets, -1 if there's none */
+    uint32_t topology_len;
+} upgradeHandoff;
+
+int upgradeSocketPair(int *fds);
+int upgradeSendSockets(int sock, int *fds, int fd_count, int unixsocket_idx,
+                       sds topology);
+int upgradeReceiveSockets(int sock, int *fds, int max_fds, int *fd_count,
+                          int *unixsocket_idx, sds *topology);
+
+#endif /* __REDIS_CLUSTER_PROXY_UPGRADE_H__ */
@@ -20,7 +20,12 @@
 
 #include <hiredis.h>
 
+int __hiredisReadReplyFromBuffer(redisReader *r, void **reply);
 void consumeRedisReaderBuffer(redisContext *ctx);
+void trimRedisReaderBuffer(redisContext *ctx, size_t len);
 void bytesToHuman(char *s, unsigned long long n);
+long long memtoll(const char *p, int *err);
+long long ustime(void);
+long long mstime(void);
 
 #endif /* __REDIS_CLUSTER_PROXY_UTIL_H__ */
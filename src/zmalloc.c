@@ -46,6 +46,12 @@ void zlibc_free(void *ptr) {
 #include "zmalloc.h"
 #include "atomicvar.h"
 
+#if !defined(USE_TCMALLOC) && defined(__GLIBC__) && \
+    ((__GLIBC__ > 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define HAVE_MALLINFO2
+#endif
+
 #ifdef HAVE_MALLOC_SIZE
 #define PREFIX_SIZE (0)
 #else
@@ -71,10 +77,20 @@ void zlibc_free(void *ptr) {
 #define dallocx(ptr,flags) je_dallocx(ptr,flags)
 #endif
 
+/* When built for the hot paths benchmark, every call to the allocator is
+ * also counted, in order to report allocations per operation. */
+#ifdef ZMALLOC_COUNT_ALLOCATIONS
+static size_t allocations = 0;
+#define count_zmalloc_allocation() (allocations++)
+#else
+#define count_zmalloc_allocation()
+#endif
+
 #define update_zmalloc_stat_alloc(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
     atomicIncr(used_memory,__n); \
+    count_zmalloc_allocation(); \
 } while(0)
 
 #define update_zmalloc_stat_free(__n) do { \
@@ -213,6 +229,12 @@ char *zstrdup(const char *s) {
     return p;
 }
 
+#ifdef ZMALLOC_COUNT_ALLOCATIONS
+size_t zmalloc_allocations(void) {
+    return allocations;
+}
+#endif
+
 size_t zmalloc_used_memory(void) {
     size_t um;
     atomicGet(used_memory,um);
@@ -323,6 +345,18 @@ int zmalloc_get_allocator_info(size_t *allocated,
     je_mallctl("stats.allocated", allocated, &sz, NULL, 0);
     return 1;
 }
+#elif defined(HAVE_MALLINFO2)
+int zmalloc_get_allocator_info(size_t *allocated,
+                               size_t *active,
+                               size_t *resident) {
+    struct mallinfo2 mi = mallinfo2();
+    /* glibc doesn't distinguish between active and resident pages: report
+     * the memory obtained from the system by all the arenas (including
+     * mmapped chunks) as both. */
+    *allocated = mi.uordblks + mi.hblkhd;
+    *active = *resident = mi.arena + mi.hblkhd;
+    return 1;
+}
 #else
 int zmalloc_get_allocator_info(size_t *allocated,
                                size_t *active,
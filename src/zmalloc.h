@@ -103,6 +103,10 @@ size_t zmalloc_usable(void *ptr);
 #define zmalloc_usable(p) zmalloc_size(p)
 #endif
 
+#ifdef ZMALLOC_COUNT_ALLOCATIONS
+size_t zmalloc_allocations(void);
+#endif
+
 #ifdef REDIS_TEST
 int zmalloc_test(int argc, char **argv);
 #endif
@@ -225,7 +225,8 @@ class RedisCluster
             authopt = " -a #{@passw}"
         end
         if redis_cli_version.split('.')[0].to_i >= 5
-            cmd = "#{@redis_cli}#{authopt} --cluster create " +
+            cmd = "#{@redis_cli}#{authopt}#{redis_cli_tls_opts} " +
+                  "--cluster create " +
             @instances.map{|instance|
                 "127.0.0.1:#{instance[:port]}"
             }.join(' ') + " --cluster-replicas #{@replicas_count}"
@@ -354,7 +355,7 @@ class RedisCluster
     end
 
     def redis_cli_cmd(port)
-        rcli = "#{@redis_cli} -p #{port}"
+        rcli = "#{@redis_cli} -p #{port}#{redis_cli_tls_opts}"
         if @passw
             rcli << " -a #{@passw}"
         end
@@ -370,9 +371,27 @@ class RedisCluster
         `#{redis_cli_cmd(port)} #{command}`
     end
 
+    def tls?
+        tls_enabled?
+    end
+
     def config_for(port, path)
+        if tls?
+            tls = tls_files!
+            portcfg =
+            "port 0\n" +
+            "tls-port #{port}\n" +
+            "tls-cert-file \"#{tls[:cert]}\"\n" +
+            "tls-key-file \"#{tls[:key]}\"\n" +
+            "tls-ca-cert-file \"#{tls[:ca]}\"\n" +
+            "tls-auth-clients no\n" +
+            "tls-cluster yes\n" +
+            "tls-replication yes\n"
+        else
+            portcfg = "port #{port}\n"
+        end
         cfg =
-        "port #{port}\n" +
+        portcfg +
         "cluster-enabled yes\n" +
         "cluster-config-file \"nodes.conf\"\n" +
         "logfile ./redis.log\n" +
@@ -96,3 +96,103 @@ end
 def find_available_port(from)
     find_available_ports(from)[0]
 end
+
+def tls_enabled?
+    $options.is_a?(Hash) && $options[:tls] == true
+end
+
+# Generate the self-signed certificate used by the proxy and by the cluster
+# nodes when tests run over TLS. The certificate is also used as the CA
+# that verifies them.
+def tls_files!
+    return $tls_files if $tls_files
+    dir = File.join(RedisProxyTestCase::TMPDIR, 'tls')
+    FileUtils.mkdir_p(dir)
+    cert = File.join(dir, 'cert.pem')
+    key = File.join(dir, 'key.pem')
+    cmd = "openssl req -x509 -newkey rsa:2048 -nodes -days 1 " +
+          "-subj /CN=localhost " +
+          "-addext subjectAltName=IP:127.0.0.1,DNS:localhost " +
+          "-keyout #{key} -out #{cert} 2>&1"
+    out = shell_exec cmd
+    if !$?.success?
+        raise "Failed to generate the TLS certificate:\n#{out}"
+    end
+    $tls_files = {cert: cert, key: key, ca: cert}
+end
+
+def redis_cli_tls_opts
+    return '' if !tls_enabled?
+    " --tls --cacert #{tls_files![:ca]}"
+end
+
+# Connect to the proxy or to a cluster node, over TLS if tests run over TLS
+# (unix sockets are never encrypted).
+def redis_client(**opts)
+    if tls_enabled? && !opts[:path]
+        opts[:ssl] = true
+        opts[:ssl_params] = {ca_file: tls_files![:ca]}
+    end
+    Redis.new(**opts)
+end
+
+# Open a raw connection to the proxy, used by tests that need to write
+# partial or malformed queries, or to stop reading replies.
+def raw_connection(port)
+    sock = TCPSocket.new('127.0.0.1', port)
+    return sock if !tls_enabled?
+    require 'openssl'
+    ctx = OpenSSL::SSL::SSLContext.new
+    ctx.ca_file = tls_files![:ca]
+    ctx.verify_mode = OpenSSL::SSL::VERIFY_PEER
+    ssl = OpenSSL::SSL::SSLSocket.new(sock, ctx)
+    ssl.sync_close = true
+    ssl.connect
+    ssl
+end
+
+def resp_command(*args)
+    "*#{args.length}\r\n" + args.map{|arg|
+        arg = arg.to_s
+        "$#{arg.bytesize}\r\n#{arg}\r\n"
+    }.join
+end
+
+# Read everything from the socket until it gets closed by the other side.
+# Returns the data read, or nil if the socket is still open after 'timeout'
+# seconds.
+def read_until_closed(sock, timeout: 5)
+    data = ''
+    deadline = Time.now + timeout
+    loop do
+        left = deadline - Time.now
+        return nil if left <= 0
+        begin
+            data << sock.read_nonblock(65536)
+        rescue IO::WaitReadable
+            IO.select([sock], nil, nil, left)
+        rescue EOFError, Errno::ECONNRESET
+            return data
+        end
+    end
+end
+
+# Set the number of threads of the proxy and wait for the resize to be
+# complete. Since PROXY CONFIG SET threads is refused while a resize is in
+# progress, setting the same number again is used to tell when it's done.
+# Returns the last reply, an error if the resize didn't complete in time.
+def resize_proxy_threads(proxy, threads, timeout: 10)
+    deadline = Time.now + timeout
+    requested = false
+    loop do
+        reply = proxy.proxy('config', 'set', 'threads', threads.to_s)
+        in_progress = (reply.is_a?(Redis::CommandError) &&
+                       reply.to_s[/in progress/])
+        if !in_progress
+            return reply if requested || reply.is_a?(Redis::CommandError)
+            requested = true
+        end
+        return reply if Time.now > deadline
+        sleep 0.1
+    end
+end
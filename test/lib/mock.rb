@@ -0,0 +1,137 @@
+# Copyright (C) 2019  Giuseppe Fabio Nicotra <artix2 at gmail dot com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Affero General Public License as published
+# by the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Affero General Public License for more details.
+#
+# You should have received a copy of the GNU Affero General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+require 'bundler/setup'
+require 'redis'
+require 'hiredis'
+
+$redis_proxy_test_libdir ||= File.expand_path(File.dirname(__FILE__))
+$redis_proxy_path ||= File.dirname(File.dirname($redis_proxy_test_libdir))
+
+# Cluster made of the nodes of a single redis-cluster-proxy-mock process.
+# It can be passed to RedisClusterProxy in place of a RedisCluster, so that
+# tests can inject latency and redirections without a real cluster.
+class RedisMockCluster
+
+    include RedisProxyTestLogger
+
+    attr_reader :port, :instances, :nodes, :masters, :logfile, :pid
+
+    def initialize(masters_count: 3, replicas: 0, latency: nil,
+                   verbose: true)
+        @masters_count = masters_count
+        @replicas_count = replicas
+        @latency = latency
+        @verbose = verbose
+        @num_instances = @masters_count + (@replicas_count * @masters_count)
+        @port = find_available_port_range(18500, @num_instances)
+        if !@port
+            raise "Could not find available ports from 18500 for the mock!"
+        end
+        @cmdpath = File.join($redis_proxy_path,
+                             'src/redis-cluster-proxy-mock')
+        if !File.exists?(@cmdpath)
+            STDERR.puts ("Could not find redis-cluster-proxy-mock in:\n'" +
+                         @cmdpath + "'\nCompile redis-cluster-proxy "+
+                         "before making tests!").red
+            exit 1
+        end
+        @logfile = File.join(RedisProxyTestCase::LOGDIR,
+                             "redis-cluster-proxy-mock-#{@port}.log")
+    end
+
+    def find_available_port_range(from, count)
+        port = from
+        while port < from + 1024
+            ports = (port...(port + count)).to_a
+            return port if ports.all?{|p| is_port_available?(p)}
+            port += count
+        end
+        nil
+    end
+
+    def start(timeout: 10)
+        return @instances if @pid
+        cmd = "#{@cmdpath} --port #{@port} --masters #{@masters_count} " +
+              "--replicas #{@replicas_count}"
+        cmd << " --latency #{@latency}" if @latency
+        log("Starting mock cluster on port #{@port}...", :gray) if @verbose
+        @pid = Process.spawn cmd, out: @logfile, err: @logfile
+        now = Time.now.to_i
+        while is_port_available?(@port + @num_instances - 1)
+            if (Time.now.to_i - now) > timeout
+                stop
+                raise "Mock cluster could not be started!"
+            end
+            sleep 0.1
+        end
+        @instances = (0...@num_instances).map{|i| {port: @port + i}}
+        @nodes = @instances
+        @masters = @instances[0, @masters_count]
+        $test_clusters ||= []
+        $test_clusters |= [self]
+        @instances
+    end
+
+    def stop
+        return if !@pid
+        log("Stopping mock cluster on port #{@port}...", :gray) if @verbose
+        Process.kill('TERM', @pid)
+        Process.wait(@pid)
+        @pid = nil
+        @redis.close if @redis
+        @redis = nil
+        @instances = nil
+    end
+
+    def restart
+        stop
+        start
+    end
+
+    def destroy!
+        stop
+        $test_clusters -= [self] if $test_clusters
+    end
+
+    def is_instance_running?(instance)
+        port = (instance.is_a?(Hash) ? instance[:port] : instance)
+        !is_port_available?(port)
+    end
+
+    # The mock doesn't support TLS, so the proxy's connections to its nodes
+    # are never encrypted.
+    def tls?
+        false
+    end
+
+    def redis_cli_cmd(port)
+        "#{find_redis!['redis-cli']} -p #{port}"
+    end
+
+    def redis
+        @redis ||= Redis.new(port: @port)
+    end
+
+    # Send a MOCK subcommand, i.e. mock('setslot', 100, 1)
+    def mock(*args)
+        begin
+            redis.call(['mock'] + args.map(&:to_s))
+        rescue Redis::CommandError => cmderr
+            cmderr
+        end
+    end
+
+end
@@ -85,6 +85,14 @@ class RedisClusterProxy
                 end
             }.join(' ')
         end
+        if tls_enabled?
+            tls = tls_files!
+            cmdopts << " --tls --tls-cert-file #{tls[:cert]} " +
+                       "--tls-key-file #{tls[:key]}"
+            if @cluster.tls?
+                cmdopts << " --tls-cluster --tls-ca-cert-file #{tls[:ca]}"
+            end
+        end
         entry_port = @entry_point[:port]
         cmd = "#{@cmdpath} -p #{@port}#{cmdopts} " +
               "127.0.0.1:#{entry_port}"
@@ -102,7 +110,7 @@ class RedisClusterProxy
         $test_proxies ||= []
         $test_proxies |= [self]
         loop do
-            `#{@redis_cli} -p #{entry_port} ping`
+            `#{@cluster.redis_cli_cmd(entry_port)} ping`
             break if $?.success?
             sleep(1)
         end
@@ -126,7 +134,7 @@ class RedisClusterProxy
     end
 
     def redis
-        @redis ||= Redis.new(port: @port)
+        @redis ||= redis_client(port: @port)
     end
 
     def redis_command(command, *args)
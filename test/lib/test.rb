@@ -24,6 +24,7 @@ load File.join($redis_proxy_test_libdir, 'log.rb')
 load File.join($redis_proxy_test_libdir, 'helpers.rb')
 load File.join($redis_proxy_test_libdir, 'cluster.rb')
 load File.join($redis_proxy_test_libdir, 'proxy.rb')
+load File.join($redis_proxy_test_libdir, 'mock.rb')
 load File.join($redis_proxy_test_libdir, 'optparser.rb')
 
 class RedisProxyTestCase
@@ -209,7 +210,7 @@ class RedisProxyTestCase
         threads = []
         (0...num).each{|tidx|
             t = Thread.new{
-                r = Redis.new port: proxy.port
+                r = redis_client port: proxy.port
                 block.call(r, tidx)
             }
             #t.abort_on_exception = true
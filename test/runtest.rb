@@ -35,6 +35,8 @@ opts =RedisProxyTestUtils::OptionParser.new help_banner_arguments: '[TESTS]' do
     option   '',   '--dump-buffer',"Proxy's --dump-buffer"
     option   '',   '--keep-logs', "Keep Proxies' logs (if any)"
     option   '',   '--valgrind', 'Valgrind mode'
+    option   '',   '--tls', 'Run tests over TLS, with a self-signed ' +
+                            'certificate (requires BUILD_TLS=yes)'
 
 end
 
@@ -47,7 +49,10 @@ if $tests.length == 0
     $tests = %w(basic_commands commands_with_key_callback pipeline query_parser
                 multislot client_disconnect node_down proxy_command 
                 disable_multiplexing auth multi cluster_errors 
-                cluster_errors_multislot unixsocket misc)
+                cluster_errors_multislot unixsocket misc failover_hold
+                node_limits redirections config_reload
+                output_buffer_limits query_limits maxmemory
+                threads_resize)
 end
 
 def final_cleanup
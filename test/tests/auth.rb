@@ -22,7 +22,7 @@ setup {
     @aux_proxy.start
     $aux_cluster, $aux_proxy = @aux_cluster, @aux_proxy
     node = @aux_cluster.masters[0]
-    r = Redis.new port: node[:port]
+    r = redis_client port: node[:port]
     reply = redis_command r, 'auth', $authpassw
     assert_not_redis_err(reply)
     begin
@@ -33,7 +33,7 @@ setup {
     @acl_command = @acl_command.first if @acl_command.is_a? Array
     if @acl_command
         @aux_cluster.nodes.each{|n|
-            r = Redis.new port: n[:port]
+            r = redis_client port: n[:port]
             reply = redis_command r, 'auth', $authpassw
             assert_not_redis_err(reply)
             reply = redis_command r, 'acl', 'setuser', $acl_username, 'on',
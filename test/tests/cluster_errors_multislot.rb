@@ -67,7 +67,7 @@ end
 
 def check_cluster(node, log: nil)
     srcaddr = "#{node[:ip]}:#{node[:port]}"
-    redis_cli = $aux_cluster.instance_eval{@redis_cli}
+    redis_cli = $aux_cluster.instance_eval{@redis_cli} + redis_cli_tls_opts
     check = `#{redis_cli} --cluster check #{srcaddr}`
     ok = $?.success?
     if !ok
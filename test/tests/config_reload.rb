@@ -0,0 +1,78 @@
+require 'redis'
+require 'hiredis'
+
+setup {
+    use_valgrind = $options[:valgrind] == true
+    loglevel = $options[:log_level] || 'debug'
+    dump_queues = $options[:dump_queues]
+    dump_queries = $options[:dump_queries]
+    @config_file = File.join(RedisProxyTestCase::TMPDIR,
+                             "proxy-#{urand2hex(6)}.conf")
+    File.write(@config_file, "client-max-ops-per-sec 1000\n" +
+                             "drain-timeout 20\n")
+    @mock_cluster = RedisMockCluster.new
+    @mock_cluster.start
+    @aux_proxy = RedisClusterProxy.new @mock_cluster,
+                                       log_level: loglevel,
+                                       dump_queries: dump_queries,
+                                       dump_queues: dump_queues,
+                                       valgrind: use_valgrind,
+                                       threads: 2,
+                                       c: @config_file
+    @aux_proxy.start
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @mock_cluster.destroy!
+    @mock_cluster = nil
+    File.unlink(@config_file) if File.exists?(@config_file)
+}
+
+def get_config(name)
+    reply = @aux_proxy.proxy('config', 'get', name)
+    assert_not_redis_err(reply)
+    reply[1].to_i
+end
+
+test "PROXY CONFIG GET options from the config file" do
+    assert_equal(get_config('client-max-ops-per-sec'), 1000)
+    assert_equal(get_config('drain-timeout'), 20)
+end
+
+test "PROXY CONFIG RELOAD applies live options" do
+    File.write(@config_file, "client-max-ops-per-sec 2000\n" +
+                             "drain-timeout 40\n")
+    reply = @aux_proxy.proxy('config', 'reload')
+    assert_not_redis_err(reply)
+    assert_equal(get_config('client-max-ops-per-sec'), 2000)
+    assert_equal(get_config('drain-timeout'), 40)
+    reply = @aux_proxy.set('reload:key', 'value')
+    assert_not_redis_err(reply)
+    assert_equal(@aux_proxy.get('reload:key'), 'value')
+end
+
+test "PROXY CONFIG RELOAD with an invalid config file" do
+    File.write(@config_file, "client-max-ops-per-sec 3000\n" +
+                             "not-a-proxy-option 1\n")
+    reply = @aux_proxy.redis_command(:proxy, 'config', 'reload')
+    assert_redis_err(reply)
+    assert_equal(get_config('client-max-ops-per-sec'), 2000)
+    assert_equal(get_config('drain-timeout'), 40)
+end
+
+test "PROXY CONFIG RELOAD changes the number of threads" do
+    File.write(@config_file, "client-max-ops-per-sec 2000\n" +
+                             "drain-timeout 40\n" +
+                             "threads 4\n")
+    reply = @aux_proxy.proxy('config', 'reload')
+    assert_not_redis_err(reply)
+    threads = nil
+    50.times{
+        threads = get_config('threads')
+        break if threads == 4
+        sleep 0.1
+    }
+    assert_equal(threads, 4)
+end
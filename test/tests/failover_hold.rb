@@ -0,0 +1,57 @@
+require 'redis'
+require 'hiredis'
+
+$numkeys = 50
+$hold_time = 15000
+
+if $options[:max_keys] && $numkeys > $options[:max_keys]
+    $numkeys = $options[:max_keys]
+end
+
+setup {
+    use_valgrind = $options[:valgrind] == true
+    loglevel = $options[:log_level] || 'debug'
+    dump_queues = $options[:dump_queues]
+    dump_queries = $options[:dump_queries]
+    @aux_cluster = RedisCluster.new node_timeout: 2000
+    @aux_cluster.restart
+    @aux_proxy = RedisClusterProxy.new @aux_cluster,
+                                       log_level: loglevel,
+                                       dump_queries: dump_queries,
+                                       dump_queues: dump_queues,
+                                       valgrind: use_valgrind,
+                                       failover_hold_time: $hold_time
+    @aux_proxy.start
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @aux_cluster.stop
+    @aux_cluster = nil
+}
+
+test "SET #{$numkeys} keys to test 'Failover hold'" do
+    spawn_clients(1, proxy: @aux_proxy){|client, idx|
+        (0...$numkeys).each{|n|
+            reply = redis_command client, :set, "k:#{n}", n.to_s
+            assert_not_redis_err(reply)
+        }
+    }
+    # Let replicas receive all the keys before stopping a master.
+    sleep 1
+end
+
+test "GET #{$numkeys} keys while a master is failing over" do
+    down_node = @aux_cluster.stop_random_master(quiet: true)
+    spawn_clients(1, proxy: @aux_proxy){|client, idx|
+        (0...$numkeys).each{|n|
+            log_test_update "key #{n + 1}/#{$numkeys}"
+            key = "k:#{n}"
+            reply = redis_command client, :get, key
+            err = "Key '#{key}' (:#{down_node[:port]} down): got '#{reply}'"
+            assert_not_redis_err(reply, err)
+            assert_equal(reply, n.to_s)
+        }
+    }
+end
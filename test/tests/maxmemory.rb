@@ -0,0 +1,75 @@
+require 'redis'
+require 'hiredis'
+
+$value_size = 64 * 1024
+$slow_queries = 400
+
+setup {
+    use_valgrind = $options[:valgrind] == true
+    loglevel = $options[:log_level] || 'debug'
+    dump_queues = $options[:dump_queues]
+    dump_queries = $options[:dump_queries]
+    @mock_cluster = RedisMockCluster.new
+    @mock_cluster.start
+    @aux_proxy = RedisClusterProxy.new @mock_cluster,
+                                       log_level: loglevel,
+                                       dump_queries: dump_queries,
+                                       dump_queues: dump_queues,
+                                       valgrind: use_valgrind,
+                                       threads: 1
+    @aux_proxy.start
+    reply = @aux_proxy.set('{maxmem}big', 'x' * $value_size)
+    assert_not_redis_err(reply)
+    # The limit is lower than the memory used by the proxy itself, which
+    # must never cause clients to be evicted.
+    reply = @aux_proxy.proxy('config', 'set', 'maxmemory', '1mb')
+    assert_not_redis_err(reply)
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @mock_cluster.destroy!
+    @mock_cluster = nil
+}
+
+def evicted_clients
+    info = @aux_proxy.proxy('info', 'memory')
+    assert_not_redis_err(info)
+    info[/^evicted_clients:(\d+)/, 1].to_i
+end
+
+test "Clients under maxmemory are not evicted" do
+    evicted = evicted_clients
+    client = redis_client port: @aux_proxy.port
+    replies = client.pipelined{
+        8.times{ client.get('{maxmem}big') }
+    }
+    assert_equal(replies.length, 8)
+    replies.each{|reply| assert_equal(reply.length, $value_size)}
+    reply = redis_command client, :get, '{maxmem}big'
+    assert_not_redis_err(reply)
+    client.close
+    assert_equal(evicted_clients, evicted)
+end
+
+test "Client over maxmemory is evicted" do
+    evicted = evicted_clients
+    # A client that never reads its replies keeps growing its output
+    # buffer until the memory used by the clients exceeds the limit.
+    sock = raw_connection(@aux_proxy.port)
+    sock.write(resp_command('get', '{maxmem}big') * $slow_queries)
+    sleep 1
+    data = read_until_closed(sock)
+    sock.close
+    assert_not_nil(data, "Client was not evicted")
+    assert(data.bytesize < $value_size * $slow_queries,
+           "Client got all its replies")
+    assert(evicted_clients > evicted, "Expected evicted_clients to grow")
+    # Other clients are still served once the evicted one is freed.
+    client = redis_client port: @aux_proxy.port
+    reply = redis_command client, :get, '{maxmem}big'
+    assert_not_redis_err(reply)
+    assert_equal(reply.length, $value_size)
+    client.close
+end
@@ -4,7 +4,7 @@ setup {
     $all_keys = []
     get_keys = proc{
         $main_cluster.masters.each{|node|
-            r = Redis.new port: node[:port]
+            r = redis_client port: node[:port]
             begin
                 reply = r.keys '*'
             rescue Redis::CommandError => cmderr
@@ -18,7 +18,7 @@ setup {
     if $all_keys.length > max_keys
         $all_keys = []
         $main_cluster.masters.each{|node|
-            r = Redis.new port: node[:port]
+            r = redis_client port: node[:port]
             begin
                 reply = r.flushdb
             rescue Redis::CommandError => cmderr
@@ -30,7 +30,7 @@ setup {
     end
     if $all_keys.length.zero?
         log "Populating cluster with #{max_keys} keys"
-        r = Redis.new port: $main_proxy.port
+        r = redis_client port: $main_proxy.port
         max_keys.times.each{|i|
             k = "k:#{i}"
             begin
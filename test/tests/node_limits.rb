@@ -0,0 +1,94 @@
+require 'redis'
+require 'hiredis'
+
+$numclients = 10
+$latency = 200
+
+setup {
+    use_valgrind = $options[:valgrind] == true
+    loglevel = $options[:log_level] || 'debug'
+    dump_queues = $options[:dump_queues]
+    dump_queries = $options[:dump_queries]
+    @mock_cluster = RedisMockCluster.new latency: $latency
+    @mock_cluster.start
+    @aux_proxy = RedisClusterProxy.new @mock_cluster,
+                                       log_level: loglevel,
+                                       dump_queries: dump_queries,
+                                       dump_queues: dump_queues,
+                                       valgrind: use_valgrind,
+                                       threads: 1,
+                                       node_max_inflight_requests: 1,
+                                       node_max_queued_requests: 2
+    @aux_proxy.start
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @mock_cluster.destroy!
+    @mock_cluster = nil
+}
+
+test "-BUSY from a slow node with node-max-queued-requests" do
+    replies = []
+    lock = Mutex.new
+    spawn_clients($numclients, proxy: @aux_proxy){|client, idx|
+        reply = redis_command client, :get, 'busy:key'
+        lock.synchronize{ replies << reply }
+    }
+    busy = replies.select{|reply|
+        reply.is_a?(Redis::CommandError) && reply.to_s[/^BUSY/]
+    }
+    other_errors = replies.select{|reply|
+        reply.is_a?(Redis::CommandError) && !reply.to_s[/^BUSY/]
+    }
+    assert(other_errors.empty?, "Unexpected error: #{other_errors.first}")
+    assert(busy.length > 0, "Expected some -BUSY replies")
+    assert(busy.length < $numclients, "Expected some queued requests")
+    info = @aux_proxy.proxy('info', 'stats')
+    assert(info[/^total_node_busy_errors:[1-9]/],
+           "Expected total_node_busy_errors > 0")
+end
+
+test "No -BUSY with node-max-queued-requests -1" do
+    reply = @aux_proxy.proxy('config', 'set', 'node-max-queued-requests', '-1')
+    assert_not_redis_err(reply)
+    spawn_clients($numclients, proxy: @aux_proxy){|client, idx|
+        reply = redis_command client, :get, 'busy:key'
+        assert_not_redis_err(reply)
+    }
+end
+
+test "Pipelining clients are served in turn by a node" do
+    reply = @mock_cluster.mock('config', 'set', 'latency', '5')
+    assert_not_redis_err(reply)
+    # Every SET fills half of the send queue's quantum, while the INCR
+    # replies tell the order the node received the commands in.
+    value = 'x' * 8000
+    numcmds = 100
+    counters = {}
+    lock = Mutex.new
+    spawn_clients(2, proxy: @aux_proxy){|client, idx|
+        # The second client joins when the first one has been alone for a
+        # while.
+        sleep 0.3 if idx == 1
+        replies = client.pipelined{
+            numcmds.times{
+                client.set("{fair}pad:#{idx}", value)
+                client.incr('{fair}counter')
+            }
+        }
+        lock.synchronize{
+            counters[idx] = replies.each_slice(2).map{|r| r[1].to_i}
+        }
+    }
+    first, last = counters[1].min, [counters[0].max, counters[1].max].min
+    assert(first < last, "Clients were not pipelining at the same time")
+    sequence = counters.map{|idx, values| values.map{|v| [v, idx]}}
+    sequence = sequence.flatten(1).sort.select{|v, idx|
+        v >= first && v <= last
+    }
+    longest_run = sequence.chunk_while{|a, b| a[1] == b[1]}.map(&:length).max
+    assert(longest_run <= 4,
+           "A client sent #{longest_run} commands in a row to the node")
+end
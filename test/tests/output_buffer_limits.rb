@@ -0,0 +1,114 @@
+require 'redis'
+require 'hiredis'
+
+$value_size = 64 * 1024
+$slow_queries = 400
+
+setup {
+    use_valgrind = $options[:valgrind] == true
+    loglevel = $options[:log_level] || 'debug'
+    dump_queues = $options[:dump_queues]
+    dump_queries = $options[:dump_queries]
+    @mock_cluster = RedisMockCluster.new
+    @mock_cluster.start
+    @aux_proxy = RedisClusterProxy.new @mock_cluster,
+                                       log_level: loglevel,
+                                       dump_queries: dump_queries,
+                                       dump_queues: dump_queues,
+                                       valgrind: use_valgrind,
+                                       threads: 1
+    @aux_proxy.start
+    reply = @aux_proxy.set('{obuf}big', 'x' * $value_size)
+    assert_not_redis_err(reply)
+    # '{other}' hashes to a different node than '{obuf}'.
+    reply = @aux_proxy.set('{other}big', 'x' * $value_size)
+    assert_not_redis_err(reply)
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @mock_cluster.destroy!
+    @mock_cluster = nil
+}
+
+def set_obuf_limits(limits)
+    reply = @aux_proxy.proxy('config', 'set', 'client-output-buffer-limit',
+                             limits)
+    assert_not_redis_err(reply)
+end
+
+def clients_output_buffers
+    info = @aux_proxy.proxy('info', 'memory')
+    assert_not_redis_err(info)
+    info[/^clients_output_buffers:(\d+)/, 1].to_i
+end
+
+# Start a client that sends a lot of queries with large replies without
+# ever reading them.
+def start_slow_reader
+    sock = raw_connection(@aux_proxy.port)
+    sock.write(resp_command('get', '{obuf}big') * $slow_queries)
+    sock
+end
+
+# While the slow reader is not reading, the other clients of its thread
+# must still get their replies in time from the other nodes.
+def assert_other_clients_served(seconds)
+    client = redis_client port: @aux_proxy.port
+    deadline = Time.now + seconds
+    while Time.now < deadline
+        start = Time.now
+        reply = redis_command client, :get, '{other}big'
+        assert_not_redis_err(reply)
+        assert_equal(reply.length, $value_size)
+        elapsed = Time.now - start
+        assert(elapsed < 0.5, "A reply took #{elapsed.round(2)}s")
+        sleep 0.05
+    end
+    client.close
+end
+
+test "Slow reader closed at the output buffer hard limit" do
+    set_obuf_limits('normal 1mb 0 0')
+    sock = start_slow_reader
+    assert_other_clients_served(1)
+    data = read_until_closed(sock)
+    sock.close
+    assert_not_nil(data, "Slow reader was not closed")
+    assert(data.bytesize < $value_size * $slow_queries,
+           "Slow reader got all its replies")
+end
+
+test "Slow reader closed after the soft limit seconds" do
+    set_obuf_limits('normal 0 512kb 2')
+    sock = start_slow_reader
+    # Other clients are served while the slow reader stays over its soft
+    # limit, since only the connection whose next reply is for the slow
+    # reader stops being read.
+    assert_other_clients_served(1.5)
+    # Most of the slow reader's replies are left to the node instead of
+    # being buffered by the proxy.
+    used = clients_output_buffers
+    assert(used < $value_size * $slow_queries / 4,
+           "Output buffers are too big: #{used}")
+    # Reading from the slow reader would drain its output buffer, so wait
+    # for the soft limit seconds to elapse first.
+    sleep 3
+    data = read_until_closed(sock)
+    sock.close
+    assert_not_nil(data, "Slow reader was not closed")
+end
+
+test "Clients under the output buffer limits are not closed" do
+    set_obuf_limits('normal 1mb 512kb 2')
+    client = redis_client port: @aux_proxy.port
+    replies = client.pipelined{
+        10.times{ client.get('{obuf}big') }
+    }
+    assert_equal(replies.length, 10)
+    replies.each{|reply| assert_equal(reply.length, $value_size)}
+    reply = redis_command client, :get, '{obuf}big'
+    assert_not_redis_err(reply)
+    client.close
+end
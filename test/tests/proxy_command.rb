@@ -15,6 +15,183 @@ test "PROXY CONFIG GET" do
     }
 end
 
+test "PROXY CONFIG SET client-output-buffer-limit" do
+    limits = 'normal 1048576 524288 10 private 0 0 0'
+    reply = $main_proxy.proxy('config', 'set', 'client-output-buffer-limit',
+                              'normal 1mb 512kb 10')
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('config', 'get', 'client-output-buffer-limit')
+    assert_not_redis_err(reply)
+    assert_equal(reply[1], limits)
+    reply = $main_proxy.proxy('config', 'set', 'client-output-buffer-limit',
+                              'invalid 1mb 512kb 10')
+    assert_redis_err(reply)
+    reply = $main_proxy.proxy('config', 'set', 'client-output-buffer-limit',
+                              'normal 0 0 0')
+    assert_not_redis_err(reply)
+end
+
+test "PROXY CONFIG SET proto-max-bulk-len" do
+    reply = $main_proxy.proxy('config', 'set', 'proto-max-bulk-len', '1mb')
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('config', 'get', 'proto-max-bulk-len')
+    assert_not_redis_err(reply)
+    assert_equal(reply[1].to_i, 1024 * 1024)
+    reply = $main_proxy.proxy('config', 'set', 'proto-max-bulk-len', '1xb')
+    assert_redis_err(reply)
+    reply = $main_proxy.proxy('config', 'set', 'proto-max-bulk-len', '512mb')
+    assert_not_redis_err(reply)
+end
+
+test "PROXY CONFIG SET maxmemory" do
+    reply = $main_proxy.proxy('config', 'set', 'maxmemory', '2gb')
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('config', 'get', 'maxmemory')
+    assert_not_redis_err(reply)
+    assert_equal(reply[1].to_i, 2 * 1024 * 1024 * 1024)
+    reply = $main_proxy.proxy('config', 'set', 'maxmemory', '0')
+    assert_not_redis_err(reply)
+end
+
+test "PROXY CONFIG SET client-max-ops-per-sec" do
+    reply = $main_proxy.proxy('config', 'set', 'client-max-ops-per-sec', '100')
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('config', 'get', 'client-max-ops-per-sec')
+    assert_not_redis_err(reply)
+    assert_equal(reply[1].to_i, 100)
+    start = Time.now
+    200.times{|i|
+        reply = $main_proxy.set("ratelimit:#{i}", i)
+        assert_not_redis_err(reply)
+    }
+    elapsed = Time.now - start
+    assert(elapsed >= 0.9, "Expected client to be throttled, took #{elapsed}s")
+    info = $main_proxy.proxy('info', 'stats')
+    assert(info[/^total_client_throttles:[1-9]/],
+           "Expected total_client_throttles > 0")
+    reply = $main_proxy.proxy('config', 'set', 'client-max-ops-per-sec', '0')
+    assert_not_redis_err(reply)
+end
+
+test "PROXY CONFIG SET node-max-inflight-requests" do
+    reply = $main_proxy.proxy('config', 'set', 'node-max-inflight-requests',
+                              '1')
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('config', 'get', 'node-max-inflight-requests')
+    assert_not_redis_err(reply)
+    assert_equal(reply[1].to_i, 1)
+    100.times{|i|
+        reply = $main_proxy.set("inflight:#{i}", i)
+        assert_not_redis_err(reply)
+        assert_equal($main_proxy.get("inflight:#{i}"), i.to_s)
+    }
+    reply = $main_proxy.proxy('config', 'set', 'node-max-inflight-requests',
+                              '0')
+    assert_not_redis_err(reply)
+end
+
+test "PROXY CONFIG SET upgrade-drain-timeout" do
+    reply = $main_proxy.proxy('config', 'get', 'upgrade-drain-timeout')
+    assert_not_redis_err(reply)
+    assert_equal(reply[1].to_i, 60)
+    reply = $main_proxy.proxy('config', 'set', 'upgrade-drain-timeout', '5')
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('config', 'get', 'upgrade-drain-timeout')
+    assert_equal(reply[1].to_i, 5)
+    reply = $main_proxy.proxy('config', 'set', 'upgrade-drain-timeout', '60')
+    assert_not_redis_err(reply)
+end
+
+test "PROXY CONFIG SET drain-timeout" do
+    reply = $main_proxy.proxy('config', 'get', 'drain-timeout')
+    assert_not_redis_err(reply)
+    assert_equal(reply[1].to_i, 30)
+    reply = $main_proxy.proxy('config', 'set', 'drain-timeout', '10')
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('config', 'set', 'drain-timeout', '30')
+    assert_not_redis_err(reply)
+end
+
+test "PROXY CONFIG SET threads" do
+    reply = $main_proxy.proxy('config', 'set', 'threads', '0')
+    assert_redis_err(reply)
+    [4, 8].each{|threads|
+        reply = resize_proxy_threads($main_proxy, threads)
+        assert_not_redis_err(reply)
+        reply = $main_proxy.proxy('config', 'get', 'threads')
+        assert_not_redis_err(reply)
+        assert_equal(reply[1].to_i, threads)
+    }
+end
+
+test "PROXY CONFIG GET tls" do
+    reply = $main_proxy.proxy('config', 'get', 'tls')
+    assert_not_redis_err(reply)
+    assert_equal(reply[1].to_i, (tls_enabled? ? 1 : 0))
+    reply = $main_proxy.proxy('config', 'get', 'tls-cluster')
+    assert_not_redis_err(reply)
+    assert_equal(reply[1].to_i, (tls_enabled? ? 1 : 0))
+    reply = $main_proxy.proxy('config', 'set', 'tls', '1')
+    assert_redis_err(reply)
+end
+
+test "PROXY INFO proxy_draining" do
+    info = $main_proxy.proxy('info', 'proxy')
+    assert_not_redis_err(info)
+    assert(info[/^proxy_draining:0/], "Proxy should not be draining")
+    reply = $main_proxy.proxy('drain', 'notanumber')
+    assert_redis_err(reply)
+end
+
+test "PROXY CONFIG RELOAD without config file" do
+    reply = $main_proxy.proxy('config', 'reload')
+    assert_redis_err(reply)
+end
+
+test "PROXY INFO memory fragmentation" do
+    info = $main_proxy.proxy('info', 'memory')
+    assert_not_redis_err(info)
+    %w(used_memory_rss mem_fragmentation_ratio mem_allocator
+       allocator_allocated allocator_frag_ratio).each{|field|
+        assert(info[/^#{field}:/], "Missing field '#{field}' in PROXY INFO")
+    }
+end
+
+test "PROXY INFO stats" do
+    info = $main_proxy.proxy('info', 'stats')
+    assert_not_redis_err(info)
+    %w(total_net_input_bytes total_client_reads avg_cluster_read_size
+       read_budget_exhausted io_read_max_len throttled_clients
+       total_client_throttles total_node_busy_errors
+       avg_node_queue_wait_us).each{|field|
+        assert(info[/^#{field}:/], "Missing field '#{field}' in PROXY INFO")
+    }
+end
+
+test "PROXY CLIENT MEMORY" do
+    reply = $main_proxy.proxy('client', 'memory')
+    assert_not_redis_err(reply)
+    assert(reply.is_a?(Array), "Expected array reply, got #{reply.class}")
+    assert_equal(reply[0], 'qbuf')
+    assert_equal(reply[2], 'obuf')
+end
+
+test "PROXY CLIENT PRIORITY" do
+    reply = $main_proxy.proxy('client', 'priority')
+    assert_equal(reply, 'interactive')
+    reply = $main_proxy.proxy('client', 'priority', 'urgent')
+    assert_redis_err(reply)
+    reply = $main_proxy.proxy('client', 'priority', 'bulk')
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('client', 'priority')
+    assert_equal(reply, 'bulk')
+    reply = $main_proxy.set('priority:key', 'value')
+    assert_not_redis_err(reply)
+    assert_equal($main_proxy.get('priority:key'), 'value')
+    reply = $main_proxy.proxy('client', 'priority', 'interactive')
+    assert_not_redis_err(reply)
+end
+
 test "LOG TO PROXY" do
     msg = "*********** TEST LOG ***********"
     reply = log_to_proxy $main_proxy, msg
@@ -22,3 +199,25 @@ test "LOG TO PROXY" do
     log = File.read $main_proxy.logfile
     assert_not_nil(log[msg], "Could not find logged message in proxy's log")
 end
+
+test "PROXY CAPTURE" do
+    path = File.join(RedisProxyTestCase::TMPDIR, "capture.rcp")
+    reply = $main_proxy.proxy('capture', 'start', path, '2')
+    assert_redis_err(reply)
+    reply = $main_proxy.proxy('capture', 'start', path)
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('capture', 'start', path)
+    assert_redis_err(reply)
+    reply = $main_proxy.set('capture:key', 'value')
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('capture', 'stop')
+    assert_not_redis_err(reply)
+    reply = $main_proxy.proxy('capture', 'status')
+    assert_not_redis_err(reply)
+    assert_equal(reply[0], 'active')
+    assert_equal(reply[1].to_i, 0)
+    data = File.binread(path)
+    assert_equal(data[0, 6], 'RCPCAP')
+    assert(data.include?('capture:key'), 'Query missing from capture file')
+    File.unlink(path)
+end
@@ -0,0 +1,64 @@
+require 'redis'
+require 'hiredis'
+
+setup {
+    use_valgrind = $options[:valgrind] == true
+    loglevel = $options[:log_level] || 'debug'
+    dump_queues = $options[:dump_queues]
+    dump_queries = $options[:dump_queries]
+    @mock_cluster = RedisMockCluster.new
+    @mock_cluster.start
+    @aux_proxy = RedisClusterProxy.new @mock_cluster,
+                                       log_level: loglevel,
+                                       dump_queries: dump_queries,
+                                       dump_queues: dump_queues,
+                                       valgrind: use_valgrind,
+                                       proto_max_bulk_len: '1kb',
+                                       client_query_buffer_limit: '64kb'
+    @aux_proxy.start
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @mock_cluster.destroy!
+    @mock_cluster = nil
+}
+
+# Send a raw query and check that the proxy replies with the expected
+# protocol error and then closes the connection.
+def assert_protocol_error(query, error)
+    sock = raw_connection(@aux_proxy.port)
+    sock.write(query)
+    data = read_until_closed(sock)
+    sock.close
+    assert_not_nil(data, "Connection was not closed")
+    assert_match(data, /\A-ERR Protocol error: #{error}\r\n\z/)
+end
+
+test "Bulk length over proto-max-bulk-len" do
+    # Only the bulk header is sent: the query must be rejected before its
+    # argument gets buffered.
+    assert_protocol_error("*3\r\n$3\r\nSET\r\n$9\r\nlimit:key\r\n$2048\r\n",
+                          'invalid bulk length')
+end
+
+test "Bulk length under proto-max-bulk-len" do
+    value = 'x' * 1024
+    reply = @aux_proxy.set('limit:key', value)
+    assert_not_redis_err(reply)
+    assert_equal(@aux_proxy.get('limit:key'), value)
+end
+
+test "Multibulk count over the limit" do
+    assert_protocol_error("*#{2 ** 31}\r\n", 'invalid multibulk length')
+    assert_protocol_error("*-5\r\n", 'invalid multibulk length')
+end
+
+test "Query over client-query-buffer-limit" do
+    reply = @aux_proxy.proxy('config', 'set', 'proto-max-bulk-len', '1mb')
+    assert_not_redis_err(reply)
+    assert_protocol_error("*3\r\n$3\r\nSET\r\n$9\r\nlimit:key\r\n" +
+                          "$#{100 * 1024}\r\n",
+                          'query buffer limit exceeded')
+end
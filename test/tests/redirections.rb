@@ -0,0 +1,96 @@
+require 'redis'
+require 'hiredis'
+
+$masters = 3
+$key = '{redir}key'
+$slot = RedisCluster::slot_for_key($key)
+# The mock initially splits the slots evenly between its masters.
+$owner = ($slot * $masters) / RedisCluster::RedisClusterHashSlots
+# Clients idle for more than 2 seconds release their (empty) request lists.
+$idle_time = 3.5
+
+setup {
+    use_valgrind = $options[:valgrind] == true
+    loglevel = $options[:log_level] || 'debug'
+    dump_queues = $options[:dump_queues]
+    dump_queries = $options[:dump_queries]
+    @mock_cluster = RedisMockCluster.new masters_count: $masters
+    @mock_cluster.start
+    @aux_proxy = RedisClusterProxy.new @mock_cluster,
+                                       log_level: loglevel,
+                                       dump_queries: dump_queries,
+                                       dump_queues: dump_queues,
+                                       valgrind: use_valgrind,
+                                       threads: 1
+    @aux_proxy.start
+    @idle_client = redis_client port: @aux_proxy.port
+}
+
+cleanup {
+    @idle_client.close
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @mock_cluster.destroy!
+    @mock_cluster = nil
+}
+
+def move_key_slot(master_index)
+    reply = @mock_cluster.mock('setslot', $slot, master_index)
+    assert_not_redis_err(reply)
+end
+
+test "MOVED on the first request of a client" do
+    reply = @idle_client.set($key, 'value')
+    assert_not_redis_err(reply)
+    move_key_slot(($owner + 1) % $masters)
+    client = redis_client port: @aux_proxy.port
+    reply = redis_command client, :get, $key
+    client.close
+    assert_not_redis_err(reply)
+    assert_equal(reply, 'value')
+end
+
+test "MOVED on an idle client" do
+    sleep $idle_time
+    move_key_slot(($owner + 2) % $masters)
+    reply = redis_command @idle_client, :get, $key
+    assert_not_redis_err(reply)
+    assert_equal(reply, 'value')
+    sleep $idle_time
+    move_key_slot($owner)
+    reply = redis_command @idle_client, :get, $key
+    assert_not_redis_err(reply)
+    assert_equal(reply, 'value')
+end
+
+test "ASK on the first request of a client" do
+    reply = @mock_cluster.mock('resetstats')
+    assert_not_redis_err(reply)
+    # The proxy retries ASK redirections on the slot's owner after updating
+    # the cluster's configuration, so only a part of the requests can be
+    # redirected, otherwise they would never be served.
+    reply = @mock_cluster.mock('config', 'set', 'ask-rate', '0.5')
+    assert_not_redis_err(reply)
+    10.times{
+        client = redis_client port: @aux_proxy.port
+        reply = redis_command client, :get, $key
+        client.close
+        assert_not_redis_err(reply)
+        assert_equal(reply, 'value')
+    }
+    stats = @mock_cluster.mock('stats')
+    assert(stats[/^ask_injected:[1-9]/], "Expected ASK redirections")
+end
+
+test "ASK on an idle client" do
+    sleep $idle_time
+    reply = redis_command @idle_client, :get, $key
+    assert_not_redis_err(reply)
+    assert_equal(reply, 'value')
+    replies = @idle_client.pipelined{
+        10.times{ @idle_client.get($key) }
+    }
+    assert_equal(replies, ['value'] * 10)
+    reply = @mock_cluster.mock('config', 'set', 'ask-rate', '0')
+    assert_not_redis_err(reply)
+end
@@ -0,0 +1,95 @@
+require 'redis'
+require 'hiredis'
+
+setup {
+    use_valgrind = $options[:valgrind] == true
+    loglevel = $options[:log_level] || 'debug'
+    dump_queues = $options[:dump_queues]
+    dump_queries = $options[:dump_queries]
+    @mock_cluster = RedisMockCluster.new
+    @mock_cluster.start
+    @aux_proxy = RedisClusterProxy.new @mock_cluster,
+                                       log_level: loglevel,
+                                       dump_queries: dump_queries,
+                                       dump_queues: dump_queues,
+                                       valgrind: use_valgrind,
+                                       threads: 2,
+                                       threads_retire_timeout: 2
+    @aux_proxy.start
+}
+
+cleanup {
+    @aux_proxy.stop
+    @aux_proxy = nil
+    @mock_cluster.destroy!
+    @mock_cluster = nil
+}
+
+def get_threads
+    reply = @aux_proxy.proxy('config', 'get', 'threads')
+    assert_not_redis_err(reply)
+    reply[1].to_i
+end
+
+test "Clients keep their session when their thread retires" do
+    clients = (0...6).map{|i|
+        client = redis_client port: @aux_proxy.port
+        reply = redis_command client, :set, "resize:#{i}", "value:#{i}"
+        assert_not_redis_err(reply)
+        # The priority is reset if the client gets reconnected.
+        reply = client.proxy('client', 'priority', 'bulk')
+        assert_not_redis_err(reply)
+        client
+    }
+    threads = clients.map{|client| client.proxy('client', 'thread').to_i}
+    assert(threads.include?(1), "No client on thread 1")
+    reply = resize_proxy_threads(@aux_proxy, 1)
+    assert_not_redis_err(reply)
+    assert_equal(get_threads, 1)
+    clients.each_with_index{|client, i|
+        assert_equal(client.proxy('client', 'thread').to_i, 0)
+        assert_equal(client.proxy('client', 'priority'), 'bulk')
+        reply = redis_command client, :get, "resize:#{i}"
+        assert_not_redis_err(reply)
+        assert_equal(reply, "value:#{i}")
+        client.close
+    }
+    reply = resize_proxy_threads(@aux_proxy, 2)
+    assert_not_redis_err(reply)
+end
+
+test "MULTI clients on a retiring thread are closed after the timeout" do
+    socks = (0...4).map{
+        sock = raw_connection(@aux_proxy.port)
+        sock.write(resp_command('proxy', 'client', 'thread'))
+        thread = sock.gets[/^:(\d+)/, 1].to_i
+        sock.write(resp_command('multi'))
+        assert_equal(sock.gets, "+OK\r\n")
+        [sock, thread]
+    }
+    retiring = socks.select{|sock, thread| thread == 1}
+    assert(retiring.length > 0, "No MULTI client on thread 1")
+    reply = @aux_proxy.proxy('config', 'set', 'threads', '1')
+    assert_not_redis_err(reply)
+    # Clients in MULTI can't be migrated, so the resize is still in
+    # progress and a new one must be refused.
+    reply = @aux_proxy.proxy('config', 'set', 'threads', '2')
+    assert_redis_err(reply)
+    assert_match(reply.to_s, /in progress/)
+    socks.each{|sock, thread|
+        data = read_until_closed(sock, timeout: (thread == 1 ? 5 : 0.5))
+        sock.close
+        if thread == 1
+            assert_not_nil(data, "MULTI client on the retiring thread " +
+                                 "was not closed")
+        else
+            assert_nil(data, "MULTI client on thread #{thread} was closed")
+        end
+    }
+    reply = resize_proxy_threads(@aux_proxy, 1)
+    assert_not_redis_err(reply)
+    assert_equal(get_threads, 1)
+    reply = resize_proxy_threads(@aux_proxy, 2)
+    assert_not_redis_err(reply)
+    assert_equal(get_threads, 2)
+end
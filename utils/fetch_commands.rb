@@ -93,6 +93,7 @@ PROXY_FLAGS = {
     MULTISLOT_UNSUPPORTED: '1 << 0',
     DUPLICATE: '1 << 1',
     HANDLE_REPLY: '1 << 2',
+    BULK: '1 << 3',
 }
 
 PROXY_COMMANDS_FLAGS = {
@@ -112,6 +113,30 @@ PROXY_COMMANDS_FLAGS = {
     },
     HANDLE_REPLY: {
         'scan' => true,
+    },
+    BULK: {
+        'keys' => true,
+        'scan' => true,
+        'sscan' => true,
+        'hscan' => true,
+        'zscan' => true,
+        'smembers' => true,
+        'sunion' => true,
+        'sinter' => true,
+        'sdiff' => true,
+        'hgetall' => true,
+        'hkeys' => true,
+        'hvals' => true,
+        'lrange' => true,
+        'zrange' => true,
+        'zrevrange' => true,
+        'zrangebyscore' => true,
+        'zrevrangebyscore' => true,
+        'zrangebylex' => true,
+        'zrevrangebylex' => true,
+        'xrange' => true,
+        'xrevrange' => true,
+        'sort' => true,
     }
 }
 